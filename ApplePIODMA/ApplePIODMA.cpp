@@ -5,9 +5,15 @@
 //  Created by Kevin Strasberg on 6/25/20.
 //
 
+#ifdef KERNEL
 #include <IOKit/apiodma/ApplePIODMADebug.h>
 #include <IOKit/apiodma/ApplePIODMA.h>
 #include <IOKit/apiodma/ApplePIODMARequest.h>
+#else
+#include "ApplePIODMADebug.h"
+#include "ApplePIODMA.h"
+#include "ApplePIODMARequest.h"
+#endif
 
 #define super IOService
 OSDefineMetaClassAndAbstractStructors(ApplePIODMA, super)
@@ -91,6 +97,7 @@ bool ApplePIODMA::start(IOService* provider)
     uint32_t piodmaCommandAddressBits     = kApplePIODMARequestDefaultCommandDMASpecificationAddressBits;
     uint32_t piodmaCommandMaxTransferSize = kApplePIODMARequestDefaultCommandDMASpecificationMaxTransfersize;
     uint32_t piodmaCommandMaxSegmentSize  = kApplePIODMARequestDefaultCommandDMASpecificationMaxSegmentSize;
+    uint32_t piodmaZeroCopyThreshold      = kApplePIODMARequestDefaultZeroCopyThreshold;
     OSData*  propertyData                 = NULL;
 
     if((propertyData = OSDynamicCast(OSData, getProperty(kApplePIODMAFIFOSize, gIOServicePlane))) != NULL)
@@ -123,6 +130,12 @@ bool ApplePIODMA::start(IOService* provider)
         propertyData                = NULL;
     }
 
+    if((propertyData = OSDynamicCast(OSData, getProperty(kApplePIODMAZeroCopyThreshold, gIOServicePlane))) != NULL)
+    {
+        piodmaZeroCopyThreshold = *reinterpret_cast<const uint32_t*>(propertyData->getBytesNoCopy());
+        propertyData            = NULL;
+    }
+
     _requestPool = ApplePIODMARequestPool::withWorkLoop(_workLoop,
                                                         _memoryMapper,
                                                         piodmaFIFOSize,
@@ -149,7 +162,9 @@ bool ApplePIODMA::start(IOService* provider)
         stop(provider);
         return false;
     }
-    _completionQueueSize = piodmaFIFOSize;
+    _requestPool->setZeroCopyThreshold(piodmaZeroCopyThreshold);
+    // a spare slot so the queue never fills, retired slots are then told apart from outstanding ones by position alone
+    _completionQueueSize = piodmaFIFOSize + 1;
 
     _completionQueue = IONewZero(ApplePIODMARequest *, _completionQueueSize);
     if(_completionQueue == NULL)
@@ -159,7 +174,7 @@ bool ApplePIODMA::start(IOService* provider)
         return false;
     }
 
-    _interruptEventSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &ApplePIODMA::interruptOccurred), provider);
+    _interruptEventSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &ApplePIODMA::handleInterrupt), provider);
     if(_interruptEventSource == NULL)
     {
         debug(kApplePIODMADebugLoggingAlways, "couldn't create interrupt event source\n");
@@ -284,6 +299,32 @@ IOReturn ApplePIODMA::hostToHost(const void* source,
     return kIOReturnUnsupported;
 }
 
+IOReturn ApplePIODMA::mapDescriptor(IOMemoryDescriptor* descriptor)
+{
+    return _requestPool->mapDescriptor(descriptor);
+}
+
+void ApplePIODMA::unmapDescriptor(IOMemoryDescriptor* descriptor)
+{
+    _requestPool->unmapDescriptor(descriptor);
+}
+
+uint32_t ApplePIODMA::maxOutstandingRequests()
+{
+    return _completionQueueSize - 1;
+}
+
+ApplePIODMARequest* ApplePIODMA::getRequest(bool blockForRequest)
+{
+    return OSDynamicCast(ApplePIODMARequest, _requestPool->getCommand(blockForRequest));
+}
+
+void ApplePIODMA::returnRequest(ApplePIODMARequest* request)
+{
+    request->complete();
+    _requestPool->returnCommand(request);
+}
+
 IOReturn ApplePIODMA::enable()
 {
     return _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePIODMA::enableGated));
@@ -314,6 +355,9 @@ IOReturn ApplePIODMA::disableGated()
     debug(kApplePIODMADebugLoggingInit, "\n");
 
     _interruptEventSource->disable();
+
+    // nothing retires once the interrupt is off
+    abortRequestsGated();
     return kIOReturnSuccess;
 }
 
@@ -323,15 +367,58 @@ void ApplePIODMA::executeRequest(ApplePIODMARequest* request)
                             reinterpret_cast<void*>(request));
 }
 
+IOReturn ApplePIODMA::executeRequestAsync(ApplePIODMARequest* request, const ApplePIODMACompletion* completion)
+{
+    IOReturn result = kIOReturnSuccess;
+
+    if(   (completion == NULL)
+       || (completion->action == NULL))
+    {
+        return kIOReturnBadArgument;
+    }
+
+    IORWLockRead(_stateLock);
+    if(_state != kApplePIODMAStateEnabled)
+    {
+        result = kIOReturnNoPower;
+    }
+    IORWLockUnlock(_stateLock);
+
+    if(result == kIOReturnSuccess)
+    {
+        request->setCompletion(completion);
+        result = _commandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePIODMA::executeRequestGated),
+                                         reinterpret_cast<void*>(request));
+    }
+
+    return result;
+}
+
 IOReturn ApplePIODMA::executeRequestGated(ApplePIODMARequest* request)
 {
-    uint8_t commandTag = request->commandTag();
-    debug(kApplePIODMADebugLoggingVerbose, "enqueuing command Tag 0x%x at index %u\n", commandTag, _completionTail);
+    uint8_t      commandTag = request->commandTag();
+    unsigned int index;
 
-    _completionQueue[_completionTail] = request;
+    // the request pool is FIFO sized, the queue can't overflow, but a retired async request must be called back before its slot is reused
+    if(   (_completionQueue[_completionTail] != NULL)
+       && (_completionQueue[_completionTail]->completion() != NULL))
+    {
+        dispatchCompletionsGated();
+    }
+    index = _completionTail;
+    debug(kApplePIODMADebugLoggingVerbose, "enqueuing command Tag 0x%x at index %u\n", commandTag, index);
+
+    request->setCompletionStatus(kIOReturnSuccess);
+    _completionQueue[index] = request;
 
     _completionTail = (_completionTail + 1) % _completionQueueSize;
 
+    if(request->completion() != NULL)
+    {
+        // async, completeRequestGated calls back when the engine retires it
+        return kIOReturnSuccess;
+    }
+
     IOReturn result = _commandGate->commandSleep(request, THREAD_UNINT);
     if(result != THREAD_AWAKENED)
     {
@@ -341,5 +428,107 @@ IOReturn ApplePIODMA::executeRequestGated(ApplePIODMARequest* request)
               result);
     }
 
-    return kIOReturnSuccess;
+    // retired by a subclass that advanced _completionHead itself, empty the slot unless it was refilled since
+    if(_completionQueue[index] == request)
+    {
+        _completionQueue[index] = NULL;
+    }
+
+    return request->completionStatus();
+}
+
+void ApplePIODMA::handleInterrupt(IOInterruptEventSource* source, int count)
+{
+    interruptOccurred(source, count);
+    dispatchCompletionsGated();
+}
+
+// slots from _completionHead up to _completionTail are outstanding, completeRequestGated empties the ones it retires
+void ApplePIODMA::completeRequestGated(uint8_t commandTag, IOReturn status)
+{
+    ApplePIODMARequest* request;
+
+    if(_completionHead == _completionTail)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "completion for tag 0x%x with nothing outstanding\n", commandTag);
+        return;
+    }
+
+    request = _completionQueue[_completionHead];
+    _completionQueue[_completionHead] = NULL;
+    _completionHead = (_completionHead + 1) % _completionQueueSize;
+
+    if(request->commandTag() != commandTag)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "completion for tag 0x%x, expected tag 0x%x\n", commandTag, request->commandTag());
+    }
+    debug(kApplePIODMADebugLoggingVerbose, "retiring command Tag 0x%x, status 0x%x\n", commandTag, status);
+
+    request->setCompletionStatus(status);
+    if(request->completion() == NULL)
+    {
+        _commandGate->commandWakeup(request, true);
+    }
+    else
+    {
+        retireRequestGated(request);
+    }
+}
+
+// a subclass that advances _completionHead itself leaves its retired requests behind the head, from
+// _completionTail round to _completionHead, oldest first; synchronous waiters empty their own slots
+void ApplePIODMA::dispatchCompletionsGated()
+{
+    ApplePIODMARequest* request;
+    unsigned int        index;
+    unsigned int        retired;
+
+    do
+    {
+        // rescanned after every callback, which may submit
+        request = NULL;
+        retired = (_completionHead + _completionQueueSize - _completionTail - 1) % _completionQueueSize + 1;
+        for(index = _completionTail; retired > 0; index = (index + 1) % _completionQueueSize, retired--)
+        {
+            if(   (_completionQueue[index] != NULL)
+               && (_completionQueue[index]->completion() != NULL))
+            {
+                request = _completionQueue[index];
+                _completionQueue[index] = NULL;
+                break;
+            }
+        }
+
+        if(request != NULL)
+        {
+            retireRequestGated(request);
+        }
+    }
+    while(request != NULL);
+}
+
+void ApplePIODMA::retireRequestGated(ApplePIODMARequest* request)
+{
+    ApplePIODMACompletion completion = *request->completion();
+    IOReturn              status     = request->completionStatus();
+
+    if(   (status == kIOReturnSuccess)
+       && (request->errorStatus() != 0))
+    {
+        status = kIOReturnIOError;
+    }
+
+    // the request goes back to the pool before the callback, which may submit the next one
+    request->complete();
+    _requestPool->returnCommand(request);
+    completion.action(completion.target, completion.parameter, status, request);
+}
+
+void ApplePIODMA::abortRequestsGated()
+{
+    while(_completionHead != _completionTail)
+    {
+        completeRequestGated(_completionQueue[_completionHead]->commandTag(), kIOReturnAborted);
+    }
+    dispatchCompletionsGated();
 }
@@ -8,6 +8,7 @@
 #ifndef _IOKIT_ApplePIODMA_H
 #define _IOKIT_ApplePIODMA_H
 
+#ifdef KERNEL
 #include <IOKit/IOLocks.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IOWorkLoop.h>
@@ -17,6 +18,12 @@
 #include <IOKit/apiodma/ApplePIODMADefinitions.h>
 #include <IOKit/apiodma/ApplePIODMARequestPool.h>
 #include <IOKit/apiodma/ApplePIODMARequest.h>
+#else
+#include "piodmakit.h"     // tools/piodmaengine.cpp
+#include "ApplePIODMADefinitions.h"
+#include "ApplePIODMARequestPool.h"
+#include "ApplePIODMARequest.h"
+#endif
 
 enum
 {
@@ -31,7 +38,10 @@ enum
     kApplePIODMARequestDefaultCommandDMASpecificationByteAlignment   = 4,
     kApplePIODMARequestDefaultCommandDMASpecificationAddressBits     = 32,
     kApplePIODMARequestDefaultCommandDMASpecificationMaxTransfersize = 128,
-    kApplePIODMARequestDefaultCommandDMASpecificationMaxSegmentSize  = 0
+    kApplePIODMARequestDefaultCommandDMASpecificationMaxSegmentSize  = 0,
+
+    // copying in and out beats a 2us map and unmap up to here, tools/piodmabounce.c
+    kApplePIODMARequestDefaultZeroCopyThreshold = 16384
 };
 
 enum tApplePIODMAState
@@ -148,9 +158,67 @@ public:
                                 void*       destination,
                                 IOByteCount size);
 
+#pragma mark Mappings
+
+    /*!
+     * @brief       Keep a descriptor mapped for the engine across transfers
+     * @discussion  Transfers addressing a mapped descriptor, as base or buffer, skip preparing a DMA command of their own. Intended for
+     *                      memory used over and over, such as snapshot buffers or BAR descriptors. The descriptor must be prepared and stay
+     *                      prepared until unmapDescriptor is called. Only a handful of descriptors can be mapped at once.
+     * @result      kIOReturnSuccess if the descriptor is mapped.
+     */
+    IOReturn mapDescriptor(IOMemoryDescriptor* descriptor);
+
+    /*!
+     * @brief       Undo mapDescriptor, the mapping goes away once no transfer in flight uses it
+     */
+    void unmapDescriptor(IOMemoryDescriptor* descriptor);
+
+#pragma mark Asynchronous DMA access
+
+    /*!
+     * @brief       Number of requests the engine FIFO holds, the useful depth of an async pipeline
+     */
+    uint32_t maxOutstandingRequests();
+
+    /*!
+     * @brief       Take a request from the engine's pool for executeRequestAsync
+     * @discussion  The pool holds maxOutstandingRequests requests. Prepare the request with prepareGenericPacket or prepareChain, using the
+     *                      command type and tag the engine expects, as the subclass does for its synchronous transfers. Blocking must not be
+     *                      done on the workloop, a completion can submit without blocking since its request is back in the pool by then.
+     * @result      NULL if blockForRequest is false and every request is in flight.
+     */
+    ApplePIODMARequest* getRequest(bool blockForRequest);
+
+    /*!
+     * @brief       Give back a request from getRequest that was not submitted, or whose submission failed
+     */
+    void returnRequest(ApplePIODMARequest* request);
+
+    /*!
+     * @brief       Queue a prepared request to the engine without waiting for it
+     * @discussion  The completion is called on the workloop when the request retires, in the order requests were submitted, after the
+     *                      request has been completed and returned to the pool. Requests retire from the interrupt path, whether
+     *                      interruptOccurred calls completeRequestGated or advances _completionHead itself. The status is
+     *                      kIOReturnIOError if the engine set an error status, kIOReturnAborted if the engine was disabled first.
+     * @result      kIOReturnSuccess if the request was queued, the completion is only called in that case.
+     */
+    IOReturn executeRequestAsync(ApplePIODMARequest* request, const ApplePIODMACompletion* completion);
+
 protected:
     void                            executeRequest(ApplePIODMARequest* request);
     virtual IOReturn                executeRequestGated(ApplePIODMARequest* request);
+
+    /*!
+     * @brief       Retire the oldest queued request with status, for interruptOccurred once per command the engine retired
+     * @discussion  Subclasses that advance _completionHead and wake requests themselves keep working, their asynchronous requests are
+     *                      called back once interruptOccurred returns. Only requests retired here can report a status of their own.
+     */
+    void                            completeRequestGated(uint8_t commandTag, IOReturn status);
+    void                            abortRequestsGated();
+    void                            dispatchCompletionsGated();
+    void                            retireRequestGated(ApplePIODMARequest* request);
+    void                            handleInterrupt(IOInterruptEventSource* source, int count);
     virtual void                    interruptOccurred(IOInterruptEventSource* source, int count) = 0;
     virtual IOReturn                enableGated();
     virtual IOReturn                disableGated();
@@ -168,7 +236,7 @@ protected:
 
     ApplePIODMARequestPool* _requestPool;
     ApplePIODMARequest**    _completionQueue;
-    unsigned int            _completionQueueSize;
+    unsigned int            _completionQueueSize;    // one more than the pool holds, head == tail only when empty
     unsigned int            _completionTail;
     unsigned int            _completionHead;
 
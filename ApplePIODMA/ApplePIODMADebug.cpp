@@ -5,7 +5,11 @@
 //  Created by Kevin Strasberg on 6/29/20.
 //
 
+#ifdef KERNEL
 #include <IOKit/apiodma/ApplePIODMADebug.h>
+#else
+#include "ApplePIODMADebug.h"
+#endif
 
 uint32_t applePIODMAgetDebugLoggingMask(const char* bootArg)
 {
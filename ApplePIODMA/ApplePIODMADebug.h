@@ -7,12 +7,16 @@
 
 #ifndef ApplePIODMADebug_h
 #define ApplePIODMADebug_h
+#ifdef KERNEL
 #include <IOKit/IOTypes.h>
 #include <IOKit/IOService.h>
 #include <IOKit/IOTimeStamp.h>
 #include <IOKit/IOLib.h>
 #include <os/log.h>
 #include <libkern/sysctl.h>
+#else
+#include "piodmakit.h"     // tools/piodmaengine.cpp
+#endif
 
 #ifdef __LP64__
 #define kprintfNamespaceFormatString         "%06lu.%06u %s::%s: "
@@ -7,7 +7,11 @@
 
 #ifndef _IOKIT_ApplePIODMADefinitions_H
 #define _IOKIT_ApplePIODMADefinitions_H
+#ifdef KERNEL
 #include <IOKit/IOTypes.h>
+#else
+#include <stdint.h>     // tools/piodmachain.c
+#endif
 
 #define APIODMABit(bit)                  ((uint32_t)(1) << bit)
 #define APIODMABitRange32(start, end)    (~(((uint32_t)(1) << start) - 1) & (((uint32_t)(1) << end) | (((uint32_t)(1) << end) - 1)))
@@ -21,6 +25,7 @@
 #define kApplePIODMAMaxTransferSize "piodma-max-transfer-size"
 #define kApplePIODMAMaxSegmentSize  "piodma-max-segment-size"
 #define kApplePIODMABaseAddresses   "piodma-base-address"
+#define kApplePIODMAZeroCopyThreshold "piodma-zero-copy-threshold"
 
 // Table 2.4. Next Pointer Packet Header, Revision 2.2.15
 enum tApplePIODMANextPointerPacketHeader
@@ -109,4 +114,39 @@ typedef struct ApplePIODMAGenericPacket
     uint32_t word3;
 } __attribute__((packed)) ApplePIODMAGenericPacket;
 
+enum tApplePIODMAChain
+{
+    // sizes in 32 bit words, as the engine counts them
+    kApplePIODMAGenericPacketSize = sizeof(ApplePIODMAGenericPacket) / sizeof(uint32_t),
+
+    // table 2.4 gives no type encoding for the next pointer header, so a command is packets back to back in one block and nothing is linked
+    kApplePIODMAChainBlockSize       = 256,
+    kApplePIODMAChainBlockMaxPackets = kApplePIODMAChainBlockSize / sizeof(ApplePIODMAGenericPacket)
+};
+
+static inline void applePIODMAEncodeGenericPacket(ApplePIODMAGenericPacket* genericPacket,
+                                                  uint64_t                  bufferPhysicalAddress,
+                                                  uint64_t                  targetPhysicalAddress,
+                                                  uint32_t                  bufferType,
+                                                  uint32_t                  targetType,
+                                                  uint64_t                  transferSize,
+                                                  uint32_t                  bufferBaseAddressSelect,
+                                                  uint32_t                  targetBaseAddressSelect)
+{
+    genericPacket->word0 = (uint32_t)(((bufferPhysicalAddress << kApplePIODMAGenericPacketWord0BufferAddrOffsetPhase) & kApplePIODMAGenericPacketWord0BufferAddrOffset)
+                                      | ((targetBaseAddressSelect << kApplePIODMAGenericPacketWord0TargetBARSelPhase) & kApplePIODMAGenericPacketWord0TargetBARSel)
+                                      | ((bufferBaseAddressSelect << kApplePIODMAGenericPacketWord0BufferBarSelPhase) & kApplePIODMAGenericPacketWord0BufferBarSel)
+                                      | ((bufferType << kApplePIODMAGenericPacketWord0TargetDeviceTypePhase) & kApplePIODMAGenericPacketWord0TargetDeviceType)
+                                      | ((targetType << kApplePIODMAGenericPacketWord0BufferDeviceTypePhase) & kApplePIODMAGenericPacketWord0BufferDeviceType)
+                                      | ((kApplePIODMAGenericPacketWord0TargetBurstTypeIncrementingValue << kApplePIODMAGenericPacketWord0TargetBurstTypePhase) & kApplePIODMAGenericPacketWord0TargetBurstType)
+                                      | ((kApplePIODMAGenericPacketWord0TargetBurstTypeIncrementingValue << kApplePIODMAGenericPacketWord0BufferBurstTypePhase) & kApplePIODMAGenericPacketWord0BufferBurstType)
+                                      | ((kApplePIODMAGenericPacketWord0ExtendedTypeValue << kApplePIODMAGenericPacketWord0ExtendedTypePhase) & kApplePIODMAGenericPacketWord0ExtendedType)
+                                      | ((kApplePIODMAGenericPacketWord0TypeValue << kApplePIODMAGenericPacketWord0TypePhase) & kApplePIODMAGenericPacketWord0Type));
+
+    genericPacket->word1 = (uint32_t)(((targetPhysicalAddress << kApplePIODMAGenericPacketWord1TargetAddrOffsetPhase) & kApplePIODMAGenericPacketWord1TargetAddrOffset)
+                                      | (((bufferPhysicalAddress >> kApplePIODMAGenericPacketWord0BufferAddrOffsetWidth) << kApplePIODMAGenericPacketWord1BufferAddrOffsetPhase) & kApplePIODMAGenericPacketWord1BufferAddrOffset));
+    genericPacket->word2 = (uint32_t)((((targetPhysicalAddress >> kApplePIODMAGenericPacketWord1TargetAddrOffsetWidth) << kApplePIODMAGenericPacketWord2TargetAddrOffsetPhase) & kApplePIODMAGenericPacketWord2TargetAddrOffset));
+    genericPacket->word3 = (uint32_t)((transferSize << kApplePIODMAGenericPacketWord3TransferSizePhase) & kApplePIODMAGenericPacketWord3TransferSize);
+}
+
 #endif /* _IOKIT_ApplePIODMADefinitions_H */
@@ -4,14 +4,76 @@
 //
 //  Created by Kevin Strasberg on 6/26/20.
 //
+#ifdef KERNEL
 #include <IOKit/IOMapper.h>
 #include <IOKit/apiodma/ApplePIODMADebug.h>
 #include <IOKit/apiodma/ApplePIODMARequest.h>
+#else
+#include "ApplePIODMADebug.h"
+#include "ApplePIODMARequest.h"
+#endif
 
 #define super IOCommand
 OSDefineMetaClassAndStructors(ApplePIODMARequest, super)
 #define debug(mask, fmt, args...) pioDMADebugObjectWithClass(mask, ApplePIODMARequest, fmt,##args)
 
+// a request's command block, the packets of one command back to back
+typedef struct ApplePIODMADescriptorBlock
+{
+    IOBufferMemoryDescriptor* buffer;
+    IOPhysicalAddress         address;
+    uint32_t*                 words;
+    uint32_t                  length;    // words in use
+} ApplePIODMADescriptorBlock;
+
+typedef struct ApplePIODMAChainScalar
+{
+    void*       buffer;
+    IOByteCount offset;    // into the scalar buffer descriptor
+    IOByteCount size;
+} ApplePIODMAChainScalar;
+
+struct ApplePIODMARequest::ExpansionData
+{
+    // the commands addressing _bufferBase and _targetBase, the request's own or a pool mapping's
+    IODMACommand*       bufferDMACommand;
+    IODMACommand*       targetDMACommand;
+    ApplePIODMAMapping* bufferMapping;
+    ApplePIODMAMapping* targetMapping;
+
+    // scalars too large for the bounce buffers, mapped in place or bounced through a buffer of their own
+    IOMemoryDescriptor*       directBuffer;
+    IOMemoryDescriptor*       directTarget;
+    IOBufferMemoryDescriptor* spillBuffer;
+    IOBufferMemoryDescriptor* spillTarget;
+    IODMACommand*             stagedBufferDMACommand;    // not bound by maxTransferSize, the request sized these itself
+    IODMACommand*             stagedTargetDMACommand;
+
+    uint32_t                            byteAlignment;
+    ApplePIODMARequestPool*             descriptorPool;
+    ApplePIODMADescriptorBlock          commandBlock;    // _commandSourceBuffer, the head of every command
+    bool                                chainOpen;       // between prepareChain and finishChain
+    uint32_t                            packetCount;
+    tApplePIODMAGenericPacketDeviceType chainBufferType;
+    tApplePIODMAGenericPacketDeviceType chainTargetType;
+    uint8_t                             chainBufferBaseAddressSelect;
+    uint8_t                             chainTargetBaseAddressSelect;
+    bool                                chainScalar;
+    ApplePIODMAChainScalar*             chainScalars;
+    uint32_t                            chainScalarCount;
+    uint32_t                            chainScalarMax;
+    IOByteCount                         chainScalarOffset;
+
+    ApplePIODMACompletion completion;
+    IOReturn              completionStatus;
+};
+
+// worst case physical runs of a scalar, one per page it touches
+static uint32_t scalarPageSpan(void* address, IOByteCount size)
+{
+    return static_cast<uint32_t>(((reinterpret_cast<uintptr_t>(address) & PAGE_MASK) + size + PAGE_MASK) >> PAGE_SHIFT);
+}
+
 ApplePIODMARequest * ApplePIODMARequest::withMapper(IOMapper * mapper,
                                                     uint32_t byteAlignment,
                                                     uint8_t numberOfAddressBits,
@@ -28,6 +90,23 @@ ApplePIODMARequest * ApplePIODMARequest::withMapper(IOMapper * mapper,
     return result;
 }
 
+ApplePIODMARequest * ApplePIODMARequest::withPool(ApplePIODMARequestPool * pool,
+                                                  IOMapper * mapper,
+                                                  uint32_t byteAlignment,
+                                                  uint8_t numberOfAddressBits,
+                                                  uint64_t maxTransferSize,
+                                                  uint64_t maxSegmentSize)
+{
+    ApplePIODMARequest* result = withMapper(mapper, byteAlignment, numberOfAddressBits, maxTransferSize, maxSegmentSize);
+    if(result != NULL)
+    {
+        // not retained, the pool owns its requests
+        result->_reserved->descriptorPool = pool;
+    }
+
+    return result;
+}
+
 
 bool ApplePIODMARequest::initWithMapper(IOMapper* mapper,
                                         uint32_t  byteAlignment,
@@ -43,11 +122,19 @@ bool ApplePIODMARequest::initWithMapper(IOMapper* mapper,
         return false;
     }
 
+    _reserved = IONewZero(ExpansionData, 1);
+    if(_reserved == NULL)
+    {
+        return false;
+    }
+
+    _reserved->byteAlignment = (byteAlignment != 0) ? byteAlignment : 1;
+
     _commandSourceDMACommand = IODMACommand::withSpecification(kIODMACommandOutputHost64,
                                                                numberOfAddressBits,
                                                                maxSegmentSize,
                                                                IODMACommand::kMapped,
-                                                               maxTransferSize,
+                                                               (maxTransferSize > kApplePIODMAChainBlockSize) ? maxTransferSize : kApplePIODMAChainBlockSize,
                                                                byteAlignment,
                                                                mapper);
 
@@ -75,10 +162,26 @@ bool ApplePIODMARequest::initWithMapper(IOMapper* mapper,
                                                             byteAlignment,
                                                             mapper);
 
-    // TODO: allow linked lists (command size should be generic packet + linked list header size)
+    _reserved->stagedBufferDMACommand = IODMACommand::withSpecification(kIODMACommandOutputHost64,
+                                                                        numberOfAddressBits,
+                                                                        maxSegmentSize,
+                                                                        IODMACommand::kMapped,
+                                                                        0,
+                                                                        byteAlignment,
+                                                                        mapper);
+
+    _reserved->stagedTargetDMACommand = IODMACommand::withSpecification(kIODMACommandOutputHost64,
+                                                                        numberOfAddressBits,
+                                                                        maxSegmentSize,
+                                                                        IODMACommand::kMapped,
+                                                                        0,
+                                                                        byteAlignment,
+                                                                        mapper);
+
+    // room for the first block of a chain, a single packet command only uses the start of it
     _commandSourceBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,
                                                                        kIOMemoryPhysicallyContiguous | kIODirectionOut,
-                                                                       sizeof(ApplePIODMAGenericPacket),
+                                                                       kApplePIODMAChainBlockSize,
                                                                        byteAlignment,
                                                                        0, 0);
 
@@ -100,22 +203,39 @@ bool ApplePIODMARequest::initWithMapper(IOMapper* mapper,
                                                                           byteAlignment,
                                                                           0, 0);
 
+    // every scalar of a chain takes at least one aligned slot of the scalar buffer
+    _reserved->chainScalarMax = static_cast<uint32_t>(maxTransferSize / _reserved->byteAlignment);
+    if(_reserved->chainScalarMax > kApplePIODMAChainBlockMaxPackets)
+    {
+        _reserved->chainScalarMax = kApplePIODMAChainBlockMaxPackets;
+    }
+    if(_reserved->chainScalarMax != 0)
+    {
+        _reserved->chainScalars = IONewZero(ApplePIODMAChainScalar, _reserved->chainScalarMax);
+    }
 
     if(   (_commandSourceDMACommand == NULL)
        || (_commandDestinationDMACommand == NULL)
        || (_bufferBaseDMACommand == NULL)
        || (_targetBaseDMACommand == NULL)
+       || (_reserved->stagedBufferDMACommand == NULL)
+       || (_reserved->stagedTargetDMACommand == NULL)
        || (_commandSourceBuffer == NULL)
        || (_commandDestinationBuffer == NULL)
        || (_scalarBufferDescriptor == NULL)
-       || (_scalarTargetDescriptor == NULL))
+       || (_scalarTargetDescriptor == NULL)
+       || (   (_reserved->chainScalarMax != 0)
+           && (_reserved->chainScalars == NULL)))
     {
         debug(kApplePIODMADebugLoggingAlways, "couldn't allocate DMA commands\n");
         return false;
     }
 
     bzero(_commandDestinationBuffer->getBytesNoCopy(), sizeof(ApplePIODMAGenericPacket));
-    bzero(_commandSourceBuffer->getBytesNoCopy(), sizeof(ApplePIODMAGenericPacket));
+    bzero(_commandSourceBuffer->getBytesNoCopy(), kApplePIODMAChainBlockSize);
+    _reserved->commandBlock.buffer = _commandSourceBuffer;
+    _reserved->commandBlock.words  = reinterpret_cast<uint32_t*>(_commandSourceBuffer->getBytesNoCopy());
+    _reserved->completionStatus    = kIOReturnNotReady;
 
     return true;
 }
@@ -126,6 +246,21 @@ void ApplePIODMARequest::free()
     OSSafeReleaseNULL(_commandDestinationDMACommand);
     OSSafeReleaseNULL(_commandSourceBuffer);
     OSSafeReleaseNULL(_commandDestinationBuffer);
+    OSSafeReleaseNULL(_bufferBaseDMACommand);
+    OSSafeReleaseNULL(_targetBaseDMACommand);
+    OSSafeReleaseNULL(_scalarBufferDescriptor);
+    OSSafeReleaseNULL(_scalarTargetDescriptor);
+    if(_reserved != NULL)
+    {
+        OSSafeReleaseNULL(_reserved->stagedBufferDMACommand);
+        OSSafeReleaseNULL(_reserved->stagedTargetDMACommand);
+        if(_reserved->chainScalars != NULL)
+        {
+            IODelete(_reserved->chainScalars, ApplePIODMAChainScalar, _reserved->chainScalarMax);
+        }
+        IODelete(_reserved, ExpansionData, 1);
+        _reserved = NULL;
+    }
     super::free();
 }
 
@@ -163,7 +298,6 @@ tApplePIODMAGenericPacketDeviceType ApplePIODMARequest::deviceType(tApplePIODMAR
     return result;
 }
 
-// TODO: support multiple packets in 1 command (linked list / multi-segments)
 IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*                 bufferBase,
                                                   IOByteCount                         bufferOffset,
                                                   IOMemoryDescriptor*                 targetBase,
@@ -195,7 +329,7 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*
     if(   (result == kIOReturnSuccess)
        && (_bufferBase != NULL))
     {
-        result = _bufferBaseDMACommand->setMemoryDescriptor(_bufferBase);
+        result = attachBase(_bufferBase, _bufferBaseDMACommand, &_reserved->bufferMapping, &_reserved->bufferDMACommand);
         IODMACommand::Segment64 segment;
 
         if(result == kIOReturnSuccess)
@@ -203,7 +337,7 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*
 			UInt64 _bufferOffset = static_cast<UInt64>(bufferOffset);
             bzero(&segment, sizeof(IODMACommand::Segment64));
             UInt32 numSegments = 1;
-            result = _bufferBaseDMACommand->genIOVMSegments(&_bufferOffset, &segment, &numSegments);
+            result = _reserved->bufferDMACommand->genIOVMSegments(&_bufferOffset, &segment, &numSegments);
         }
 
         if(result == kIOReturnSuccess)
@@ -219,7 +353,7 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*
     if(   (result == kIOReturnSuccess)
        && (_targetBase != NULL))
     {
-        result = _targetBaseDMACommand->setMemoryDescriptor(_targetBase);
+        result = attachBase(_targetBase, _targetBaseDMACommand, &_reserved->targetMapping, &_reserved->targetDMACommand);
         IODMACommand::Segment64 segment;
 
         if(result == kIOReturnSuccess)
@@ -227,7 +361,7 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*
 			UInt64 _targetOffset = static_cast<UInt64>(targetOffset);
             bzero(&segment, sizeof(IODMACommand::Segment64));
             UInt32 numSegments = 1;
-            result = _targetBaseDMACommand->genIOVMSegments(&_targetOffset, &segment, &numSegments);
+            result = _reserved->targetDMACommand->genIOVMSegments(&_targetOffset, &segment, &numSegments);
         }
 
         if(result == kIOReturnSuccess)
@@ -240,28 +374,22 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*
         }
     }
 
-    // TODO: allow linked lists
-    _commandSize  = sizeof(ApplePIODMAGenericPacket) / sizeof(uint32_t);
+    _commandSize  = kApplePIODMAGenericPacketSize;
     _commandType  = commandType;
     _transferSize = transferSize;
     if(result == kIOReturnSuccess)
     {
-        ApplePIODMAGenericPacket* genericPacket = reinterpret_cast<ApplePIODMAGenericPacket*>(_commandSourceBuffer->getBytesNoCopy());
-        genericPacket->word0 = ((bufferPhysicalAddress << kApplePIODMAGenericPacketWord0BufferAddrOffsetPhase) & kApplePIODMAGenericPacketWord0BufferAddrOffset)
-                               | ((targetBaseAddressSelect << kApplePIODMAGenericPacketWord0TargetBARSelPhase) & kApplePIODMAGenericPacketWord0TargetBARSel)
-                               | ((bufferBaseAddressSelect << kApplePIODMAGenericPacketWord0BufferBarSelPhase) & kApplePIODMAGenericPacketWord0BufferBarSel)
-                               | ((bufferType << kApplePIODMAGenericPacketWord0TargetDeviceTypePhase) & kApplePIODMAGenericPacketWord0TargetDeviceType)
-                               | ((targetType << kApplePIODMAGenericPacketWord0BufferDeviceTypePhase) & kApplePIODMAGenericPacketWord0BufferDeviceType)
-                               | ((kApplePIODMAGenericPacketWord0TargetBurstTypeIncrementingValue << kApplePIODMAGenericPacketWord0TargetBurstTypePhase) & kApplePIODMAGenericPacketWord0TargetBurstType)
-                               | ((kApplePIODMAGenericPacketWord0TargetBurstTypeIncrementingValue << kApplePIODMAGenericPacketWord0BufferBurstTypePhase) & kApplePIODMAGenericPacketWord0BufferBurstType)
-                               | ((kApplePIODMAGenericPacketWord0ExtendedTypeValue << kApplePIODMAGenericPacketWord0ExtendedTypePhase) & kApplePIODMAGenericPacketWord0ExtendedType)
-                               | ((kApplePIODMAGenericPacketWord0TypeValue << kApplePIODMAGenericPacketWord0TypePhase) & kApplePIODMAGenericPacketWord0Type);
-
-
-        genericPacket->word1 = ((targetPhysicalAddress << kApplePIODMAGenericPacketWord1TargetAddrOffsetPhase) & kApplePIODMAGenericPacketWord1TargetAddrOffset)
-                               | (((bufferPhysicalAddress >> kApplePIODMAGenericPacketWord0BufferAddrOffsetWidth) << kApplePIODMAGenericPacketWord1BufferAddrOffsetPhase) & kApplePIODMAGenericPacketWord1BufferAddrOffset);
-        genericPacket->word2 = (((targetPhysicalAddress  >> kApplePIODMAGenericPacketWord1TargetAddrOffsetWidth) << kApplePIODMAGenericPacketWord2TargetAddrOffsetPhase) & kApplePIODMAGenericPacketWord2TargetAddrOffset);
-        genericPacket->word3 = ((_transferSize << kApplePIODMAGenericPacketWord3TransferSizePhase) & kApplePIODMAGenericPacketWord3TransferSize);
+        ApplePIODMAGenericPacket* genericPacket = reinterpret_cast<ApplePIODMAGenericPacket*>(_reserved->commandBlock.words);
+        applePIODMAEncodeGenericPacket(genericPacket,
+                                       bufferPhysicalAddress,
+                                       targetPhysicalAddress,
+                                       bufferType,
+                                       targetType,
+                                       _transferSize,
+                                       bufferBaseAddressSelect,
+                                       targetBaseAddressSelect);
+        _reserved->commandBlock.length = kApplePIODMAGenericPacketSize;
+        _reserved->packetCount         = 1;
 
         result = _commandSourceDMACommand->setMemoryDescriptor(_commandSourceBuffer);
 
@@ -301,27 +429,79 @@ IOReturn ApplePIODMARequest::complete()
 {
     IOReturn result = kIOReturnSuccess;
 
+    // only a transfer that ran and retired cleanly has anything worth copying back to the caller
+    bool copyBack = (_reserved->completionStatus == kIOReturnSuccess) && (_errorStatus == 0);
+
     // clear out command to be re-used in pool
     _bufferBaseDMACommand->clearMemoryDescriptor();
     _targetBaseDMACommand->clearMemoryDescriptor();
+    _reserved->stagedBufferDMACommand->clearMemoryDescriptor();
+    _reserved->stagedTargetDMACommand->clearMemoryDescriptor();
+    _reserved->bufferDMACommand = NULL;
+    _reserved->targetDMACommand = NULL;
+    if(_reserved->bufferMapping != NULL)
+    {
+        _reserved->descriptorPool->releaseMapping(_reserved->bufferMapping);
+        _reserved->bufferMapping = NULL;
+    }
+    if(_reserved->targetMapping != NULL)
+    {
+        _reserved->descriptorPool->releaseMapping(_reserved->targetMapping);
+        _reserved->targetMapping = NULL;
+    }
     OSSafeReleaseNULL(_bufferBase);
     OSSafeReleaseNULL(_targetBase);
+    if(_reserved->directBuffer != NULL)
+    {
+        _reserved->directBuffer->complete();
+        OSSafeReleaseNULL(_reserved->directBuffer);
+    }
+    if(_reserved->directTarget != NULL)
+    {
+        _reserved->directTarget->complete();
+        OSSafeReleaseNULL(_reserved->directTarget);
+    }
     _commandSourceDMACommand->clearMemoryDescriptor();
     _commandDestinationDMACommand->clearMemoryDescriptor();
-    bzero(_commandSourceBuffer->getBytesNoCopy(), sizeof(ApplePIODMAGenericPacket));
     bzero(_commandDestinationBuffer->getBytesNoCopy(), sizeof(ApplePIODMAGenericPacket));
 
+    bzero(_reserved->commandBlock.words, _reserved->commandBlock.length * sizeof(uint32_t));
+    _reserved->commandBlock.length = 0;
+    _reserved->commandBlock.address = 0;
+
+    for(uint32_t i = 0; (copyBack == true) && (i < _reserved->chainScalarCount); i++)
+    {
+        bcopy(reinterpret_cast<uint8_t*>(_scalarBufferDescriptor->getBytesNoCopy()) + _reserved->chainScalars[i].offset,
+              _reserved->chainScalars[i].buffer,
+              _reserved->chainScalars[i].size);
+    }
+    _reserved->chainScalarCount  = 0;
+    _reserved->chainScalarOffset = 0;
+    _reserved->chainScalar       = false;
+    _reserved->chainOpen         = false;
+    _reserved->packetCount       = 0;
+
     if(_scalarBuffer != NULL)
     {
-        bcopy(_scalarBufferDescriptor->getBytesNoCopy(), _scalarBuffer, _transferSize);
+        if(copyBack == true)
+        {
+            IOBufferMemoryDescriptor* bounce = (_reserved->spillBuffer != NULL) ? _reserved->spillBuffer : _scalarBufferDescriptor;
+            bcopy(bounce->getBytesNoCopy(), _scalarBuffer, _transferSize);
+        }
         _scalarBuffer = NULL;
     }
 
     if(_scalarTarget != NULL)
     {
-        bcopy(_scalarTargetDescriptor->getBytesNoCopy(), _scalarTarget, _transferSize);
+        if(copyBack == true)
+        {
+            IOBufferMemoryDescriptor* bounce = (_reserved->spillTarget != NULL) ? _reserved->spillTarget : _scalarTargetDescriptor;
+            bcopy(bounce->getBytesNoCopy(), _scalarTarget, _transferSize);
+        }
         _scalarTarget = NULL;
     }
+    OSSafeReleaseNULL(_reserved->spillBuffer);
+    OSSafeReleaseNULL(_reserved->spillTarget);
 
     _errorAddress = 0;
     _errorStatus  = 0;
@@ -329,6 +509,8 @@ IOReturn ApplePIODMARequest::complete()
     _commandSize  = 0;
     _commandType  = 0;
     _transferSize = 0;
+    _reserved->completionStatus = kIOReturnNotReady;
+    bzero(&_reserved->completion, sizeof(_reserved->completion));
     return result;
 }
 
@@ -342,17 +524,31 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(void*
                                                   uint8_t                             bufferBaseAddressSelect,
                                                   uint8_t                             targetBaseAddressSelect)
 {
-    if(   (transferSize > _scalarBufferDescriptor->getLength())
-       || (buffer == NULL))
+    IOMemoryDescriptor* bufferBase = NULL;
+    IOReturn            result     = stageScalar(buffer, transferSize, kIODirectionOut, kApplePIODMAChainBlockMaxPackets, _scalarBufferDescriptor, &_scalarBuffer, &_reserved->directBuffer, &_reserved->spillBuffer, &bufferBase);
+
+    if(result != kIOReturnSuccess)
     {
-        debug(kApplePIODMADebugLoggingAlways, "rejecting scalar request of size %llu\n", transferSize);
-        return kIOReturnBadArgument;
+        complete();
+        return result;
     }
 
-    _scalarBuffer = buffer;
-    bcopy(buffer, _scalarBufferDescriptor->getBytesNoCopy(), transferSize);
+    if(   (_reserved->directBuffer != NULL)
+       || (_reserved->spillBuffer != NULL))
+    {
+        return prepareDirect(bufferBase,
+                             0,
+                             targetBase,
+                             targetOffset,
+                             bufferType,
+                             targetType,
+                             transferSize,
+                             commandType,
+                             bufferBaseAddressSelect,
+                             targetBaseAddressSelect);
+    }
 
-    return prepareGenericPacket(_scalarBufferDescriptor,
+    return prepareGenericPacket(bufferBase,
                                 0,
                                 targetBase,
                                 targetOffset,
@@ -374,19 +570,36 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(IOMemoryDescriptor*
                                                   uint8_t                             bufferBaseAddressSelect,
                                                   uint8_t                             targetBaseAddressSelect)
 {
-    if(   (transferSize > _scalarTargetDescriptor->getLength())
-       || (target == NULL))
+    IOMemoryDescriptor* targetBase = NULL;
+    // a chain needs a buffer descriptor, against a raw buffer offset the target is always bounced and its contiguous bounce buffer is one packet
+    uint32_t            targetRuns = (bufferBase != NULL) ? kApplePIODMAChainBlockMaxPackets : 0;
+    IOReturn            result     = stageScalar(target, transferSize, kIODirectionIn, targetRuns, _scalarTargetDescriptor, &_scalarTarget, &_reserved->directTarget, &_reserved->spillTarget, &targetBase);
+
+    if(result != kIOReturnSuccess)
     {
-        debug(kApplePIODMADebugLoggingAlways, "rejecting scalar request of size %llu\n", transferSize);
-        return kIOReturnBadArgument;
+        complete();
+        return result;
     }
 
-    _scalarTarget = target;
-    bcopy(target, _scalarTargetDescriptor->getBytesNoCopy(), transferSize);
+    if(   (_reserved->directTarget != NULL)
+       || (   (_reserved->spillTarget != NULL)
+           && (bufferBase != NULL)))
+    {
+        return prepareDirect(bufferBase,
+                             bufferOffset,
+                             targetBase,
+                             0,
+                             bufferType,
+                             targetType,
+                             transferSize,
+                             commandType,
+                             bufferBaseAddressSelect,
+                             targetBaseAddressSelect);
+    }
 
     return prepareGenericPacket(bufferBase,
                                 bufferOffset,
-                                _scalarTargetDescriptor,
+                                targetBase,
                                 0,
                                 bufferType,
                                 targetType,
@@ -405,24 +618,49 @@ IOReturn ApplePIODMARequest::prepareGenericPacket(void*
                                                   uint8_t                             bufferBaseAddressSelect,
                                                   uint8_t                             targetBaseAddressSelect)
 {
-    if(   (transferSize > _scalarBufferDescriptor->getLength())
-       || (transferSize > _scalarTargetDescriptor->getLength())
-       || (buffer == NULL)
-       || (target == NULL))
+    IOMemoryDescriptor* bufferBase = NULL;
+    IOMemoryDescriptor* targetBase = NULL;
+    uint32_t            targetRuns = kApplePIODMAChainBlockMaxPackets;
+    IOReturn            result     = stageScalar(buffer, transferSize, kIODirectionOut, kApplePIODMAChainBlockMaxPackets, _scalarBufferDescriptor, &_scalarBuffer, &_reserved->directBuffer, &_reserved->spillBuffer, &bufferBase);
+
+    if(result == kIOReturnSuccess)
     {
-        debug(kApplePIODMADebugLoggingAlways, "rejecting scalar request of size %llu\n", transferSize);
-        return kIOReturnBadArgument;
+        // packets split wherever either side does, so the target only gets the runs the buffer leaves over
+        if(bufferBase != _scalarBufferDescriptor)
+        {
+            void*    staged     = (_reserved->spillBuffer != NULL) ? _reserved->spillBuffer->getBytesNoCopy() : buffer;
+            uint32_t bufferRuns = scalarPageSpan(staged, transferSize);
+            targetRuns = (bufferRuns < kApplePIODMAChainBlockMaxPackets) ? (kApplePIODMAChainBlockMaxPackets - bufferRuns + 1) : 1;
+        }
+        result = stageScalar(target, transferSize, kIODirectionIn, targetRuns, _scalarTargetDescriptor, &_scalarTarget, &_reserved->directTarget, &_reserved->spillTarget, &targetBase);
     }
 
-    _scalarBuffer = buffer;
-    bcopy(buffer, _scalarBufferDescriptor->getBytesNoCopy(), transferSize);
+    if(result != kIOReturnSuccess)
+    {
+        complete();
+        return result;
+    }
 
-    _scalarTarget = target;
-    bcopy(target, _scalarTargetDescriptor->getBytesNoCopy(), transferSize);
+    if(   (_reserved->directBuffer != NULL)
+       || (_reserved->directTarget != NULL)
+       || (_reserved->spillBuffer != NULL)
+       || (_reserved->spillTarget != NULL))
+    {
+        return prepareDirect(bufferBase,
+                             0,
+                             targetBase,
+                             0,
+                             bufferType,
+                             targetType,
+                             transferSize,
+                             commandType,
+                             bufferBaseAddressSelect,
+                             targetBaseAddressSelect);
+    }
 
-    return prepareGenericPacket(_scalarBufferDescriptor,
+    return prepareGenericPacket(bufferBase,
                                 0,
-                                _scalarTargetDescriptor,
+                                targetBase,
                                 0,
                                 bufferType,
                                 targetType,
@@ -495,3 +733,404 @@ IOPhysicalAddress ApplePIODMARequest::commandDestination()
 
     return segment.fIOVMAddr;
 }
+
+void ApplePIODMARequest::setCompletion(const ApplePIODMACompletion* completion)
+{
+    if(completion != NULL)
+    {
+        _reserved->completion = *completion;
+    }
+    else
+    {
+        bzero(&_reserved->completion, sizeof(_reserved->completion));
+    }
+}
+
+const ApplePIODMACompletion* ApplePIODMARequest::completion()
+{
+    return (_reserved->completion.action != NULL) ? &_reserved->completion : NULL;
+}
+
+void ApplePIODMARequest::setCompletionStatus(IOReturn status)
+{
+    _reserved->completionStatus = status;
+}
+
+IOReturn ApplePIODMARequest::completionStatus()
+{
+    return _reserved->completionStatus;
+}
+
+#pragma mark Multi-packet commands
+
+IOReturn ApplePIODMARequest::prepareChain(IOMemoryDescriptor*                 bufferBase,
+                                          IOMemoryDescriptor*                 targetBase,
+                                          tApplePIODMAGenericPacketDeviceType bufferType,
+                                          tApplePIODMAGenericPacketDeviceType targetType,
+                                          uint8_t                             commandType,
+                                          uint8_t                             bufferBaseAddressSelect,
+                                          uint8_t                             targetBaseAddressSelect)
+{
+    IOReturn                result = kIOReturnSuccess;
+    IODMACommand::Segment64 segment;
+    UInt32                  numSegments = 1;
+    UInt64                  offset      = 0;
+
+    if(   (_reserved->chainOpen == true)
+       || (_commandSize != 0))
+    {
+        debug(kApplePIODMADebugLoggingAlways, "request already prepared\n");
+        return kIOReturnBusy;
+    }
+
+    if(bufferBase == NULL)
+    {
+        bufferBase   = _scalarBufferDescriptor;
+        _reserved->chainScalar = true;
+    }
+
+    _bufferBase = bufferBase;
+    _bufferBase->retain();
+    result = attachBase(_bufferBase, _bufferBaseDMACommand, &_reserved->bufferMapping, &_reserved->bufferDMACommand);
+
+    if(   (result == kIOReturnSuccess)
+       && (targetBase != NULL))
+    {
+        _targetBase = targetBase;
+        _targetBase->retain();
+        result = attachBase(_targetBase, _targetBaseDMACommand, &_reserved->targetMapping, &_reserved->targetDMACommand);
+    }
+
+    if(result == kIOReturnSuccess)
+    {
+        result = _commandSourceDMACommand->setMemoryDescriptor(_commandSourceBuffer);
+    }
+
+    if(result == kIOReturnSuccess)
+    {
+        bzero(&segment, sizeof(IODMACommand::Segment64));
+        result = _commandSourceDMACommand->genIOVMSegments(&offset, &segment, &numSegments);
+    }
+
+    if(result != kIOReturnSuccess)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "couldn't prepare chain, result = 0x%x\n", result);
+        complete();
+        return result;
+    }
+
+    _reserved->commandBlock.address         = segment.fIOVMAddr;
+    _reserved->commandBlock.length          = 0;
+    _reserved->chainOpen                    = true;
+    _reserved->chainBufferType              = bufferType;
+    _reserved->chainTargetType              = targetType;
+    _reserved->chainBufferBaseAddressSelect = bufferBaseAddressSelect;
+    _reserved->chainTargetBaseAddressSelect = targetBaseAddressSelect;
+    _commandType                  = commandType;
+
+    return result;
+}
+
+IOReturn ApplePIODMARequest::appendTransfer(IOByteCount bufferOffset,
+                                            IOByteCount targetOffset,
+                                            IOByteCount transferSize)
+{
+    if(   (_reserved->chainOpen == false)
+       || (_reserved->chainScalar == true))
+    {
+        return kIOReturnNotReady;
+    }
+
+    return appendSegments(bufferOffset, targetOffset, transferSize);
+}
+
+IOReturn ApplePIODMARequest::appendScalar(void*       buffer,
+                                          IOByteCount targetOffset,
+                                          IOByteCount transferSize)
+{
+    IOByteCount offset = (_reserved->chainScalarOffset + _reserved->byteAlignment - 1) / _reserved->byteAlignment * _reserved->byteAlignment;
+
+    if(   (_reserved->chainOpen == false)
+       || (_reserved->chainScalar == false))
+    {
+        return kIOReturnNotReady;
+    }
+
+    if(   (buffer == NULL)
+       || (transferSize == 0)
+       || (offset + transferSize > _scalarBufferDescriptor->getLength())
+       || (_reserved->chainScalarCount == _reserved->chainScalarMax))
+    {
+        debug(kApplePIODMADebugLoggingAlways, "rejecting scalar of size %llu at %llu\n", transferSize, offset);
+        return kIOReturnNoSpace;
+    }
+
+    bcopy(buffer, reinterpret_cast<uint8_t*>(_scalarBufferDescriptor->getBytesNoCopy()) + offset, transferSize);
+    _reserved->chainScalars[_reserved->chainScalarCount].buffer = buffer;
+    _reserved->chainScalars[_reserved->chainScalarCount].offset = offset;
+    _reserved->chainScalars[_reserved->chainScalarCount].size   = transferSize;
+    _reserved->chainScalarCount++;
+    _reserved->chainScalarOffset = offset + transferSize;
+
+    return appendSegments(offset, targetOffset, transferSize);
+}
+
+IOReturn ApplePIODMARequest::finishChain()
+{
+    IOReturn result = kIOReturnSuccess;
+
+    if(   (_reserved->chainOpen == false)
+       || (_reserved->packetCount == 0))
+    {
+        return kIOReturnNotReady;
+    }
+
+    _commandSize = _reserved->commandBlock.length;
+    _reserved->chainOpen   = false;
+
+    result = _commandDestinationDMACommand->setMemoryDescriptor(_commandDestinationBuffer);
+    if(result != kIOReturnSuccess)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "couldn't set memory descriptor for command destination buffer, result = 0x%x\n", result);
+        complete();
+    }
+    else
+    {
+        debug(kApplePIODMADebugLoggingIO, "command of %u packets, %llu bytes\n", _reserved->packetCount, _transferSize);
+    }
+
+    return result;
+}
+
+uint32_t ApplePIODMARequest::packetCount()
+{
+    return _reserved->packetCount;
+}
+
+IOReturn ApplePIODMARequest::chainSegment(IODMACommand* dmaCommand, IOMemoryDescriptor* base, IOByteCount offset, uint64_t* address, IOByteCount* length)
+{
+    IOReturn                result      = kIOReturnSuccess;
+    IODMACommand::Segment64 segment;
+    UInt32                  numSegments = 1;
+    UInt64                  segmentOffset = offset;
+
+    if(base == NULL)
+    {
+        *address = offset;
+        return result;
+    }
+
+    bzero(&segment, sizeof(IODMACommand::Segment64));
+    result = dmaCommand->genIOVMSegments(&segmentOffset, &segment, &numSegments);
+    if(   (result == kIOReturnSuccess)
+       && (   (numSegments == 0)
+           || (segment.fLength == 0)))
+    {
+        result = kIOReturnOverrun;
+    }
+
+    if(result == kIOReturnSuccess)
+    {
+        *address = segment.fIOVMAddr;
+        if(segment.fLength < *length)
+        {
+            *length = segment.fLength;
+        }
+    }
+
+    return result;
+}
+
+IOReturn ApplePIODMARequest::appendSegments(IOByteCount bufferOffset, IOByteCount targetOffset, IOByteCount transferSize)
+{
+    IOReturn result = kIOReturnSuccess;
+
+    while(   (result == kIOReturnSuccess)
+          && (transferSize > 0))
+    {
+        uint64_t    bufferAddress = 0;
+        uint64_t    targetAddress = 0;
+        IOByteCount length        = (transferSize > UINT32_MAX) ? UINT32_MAX : transferSize;
+
+        result = chainSegment(_reserved->bufferDMACommand, _bufferBase, bufferOffset, &bufferAddress, &length);
+
+        if(result == kIOReturnSuccess)
+        {
+            result = chainSegment(_reserved->targetDMACommand, _targetBase, targetOffset, &targetAddress, &length);
+        }
+
+        if(result == kIOReturnSuccess)
+        {
+            result = appendPacket(bufferAddress, targetAddress, length);
+        }
+
+        bufferOffset += length;
+        targetOffset += length;
+        transferSize -= length;
+    }
+
+    if(result != kIOReturnSuccess)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "couldn't append to chain, result = 0x%x\n", result);
+        complete();
+    }
+
+    return result;
+}
+
+IOReturn ApplePIODMARequest::appendPacket(uint64_t bufferAddress, uint64_t targetAddress, IOByteCount transferSize)
+{
+    ApplePIODMADescriptorBlock* block = &_reserved->commandBlock;
+
+    if(block->length == kApplePIODMAChainBlockMaxPackets * kApplePIODMAGenericPacketSize)
+    {
+        // the command block is the whole command, nothing links past it
+        return kIOReturnNoResources;
+    }
+
+    applePIODMAEncodeGenericPacket(reinterpret_cast<ApplePIODMAGenericPacket*>(block->words + block->length),
+                                   bufferAddress,
+                                   targetAddress,
+                                   _reserved->chainBufferType,
+                                   _reserved->chainTargetType,
+                                   transferSize,
+                                   _reserved->chainBufferBaseAddressSelect,
+                                   _reserved->chainTargetBaseAddressSelect);
+    block->length += kApplePIODMAGenericPacketSize;
+    _reserved->packetCount++;
+    _transferSize += transferSize;
+
+    return kIOReturnSuccess;
+}
+
+#pragma mark Zero copy
+
+IOReturn ApplePIODMARequest::attachBase(IOMemoryDescriptor* base, IODMACommand* ownDMACommand, ApplePIODMAMapping** mapping, IODMACommand** dmaCommand)
+{
+    // scalars staged past the bounce buffers can be longer than maxTransferSize allows
+    if(   (base == _reserved->directBuffer)
+       || (base == _reserved->spillBuffer))
+    {
+        ownDMACommand = _reserved->stagedBufferDMACommand;
+    }
+    else if(   (base == _reserved->directTarget)
+            || (base == _reserved->spillTarget))
+    {
+        ownDMACommand = _reserved->stagedTargetDMACommand;
+    }
+
+    if(_reserved->descriptorPool != NULL)
+    {
+        *mapping = _reserved->descriptorPool->copyMapping(base);
+    }
+
+    if(*mapping != NULL)
+    {
+        // already mapped by the pool, nothing to prepare
+        *dmaCommand = (*mapping)->dmaCommand;
+        return kIOReturnSuccess;
+    }
+
+    *dmaCommand = ownDMACommand;
+    return ownDMACommand->setMemoryDescriptor(base);
+}
+
+IOReturn ApplePIODMARequest::stageScalar(void* address, IOByteCount size, IODirection direction, uint32_t maxRuns, IOBufferMemoryDescriptor* bounce, void** scalar, IOMemoryDescriptor** direct, IOBufferMemoryDescriptor** spill, IOMemoryDescriptor** base)
+{
+    IOReturn result    = kIOReturnSuccess;
+    uint64_t threshold = (_reserved->descriptorPool != NULL) ? _reserved->descriptorPool->zeroCopyThreshold() : UINT64_MAX;
+    bool     aligned   = ((reinterpret_cast<uintptr_t>(address) | size) & (_reserved->byteAlignment - 1)) == 0;
+    bool     fits      = (size <= bounce->getLength());
+
+    if(address == NULL)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "rejecting scalar request of size %llu\n", size);
+        return kIOReturnBadArgument;
+    }
+
+    // only goes direct if its runs are sure to fit the command block, anything else is bounced
+    if(   (aligned == true)
+       && (scalarPageSpan(address, size) <= maxRuns)
+       && (   (fits == false)
+           || (size > threshold)))
+    {
+        *direct = IOMemoryDescriptor::withAddressRange(reinterpret_cast<mach_vm_address_t>(address), size, direction, kernel_task);
+        if(*direct != NULL)
+        {
+            result = (*direct)->prepare();
+            if(result != kIOReturnSuccess)
+            {
+                debug(kApplePIODMADebugLoggingAlways, "couldn't wire scalar of size %llu, result = 0x%x\n", size, result);
+                OSSafeReleaseNULL(*direct);
+            }
+        }
+
+        if(*direct != NULL)
+        {
+            *base = *direct;
+            return kIOReturnSuccess;
+        }
+
+        result = kIOReturnSuccess;
+    }
+
+    if(fits == false)
+    {
+        // too large for the request's bounce buffer, bounce it through a contiguous one of its own
+        *spill = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task,
+                                                             kIOMemoryPhysicallyContiguous | kIODirectionInOut,
+                                                             size,
+                                                             _reserved->byteAlignment,
+                                                             0, 0);
+        if(*spill == NULL)
+        {
+            debug(kApplePIODMADebugLoggingAlways, "couldn't allocate bounce buffer for scalar of size %llu\n", size);
+            return kIOReturnNoMemory;
+        }
+
+        bounce = *spill;
+    }
+
+    *scalar = address;
+    bcopy(address, bounce->getBytesNoCopy(), size);
+    *base = bounce;
+
+    return result;
+}
+
+IOReturn ApplePIODMARequest::prepareDirect(IOMemoryDescriptor*                 bufferBase,
+                                           IOByteCount                         bufferOffset,
+                                           IOMemoryDescriptor*                 targetBase,
+                                           IOByteCount                         targetOffset,
+                                           tApplePIODMAGenericPacketDeviceType bufferType,
+                                           tApplePIODMAGenericPacketDeviceType targetType,
+                                           IOByteCount                         transferSize,
+                                           uint8_t                             commandType,
+                                           uint8_t                             bufferBaseAddressSelect,
+                                           uint8_t                             targetBaseAddressSelect)
+{
+    IOReturn result = kIOReturnSuccess;
+
+    if(bufferBase == NULL)
+    {
+        // a chain needs a descriptor on the buffer side, raw buffer offsets only work for scalars that fit the bounce buffers
+        debug(kApplePIODMADebugLoggingAlways, "rejecting direct scalar of size %llu without a buffer descriptor\n", transferSize);
+        complete();
+        return kIOReturnUnsupported;
+    }
+
+    // caller memory is only virtually contiguous and a large bounce buffer can outrun a segment, so this is a packet per physical run
+    result = prepareChain(bufferBase, targetBase, bufferType, targetType, commandType, bufferBaseAddressSelect, targetBaseAddressSelect);
+
+    if(result == kIOReturnSuccess)
+    {
+        result = appendTransfer(bufferOffset, targetOffset, transferSize);
+    }
+
+    if(result == kIOReturnSuccess)
+    {
+        result = finishChain();
+    }
+
+    return result;
+}
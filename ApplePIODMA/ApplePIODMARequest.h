@@ -7,6 +7,7 @@
 
 #ifndef ApplePIODMARequest_H
 #define ApplePIODMARequest_H
+#ifdef KERNEL
 #include <IOKit/IOCommand.h>
 #include <IOKit/IODMACommand.h>
 #include <IOKit/IOCommandPool.h>
@@ -16,6 +17,11 @@
 
 #include <IOKit/apiodma/ApplePIODMADefinitions.h>
 #include <IOKit/apiodma/ApplePIODMARequestPool.h>
+#else
+#include "piodmakit.h"     // tools/piodmaengine.cpp
+#include "ApplePIODMADefinitions.h"
+#include "ApplePIODMARequestPool.h"
+#endif
 
 
 enum tApplePIODMARequestBufferType
@@ -27,6 +33,21 @@ enum tApplePIODMARequestBufferType
     kApplePIODMARequestBufferTypeCount
 };
 
+class ApplePIODMARequest;
+
+/*!
+ * @brief       Called on the engine's workloop when an asynchronous request retires
+ * @discussion  The request has been completed and returned to the pool, only its pointer is valid for matching.
+ */
+typedef void (*ApplePIODMACompletionAction)(void* target, void* parameter, IOReturn status, ApplePIODMARequest* request);
+
+typedef struct ApplePIODMACompletion
+{
+    void*                       target;
+    ApplePIODMACompletionAction action;
+    void*                       parameter;
+} ApplePIODMACompletion;
+
 class ApplePIODMARequest : public IOCommand
 {
     OSDeclareDefaultStructors(ApplePIODMARequest);
@@ -43,6 +64,13 @@ public:
                                           uint64_t  maxTransferSize,
                                           uint64_t  maxSegmentSize);
 
+    static ApplePIODMARequest* withPool(ApplePIODMARequestPool* pool,
+                                        IOMapper*               mapper,
+                                        uint32_t                byteAlignment,
+                                        uint8_t                 numberOfAddressBits,
+                                        uint64_t                maxTransferSize,
+                                        uint64_t                maxSegmentSize);
+
     virtual IOReturn prepareGenericPacket(IOMemoryDescriptor*                 bufferBase,
                                           IOByteCount                         bufferOffset,
                                           IOMemoryDescriptor*                 targetBase,
@@ -54,6 +82,7 @@ public:
                                           uint8_t                             bufferBaseAddressSelect = 0,
                                           uint8_t                             targetBaseAddressSelect = 0);
 
+    // the scalar variants take buffer as the transfer's source and target as its destination, a scalar is wired for that direction only
     virtual IOReturn prepareGenericPacket(void*                               buffer,
                                           IOMemoryDescriptor*                 targetBase,
                                           IOByteCount                         targetOffset,
@@ -83,6 +112,50 @@ public:
                                           uint8_t                             bufferBaseAddressSelect = 0,
                                           uint8_t                             targetBaseAddressSelect = 0);
 
+#pragma mark Multi-packet commands
+
+    /*!
+     * @brief       Start a command made of several generic packets
+     * @discussion  Packets are appended with appendTransfer or appendScalar and the command is closed with finishChain, after which it is
+     *                      executed like a single packet request and completes once for all its packets. The packets sit back to back in
+     *                      the request's own command block and the engine is given the block's address and total size, no next pointer
+     *                      packets are emitted. So a command holds at most kApplePIODMAChainBlockMaxPackets packets, appending more fails
+     *                      with kIOReturnNoResources. On failure the request is completed and must be prepared again.
+     * @param       bufferBase         Memory descriptor all buffer offsets are relative to, or NULL for a command of scalar accesses
+     * @param       targetBase         Memory descriptor all target offsets are relative to, or NULL for raw target offsets
+     */
+    IOReturn prepareChain(IOMemoryDescriptor*                 bufferBase,
+                          IOMemoryDescriptor*                 targetBase,
+                          tApplePIODMAGenericPacketDeviceType bufferType,
+                          tApplePIODMAGenericPacketDeviceType targetType,
+                          uint8_t                             commandType,
+                          uint8_t                             bufferBaseAddressSelect = 0,
+                          uint8_t                             targetBaseAddressSelect = 0);
+
+    /*!
+     * @brief       Append a transfer to the command, split into one packet per physically contiguous run
+     */
+    IOReturn appendTransfer(IOByteCount bufferOffset,
+                            IOByteCount targetOffset,
+                            IOByteCount transferSize);
+
+    /*!
+     * @brief       Append a scalar access to a command prepared without a bufferBase
+     * @discussion  buffer is staged like the scalar prepareGenericPacket variants and copied back when the request completes, unless the
+     *                      transfer failed. All scalars of a command share the request's scalar buffer, so their total size is limited to the
+     *                      maximum transfer size.
+     */
+    IOReturn appendScalar(void*       buffer,
+                          IOByteCount targetOffset,
+                          IOByteCount transferSize);
+
+    /*!
+     * @brief       Close the command and make the request ready to execute
+     */
+    IOReturn finishChain();
+
+    uint32_t packetCount();
+
     virtual IOReturn complete();
 
     virtual void              setCommandTag(uint8_t commandTag);
@@ -96,6 +169,14 @@ public:
     virtual IOPhysicalAddress commandSource();
     virtual IOPhysicalAddress commandDestination();
 
+    // an async request carries its completion, a sync one has none
+    void                         setCompletion(const ApplePIODMACompletion* completion);
+    const ApplePIODMACompletion* completion();
+
+    // how the request retired, kIOReturnAborted if the engine was disabled under it, valid until complete()
+    void     setCompletionStatus(IOReturn status);
+    IOReturn completionStatus();
+
 protected:
     virtual bool initWithMapper(IOMapper* mapper,
                                 uint32_t  byteAlignment,
@@ -105,6 +186,22 @@ protected:
 
     virtual tApplePIODMAGenericPacketDeviceType deviceType(tApplePIODMARequestBufferType sourceType);
 
+    IOReturn attachBase(IOMemoryDescriptor* base, IODMACommand* ownDMACommand, ApplePIODMAMapping** mapping, IODMACommand** dmaCommand);
+    IOReturn stageScalar(void* address, IOByteCount size, IODirection direction, uint32_t maxRuns, IOBufferMemoryDescriptor* bounce, void** scalar, IOMemoryDescriptor** direct, IOBufferMemoryDescriptor** spill, IOMemoryDescriptor** base);
+    IOReturn prepareDirect(IOMemoryDescriptor*                 bufferBase,
+                           IOByteCount                         bufferOffset,
+                           IOMemoryDescriptor*                 targetBase,
+                           IOByteCount                         targetOffset,
+                           tApplePIODMAGenericPacketDeviceType bufferType,
+                           tApplePIODMAGenericPacketDeviceType targetType,
+                           IOByteCount                         transferSize,
+                           uint8_t                             commandType,
+                           uint8_t                             bufferBaseAddressSelect,
+                           uint8_t                             targetBaseAddressSelect);
+    IOReturn chainSegment(IODMACommand* dmaCommand, IOMemoryDescriptor* base, IOByteCount offset, uint64_t* address, IOByteCount* length);
+    IOReturn appendSegments(IOByteCount bufferOffset, IOByteCount targetOffset, IOByteCount transferSize);
+    IOReturn appendPacket(uint64_t bufferAddress, uint64_t targetAddress, IOByteCount transferSize);
+
     IODMACommand*       _bufferBaseDMACommand;
     IODMACommand*       _targetBaseDMACommand;
     IOMemoryDescriptor* _bufferBase;
@@ -130,6 +227,17 @@ protected:
     uint8_t     _commandTag;
     uint8_t     _commandType;
 
+    /*!
+     * @struct      ExpansionData
+     * @discussion  This structure will be used to expand the capabilities of the class in the future.
+     */
+    struct ExpansionData;
+
+    /*!
+     * @var         _reserved
+     * @discussion  Reserved for future use. (Internal use only)
+     */
+    ExpansionData* _reserved;
 };
 
 #endif /* ApplePIODMARequest_H */
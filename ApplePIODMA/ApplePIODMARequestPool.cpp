@@ -4,10 +4,16 @@
 //
 //  Created by Kevin Strasberg on 6/26/20.
 //
+#ifdef KERNEL
 #include <IOKit/IOReturn.h>
 #include <IOKit/apiodma/ApplePIODMADebug.h>
 #include <IOKit/apiodma/ApplePIODMARequest.h>
 #include <IOKit/apiodma/ApplePIODMARequestPool.h>
+#else
+#include "ApplePIODMADebug.h"
+#include "ApplePIODMARequest.h"
+#include "ApplePIODMARequestPool.h"
+#endif
 
 
 #define super IOCommandPool
@@ -15,6 +21,18 @@ OSDefineMetaClassAndStructors(ApplePIODMARequestPool, IOCommandPool)
 
 #define debug(mask, fmt, args...) pioDMADebugObjectWithClass(mask, ApplePIODMARequestPool, fmt,##args)
 
+enum
+{
+    kApplePIODMARequestPoolMaxMappings = 16
+};
+
+struct ApplePIODMARequestPool::ExpansionData
+{
+    IOLock*            descriptorLock;    // protects mappings
+    ApplePIODMAMapping mappings[kApplePIODMARequestPoolMaxMappings];
+    uint64_t           zeroCopyThreshold;
+};
+
 ApplePIODMARequestPool * ApplePIODMARequestPool::withWorkLoop(IOWorkLoop * workLoop,
                                                               IOMapper *   mapper,
                                                               uint32_t maxOutstandingCommands,
@@ -53,6 +71,12 @@ bool ApplePIODMARequestPool::initWithWorkLoop(IOWorkLoop* workLoop,
         return false;
     }
 
+    _reserved = IONewZero(ExpansionData, 1);
+    if(_reserved == NULL)
+    {
+        return false;
+    }
+
     _debugLoggingMask = applePIODMAgetDebugLoggingMaskForMetaClass(getMetaClass(), super::metaClass);
 
     _maxOutstandingCommands = maxOutstandingCommands;
@@ -62,6 +86,8 @@ bool ApplePIODMARequestPool::initWithWorkLoop(IOWorkLoop* workLoop,
     _maxSegmentSize         = maxSegmentSize;
     _maxOutstandingCommands = maxOutstandingCommands;
 
+    _reserved->zeroCopyThreshold = UINT64_MAX;
+
     _workLoop = workLoop;
     _workLoop->retain();
 
@@ -71,6 +97,12 @@ bool ApplePIODMARequestPool::initWithWorkLoop(IOWorkLoop* workLoop,
         _memoryMapper->retain();
     }
 
+    _reserved->descriptorLock = IOLockAlloc();
+    if(_reserved->descriptorLock == NULL)
+    {
+        return false;
+    }
+
     // allocate the commands during initialization
     for(unsigned int i = 0; i < _maxOutstandingCommands; i++)
     {
@@ -84,6 +116,25 @@ bool ApplePIODMARequestPool::initWithWorkLoop(IOWorkLoop* workLoop,
 
 void ApplePIODMARequestPool::free()
 {
+    if(_reserved != NULL)
+    {
+        for(unsigned int i = 0; i < kApplePIODMARequestPoolMaxMappings; i++)
+        {
+            if(_reserved->mappings[i].descriptor != NULL)
+            {
+                freeMapping(&_reserved->mappings[i]);
+            }
+        }
+
+        if(_reserved->descriptorLock != NULL)
+        {
+            IOLockFree(_reserved->descriptorLock);
+        }
+
+        IODelete(_reserved, ExpansionData, 1);
+        _reserved = NULL;
+    }
+
     OSSafeReleaseNULL(_workLoop);
     OSSafeReleaseNULL(_memoryMapper);
     super::free();
@@ -92,9 +143,186 @@ void ApplePIODMARequestPool::free()
 #pragma mark Pool Management
 IOCommand* ApplePIODMARequestPool::allocateCommand()
 {
-    return ApplePIODMARequest::withMapper(_memoryMapper,
-                                          _byteAlignment,
-                                          _numberOfAddressBits,
-                                          _maxTransferSize,
-                                          _maxSegmentSize);
+    return ApplePIODMARequest::withPool(this,
+                                        _memoryMapper,
+                                        _byteAlignment,
+                                        _numberOfAddressBits,
+                                        _maxTransferSize,
+                                        _maxSegmentSize);
+}
+
+#pragma mark Mappings
+IOReturn ApplePIODMARequestPool::mapDescriptor(IOMemoryDescriptor* descriptor)
+{
+    IOReturn           result  = kIOReturnSuccess;
+    ApplePIODMAMapping mapping = { };
+    ApplePIODMAMapping* slot   = NULL;
+
+    if(descriptor == NULL)
+    {
+        return kIOReturnBadArgument;
+    }
+
+    IOLockLock(_reserved->descriptorLock);
+    for(unsigned int i = 0; i < kApplePIODMARequestPoolMaxMappings; i++)
+    {
+        if(   (_reserved->mappings[i].descriptor == descriptor)
+           && (_reserved->mappings[i].registrations != 0))
+        {
+            _reserved->mappings[i].registrations++;
+            IOLockUnlock(_reserved->descriptorLock);
+            return kIOReturnSuccess;
+        }
+    }
+    IOLockUnlock(_reserved->descriptorLock);
+
+    // no transfer size limit, the whole descriptor stays mapped
+    mapping.dmaCommand = IODMACommand::withSpecification(kIODMACommandOutputHost64,
+                                                         _numberOfAddressBits,
+                                                         _maxSegmentSize,
+                                                         IODMACommand::kMapped,
+                                                         0,
+                                                         _byteAlignment,
+                                                         _memoryMapper);
+    if(mapping.dmaCommand == NULL)
+    {
+        return kIOReturnNoMemory;
+    }
+
+    result = mapping.dmaCommand->setMemoryDescriptor(descriptor);
+    if(result != kIOReturnSuccess)
+    {
+        debug(kApplePIODMADebugLoggingAlways, "couldn't map descriptor, result = 0x%x\n", result);
+        OSSafeReleaseNULL(mapping.dmaCommand);
+        return result;
+    }
+
+    mapping.descriptor    = descriptor;
+    mapping.registrations = 1;
+    mapping.descriptor->retain();
+
+    IOLockLock(_reserved->descriptorLock);
+    for(unsigned int i = 0; i < kApplePIODMARequestPoolMaxMappings; i++)
+    {
+        if(   (_reserved->mappings[i].descriptor == descriptor)
+           && (_reserved->mappings[i].registrations != 0))
+        {
+            // raced with another mapDescriptor for the same descriptor
+            _reserved->mappings[i].registrations++;
+            slot = &_reserved->mappings[i];
+            break;
+        }
+    }
+    if(slot == NULL)
+    {
+        for(unsigned int i = 0; i < kApplePIODMARequestPoolMaxMappings; i++)
+        {
+            if(_reserved->mappings[i].descriptor == NULL)
+            {
+                _reserved->mappings[i] = mapping;
+                slot                   = &_reserved->mappings[i];
+                bzero(&mapping, sizeof(mapping));
+                break;
+            }
+        }
+    }
+    IOLockUnlock(_reserved->descriptorLock);
+
+    if(slot == NULL)
+    {
+        result = kIOReturnNoResources;
+    }
+
+    if(mapping.descriptor != NULL)
+    {
+        freeMapping(&mapping);
+    }
+
+    return result;
+}
+
+void ApplePIODMARequestPool::unmapDescriptor(IOMemoryDescriptor* descriptor)
+{
+    ApplePIODMAMapping mapping = { };
+
+    IOLockLock(_reserved->descriptorLock);
+    for(unsigned int i = 0; i < kApplePIODMARequestPoolMaxMappings; i++)
+    {
+        if(   (_reserved->mappings[i].descriptor == descriptor)
+           && (_reserved->mappings[i].registrations != 0))
+        {
+            _reserved->mappings[i].registrations--;
+            if(   (_reserved->mappings[i].registrations == 0)
+               && (_reserved->mappings[i].useCount == 0))
+            {
+                mapping = _reserved->mappings[i];
+                bzero(&_reserved->mappings[i], sizeof(_reserved->mappings[i]));
+            }
+            break;
+        }
+    }
+    IOLockUnlock(_reserved->descriptorLock);
+
+    if(mapping.descriptor != NULL)
+    {
+        freeMapping(&mapping);
+    }
+}
+
+ApplePIODMAMapping* ApplePIODMARequestPool::copyMapping(IOMemoryDescriptor* descriptor)
+{
+    ApplePIODMAMapping* result = NULL;
+
+    IOLockLock(_reserved->descriptorLock);
+    for(unsigned int i = 0; i < kApplePIODMARequestPoolMaxMappings; i++)
+    {
+        if(   (_reserved->mappings[i].descriptor == descriptor)
+           && (_reserved->mappings[i].registrations != 0))
+        {
+            _reserved->mappings[i].useCount++;
+            result = &_reserved->mappings[i];
+            break;
+        }
+    }
+    IOLockUnlock(_reserved->descriptorLock);
+
+    return result;
+}
+
+void ApplePIODMARequestPool::releaseMapping(ApplePIODMAMapping* mapping)
+{
+    ApplePIODMAMapping unmapped = { };
+
+    IOLockLock(_reserved->descriptorLock);
+    mapping->useCount--;
+    if(   (mapping->registrations == 0)
+       && (mapping->useCount == 0))
+    {
+        // unmapped while in use, the last request out frees it
+        unmapped = *mapping;
+        bzero(mapping, sizeof(*mapping));
+    }
+    IOLockUnlock(_reserved->descriptorLock);
+
+    if(unmapped.descriptor != NULL)
+    {
+        freeMapping(&unmapped);
+    }
+}
+
+void ApplePIODMARequestPool::freeMapping(ApplePIODMAMapping* mapping)
+{
+    mapping->dmaCommand->clearMemoryDescriptor();
+    OSSafeReleaseNULL(mapping->dmaCommand);
+    OSSafeReleaseNULL(mapping->descriptor);
+}
+
+void ApplePIODMARequestPool::setZeroCopyThreshold(uint64_t threshold)
+{
+    _reserved->zeroCopyThreshold = threshold;
+}
+
+uint64_t ApplePIODMARequestPool::zeroCopyThreshold()
+{
+    return _reserved->zeroCopyThreshold;
 }
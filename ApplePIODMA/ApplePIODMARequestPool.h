@@ -7,11 +7,29 @@
 
 #ifndef ApplePIODMARequestPool_h
 #define ApplePIODMARequestPool_h
+#ifdef KERNEL
 #include <IOKit/IOCommand.h>
 #include <IOKit/IODMACommand.h>
 #include <IOKit/IOCommandPool.h>
 #include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/apiodma/ApplePIODMADefinitions.h>
+#else
+#include "piodmakit.h"     // tools/piodmaengine.cpp
+#include "ApplePIODMADefinitions.h"
+#endif
+
+/*!
+ * @brief       A caller's memory descriptor kept mapped for the engine, see mapDescriptor
+ */
+typedef struct ApplePIODMAMapping
+{
+    IOMemoryDescriptor* descriptor;
+    IODMACommand*       dmaCommand;
+    uint32_t            registrations;
+    uint32_t            useCount;    // requests currently addressing through dmaCommand
+} ApplePIODMAMapping;
 
 class ApplePIODMARequestPool :  public IOCommandPool
 {
@@ -29,6 +47,29 @@ public:
 
     virtual void free() override;
 
+#pragma mark Mappings
+
+    /*!
+     * @brief       Keep a descriptor mapped for the engine until unmapDescriptor
+     * @discussion  Requests addressing a mapped descriptor use its cached IODMACommand rather than preparing their own for every transfer. The
+     *                      descriptor must already be prepared (wired) and stay so until it is unmapped. Calls nest.
+     * @result      kIOReturnNoResources if the pool already holds as many mappings as it has room for.
+     */
+    IOReturn mapDescriptor(IOMemoryDescriptor* descriptor);
+    void     unmapDescriptor(IOMemoryDescriptor* descriptor);
+
+    // NULL if descriptor is not mapped, else a mapping to be given back with releaseMapping
+    ApplePIODMAMapping* copyMapping(IOMemoryDescriptor* descriptor);
+    void                releaseMapping(ApplePIODMAMapping* mapping);
+
+    /*!
+     * @brief       Scalar transfers larger than this are mapped in place instead of being copied through a request's bounce buffers
+     * @discussion  Only while the pages a scalar touches fit one command block. A scalar that can't be wired, or whose pages don't fit,
+     *                      is bounced instead, through a physically contiguous buffer of its own if it is too large for the request's.
+     */
+    void     setZeroCopyThreshold(uint64_t threshold);
+    uint64_t zeroCopyThreshold();
+
 protected:
     virtual bool initWithWorkLoop(IOWorkLoop* workLoop,
                                   IOMapper*   mapper,
@@ -42,6 +83,8 @@ protected:
 
     virtual IOCommand* allocateCommand();
 
+    void freeMapping(ApplePIODMAMapping* mapping);
+
     uint32_t    _debugLoggingMask;
     IOWorkLoop* _workLoop;
     IOMapper*   _memoryMapper;
@@ -50,6 +93,18 @@ protected:
     uint8_t     _numberOfAddressBits;
     uint64_t    _maxTransferSize;
     uint64_t    _maxSegmentSize;
+
+    /*!
+     * @struct      ExpansionData
+     * @discussion  This structure will be used to expand the capabilities of the class in the future.
+     */
+    struct ExpansionData;
+
+    /*!
+     * @var         _reserved
+     * @discussion  Reserved for future use. (Internal use only)
+     */
+    ExpansionData* _reserved;
 };
 
 #endif /* ApplePIODMARequestPool_h */
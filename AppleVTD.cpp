@@ -99,6 +99,18 @@ extern "C" ppnum_t pmap_find_phys(pmap_t pmap, addr64_t va);
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// map and unmap run unlocked on every CPU
+static inline void vtd_stats_hist(uint64_t * hist, uint64_t value)
+{
+	uint32_t bucket;
+
+	bucket = value ? (64 - __builtin_clzll(value)) : 0;
+	if (bucket >= kVTDStatsHistBuckets) bucket = kVTDStatsHistBuckets - 1;
+	OSIncrementAtomic64((volatile SInt64 *) &hist[bucket]);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 static inline void __mfence(void)
 {
     __asm__ volatile("mfence");
@@ -122,6 +134,7 @@ static inline void clflush(uintptr_t addr, unsigned int count, uintptr_t linesiz
 }
 
 static void unit_quiesce(vtd_unit_t * unit);
+static void vtd_map_cache_work(vtd_map_cache_t * cache, bool final);
 
 static
 vtd_unit_t * unit_init(ACPI_DMAR_HARDWARE_UNIT * dmar)
@@ -555,6 +568,73 @@ vtd_space_fault(vtd_space_t * bf, vtd_vaddr_t start, vtd_vaddr_t size)
 	}
 }
 
+// map one page, or one 2M/1G superpage when the space, alignment and length allow.
+// the leaf table under a superpage stays faulted & zeroed so the entry can be restored on unmap.
+// returns the number of pages mapped.
+static vtd_vaddr_t
+vtd_space_set_super(vtd_space_t * bf, vtd_vaddr_t start, ppnum_t phys, vtd_vaddr_t size, uint64_t access)
+{
+	if (bf->superpage_levels && (start >= bf->rsize))
+	{
+		if ((bf->superpage_levels > 1)
+			&& (size > kSuperPageMask1G)
+			&& !(kSuperPageMask1G & (start | phys)))
+		{
+			bf->tables[2][start >> kSuperPageShift1G].bits = (access | kSuperPage | ptoa_64(phys));
+			STAT_ADD(bf, superpages[1], 1);
+			return (kSuperPageMask1G + 1);
+		}
+		if ((size > kSuperPageMask2M)
+			&& !(kSuperPageMask2M & (start | phys)))
+		{
+			bf->tables[1][start >> kSuperPageShift2M].bits = (access | kSuperPage | ptoa_64(phys));
+			STAT_ADD(bf, superpages[0], 1);
+			return (kSuperPageMask2M + 1);
+		}
+	}
+	bf->tables[0][start].bits = (access | ptoa_64(phys));
+	return (1);
+}
+
+// restore the table pointers under any superpages in the range.
+// returns true if any non-leaf entry was changed.
+static bool
+vtd_space_unset_super(vtd_space_t * bf, vtd_vaddr_t start, vtd_vaddr_t size)
+{
+	vtd_vaddr_t idx, end;
+	ppnum_t     page;
+	bool        result;
+
+	result = false;
+	if (!bf->superpage_levels || (start < bf->rsize)) return (result);
+
+	end = start + size;
+	for (idx = start & ~kSuperPageMask2M; idx < end; )
+	{
+		if ((bf->superpage_levels > 1)
+			&& (kSuperPage & bf->tables[2][idx >> kSuperPageShift1G].bits))
+		{
+			page = pmap_find_phys(kernel_pmap, (uintptr_t) &bf->tables[1][(idx >> kSuperPageShift1G) << 9]);
+			if (!page) panic("!lvl1page");
+			bf->tables[2][idx >> kSuperPageShift1G].bits = ptoa_64(page) | kPageAccess;
+			idx = (idx | kSuperPageMask1G) + 1;
+			result = true;
+			continue;
+		}
+		if (kSuperPage & bf->tables[1][idx >> kSuperPageShift2M].bits)
+		{
+			page = pmap_find_phys(kernel_pmap, (uintptr_t) &bf->tables[0][idx & ~kSuperPageMask2M]);
+			if (!page) panic("!lvl0page");
+			bf->tables[1][idx >> kSuperPageShift2M].bits = ptoa_64(page) | kPageAccess;
+			result = true;
+		}
+		idx = (idx | kSuperPageMask2M) + 1;
+	}
+	if (result) table_flush(&bf->tables[1][start >> kSuperPageShift2M], 0, bf->cachelinesize);
+
+	return (result);
+}
+
 static void
 vtd_space_set(vtd_space_t * bf, vtd_vaddr_t start, vtd_vaddr_t size,
 			  uint32_t mapOptions, const upl_page_info_t * pageList)
@@ -572,9 +652,9 @@ vtd_space_set(vtd_space_t * bf, vtd_vaddr_t start, vtd_vaddr_t size,
 
 	if (kIODMAMapPhysicallyContiguous & mapOptions)
 	{
-		for (idx = 0; idx < size; idx++)
+		for (idx = 0; idx < size; )
 		{
-			bf->tables[0][start + idx].bits = (access | ptoa_64(pageList[0].phys_addr + idx));
+			idx += vtd_space_set_super(bf, start + idx, pageList[0].phys_addr + idx, size - idx, access);
 		}
 	}
 	else
@@ -677,7 +757,8 @@ AppleVTD::adjustDevice(IOService * device)
     }
 
     // If the child driver had IOPCIUseDeviceMapper set, it wants to opt-in
-    if (pciDevice->getProperty(kIOPCIUseDeviceMapperKey)) {
+    // The map cache is kept per space, so it also opts in to the device mapper
+    if (pciDevice->getProperty(kIOPCIUseDeviceMapperKey) || pciDevice->getProperty(kIOPCIMapCacheKey)) {
         mapperSelection |= kIOPCIMapperSelectionBundlePlist;
     }
     
@@ -740,6 +821,7 @@ AppleVTD::adjustDevice(IOService * device)
         }
 		if (mapper)
 		{
+            if (pciDevice->getProperty(kIOPCIMapCacheKey)) mapper->fMapCache = true;
             mapperSelection |= kIOPCIMapperSelectionChanged;
 			pciDevice->setProperty("iommu-parent", mapper);
 			mapper->release();
@@ -835,6 +917,8 @@ AppleVTD::init(IOWorkLoop * wl, const OSData * data)
 
 	fNumMemoryRanges = 0;
 	fSpace = 0;
+	fIRDirtyFirst = kIRCount;
+	fIRDirtyLast = 0;
 	fAMDSpace = NULL;
 	fAMDMapperLock = NULL;
 
@@ -881,7 +965,11 @@ AppleVTD::space_destroy(vtd_space_t * bf)
 		}
 	}
 
-	if (bf->domain) vtd_bitmap_bitset(fDomainBitmap, false, bf->domain);
+	if (bf->domain)
+	{
+		vtd_bitmap_bitset(fDomainBitmap, false, bf->domain);
+		if (fDomainSpaces) fDomainSpaces[bf->domain] = NULL;
+	}
 	VTHWUNLOCK(fHWLock);
 
 	vtd_rballocator_free(bf);
@@ -933,6 +1021,15 @@ AppleVTD::space_destroy(vtd_space_t * bf)
 		IOLockFree(bf->rlock);
 		bf->rlock = 0;
 	}
+	if (bf->map_cache)
+	{
+		thread_call_cancel_wait(bf->map_cache->wire);
+		thread_call_free(bf->map_cache->wire);
+		vtd_map_cache_work(bf->map_cache, true);
+		IOLockFree(bf->map_cache->lock);
+		IOFreeType(bf->map_cache, vtd_map_cache_t);
+		bf->map_cache = 0;
+	}
 	IOFreeType(bf, vtd_space_t);
 }
 
@@ -969,7 +1066,11 @@ AppleVTD::space_create(ppnum_t vsize, uint32_t buddybits, ppnum_t rsize)
 
 		VTHWLOCK(fHWLock);
 		domain = vtd_bitmap_count(fDomainBitmap, true, 0, fDomainSize);
-		if (domain != fDomainSize) vtd_bitmap_bitset(fDomainBitmap, true, domain);
+		if (domain != fDomainSize)
+		{
+			vtd_bitmap_bitset(fDomainBitmap, true, domain);
+			if (fDomainSpaces) fDomainSpaces[domain] = bf;
+		}
 		VTHWUNLOCK(fHWLock);
 
 		if (domain == fDomainSize) break;
@@ -1077,6 +1178,8 @@ AppleVTD::space_create(ppnum_t vsize, uint32_t buddybits, ppnum_t rsize)
 			vtd_ballocator_init(bf, buddybits);
 		}
 		bf->rsize = rsize;
+		bf->superpage_levels = fSuperPageLevels;
+		if (bf->superpage_levels > bf->max_level) bf->superpage_levels = bf->max_level;
 		vtd_rballocator_init(bf, rsize, vsize - rsize);
 		STAT_ADD(bf, vsize, vsize);
 		ok = true;
@@ -1175,6 +1278,22 @@ AppleVTD::space_alloc(vtd_space_t * bf, vtd_vaddr_t addr, vtd_vaddr_t size,
 				hwalign--;
 				hwalignsize = (size + hwalign) & ~hwalign;
 
+				// align contiguous maps to the largest superpage they can use
+				if (bf->superpage_levels
+					&& (kIODMAMapPhysicallyContiguous & mapOptions) && pageList)
+				{
+					if ((bf->superpage_levels > 1) && (size > kSuperPageMask1G)
+						&& !(kSuperPageMask1G & pageList[0].phys_addr))
+					{
+						if (align <= kSuperPageMask1G) align = kSuperPageMask1G + 1;
+					}
+					else if ((size > kSuperPageMask2M)
+						&& !(kSuperPageMask2M & pageList[0].phys_addr))
+					{
+						if (align <= kSuperPageMask2M) align = kSuperPageMask2M + 1;
+					}
+				}
+
 				addr = vtd_rballoc(bf, hwalignsize, align, mapOptions, pageList);
 			}
 			STAT_ADD(bf, allocs[list], 1);
@@ -1208,8 +1327,13 @@ AppleVTD::space_alloc(vtd_space_t * bf, vtd_vaddr_t addr, vtd_vaddr_t size,
 		if (!uselarge && (size >= (1 << (kBPagesLog2 - 2)))) break;
 		if (kIODMAMapFixedAddress & mapOptions)              break;
 
+		// idle cached mappings are retired through the free queue, which wakes us
+		if (bf->map_cache) spaceMapCacheFlush(bf, false);
+
 		IOLockLock(bf->rlock);
 		bf->waiting_space = true;
+		STAT_ADD(bf, waits, 1);
+		fSpaceWaits++;
 		IOLockSleep(bf->rlock, &bf->waiting_space, THREAD_UNINT);
 		IOLockUnlock(bf->rlock);
 //		IOLog("AppleVTD: waiting space (%d)\n", size);
@@ -1438,20 +1562,30 @@ AppleVTD::initHardware(IOService *provider)
 	}
 
     fDomainSize = 512;
+	fSuperPageLevels = 2;
 
 	for (idx = 0; (unit = units[idx]); idx++)
 	{	
+		uint32_t sllps;
+
 		if (!unit->translating) continue;
 		if (unit->domains < fDomainSize) fDomainSize = unit->domains;
 
+		// second level large page support, 2M & 1G
+		sllps = (0xf & (unit->regs->capability >> 34));
+		if (!(2 & sllps) && (fSuperPageLevels > 1)) fSuperPageLevels = 1;
+		if (!(1 & sllps))                           fSuperPageLevels = 0;
+
 		if (!((0x100 << fContextWidth) & unit->regs->capability))
 			panic("!tree bits %d on unit %d", fTreeBits, idx);
 		if (unit->selective && ((unit->rounding > fMaxRoundSize)))
 			fMaxRoundSize = unit->rounding;
 	}
 
-	VTLOG("domains %d, contextwidth %lld, treebits %d, round %d\n",
-			fDomainSize, fContextWidth, fTreeBits, fMaxRoundSize);
+	if (kIOPCIConfiguratorNoSuperPages & gIOPCIFlags) fSuperPageLevels = 0;
+
+	VTLOG("domains %d, contextwidth %lld, treebits %d, round %d, superpages %d\n",
+			fDomainSize, fContextWidth, fTreeBits, fMaxRoundSize, fSuperPageLevels);
 
     // need better legacy checks
 	if (!fMaxRoundSize)                                                                              return (false);
@@ -1462,6 +1596,8 @@ AppleVTD::initHardware(IOService *provider)
 
 	fDomainBitmap = vtd_bitmap_alloc(fDomainSize);
 	vtd_bitmap_bitset(fDomainBitmap, true, 0);
+	fDomainSpaces = IONewZero(vtd_space_t *, fDomainSize);
+	nanoseconds_to_absolutetime(10 * NSEC_PER_MSEC, &fDepthSampleInterval);
 
 	fSpace = space_create(kVPages, kBPagesLog2, kRPages);
 	if (!fSpace) return (false);
@@ -1475,6 +1611,14 @@ AppleVTD::initHardware(IOService *provider)
 		data->release();
 	}
 
+	OSSerializer * serializer = OSSerializer::forTarget(this,
+								OSMemberFunctionCast(OSSerializerCallback, this, &AppleVTD::serializeStatistics));
+	if (serializer)
+	{
+		setProperty("statistics", serializer);
+		serializer->release();
+	}
+
 	reserveRanges(fSpace, true);
 
 	md = IOBufferMemoryDescriptor::inTaskWithOptions(TASK_NULL,
@@ -1763,6 +1907,17 @@ IOPCISetAPICInterrupt(uint64_t entry)
 
 IOReturn
 IOPCISetMSIInterrupt(uint32_t vector, uint32_t count, uint32_t * msiData)
+{
+	IOReturn ret;
+
+	ret = IOPCISetMSIInterruptDeferred(vector, count, msiData);
+	if (kIOReturnSuccess == ret) ret = IOPCICommitInterrupts(NULL, NULL);
+
+	return (ret);
+}
+
+IOReturn
+IOPCISetMSIInterruptDeferred(uint32_t vector, uint32_t count, uint32_t * msiData)
 {
 	AppleVTD * vtd;
 	uint64_t   present;
@@ -1777,7 +1932,7 @@ IOPCISetMSIInterrupt(uint32_t vector, uint32_t count, uint32_t * msiData)
 	if (!(vtd = OSDynamicCast(AppleVTD, IOMapper::gSystem))) return (kIOReturnUnsupported);
 	if (!vtd->fIRTable)                                      return (kIOReturnUnsupported);
 
-    if ((vector + count) > kIRCount) panic("IOPCISetMSIInterrupt(%d, %d)", vector, count);
+    if ((vector + count) > kIRCount) panic("IOPCISetMSIInterruptDeferred(%d, %d)", vector, count);
 
     inval = false;
     for (idx = vector; idx < (vector + count); idx++)
@@ -1814,7 +1969,7 @@ IOPCISetMSIInterrupt(uint32_t vector, uint32_t count, uint32_t * msiData)
 		}
     }
 
-    if (inval) vtd->interruptInvalidate(vector, count);
+    if (inval) vtd->interruptDefer(vector, count);
 
     if (msiData)
     {
@@ -1832,6 +1987,51 @@ IOPCISetMSIInterrupt(uint32_t vector, uint32_t count, uint32_t * msiData)
     return (kIOReturnSuccess);
 }
 
+IOReturn
+IOPCISteerMSIInterrupt(uint32_t vector, uint32_t cpu, uint32_t destVector)
+{
+	extern int cpu_to_lapic[];
+	AppleVTD * vtd;
+	uint64_t   destID;
+	uint64_t   irte;
+	uint64_t   prior;
+	int        destShift;
+
+	if (!(vtd = OSDynamicCast(AppleVTD, IOMapper::gSystem))) return (kIOReturnUnsupported);
+	if (!vtd->fIRTable)                                      return (kIOReturnUnsupported);
+	if (vector >= kIRCount)                                  return (kIOReturnBadArgument);
+
+	prior = vtd->fIRTable[vector].data;
+	if (!(1 & prior))                                        return (kIOReturnNotReady);
+
+	destID    = (uint64_t)cpu_to_lapic[cpu];
+	destShift = vtd->x2apic_mode ? 32 : 40;
+	irte = (prior & ~((0xFFFFFFFFULL << 32) | (0xFFULL << 16)))
+		 | (destID << destShift)              // destID
+		 | ((0xFFULL & destVector) << 16);    // vector
+
+	VTLOG("ir[0x%x] 0x%qx -> 0x%qx\n", vector, prior, irte);
+	if (irte != prior)
+	{
+		vtd->fIRTable[vector].data = irte;
+		__mfence();
+		vtd->interruptDefer(vector, 1);
+	}
+
+	return (kIOReturnSuccess);
+}
+
+IOReturn
+IOPCICommitInterrupts(IOPCIInterruptCommitAction action, void * refCon)
+{
+	AppleVTD * vtd;
+
+	if (!(vtd = OSDynamicCast(AppleVTD, IOMapper::gSystem))) return (kIOReturnUnsupported);
+	if (!vtd->fIRTable)                                      return (kIOReturnUnsupported);
+
+	return (vtd->interruptCommit(action, refCon));
+}
+
 IOReturn
 AppleVTD::handleInterrupt(IOInterruptEventSource * source, int count)
 {
@@ -1846,6 +2046,8 @@ AppleVTD::handleInterrupt(IOInterruptEventSource * source, int count)
 	}
 	VTHWUNLOCK(fHWLock);
 
+	checkInterruptCommits();
+
 	return (kIOReturnSuccess);
 }
 
@@ -1869,11 +2071,119 @@ AppleVTD::timer(OSObject * owner, IOTimerEventSource * sender)
 	for (idx = 0; idx < kFreeQCount; idx++) checkFree(fSpace, idx);
 	VTHWUNLOCK(fHWLock);
 
+	checkInterruptCommits();
+
 	fTimerES->setTimeoutMS(10);
 
 	return (kIOReturnSuccess);
 }
 
+static void
+vtd_stats_append(OSData * data, uint32_t * records, uint32_t type, const char * name,
+				 uint32_t elemLength, uint32_t count, const void * elems)
+{
+	vtd_stats_record_t record;
+	uint64_t           pad = 0;
+	uint32_t           length;
+
+	length = elemLength * count;
+	bzero(&record, sizeof(record));
+	record.type        = type;
+	record.length      = static_cast<uint32_t>(sizeof(record) + ((length + 7) & ~7U));
+	record.elem_length = elemLength;
+	record.count       = count;
+	strlcpy(record.name, name, sizeof(record.name));
+
+	data->appendBytes(&record, sizeof(record));
+	data->appendBytes(elems, length);
+	if (length & 7) data->appendBytes(&pad, 8 - (length & 7));
+	(*records)++;
+}
+
+bool
+AppleVTD::serializeStatistics(void * ref __unused, OSSerialize * serializer)
+{
+	mach_timebase_info_data_t timebase;
+	vtd_stats_header_t        header;
+	vtd_stats_header_t      * blob;
+	vtd_stats_domain_t      * domains;
+	vtd_stats_sample_t      * samples;
+	vtd_space_t             * space;
+	OSData                  * data;
+	uint64_t                  counter;
+	uint32_t                  idx, count, first, records = 0;
+	bool                      ok;
+
+	domains = IONewZero(vtd_stats_domain_t, fDomainSize);
+	samples = IONewZero(vtd_stats_sample_t, kVTDStatsSamples);
+	data    = OSData::withCapacity(4096);
+	ok = (domains && samples && data);
+
+	if (ok)
+	{
+		clock_timebase_info(&timebase);
+		bzero(&header, sizeof(header));
+		header.magic          = kVTDStatsMagic;
+		header.version        = kVTDStatsVersion;
+		header.header_length  = sizeof(header);
+		header.timebase_numer = timebase.numer;
+		header.timebase_denom = timebase.denom;
+		header.time           = mach_absolute_time();
+		data->appendBytes(&header, sizeof(header));
+
+		vtd_stats_append(data, &records, kVTDStatsRecordHistogram, "map_time", sizeof(uint64_t), kVTDStatsHistBuckets, &fMapHist[0]);
+		vtd_stats_append(data, &records, kVTDStatsRecordHistogram, "unmap_time", sizeof(uint64_t), kVTDStatsHistBuckets, &fUnmapHist[0]);
+		vtd_stats_append(data, &records, kVTDStatsRecordHistogram, "qi_stall_time", sizeof(uint64_t), kVTDStatsHistBuckets, &fQIStallHist[0]);
+		vtd_stats_append(data, &records, kVTDStatsRecordHistogram, "free_depth_small", sizeof(uint64_t), kVTDStatsHistBuckets, &fFreeDepthHist[0][0]);
+		vtd_stats_append(data, &records, kVTDStatsRecordHistogram, "free_depth_large", sizeof(uint64_t), kVTDStatsHistBuckets, &fFreeDepthHist[1][0]);
+		counter = fQIStallTime;
+		vtd_stats_append(data, &records, kVTDStatsRecordCounter, "qi_stall_time_total", sizeof(uint64_t), 1, &counter);
+		counter = fSpaceWaits;
+		vtd_stats_append(data, &records, kVTDStatsRecordCounter, "space_waits", sizeof(uint64_t), 1, &counter);
+
+		count = 0;
+		VTHWLOCK(fHWLock);
+		first = fDepthSampleNext;
+		for (idx = 0; idx < kVTDStatsSamples; idx++)
+		{
+			vtd_stats_sample_t * sample = &fDepthSamples[(first + idx) % kVTDStatsSamples];
+			if (sample->time) samples[count++] = *sample;
+		}
+		VTHWUNLOCK(fHWLock);
+		vtd_stats_append(data, &records, kVTDStatsRecordSamples, "free_depth", sizeof(vtd_stats_sample_t), count, samples);
+
+		count = 0;
+		VTHWLOCK(fHWLock);
+		for (idx = 0; fDomainSpaces && (idx < fDomainSize); idx++)
+		{
+			if (!(space = fDomainSpaces[idx])) continue;
+			domains[count].domain       = space->domain;
+			domains[count].vsize        = space->stats.vsize;
+			domains[count].rsize        = space->rsize;
+			domains[count].bused        = space->stats.bused;
+			domains[count].rused        = space->stats.rused;
+			domains[count].tables       = space->stats.tables;
+			domains[count].waits        = space->stats.waits;
+			domains[count].pending_free = space->pending_free;
+			count++;
+		}
+		VTHWUNLOCK(fHWLock);
+		vtd_stats_append(data, &records, kVTDStatsRecordDomains, "domains", sizeof(vtd_stats_domain_t), count, domains);
+
+		blob = (typeof(blob)) data->getBytesNoCopy();
+		blob->length  = data->getLength();
+		blob->records = records;
+
+		ok = data->serialize(serializer);
+	}
+
+	if (domains) IODelete(domains, vtd_stats_domain_t, fDomainSize);
+	if (samples) IODelete(samples, vtd_stats_sample_t, kVTDStatsSamples);
+	OSSafeReleaseNULL(data);
+
+	return (ok);
+}
+
 IOReturn 
 AppleVTD::callPlatformFunction(const OSSymbol * functionName,
 							   bool waitForFunction,
@@ -1893,6 +2203,7 @@ AppleVTD::callPlatformFunction(const OSSymbol * functionName,
 			}
 			contextInvalidate(0);
 			interruptInvalidate(0, 256);
+			checkInterruptCommits();
 
 			if (fDisabled) for (idx = 0; (unit = units[idx]); idx++) unit_quiesce(unit);
 
@@ -1945,6 +2256,12 @@ AppleVTD::spaceMapMemory(
     bool     discontig;
     IOReturn ret;
 
+	if (space->map_cache && memory && !(kIODMAMapFixedAddress & mapOptions)
+	 && spaceMapCacheLookup(space, memory, descriptorOffset, length, mapOptions, pageList, mapAddress, mapLength))
+	{
+		return (kIOReturnSuccess);
+	}
+
 	mapperPageMask  = 4096 - 1;
 	mapperPageShift = (64 - __builtin_clzll(mapperPageMask));
 	mappedAddress = 0;
@@ -2052,6 +2369,11 @@ AppleVTD::spaceMapMemory(
 		*mapLength  = length;
 	}
 
+	if (space->map_cache && memory && !(kIODMAMapFixedAddress & mapOptions))
+	{
+		spaceMapCacheInsert(space, memory, descriptorOffset, length, mapOptions, *mapAddress, *mapLength);
+	}
+
     return (kIOReturnSuccess);
 }
 
@@ -2060,8 +2382,12 @@ AppleVTD::spaceMapMemory(
 #define WAIT_QI_FREE(unit, idx)		\
 	if (!stampPassed((unit)->qi_stamp, (unit)->qi_table_stamps[(idx)]))				\
 	{																				\
+		uint64_t stallStart = mach_absolute_time();									\
 		(unit)->qi_stalled_stamp = (unit)->qi_table_stamps[(idx)];					\
 		while (!stampPassed((unit)->qi_stamp, (unit)->qi_table_stamps[(idx)])) {}	\
+		stallStart = mach_absolute_time() - stallStart;								\
+		fQIStallTime += stallStart;													\
+		vtd_stats_hist(&fQIStallHist[0], stallStart);								\
 	}
 
 IOReturn 
@@ -2084,6 +2410,8 @@ AppleVTD::spaceUnmapMemory(	vtd_space_t * space,
 	ppnum_t      addr;
 	ppnum_t      pages;
 
+	if (space->map_cache && spaceMapCacheRelease(space, mapAddress)) return (kIOReturnSuccess);
+
     did = space->domain;
     addr = static_cast<ppnum_t>(atop_64(mapAddress));
     pages = static_cast<ppnum_t>(atop_64(round_page_64(mapAddress + mapLength)) - addr);
@@ -2094,10 +2422,11 @@ AppleVTD::spaceUnmapMemory(	vtd_space_t * space,
 
 	vtassert((addr + pages) <= space->vsize);
 	vtd_space_nfault(space, addr, pages);
+	// superpage entries live in the non-leaf tables, hint the paging structure caches also need invalidation
+	leaf = !vtd_space_unset_super(space, addr, pages);
 	bzero(&space->tables[0][addr], pages * sizeof(vtd_table_entry_t));
 	table_flush(&space->tables[0][addr], pages * sizeof(vtd_table_entry_t), fCacheLineSize);
 
-	leaf = true;
 	isLarge = (addr >= space->rsize);
 
 	VTHWLOCK(fHWLock);
@@ -2135,6 +2464,18 @@ AppleVTD::spaceUnmapMemory(	vtd_space_t * space,
 	space->pending_free++;
 	free_tail[isLarge] = next;
 
+	count = ((next - free_head[isLarge]) & free_mask);
+	vtd_stats_hist(&fFreeDepthHist[isLarge][0], count);
+	if ((mach_absolute_time() - fDepthSampleLast) >= fDepthSampleInterval)
+	{
+		vtd_stats_sample_t * sample = &fDepthSamples[fDepthSampleNext++ % kVTDStatsSamples];
+		fDepthSampleLast = sample->time = mach_absolute_time();
+		for (idx = 0; idx < kFreeQCount; idx++)
+		{
+			sample->depth[idx] = ((free_tail[idx] - free_head[idx]) & free_mask);
+		}
+	}
+
 	for (unitIdx = 0; (unit = units[unitIdx]); unitIdx++)
 	{
 		if (!unit->translating) continue;
@@ -2333,21 +2674,37 @@ AppleVTD::contextInvalidate(uint16_t domainID)
 
 void
 AppleVTD::interruptInvalidate(uint16_t index, uint16_t count)
+{
+	uint32_t stamp[kMaxUnits];
+	bool     queued;
+
+	if (!fIRTable) return;
+
+	VTHWLOCK(fHWLock);
+	queued = interruptQueue(index, index + count - 1, false, stamp);
+	VTHWUNLOCK(fHWLock);
+
+	if (queued) interruptWait(stamp);
+}
+
+// fHWLock held, queue one index masked IEC covering first..last on each
+// remapping unit, returning the stamps to wait on
+bool
+AppleVTD::interruptQueue(uint32_t first, uint32_t last, bool complete, uint32_t stamp[kMaxUnits])
 {
 	vtd_unit_t * unit;
 	unsigned int unitIdx;
 	uint32_t     idx;
 	uint32_t     next;
-	uint32_t     stamp[kMaxUnits];
-	uint64_t     deadline;
-	bool         ok;
-
-	if (!fIRTable) return;
-
-	count = vtd_log2up(count);
+	uint32_t     index;
+	uint32_t     mask;
+	uint64_t     command;
+	bool         queued;
 
-	VTHWLOCK(fHWLock);
+	for (mask = 0; (first >> mask) != (last >> mask); mask++) {}
+	index = first & ~((1U << mask) - 1);
 
+	queued = false;
 	for (unitIdx = 0; (unit = units[unitIdx]); unitIdx++)
 	{
 		if (!unit->ir_address) continue;
@@ -2358,29 +2715,42 @@ AppleVTD::interruptInvalidate(uint16_t index, uint16_t count)
 		// int invalidate
 		WAIT_QI_FREE(unit, idx);
 		unit->qi_table[idx].address = 0;
-		unit->qi_table[idx].command = (((uint64_t) index) << 32) | (count << 27) | (0<<4) | (4);
+		unit->qi_table[idx].command = (((uint64_t) index) << 32) | (mask << 27) | (0<<4) | (4);
 		unit->qi_table_stamps[idx] = stamp[unitIdx];
 
-		// stamp
+		// stamp, with a completion interrupt for async commits
 		idx = next;
 		next = (idx + 1) & kQIIndexMask;
 		WAIT_QI_FREE(unit, idx);
+		command = (static_cast<uint64_t>(stamp[unitIdx])<<32) | (1<<5) | (5);
+		if (complete) command |= (1<<4);
 		unit->qi_table[idx].address = unit->qi_stamp_address;
-		unit->qi_table[idx].command = (static_cast<uint64_t>(stamp[unitIdx])<<32) | (1<<5) | (5);
+		unit->qi_table[idx].command = command;
 		unit->qi_table_stamps[idx] = stamp[unitIdx];
 
 		__mfence();
 		unit->regs->invalidation_queue_tail = (next << 4);
 		unit->qi_tail = next;
+		queued = true;
 	}
 
-	VTHWUNLOCK(fHWLock);
+	return (queued);
+}
+
+void
+AppleVTD::interruptWait(const uint32_t stamp[kMaxUnits])
+{
+	vtd_unit_t * unit;
+	unsigned int unitIdx;
+	uint64_t     deadline;
+	bool         ok;
 
 	clock_interval_to_deadline(600, kMillisecondScale, &deadline);
 	while (true)
 	{
 		for (unitIdx = 0, ok = true; ok && (unit = units[unitIdx]); unitIdx++)
 		{
+			if (!unit->ir_address) continue;
 			ok &= stampPassed(unit->qi_stamp, stamp[unitIdx]);
 		}
 		if (ok) break;
@@ -2388,6 +2758,93 @@ AppleVTD::interruptInvalidate(uint16_t index, uint16_t count)
 	}
 }
 
+void
+AppleVTD::interruptDefer(uint32_t index, uint32_t count)
+{
+	VTHWLOCK(fHWLock);
+	if (index < fIRDirtyFirst)                fIRDirtyFirst = index;
+	if ((index + count - 1) > fIRDirtyLast)   fIRDirtyLast  = index + count - 1;
+	VTHWUNLOCK(fHWLock);
+}
+
+IOReturn
+AppleVTD::interruptCommit(IOPCIInterruptCommitAction action, void * refCon)
+{
+	vtd_ir_commit_t * commit;
+	uint32_t          stamp[kMaxUnits];
+	uint32_t          first, last;
+	bool              async, queued;
+
+	VTHWLOCK(fHWLock);
+
+	first = fIRDirtyFirst;
+	last  = fIRDirtyLast;
+	fIRDirtyFirst = kIRCount;
+	fIRDirtyLast  = 0;
+
+	// async needs the completion interrupt, and a free slot
+	async = (action && fIntES && fFaultES
+			&& (((fIRCommitTail + 1) % kIRCommitCount) != fIRCommitHead));
+
+	if (first <= last) queued = interruptQueue(first, last, async, stamp);
+	else if ((queued = (fIRCommitHead != fIRCommitTail)))
+	{
+		// nothing new staged, but entries may ride on an earlier async commit
+		commit = &fIRCommits[(fIRCommitTail + kIRCommitCount - 1) % kIRCommitCount];
+		bcopy(commit->stamp, stamp, sizeof(stamp));
+	}
+
+	if (queued && async)
+	{
+		commit = &fIRCommits[fIRCommitTail];
+		commit->action = action;
+		commit->refCon = refCon;
+		bcopy(stamp, commit->stamp, sizeof(stamp));
+		fIRCommitTail = (fIRCommitTail + 1) % kIRCommitCount;
+	}
+
+	VTHWUNLOCK(fHWLock);
+
+	if (queued && async) return (kIOReturnSuccess);
+
+	if (queued) interruptWait(stamp);
+	if (action) action(refCon, kIOReturnSuccess);
+
+	return (kIOReturnSuccess);
+}
+
+void
+AppleVTD::checkInterruptCommits(void)
+{
+	vtd_ir_commit_t          * commit;
+	vtd_unit_t               * unit;
+	uint32_t                   unitIdx;
+	IOPCIInterruptCommitAction action;
+	void                     * refCon;
+	bool                       ok;
+
+	VTHWLOCK(fHWLock);
+	while (fIRCommitHead != fIRCommitTail)
+	{
+		commit = &fIRCommits[fIRCommitHead];
+		for (unitIdx = 0, ok = true; ok && (unit = units[unitIdx]); unitIdx++)
+		{
+			if (!unit->ir_address) continue;
+			ok &= stampPassed(unit->qi_stamp, commit->stamp[unitIdx]);
+		}
+		if (!ok) break;
+
+		action = commit->action;
+		refCon = commit->refCon;
+		fIRCommitHead = (fIRCommitHead + 1) % kIRCommitCount;
+
+		VTHWUNLOCK(fHWLock);
+		action(refCon, kIOReturnSuccess);
+		VTHWLOCK(fHWLock);
+	}
+	VTHWUNLOCK(fHWLock);
+}
+
 uint64_t
 AppleVTD::spaceMapToPhysicalAddress(vtd_space_t * space, uint64_t addr)
 {
@@ -2398,6 +2855,17 @@ AppleVTD::spaceMapToPhysicalAddress(vtd_space_t * space, uint64_t addr)
 
 	if (!vtd_space_present(space, page)) return (addr);
 
+	if (space->superpage_levels && (page >= space->rsize))
+	{
+		if (space->superpage_levels > 1)
+		{
+			entry = space->tables[2][page >> kSuperPageShift1G].bits;
+			if (kSuperPage & entry) return ((entry & kPageAddrMask) + (addr & (ptoa_64(kSuperPageMask1G) | page_mask)));
+		}
+		entry = space->tables[1][page >> kSuperPageShift2M].bits;
+		if (kSuperPage & entry) return ((entry & kPageAddrMask) + (addr & (ptoa_64(kSuperPageMask2M) | page_mask)));
+	}
+
 	entry = space->tables[0][page].bits;
 
 #if KP
@@ -2412,6 +2880,326 @@ AppleVTD::spaceMapToPhysicalAddress(vtd_space_t * space, uint64_t addr)
     return (0);
 }
 
+// prepare() new entries so their pages stay put while cached, and complete()
+// and release() retired ones. Both take the descriptor's prepare lock, which
+// the map and unmap paths may already hold. With final every entry goes.
+static void
+vtd_map_cache_work(vtd_map_cache_t * cache, bool final)
+{
+	vtd_map_cache_entry_t * entry;
+	IOMemoryDescriptor    * memory;
+	uint32_t                idx;
+	bool                    wired;
+
+	for (idx = 0; idx < kMapCacheEntries; idx++)
+	{
+		entry = &cache->entries[idx];
+		IOLockLock(cache->lock);
+		memory = entry->memory;
+		if (!final && (kMapCacheEntryWiring == entry->state) && !entry->wired)
+		{
+			// only this call frees a slot, so the entry stays the same
+			IOLockUnlock(cache->lock);
+			wired = (kIOReturnSuccess == memory->prepare());
+			IOLockLock(cache->lock);
+			entry->wired = wired;
+			if (kMapCacheEntryWiring == entry->state)
+			{
+				entry->state = wired ? kMapCacheEntryLive : kMapCacheEntryRetiring;
+			}
+		}
+		if ((final && memory)
+			|| ((kMapCacheEntryRetiring == entry->state) && !entry->users))
+		{
+			wired = entry->wired;
+			bzero(entry, sizeof(*entry));
+			IOLockUnlock(cache->lock);
+			if (wired) memory->complete();
+			memory->release();
+			continue;
+		}
+		IOLockUnlock(cache->lock);
+	}
+}
+
+static void
+vtd_map_cache_wire(thread_call_param_t param0, thread_call_param_t param1 __unused)
+{
+	vtd_map_cache_work((vtd_map_cache_t *) param0, false);
+}
+
+void
+AppleVTD::spaceMapCacheEnable(vtd_space_t * space)
+{
+	vtd_map_cache_t * cache;
+
+	cache = IOMallocType(vtd_map_cache_t);
+	if (!cache) return;
+	cache->lock = IOLockAlloc();
+	cache->wire = thread_call_allocate_with_options(&vtd_map_cache_wire, cache,
+													THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+	if (!cache->lock || !cache->wire)
+	{
+		if (cache->lock) IOLockFree(cache->lock);
+		if (cache->wire) thread_call_free(cache->wire);
+		IOFreeType(cache, vtd_map_cache_t);
+		return;
+	}
+	space->map_cache = cache;
+}
+
+// retire idle entries, or every entry when the space is going away.
+// entries still in use are dropped and unmapped normally by their owners.
+void
+AppleVTD::spaceMapCacheFlush(vtd_space_t * space, bool all)
+{
+	vtd_map_cache_t       * cache = space->map_cache;
+	vtd_map_cache_entry_t * entry;
+	vtd_map_cache_entry_t   evicted;
+	uint32_t                idx;
+	bool                    evict, retire;
+
+	retire = false;
+	for (idx = 0; idx < kMapCacheEntries; idx++)
+	{
+		evict = false;
+		entry = &cache->entries[idx];
+		IOLockLock(cache->lock);
+		if (((kMapCacheEntryLive == entry->state) || (kMapCacheEntryWiring == entry->state))
+			&& (all || !entry->users))
+		{
+			evicted = *entry;
+			evict = !evicted.users;
+			entry->state = kMapCacheEntryRetiring;
+			retire = true;
+		}
+		IOLockUnlock(cache->lock);
+
+		if (evict) spaceUnmapMemory(space, NULL, NULL, evicted.mapAddress, evicted.mapLength);
+	}
+	if (retire) thread_call_enter(cache->wire);
+}
+
+// compare the descriptor's current physical pages with the live table entries.
+// called without the cache lock, the entry is pinned by a user.
+bool
+AppleVTD::spaceMapCacheVerify(vtd_space_t * space, vtd_map_cache_entry_t * entry,
+							  IOMemoryDescriptor * memory, const IODMAMapPageList * pageList)
+{
+	IOMDDMAWalkSegmentState  walkState;
+	IOMDDMAWalkSegmentArgs * walkArgs = (IOMDDMAWalkSegmentArgs *) (void *)&walkState;
+	IOOptionBits             mdOp;
+	IOReturn                 ret;
+	uint64_t                 index, idx, count;
+	uint64_t                 phys, segLen, mapped;
+
+	mapped = trunc_page_64(entry->mapAddress);
+
+	if (pageList)
+	{
+		for (idx = 0; idx < pageList->pageListCount; idx++, mapped += page_size)
+		{
+			if (kIODMAMapPhysicallyContiguous & entry->mapOptions) phys = ptoa_64(pageList->pageList[0].phys_addr + idx);
+			else                                                   phys = ptoa_64(pageList->pageList[idx].phys_addr);
+			if (phys != trunc_page_64(spaceMapToPhysicalAddress(space, mapped))) return (false);
+		}
+		return (true);
+	}
+
+	walkArgs->fMapped = false;
+	mdOp = kIOMDFirstSegment;
+	for (index = 0; index < entry->length; )
+	{
+		walkArgs->fOffset = entry->offset + index;
+		ret = memory->dmaCommandOperation(mdOp, &walkState, sizeof(walkState));
+		mdOp = kIOMDWalkSegments;
+		if (ret != kIOReturnSuccess) return (false);
+		phys = walkArgs->fIOVMAddr;
+		segLen = walkArgs->fLength;
+		if (segLen > (entry->length - index)) {
+			segLen = entry->length - index;
+		}
+		index += segLen;
+
+		count = atop_64(round_page_64(phys + segLen)) - atop_64(phys);
+		phys  = trunc_page_64(phys);
+		for (idx = 0; idx < count; idx++, mapped += page_size, phys += page_size)
+		{
+			if (phys != trunc_page_64(spaceMapToPhysicalAddress(space, mapped))) return (false);
+		}
+	}
+
+	return (true);
+}
+
+bool
+AppleVTD::spaceMapCacheLookup(vtd_space_t * space, IOMemoryDescriptor * memory,
+							  uint64_t descriptorOffset, uint64_t length, uint32_t mapOptions,
+							  const IODMAMapPageList * pageList,
+							  uint64_t * mapAddress, uint64_t * mapLength)
+{
+	vtd_map_cache_t       * cache = space->map_cache;
+	vtd_map_cache_entry_t * entry;
+	vtd_map_cache_entry_t   found;
+	uint32_t                idx;
+	bool                    hit, evict;
+
+	entry = NULL;
+	IOLockLock(cache->lock);
+	for (idx = 0; idx < kMapCacheEntries; idx++)
+	{
+		entry = &cache->entries[idx];
+		if ((kMapCacheEntryLive != entry->state)
+			|| (memory != entry->memory)
+			|| (descriptorOffset != entry->offset)
+			|| (length != entry->length)
+			|| (mapOptions != entry->mapOptions)) continue;
+
+		// pinned while its pages are walked without the lock
+		entry->users++;
+		found = *entry;
+		break;
+	}
+	if (idx == kMapCacheEntries)
+	{
+		space->stats.map_misses++;
+		IOLockUnlock(cache->lock);
+		return (false);
+	}
+	IOLockUnlock(cache->lock);
+
+	hit = spaceMapCacheVerify(space, &found, memory, pageList);
+
+	evict = false;
+	IOLockLock(cache->lock);
+	if (hit)
+	{
+		entry->lru = ++cache->lru;
+		*mapAddress = found.mapAddress;
+		*mapLength  = found.mapLength;
+		space->stats.map_hits++;
+	}
+	else
+	{
+		entry->users--;
+		if (!entry->users)
+		{
+			// pages moved under the descriptor, retire the old mapping
+			entry->state = kMapCacheEntryRetiring;
+			evict = true;
+		}
+		space->stats.map_misses++;
+	}
+	IOLockUnlock(cache->lock);
+
+	if (evict)
+	{
+		spaceUnmapMemory(space, NULL, NULL, found.mapAddress, found.mapLength);
+		thread_call_enter(cache->wire);
+	}
+
+	return (hit);
+}
+
+void
+AppleVTD::spaceMapCacheInsert(vtd_space_t * space, IOMemoryDescriptor * memory,
+							  uint64_t descriptorOffset, uint64_t length, uint32_t mapOptions,
+							  uint64_t mapAddress, uint64_t mapLength)
+{
+	vtd_map_cache_t       * cache = space->map_cache;
+	vtd_map_cache_entry_t * entry;
+	vtd_map_cache_entry_t * slot;
+	vtd_map_cache_entry_t   evicted;
+	uint32_t                idx;
+	bool                    evict;
+
+	slot  = NULL;
+	evict = false;
+	IOLockLock(cache->lock);
+	for (idx = 0; idx < kMapCacheEntries; idx++)
+	{
+		entry = &cache->entries[idx];
+		if (kMapCacheEntryFree == entry->state)
+		{
+			if (!slot || (kMapCacheEntryFree != slot->state)) slot = entry;
+			continue;
+		}
+		if (kMapCacheEntryRetiring == entry->state) continue;
+		// an in use, stale mapping of the same buffer keeps the slot
+		if ((memory == entry->memory)
+			&& (descriptorOffset == entry->offset)
+			&& (length == entry->length)
+			&& (mapOptions == entry->mapOptions))
+		{
+			slot = NULL;
+			break;
+		}
+		if (entry->users || (kMapCacheEntryLive != entry->state)) continue;
+		if (!slot || ((kMapCacheEntryFree != slot->state) && (entry->lru < slot->lru))) slot = entry;
+	}
+	if (slot && (kMapCacheEntryFree != slot->state))
+	{
+		// the least recently used idle entry makes room, its slot frees once unwired
+		evicted = *slot;
+		slot->state = kMapCacheEntryRetiring;
+		evict = true;
+		slot = NULL;
+	}
+	if (slot)
+	{
+		memory->retain();
+		slot->memory     = memory;
+		slot->offset     = descriptorOffset;
+		slot->length     = length;
+		slot->mapOptions = mapOptions;
+		slot->mapAddress = mapAddress;
+		slot->mapLength  = mapLength;
+		slot->users      = 1;
+		slot->lru        = ++cache->lru;
+		slot->state      = kMapCacheEntryWiring;
+		slot->wired      = false;
+	}
+	IOLockUnlock(cache->lock);
+
+	if (evict) spaceUnmapMemory(space, NULL, NULL, evicted.mapAddress, evicted.mapLength);
+	if (evict || slot) thread_call_enter(cache->wire);
+}
+
+// returns true if the mapping is cached, and stays live for a later re-map.
+// an entry not yet wired, or out of the cache, is unmapped by its last user.
+bool
+AppleVTD::spaceMapCacheRelease(vtd_space_t * space, uint64_t mapAddress)
+{
+	vtd_map_cache_t       * cache = space->map_cache;
+	vtd_map_cache_entry_t * entry;
+	uint32_t                idx;
+	bool                    cached, retire;
+
+	cached = retire = false;
+	IOLockLock(cache->lock);
+	for (idx = 0; idx < kMapCacheEntries; idx++)
+	{
+		entry = &cache->entries[idx];
+		if (kMapCacheEntryFree == entry->state)  continue;
+		if (mapAddress != entry->mapAddress)     continue;
+		if (!entry->users)                       continue;
+		entry->users--;
+		cached = true;
+		if (!entry->users && (kMapCacheEntryLive != entry->state))
+		{
+			entry->state = kMapCacheEntryRetiring;
+			cached = false;
+			retire = true;
+		}
+		break;
+	}
+	IOLockUnlock(cache->lock);
+
+	if (retire) thread_call_enter(cache->wire);
+
+	return (cached);
+}
+
 IOReturn
 AppleVTD::spaceInsert(vtd_space_t * space, uint32_t mapOptions,
 					  uint64_t mapAddress, uint64_t byteOffset,
@@ -2431,9 +3219,9 @@ AppleVTD::spaceInsert(vtd_space_t * space, uint32_t mapOptions,
 	addr += offset;
 	vtassert((addr + pageCount) <= space->vsize);
 	vtd_space_nfault(space, addr, pageCount);
-    for (idx = 0; idx < pageCount; idx++)
+    for (idx = 0; idx < pageCount; )
     {
-		space->tables[0][addr + idx].bits = (ptoa_64(phys + idx)) | kPageAccess;
+		idx += vtd_space_set_super(space, addr + idx, phys + idx, pageCount - idx, kPageAccess);
 	}
 	table_flush(&space->tables[0][addr], pageCount * sizeof(vtd_table_entry_t), fCacheLineSize);
 	STAT_ADD(space, inserts, pageCount);
@@ -2461,8 +3249,14 @@ AppleVTD::iovmMapMemory(
 			  uint64_t                    * mapAddress,
 			  uint64_t                    * mapLength)
 {
-    return (spaceMapMemory(fSpace, memory, descriptorOffset, length,
-			  mapOptions, mapSpecification, dmaCommand, pageList, mapAddress, mapLength));
+	IOReturn ret;
+	uint64_t start = mach_absolute_time();
+
+    ret = spaceMapMemory(fSpace, memory, descriptorOffset, length,
+			  mapOptions, mapSpecification, dmaCommand, pageList, mapAddress, mapLength);
+	vtd_stats_hist(&fMapHist[0], mach_absolute_time() - start);
+
+	return (ret);
 }
 
 IOReturn
@@ -2470,7 +3264,13 @@ AppleVTD::iovmUnmapMemory(IOMemoryDescriptor * memory,
 						  IODMACommand * dmaCommand,
 						  uint64_t mapAddress, uint64_t mapLength)
 {
-    return (spaceUnmapMemory(fSpace, memory, dmaCommand, mapAddress, mapLength));
+	IOReturn ret;
+	uint64_t start = mach_absolute_time();
+
+    ret = spaceUnmapMemory(fSpace, memory, dmaCommand, mapAddress, mapLength);
+	vtd_stats_hist(&fUnmapHist[0], mach_absolute_time() - start);
+
+	return (ret);
 }
 
 uint64_t
@@ -2592,6 +3392,7 @@ AppleVTD::deviceMapperActivate(AppleVTDDeviceMapper * mapper, uint32_t options)
 		if (created)
 		{
 			mapper->fVTD->reserveRanges(space, false);
+			if (space && mapper->fMapCache) spaceMapCacheEnable(space);
 		}
 	}
 	if (!space) space = fSpace;
@@ -2616,6 +3417,7 @@ AppleVTD::deviceMapperActivate(AppleVTDDeviceMapper * mapper, uint32_t options)
 	// The AMD mapper space is persistent
     if ((kDeviceMapperDeactivate & options) && !(mapper->fIsAMD))
     {
+		if (mapper->fSpace->map_cache) spaceMapCacheFlush(mapper->fSpace, true);
 		space_destroy(mapper->fSpace);
 		mapper->fSpace = 0;
     }
@@ -2707,6 +3509,44 @@ AppleVTDDeviceMapper::free()
 	super::free();
 }
 
+IOReturn
+AppleVTDDeviceMapper::callPlatformFunction(const OSSymbol * functionName,
+										   bool waitForFunction,
+										   void * param1, void * param2,
+										   void * param3, void * param4)
+{
+	if (functionName && functionName->isEqualTo(gIOMapperWaitForQuiesceKey))
+	{
+		return (waitForQuiesce((uint64_t)(uintptr_t) param1, (uint32_t *) param2));
+	}
+    return (super::callPlatformFunction(functionName, waitForFunction,
+                                        param1, param2, param3, param4));
+}
+
+// Block until every mapping handed out has been unmapped, or the deadline passes.
+// The last unmap wakes the waiter, there is no polling. Idle map cache entries
+// are still live in the IOMMU, so they are retired each time before counting.
+IOReturn
+AppleVTDDeviceMapper::waitForQuiesce(uint64_t deadline, uint32_t * mappings)
+{
+	IOReturn ret = kIOReturnSuccess;
+	bool     timedOut;
+
+	IOLockLock(fAppleVTDforDeviceLock);
+	for (timedOut = false; ; )
+	{
+		if (fSpace && fSpace->map_cache) fVTD->spaceMapCacheFlush(fSpace, false);
+		if ((fMappings <= 0) || timedOut) break;
+		timedOut = (THREAD_TIMED_OUT == IOLockSleepDeadline(fAppleVTDforDeviceLock, (void *) &fMappings,
+															*(AbsoluteTime *) &deadline, THREAD_UNINT));
+	}
+	if (fMappings > 0) ret = kIOReturnTimeout;
+	if (mappings) *mappings = (fMappings > 0) ? fMappings : 0;
+	IOLockUnlock(fAppleVTDforDeviceLock);
+
+	return (ret);
+}
+
 uint64_t
 AppleVTDDeviceMapper::getPageSize(void) const
 {
@@ -2738,8 +3578,11 @@ AppleVTDDeviceMapper::iovmMapMemory(
         return (ret);
 	}
 
+	uint64_t start = mach_absolute_time();
     ret = fVTD->spaceMapMemory(fSpace, memory, descriptorOffset, length,
 				mapOptions, mapSpecification, dmaCommand, pageList, mapAddress, mapLength);
+	vtd_stats_hist(&fVTD->fMapHist[0], mach_absolute_time() - start);
+	if (kIOReturnSuccess == ret) OSIncrementAtomic(&fMappings);
 
     return (ret);
 }
@@ -2749,8 +3592,25 @@ AppleVTDDeviceMapper::iovmUnmapMemory(IOMemoryDescriptor * memory,
 									  IODMACommand * dmaCommand,
 									  uint64_t mapAddress, uint64_t mapLength)
 {
-	if (!fSpace) return kIOReturnSuccess;
-    return (fVTD->spaceUnmapMemory(fSpace, memory, dmaCommand, mapAddress, mapLength));
+	IOReturn ret;
+	uint64_t start;
+
+	ret = kIOReturnSuccess;
+	if (fSpace)
+	{
+		start = mach_absolute_time();
+		ret = fVTD->spaceUnmapMemory(fSpace, memory, dmaCommand, mapAddress, mapLength);
+		vtd_stats_hist(&fVTD->fUnmapHist[0], mach_absolute_time() - start);
+	}
+	// a deactivated space took its mappings with it, they still count as unmapped here
+	if (1 == OSDecrementAtomic(&fMappings))
+	{
+		IOLockLock(fAppleVTDforDeviceLock);
+		IOLockWakeup(fAppleVTDforDeviceLock, (void *) &fMappings, false);
+		IOLockUnlock(fAppleVTDforDeviceLock);
+	}
+
+	return (ret);
 }
 
 uint64_t
@@ -23,6 +23,7 @@
 #pragma once
 
 #include <IOKit/IOMapper.h>
+#include <kern/thread_call.h>
 #include <IOKit/IOKitKeysPrivate.h>
 #include <libkern/tree.h>
 #include <libkern/OSDebug.h>
@@ -30,6 +31,7 @@
 #include <libkern/sysctl.h>
 
 #include "dmar.h"
+#include "vtdstats.h"
 
 #if 0
 #define VTHWLOCKTYPE   IOLock
@@ -165,6 +167,15 @@ enum
 	kPageAddrMask			= 0x3ffffffffffff000ULL
 };
 
+// superpage sizes, in 4K pages
+enum
+{
+	kSuperPageShift2M		= 9,
+	kSuperPageShift1G		= 18,
+	kSuperPageMask2M		= (1U << kSuperPageShift2M) - 1,
+	kSuperPageMask1G		= (1U << kSuperPageShift1G) - 1,
+};
+
 typedef char vtd_registers_t_check[(sizeof(vtd_registers_t) == 0xc0) ? 1 : -1];
 
 #define kMaxUnits	(8)
@@ -275,9 +286,50 @@ struct vtd_space_stats
 	ppnum_t merges;
 	ppnum_t allocs[64];
 	ppnum_t bcounts[20];
+	ppnum_t superpages[2];
+	ppnum_t map_hits;
+	ppnum_t map_misses;
+	ppnum_t waits;
 };
 typedef struct vtd_space_stats vtd_space_stats_t;
 
+// mappings of a descriptor kept live after unmap, so an unchanged re-map reuses the IOVA.
+// the descriptor is retained and kept prepared while its entry can hold a live mapping.
+enum
+{
+	kMapCacheEntryFree = 0,
+	kMapCacheEntryWiring,				// mapped, waiting for the cache's prepare()
+	kMapCacheEntryLive,					// wired, reusable once idle
+	kMapCacheEntryRetiring,				// out of the cache, waiting for complete() and release()
+};
+
+struct vtd_map_cache_entry_t
+{
+	IOMemoryDescriptor * memory;		// retained
+	uint64_t             offset;
+	uint64_t             length;
+	uint64_t             mapAddress;
+	uint64_t             mapLength;
+	uint64_t             lru;
+	uint32_t             mapOptions;
+	uint32_t             users;
+	uint8_t              state;
+	bool                 wired;
+};
+
+enum
+{
+	kMapCacheEntries = 32
+};
+
+struct vtd_map_cache_t
+{
+	IOLock *              lock;
+	thread_call_t         wire;			// prepare() and complete() can't run under the map calls
+	uint64_t              lru;
+	vtd_map_cache_entry_t entries[kMapCacheEntries];
+};
+
 struct vtd_free_queued_t
 {
 	ppnum_t  addr;
@@ -292,6 +344,19 @@ enum
 	kFreeQElems = 256
 };
 
+// interrupt remapping invalidates waiting on IOPCICommitInterrupts() callers
+struct vtd_ir_commit_t
+{
+	IOPCIInterruptCommitAction action;
+	void *                     refCon;
+	uint32_t                   stamp[kMaxUnits];
+};
+
+enum
+{
+	kIRCommitCount = 16
+};
+
 struct vtd_space
 {
 	IOSimpleLock *      block;
@@ -306,10 +371,12 @@ struct vtd_space
 	uint32_t            cachelinesize;
 	ppnum_t             root_page;
 	uint8_t             max_level;
+	uint8_t             superpage_levels;
 	uint8_t             waiting_space;
 	uint8_t             bheads_count;
 	uint32_t            pending_free;
 	vtd_table_entry_t * bheads;
+	vtd_map_cache_t   * map_cache;
 	
 	vtd_space_stats_t   stats;
 
@@ -352,7 +419,13 @@ public:
 	IOMemoryMap     * fIRMap;
 	uint64_t          fIRAddress;
 	ir_descriptor_t * fIRTable;
+	uint32_t          fIRDirtyFirst;		// staged entries not yet invalidated,
+	uint32_t          fIRDirtyLast;			// empty when first > last
+	vtd_ir_commit_t   fIRCommits[kIRCommitCount];
+	uint32_t          fIRCommitHead;
+	uint32_t          fIRCommitTail;
 	uint8_t           fDisabled;
+	uint8_t           fSuperPageLevels;
 	bool              x2apic_mode;
 
 	uint64_t          fNumMemoryRanges;
@@ -367,6 +440,19 @@ public:
 	volatile uint32_t   free_tail[kFreeQCount];
 	uint32_t            free_mask;
 
+	// "statistics" property, see vtdstats.h
+	vtd_space_t      ** fDomainSpaces;
+	uint64_t            fMapHist[kVTDStatsHistBuckets];
+	uint64_t            fUnmapHist[kVTDStatsHistBuckets];
+	uint64_t            fQIStallHist[kVTDStatsHistBuckets];
+	uint64_t            fFreeDepthHist[kFreeQCount][kVTDStatsHistBuckets];
+	uint64_t            fQIStallTime;
+	uint64_t            fSpaceWaits;
+	vtd_stats_sample_t  fDepthSamples[kVTDStatsSamples];
+	uint32_t            fDepthSampleNext;
+	uint64_t            fDepthSampleLast;
+	uint64_t            fDepthSampleInterval;
+
 	static void install(IOWorkLoop * wl, uint32_t flags,
 						IOService * provider, const OSData * data,
 						IOPCIMessagedInterruptController  * messagedInterruptController);
@@ -394,6 +480,7 @@ public:
 	IOReturn handleInterrupt(IOInterruptEventSource * source, int count);
 	IOReturn handleFault(IOInterruptEventSource * source, int count);
 	IOReturn timer(OSObject * owner, IOTimerEventSource * sender);
+	bool serializeStatistics(void * ref, OSSerialize * serializer);
 	virtual IOReturn callPlatformFunction(const OSSymbol * functionName,
 										  bool waitForFunction,
 										  void * param1, void * param2,
@@ -402,6 +489,11 @@ public:
 	void checkFree(vtd_space_t * space, uint32_t queue);
 	void contextInvalidate(uint16_t domainID);
 	void interruptInvalidate(uint16_t index, uint16_t count);
+	void interruptDefer(uint32_t index, uint32_t count);
+	IOReturn interruptCommit(IOPCIInterruptCommitAction action, void * refCon);
+	bool interruptQueue(uint32_t first, uint32_t last, bool complete, uint32_t stamp[kMaxUnits]);
+	void interruptWait(const uint32_t stamp[kMaxUnits]);
+	void checkInterruptCommits(void);
 
 	IOReturn deviceMapperActivate(AppleVTDDeviceMapper * mapper, uint32_t options);
 	IOReturn newContextPage(uint32_t idx);
@@ -431,6 +523,19 @@ public:
 
 	uint64_t spaceMapToPhysicalAddress(vtd_space_t * space, uint64_t mappedAddress);
 
+	void spaceMapCacheEnable(vtd_space_t * space);
+	void spaceMapCacheFlush(vtd_space_t * space, bool all);
+	bool spaceMapCacheVerify(vtd_space_t * space, vtd_map_cache_entry_t * entry,
+							 IOMemoryDescriptor * memory, const IODMAMapPageList * pageList);
+	bool spaceMapCacheLookup(vtd_space_t * space, IOMemoryDescriptor * memory,
+							 uint64_t descriptorOffset, uint64_t length, uint32_t mapOptions,
+							 const IODMAMapPageList * pageList,
+							 uint64_t * mapAddress, uint64_t * mapLength);
+	void spaceMapCacheInsert(vtd_space_t * space, IOMemoryDescriptor * memory,
+							 uint64_t descriptorOffset, uint64_t length, uint32_t mapOptions,
+							 uint64_t mapAddress, uint64_t mapLength);
+	bool spaceMapCacheRelease(vtd_space_t * space, uint64_t mapAddress);
+
 	// }
 	// { IOMapper
 
@@ -474,14 +579,23 @@ public:
 	vtd_space_t * fSpace;
 	uint32_t      fSourceID;
 	bool          fIsAMD;
+	bool          fMapCache;
 	uint8_t       fAllFunctions;
     IOLock      * fAppleVTDforDeviceLock;
 	ppnum_t       vsize;
+	volatile SInt32 fMappings;			// iovmMapMemory() not yet unmapped
 
 	static AppleVTDDeviceMapper * forDevice(IOService * device, uint32_t flags);
 
 	virtual void free() APPLE_KEXT_OVERRIDE;
 
+	virtual IOReturn callPlatformFunction(const OSSymbol * functionName,
+										  bool waitForFunction,
+										  void * param1, void * param2,
+										  void * param3, void * param4) APPLE_KEXT_OVERRIDE;
+
+	IOReturn waitForQuiesce(uint64_t deadline, uint32_t * mappings);
+
 	// { IOMapper
 
 	virtual bool initHardware(IOService *provider) APPLE_KEXT_OVERRIDE;
@@ -130,6 +130,7 @@ class __kpi_deprecated("Use PCIDriverKit") IOPCIBridge : public IOService
     friend class IOPCIConfigurator;
     friend class IOPCIEventSource;
     friend class IOPCIHostBridge;
+    friend class IOPCIDiagnosticsClient;
 
     OSDeclareAbstractStructors(IOPCIBridge)
 
@@ -471,6 +472,7 @@ public:
 
 protected:
 	void updateLinkStatusProperty(uint16_t linkStatus);
+	void invalidateChildProperties(void);
 
 	// findDeviceByXXX retains the returned IOPCIDevice object
 	IOPCIDevice *findDeviceByBDF(IOPCIAddressSpace space);
@@ -562,6 +564,8 @@ public:
 
     virtual void stop( IOService * provider ) override;
 
+    virtual bool willTerminate( IOService * provider, IOOptionBits options ) override;
+
     virtual bool configure( IOService * provider ) override;
 
     virtual void probeBus( IOService * provider, UInt8 busNum ) override;
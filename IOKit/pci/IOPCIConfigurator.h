@@ -109,6 +109,15 @@ IOPCIScalar IOPCIRangeLastFree(IOPCIRange * headRange, IOPCIScalar align);
 void        IOPCIRangeListOptimize(IOPCIRange * headRange);
 IOPCIScalar IOPCIRangeListSize(IOPCIRange * first);
 
+// cost of moving an allocation, kIOPCIRangePlanImmovable if it can't be moved
+typedef IOPCIScalar (*IOPCIRangePlanCost)(void * ref, IOPCIRange * range);
+#define kIOPCIRangePlanImmovable    (0xFFFFFFFFFFFFFFFFULL)
+#define kIOPCIPausePlanMax          (32)
+
+bool IOPCIRangeListPlanHole(IOPCIRange * headRange, IOPCIScalar size, IOPCIScalar alignment,
+                            IOPCIRangePlanCost cost, void * ref,
+                            IOPCIRange ** plan, uint32_t * planCount, IOPCIScalar * planCost);
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #ifdef KERNEL
@@ -153,7 +162,7 @@ enum {
     kIOPCIConfiguratorBoot           = 0x00004000,
     kIOPCIConfiguratorIGIsMapped     = 0x00008000,
     kIOPCIConfiguratorFPBEnable      = 0x00010000,
-    //<unused>                       = 0x00020000,
+    kIOPCIConfiguratorNoSuperPages   = 0x00020000, // VT-d maps with 4K pages only
     kIOPCIConfiguratorUsePause       = 0x00040000,
     kIOPCIConfiguratorCheckTunnel    = 0x00080000,
     kIOPCIConfiguratorNoTunnelDrv    = 0x00100000,
@@ -165,7 +174,7 @@ enum {
     kIOPCIConfiguratorSystemMap      = 0x04000000, // Force all devices to use system mapper, x86 only
     kIOPCIConfiguratorDefaultETF     = 0x08000000, // Use default extended tag settings
     kIOPCIConfiguratorForcePause     = 0x10000000, // Force all probes to trigger a pause
-    //<unused>                       = 0x20000000,
+    kIOPCIConfiguratorWarmBoot       = 0x20000000, // Reuse BAR sizing and placement from kIOPCITopologySnapshotKey
     //<unused>                       = 0x40000000,
     //<unused>                       = 0x80000000,
 
@@ -283,6 +292,49 @@ enum
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// kIOPCITopologySnapshotKey, published on each host bridge after configuration
+// and saved to NVRAM for the next boot: a header, then a record for every
+// function below the host bridge in probe order. Each record is followed by
+// an IOPCITopologyBar for every BAR set in its barMask, lowest first.
+enum
+{
+    kIOPCITopologySignature    = 0x50434954,   // 'PCIT'
+    kIOPCITopologyVersion      = 2,
+    kIOPCITopologyMaxNVRAMSize = 4096,         // larger snapshots are not saved
+};
+
+struct IOPCITopologyHeader
+{
+    uint32_t            signature;
+    uint16_t            version;
+    uint16_t            recordSize;
+    uint32_t            count;
+    uint32_t            rootVendorProduct;
+};
+
+struct IOPCITopologyRecord
+{
+    uint32_t            space;              // IOPCIAddressSpace bits
+    uint32_t            vendorProduct;
+    uint32_t            classCode;          // class code and revision ID
+    uint32_t            subsystem;          // header type 0 only
+    uint8_t             headerType;
+    uint8_t             barMask;            // BARs recorded, bit 6 is the expansion ROM
+    uint8_t             bar64Mask;          // BARs decoding 64 bits
+    uint8_t             clean64Mask;        // and placed as kIOPCIRangeFlagBar64
+};
+
+struct IOPCITopologyBar
+{
+    uint32_t            startLow;           // final placement
+    uint32_t            startHigh;
+    uint8_t             type;
+    uint8_t             sizeShift;          // probed size is 1 << sizeShift
+    uint16_t            resv;
+};
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 struct IOPCIConfigEntry
 {
     IOPCIConfigEntry *  parent;
@@ -294,6 +346,9 @@ struct IOPCIConfigEntry
     uint32_t            classCode;
     IOPCIAddressSpace   space;
     uint32_t            vendorProduct;
+    uint32_t            subsystem;          // kIOPCIConfiguratorWarmBoot only
+    uint8_t             revisionID;
+    uint8_t             bar64Mask;
 
     uint32_t            expressCapBlock;
     uint32_t            expressDeviceCaps1;
@@ -351,6 +406,9 @@ struct IOPCIConfigEntry
     IORegistryEntry *   dtNub;
 
 	uint8_t *			configShadow;
+
+    const IOPCITopologyRecord * warm;       // snapshot record this function matched
+    OSData *            warmSnapshot;       // host bridge only
 };
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -380,6 +438,7 @@ class IOPCIConfigurator : public IOService
     uint64_t                fResetStartTime;
     uint64_t                fResetWaitTime;
 	uint32_t                fDomainId;
+	uint32_t                fWarmFunctions;		// matched a snapshot record this configuration
 #if ACPI_SUPPORT
 	uint8_t				 	fAddedHost64;
 #endif /* ACPI_SUPPORT */
@@ -417,6 +476,11 @@ protected:
     IOPCIRange * bridgeGetRange(IOPCIConfigEntry * bridge, uint32_t type);
     bool    bridgeTotalResources(IOPCIConfigEntry * bridge, uint32_t typeMask);
     int32_t bridgeAllocateResources( IOPCIConfigEntry * bridge, uint32_t typeMask );
+    static IOPCIScalar pausePlanCost(void * ref, IOPCIRange * range);
+    bool    canPause(IOPCIConfigEntry * child);
+    bool    bridgePlanPause(IOPCIConfigEntry * bridge, uint32_t failTypes,
+                            IOPCIScalar * shortage, IOPCIScalar * shortageAlignments,
+                            IOPCIConfigEntry ** plan, uint32_t * planCount);
 
 	void    bridgeDeallocateChildRanges(IOPCIConfigEntry * bridge, IOPCIConfigEntry * dead);
 
@@ -437,6 +501,7 @@ protected:
     void    bridgeProbeChildRanges(IOPCIConfigEntry * bridge, uint32_t resetMask);
     void    probeBaseAddressRegister(IOPCIConfigEntry * device, uint32_t lastBarNum, uint32_t resetMask);
     void    safeProbeBaseAddressRegister(IOPCIConfigEntry * device, uint32_t lastBarNum, uint32_t resetMask, bool disableInterrupts);
+    bool    warmProbeBaseAddressRegister(IOPCIConfigEntry * device, uint32_t lastBarNum, uint32_t resetMask);
     void    deviceProbeRanges(IOPCIConfigEntry * device, uint32_t resetMask);
     void    bridgeProbeRanges(IOPCIConfigEntry * bridge, uint32_t resetMask);
     void    cardbusProbeRanges(IOPCIConfigEntry * bridge, uint32_t resetMask);
@@ -457,6 +522,11 @@ protected:
 
     bool     createRoot(void);
     IOReturn addHostBridge(IOPCIHostBridge * hostBridge);
+    void     warmBootLoadSnapshot(IOPCIConfigEntry * hostBridge);
+    const IOPCITopologyRecord * warmBootMatch(IOPCIConfigEntry * bridge, IOPCIConfigEntry * child);
+    uint32_t warmBootRecord(IOPCIConfigEntry * bridge, OSData * records);
+    void     warmBootSaveSnapshot(void);
+    void     warmBootRemoveSnapshot(void);
     IOPCIConfigEntry * findEntry(IORegistryEntry * from, IOPCIAddressSpace space);
     IOPCIConfigEntry * findEntryByAddress(IORegistryEntry * from, IOPCIScalar address);
 	bool     rangeListContains(IOPCIRange * range, IOPCIScalar address);
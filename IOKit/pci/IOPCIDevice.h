@@ -195,6 +195,7 @@ struct IOPCIPhysicalAddress {
 
 #if ACPI_SUPPORT
 #define kIOPCIUseDeviceMapperKey        "IOPCIUseDeviceMapper"
+#define kIOPCIMapCacheKey               "IOPCIMapCache"
 #define kIOPCIChildBundleIdentifierKey  "driver-child-bundle"
 #define kIOPCIDeviceMapArgLen                1024
 #endif
@@ -214,6 +215,14 @@ enum
     kIOPCILatencyUnsnooped = 0x00000002,
 };
 
+// configureInterrupts options
+enum
+{
+    kIOPCIInterruptAffinitySpread   = 0x00000001,   // steer MSI/MSI-X vectors round robin over interrupt CPUs
+    kIOPCIInterruptAffinityCPUMask  = 0xffff0000,   // interrupt CPUs to spread over, zero for all, see setInterruptAffinity()
+    kIOPCIInterruptAffinityCPUShift = 16,
+};
+
 enum
 {
     kIOPCIProbeOptionDone      = 0x80000000,
@@ -241,6 +250,8 @@ class IOPCIMessagedInterruptController;
 class IOPCIConfigurator;
 class IOPCIEventSource;
 class IOPCIHostBridgeData;
+struct IOPCIEventEntry;
+struct IOPCIFLRRestore;
 
 // IOPCIEvent.event
 enum
@@ -260,6 +271,13 @@ struct IOPCIEvent
     uint32_t      data[5];
 };
 
+// IOPCIDevice::createEventSource() options
+enum
+{
+    kIOPCIEventSourceDepthMask  = 0x00000fff,   // queue depth, zero for the default
+    kIOPCIEventSourceNoCoalesce = 0x00001000,   // queue every correctable error
+};
+
 enum IOPCIResetType {
     kIOPCIResetNone,
     kIOPCIResetHot,
@@ -281,15 +299,28 @@ private:
     queue_chain_t     fQ;
     IOPCI2PCIBridge * fRoot;
     IOPCIDevice *     fDevice;
-    uint8_t           fReadIndex;
-    uint8_t           fWriteIndex;
-    IOPCIEvent *      fEvents;
+    uint32_t          fReadIndex;
+    uint32_t          fWriteIndex;
+    IOPCIEventEntry * fEvents;
+    uint32_t          fDepth;
+    uint32_t          fOptions;
+    IOSimpleLock *    fLock;
+    uint64_t          fDropped;
+    uint64_t          fCoalesced;
 
     IOPCIHostBridgeData *getHostBridgeData(void);
+    bool enqueueEvent(IOPCIDevice * device, uint32_t event, const IOPCIEvent * newEvent);
+    bool dequeueEvent(IOPCIEventEntry * entry);
 public:
     virtual void enable( void ) APPLE_KEXT_OVERRIDE;
     virtual void disable( void ) APPLE_KEXT_OVERRIDE;
 
+    // For the event passed to the action only: the number of identical correctable
+    // errors coalesced into it, and the mach_absolute_time() of the first and last.
+    uint32_t getEventCount(const IOPCIEvent * event, uint64_t * firstTime, uint64_t * lastTime) const;
+    // Events lost because the queue was full.
+    uint64_t getDroppedEventCount(void) const;
+
 protected:
     virtual void free( void ) APPLE_KEXT_OVERRIDE;
     virtual bool checkForWork( void ) APPLE_KEXT_OVERRIDE;
@@ -434,6 +465,7 @@ public:
 
     using IOService::getProperty;
     virtual OSObject * getProperty( const OSSymbol * aKey) const APPLE_KEXT_OVERRIDE;
+    virtual bool serializeProperties( OSSerialize * serialize ) const APPLE_KEXT_OVERRIDE;
 
     virtual IOReturn setProperties(OSObject * properties) APPLE_KEXT_OVERRIDE;
     virtual IOReturn callPlatformFunction(const OSSymbol * functionName,
@@ -689,6 +721,74 @@ public:
 
     virtual UInt8 ioRead8( UInt16 offset, IOMemoryMap * map = 0 );
 
+/*! @function ioRead32Relaxed
+    @abstract Reads a 32-bit value from an I/O space aperture without a barrier.
+    @discussion As ioRead32, but the access is not ordered against other relaxed accesses to device memory. Use ioBarrier() after a run of relaxed accesses, before anything that depends on their order, such as a write that acknowledges the status just read.
+    @param offset An offset into a bus or device's I/O space aperture.
+    @param map If the offset is relative to the beginning of a device's aperture, an IOMemoryMap object for that object should be passed in. Otherwise, passing zero will read the value relative to the beginning of the bus' I/O space.
+    @result The value read in host byte order. */
+
+    UInt32 ioRead32Relaxed( UInt16 offset, IOMemoryMap * map = 0 );
+
+/*! @function ioRead16Relaxed
+    @abstract Reads a 16-bit value from an I/O space aperture without a barrier. See ioRead32Relaxed(). */
+
+    UInt16 ioRead16Relaxed( UInt16 offset, IOMemoryMap * map = 0 );
+
+/*! @function ioRead8Relaxed
+    @abstract Reads a 8-bit value from an I/O space aperture without a barrier. See ioRead32Relaxed(). */
+
+    UInt8 ioRead8Relaxed( UInt16 offset, IOMemoryMap * map = 0 );
+
+/*! @function ioWrite32Relaxed
+    @abstract Writes a 32-bit value to an I/O space aperture without a barrier.
+    @discussion As ioWrite32, but the access is not ordered against other relaxed accesses to device memory. Use ioBarrier() after a run of relaxed accesses.
+    @param offset An offset into a bus or device's I/O space aperture.
+    @param value The value to be written in host byte order.
+    @param map If the offset is relative to the beginning of a device's aperture, an IOMemoryMap object for that object should be passed in. Otherwise, passing zero will write the value relative to the beginning of the bus' I/O space. */
+
+    void ioWrite32Relaxed( UInt16 offset, UInt32 value, IOMemoryMap * map = 0 );
+
+/*! @function ioWrite16Relaxed
+    @abstract Writes a 16-bit value to an I/O space aperture without a barrier. See ioWrite32Relaxed(). */
+
+    void ioWrite16Relaxed( UInt16 offset, UInt16 value, IOMemoryMap * map = 0 );
+
+/*! @function ioWrite8Relaxed
+    @abstract Writes a 8-bit value to an I/O space aperture without a barrier. See ioWrite32Relaxed(). */
+
+    void ioWrite8Relaxed( UInt16 offset, UInt8 value, IOMemoryMap * map = 0 );
+
+/*! @function ioBarrier
+    @abstract Orders all earlier I/O space accesses before any later ones.
+    @discussion The barrier the ordered accessors issue after every access. Port I/O is already serializing on x86, where this only stops the compiler reordering. */
+
+    void ioBarrier( void );
+
+/*! @function ioReadBlock
+    @abstract Reads a run of values from one I/O port, as the x86 string input instructions do.
+    @discussion The port is read count times into consecutive elements of data, with one barrier after the last read rather than one after each.
+    @param offset An offset into a bus or device's I/O space aperture, aligned to size.
+    @param data The buffer for count values of size bytes each, in host byte order.
+    @param count The number of values to read.
+    @param size The width of each access, 4, 2 or 1.
+    @param map If the offset is relative to the beginning of a device's aperture, an IOMemoryMap object for that object should be passed in. Otherwise, passing zero will read relative to the beginning of the bus' I/O space.
+    @result kIOReturnSuccess, kIOReturnBadArgument for any other size, or kIOReturnNoMemory without an I/O space mapping. */
+
+    IOReturn ioReadBlock( UInt16 offset, void * data, IOByteCount count, UInt8 size, IOMemoryMap * map = 0 );
+
+/*! @function ioWriteBlock
+    @abstract Writes a run of values to one I/O port, as the x86 string output instructions do.
+    @discussion Consecutive elements of data are written to the port, with one barrier after the last write rather than one after each.
+    @param offset An offset into a bus or device's I/O space aperture, aligned to size.
+    @param data The count values of size bytes each to write, in host byte order.
+    @param count The number of values to write.
+    @param size The width of each access, 4, 2 or 1.
+    @param map If the offset is relative to the beginning of a device's aperture, an IOMemoryMap object for that object should be passed in. Otherwise, passing zero will write relative to the beginning of the bus' I/O space.
+    @result kIOReturnSuccess, kIOReturnBadArgument for any other size, or kIOReturnNoMemory without an I/O space mapping. */
+
+    IOReturn ioWriteBlock( UInt16 offset, const void * data, IOByteCount count, UInt8 size, IOMemoryMap * map = 0 );
+
     OSMetaClassDeclareReservedUsed(IOPCIDevice,  0);
 /*! @function hasPCIPowerManagement
     @abstract determine whether or not the device supports PCI Bus Power Management.
@@ -722,7 +822,7 @@ public:
     @param interruptType kIOInterruptTypeLevel, kIOInterruptTypePCIMessaged or kIOInterruptTypePCIMessagedX.
     @param numRequired The minimum number of vectors for allocation to succeed.
     @param numRequested The desired number of vectors to allocate.
-    @param options Unused
+    @param options kIOPCIInterruptAffinitySpread to steer the vectors across interrupt CPUs, see setInterruptAffinity().
     @result kIOReturnSuccess if there were no errors */
 
     virtual IOReturn configureInterrupts( UInt32 interruptType = kIOInterruptTypeLevel,
@@ -844,6 +944,21 @@ public:
 
 	IOReturn setLatencyTolerance(IOOptionBits type, uint64_t nanoseconds);
 
+    // Steer an MSI/MSI-X interrupt source to a CPU by retargeting its interrupt
+    // remapping entry, without reprogramming the device. Shared MSI-X sub vectors
+    // move together. Returns kIOReturnUnsupported without interrupt remapping.
+    // cpu is an interrupt CPU, one of the platform's 256 vector delivery windows
+    // rather than a logical processor, so there are few of them, typically two
+    // on x86. kIOReturnBadArgument for a cpu past the last window.
+    IOReturn setInterruptAffinity(int source, uint32_t cpu);
+
+    // Moderate a registered MSI-X interrupt source in software. Above maxRate
+    // interrupts per second the vector is masked after each interrupt and
+    // unmasked every intervalUS (zero for the default), so a busy source takes
+    // one interrupt per interval. Moderation ends when an interval passes with
+    // no interrupt. A maxRate of zero turns moderation off.
+    IOReturn setInterruptModeration(int source, uint32_t maxRate, uint32_t intervalUS);
+
     IOPCIEventSource * createEventSource(OSObject * owner, IOPCIEventSource::Action action, uint32_t options);
 
     // allow tunnel controller to enter L1, client should be an attached driver calling
@@ -1048,6 +1163,40 @@ public:
 								uint8_t  data,
 								IOOptionBits options);
 
+	/*!
+	 * @brief       Copies a range of the PCI device's aperture at a given memory index into a buffer.
+	 * @discussion  The range is validated once, then read with the widest naturally aligned accesses, or as a single
+	 *              transfer when the host bridge does device memory reads. Use for ring descriptors, logs and the like,
+	 *              not for registers with read side effects that need a specific access size.
+	 * @param       memoryIndex An index into the array of ranges assigned to the device
+	 * @param       offset An offset into the device's memory specified by the index.
+	 * @param       data The buffer to copy into, in device byte order.
+	 * @param       length The number of bytes to copy.
+	 * @param       options Optional access options (see enum tIOPCIAccessOptions).
+	 * @return      kIOReturnSuccess, or kIOReturnOverrun if the range is outside the aperture.
+	 */
+	IOReturn deviceMemoryReadBlock(uint8_t      memoryIndex,
+								   uint64_t     offset,
+								   void*        data,
+								   IOByteCount  length,
+								   IOOptionBits options = 0);
+
+	/*!
+	 * @brief       Copies a buffer into a range of the PCI device's aperture at a given memory index.
+	 * @discussion  The range is validated once, then written with the widest naturally aligned accesses.
+	 * @param       memoryIndex An index into the array of ranges assigned to the device
+	 * @param       offset An offset into the device's memory specified by the index.
+	 * @param       data The buffer to copy from, in device byte order.
+	 * @param       length The number of bytes to copy.
+	 * @param       options Optional access options (see enum tIOPCIAccessOptions).
+	 * @return      kIOReturnSuccess, or kIOReturnOverrun if the range is outside the aperture.
+	 */
+	IOReturn deviceMemoryWriteBlock(uint8_t      memoryIndex,
+									uint64_t     offset,
+									const void*  data,
+									IOByteCount  length,
+									IOOptionBits options = 0);
+
 	/*!
 	 * @brief       Register a dext crash notification handler for this PCI device.
 	 * @discussion  The handler is invoked prior to disabling and terminating the crashed device,
@@ -1107,6 +1256,32 @@ public:
 	IOReturn reset(tIOPCIDeviceResetTypes type,
 				   tIOPCIDeviceResetOptions options = kIOPCIDeviceResetOptionNone);
 
+	/*! @function copyCapabilityOffsets
+	 *   @abstract     Returns the function's capability offsets, keyed by capability name.
+	 *   @discussion   The capability lists are walked on first use rather than at publish, and again after an
+	 *                 invalidating event. Each successful walk publishes the result as the "Capability Offsets"
+	 *                 OSDictionary property, which getProperty() and registry reads bring up to date first.
+	 *                 The walk is skipped while config access is blocked.
+	 *   @return       A retained dictionary the caller must release, or NULL.
+	 */
+	OSDictionary * copyCapabilityOffsets(void);
+
+	/*! @function resetFunctions
+	 *   @abstract     Function level reset a set of functions together.
+	 *   @discussion   For example all functions of a multi-function device. Every function must support FLR. The resets are
+	 *                 issued back to back, so the call waits about as long as the slowest function rather than the sum.
+	 *                 Configuration state is saved before and restored after, parents first, the rest concurrently. SR-IOV state
+	 *                 is not restored: a physical function's FLR clears VF Enable, so a set may not hold a physical function
+	 *                 together with its enabled virtual functions. During reset, the caller must not access the functions.
+	 *   @param functions The functions to reset.
+	 *   @param count     The number of functions.
+	 *   @param options   tIOPCIDeviceResetOptions.
+	 *   @return       kIOReturnSuccess, kIOReturnUnsupported if any function does not support FLR, or kIOReturnBadArgument
+	 *                 if the set holds a physical function and any of its virtual functions.
+	 */
+	static IOReturn resetFunctions(IOPCIDevice ** functions, uint32_t count,
+								   tIOPCIDeviceResetOptions options = kIOPCIDeviceResetOptionNone);
+
 public:
 	virtual bool setProperty(const OSSymbol * aKey, OSObject * anObject);
 	virtual bool setProperty(const OSString * aKey, OSObject * anObject);
@@ -1130,11 +1305,21 @@ protected:
 	bool supportsFLR(void);
 	void prepareFLR(void);
 	void flr(void);
-	void completeFLR(void);
+	void completeFLR(IOPCIDevice ** functions, uint32_t count);
+	void probeFLRReadiness(void);
+	bool waitForFRS(uint64_t deadline, IOPCIDevice ** functions, uint32_t count);
+	static void waitForTransactions(IOPCIDevice ** functions, uint32_t count);
 
 private:
 	IOReturn resetFunction(tIOPCIDeviceResetOptions options);
+	void flrRestoreThreadCall(struct IOPCIFLRRestore * restore);
 	void resetNubState(void);
+	void resolveConfigHost(void);
+	void invalidateProperties(void);
+	bool propertyCacheValid(UInt32 generation, uint64_t timestamp) const;
+	IOReturn deviceMemoryBlockRange(uint8_t memoryIndex, uint64_t offset, IOByteCount length,
+									IOVirtualAddress * address, IOOptionBits options,
+									IODeviceMemory ** offload);
 
 protected:
 	bool isDownstreamFacing(void);
@@ -1146,12 +1331,14 @@ protected:
 private:
 	bool isFunctionAccessible(IOPCIDevice *function);
     void republishTimerHandler(IOTimerEventSource * es);
+	void armPublishDeadline(void);
 
 	void pauseTimerHandler(IOTimerEventSource * es);
 	static IOReturn busyStateChange(void * target, void * refCon,
 									UInt32 messageType, IOService * service,
 									void * messageArgument, vm_size_t argSize);
 	bool isInitializing(void);
+	uint64_t pauseDelayNS(void);
 protected:
 	void initiatePause(void);
 
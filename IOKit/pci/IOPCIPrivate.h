@@ -77,6 +77,15 @@ enum
 	kIOPCISubClassBridgeOther   = 0x80,
 };
 
+// IOPCIEventSource queue element, the action is passed &entry->event
+struct IOPCIEventEntry
+{
+    IOPCIEvent event;
+    uint32_t   count;       // identical correctable errors coalesced
+    uint64_t   firstTime;
+    uint64_t   lastTime;
+};
+
 struct IOPCIDeviceExpansionData
 {
     uint16_t powerCapability;
@@ -113,6 +122,10 @@ struct IOPCIDeviceExpansionData
 	uint64_t            msiTable;
 	uint64_t            msiPBA;
 	IOInterruptVector * msiVectors;
+	uint32_t *          msiRegisteredMask;	// shared msix, registered sub vectors
+	uint32_t            msiRegisteredWords;	// pba words with any bit in msiRegisteredMask
+	struct IOPCIMSIModeration ** msiModeration;	// [msiPhysVectorCount], or NULL
+	struct IOPCIMSIStats *       msiStats;		// per cpu vector accounting
 
     uint16_t latencyToleranceCapability;
     uint16_t acsCapability;
@@ -123,7 +136,7 @@ struct IOPCIDeviceExpansionData
     uint8_t  headerType;
     uint8_t  rootPort;
 
-    uint8_t  configProt;
+    volatile UInt32 configAccessState;		// kIOPCIConfigAccess*, updated with IOPCIConfigAccessUpdate()
     uint8_t  pmActive;
     uint8_t  pmeUpdate;
     uint8_t  updateWakeReason;
@@ -138,6 +151,7 @@ struct IOPCIDeviceExpansionData
 	IORecursiveLock * lock;
     struct IOPCIConfigEntry * configEntry;
     IOPCIHostBridge *hostBridge;
+    IOPCIBridge *configHost;		// does this nub's config accesses, the parent or the host bridge
 
 	IOOptionBits sessionOptions;
 
@@ -179,17 +193,34 @@ struct IOPCIDeviceExpansionData
 
 	OSDictionary *capDict;
 
-    IOTimerEventSource *republishTimer;
-	uint8_t publishRetryCount;
+    IOTimerEventSource *republishTimer;		// kicked on power on, else fires at publishDeadline
+	uint8_t publishPending;
+	uint64_t publishDeadline;
 
-	IOTimerEventSource *pauseTimer;
+	IOTimerEventSource *pauseTimer;			// armed for the end of the settle grace period
 	IONotifier *busyNotifier;
 	AbsoluteTime busyTimestamp;
+	uint8_t pauseDeferred;
+
+	uint8_t       flrReadiness;			// how completeFLR() learns the function is ready
+	uint16_t      flrFRSQueue;			// root port FRS Queuing capability, kIOPCIFLRReadyFRS
+	uint64_t      flrReadyNS;			// reported FLR Time, kIOPCIFLRReadyReported
+	uint64_t      flrStart;				// when flr() was issued, completeFLR() waits from here
+	uint8_t       flrReady;				// FRS message seen
+	IOPCIDevice * flrRootPort;
 
 	IOPCIEventSource *pciEventSource;
+	queue_head_t eventSourceQueue;		// enabled sources for this device only
+	IORecursiveLock *eventSourceLock;	// eventSourceQueue, the host bridge lock covers the rest
 	IOWorkLoop *pciEventSourceWorkLoop;
 	IOCommandGate *pciEventSourceCmdGate;
 	uint32_t iommuEventCount;
+
+	volatile UInt32 propertyGeneration;	// bumped by IOPCIDevice::invalidateProperties()
+	UInt32        linkStatusGeneration;	// propertyGeneration the link status was read at
+	uint64_t      linkStatusTime;		// and when, zero if never
+	uint32_t      linkStatusValue;
+	UInt32        capDictGeneration;		// propertyGeneration capDict was built at
 };
 
 enum
@@ -199,6 +230,44 @@ enum
     kTunnelL1NotSet  = 2
 };
 
+// FLR completion, best first (PCI Express Base 5.0 - 6.6.2)
+enum
+{
+    kIOPCIFLRReadyWait      = 0,	// 100 ms
+    kIOPCIFLRReadyImmediate = 1,	// Immediate Readiness in the Status register
+    kIOPCIFLRReadyReported  = 2,	// FLR Time from Readiness Time Reporting
+    kIOPCIFLRReadyFRS       = 3,	// FLR Completed FRS message at the root port
+    kIOPCIFLRReadyCRS       = 4,	// 100 ms, then Vendor ID polled with CRS Software Visibility
+};
+
+#define kIOPCIFLRWaitMS			100
+#define kIOPCIFLRCRSWaitMS		1000
+
+// longest a cached link status is served without an invalidating event
+#define kIOPCIPropertyCacheMS	1000
+
+// IOPCIDeviceExpansionData::configAccessState, any bit set blocks the access
+enum
+{
+    kIOPCIConfigAccessReadProtect  = 0x00000001,	// protectDevice() VM_PROT_READ
+    kIOPCIConfigAccessWriteProtect = 0x00000002,	// protectDevice() VM_PROT_WRITE
+    kIOPCIConfigAccessInReset      = 0x00000004,	// parent IOPCIBridge::setInReset()
+
+    kIOPCIConfigAccessReadBlocked  = kIOPCIConfigAccessReadProtect  | kIOPCIConfigAccessInReset,
+    kIOPCIConfigAccessWriteBlocked = kIOPCIConfigAccessWriteProtect | kIOPCIConfigAccessInReset,
+};
+
+static inline void IOPCIConfigAccessUpdate(volatile UInt32 * state, UInt32 clear, UInt32 set)
+{
+    UInt32 old;
+
+    do
+    {
+        old = *state;
+    }
+    while (!OSCompareAndSwap(old, (old & ~clear) | set, state));
+}
+
 #define expressV2(device) ((15 & device->reserved->expressCapabilities) > 1)
 
 enum
@@ -250,6 +319,28 @@ static inline void savedConfigWrite32( IOPCIConfigSave *save, uint16_t offset, u
 	*(uint32_t *)(&savedConfig[offset]) = data;
 }
 
+// per cpu accounting of one device's messaged vectors, IOPCIMessagedInterruptController.cpp
+struct IOPCIMSIStats;
+
+// software moderation of one msix vector, see IOPCIDevice::setInterruptModeration()
+struct IOPCIMSIModeration
+{
+	IOSimpleLock *           lock;
+	thread_call_t            poll;
+	IOPCIDevice *            device;
+	IOInterruptVector *      vector;
+	uint32_t                 index;			// msix table entry
+	uint32_t                 threshold;		// interrupts per window to start moderating
+	uint64_t                 window;		// absolute time
+	uint64_t                 interval;		// absolute time, poll period while moderated
+	uint64_t                 windowStart;
+	uint32_t                 count;			// interrupts this window
+	uint32_t                 pending;		// interrupts since the last poll
+	volatile bool            moderated;		// read unlocked by pba dispatch
+	uint64_t                 moderations;
+	uint64_t                 polls;
+};
+
 struct IOPCIMSISave
 {
 	uint32_t				 address0;
@@ -325,6 +416,7 @@ enum
 
 #define kIOPCIEjectableKey        "IOPCIEjectable"
 #define kIOPCIHotPlugKey          "IOPCIHotPlug"
+#define kIOPCICapabilityOffsetsKey "Capability Offsets"
 #define kIOPCILinkChangeKey       "IOPCILinkChange"
 #define kIOPCITunnelLinkChangeKey "IOPCITunnelLinkChange"
 #define kIOPCITunnelBootDeferKey  "IOPCITunnelBootDefer"
@@ -337,6 +429,12 @@ enum
 #define kIOPCIMSIFlagsKey         "pci-msi-flags"
 #define kIOPCIMSILimitKey         "pci-msi-limit"
 #define kIOPCIIgnoreLinkStatusKey "pci-ignore-linkstatus"
+// Saved by IOPCIConfigurator in the NVRAM variable pci-topology-snapshot-<host
+// bridge space, %08x> when kIOPCIConfiguratorWarmBoot is set, up to
+// kIOPCITopologyMaxNVRAMSize bytes, and removed at boot when it is not. Read back on the next boot from the host
+// bridge's provider under kIOPCITopologySnapshotKey, where a booter that starts
+// PCI before NVRAM is available must copy it, else from NVRAM.
+#define kIOPCITopologySnapshotKey "pci-topology-snapshot"
 
 #ifndef kACPIDevicePathKey
 #define kACPIDevicePathKey             "acpi-path"
@@ -473,6 +571,12 @@ enum
 
 #define kIOPCIPublishRetryTimeoutKey	"IOPCIDevicePublishRetryTimeout"
 
+// IOMapper::callPlatformFunction(), block until the mapper has no mappings outstanding.
+// param1 is an absolute time deadline, param2 an optional uint32_t * for the mappings
+// left. Returns kIOReturnTimeout at the deadline, kIOReturnUnsupported from mappers
+// without the notification.
+#define kIOMapperWaitForQuiesceKey		"IOMapperWaitForQuiesce"
+
 // Entitlements
 #define kIOPCITransportDextEntitlement                     "com.apple.developer.driverkit.transport.pci"
 #define kIOPCITransportBridgeDextEntitlement               "com.apple.developer.driverkit.transport.pci.bridge"
@@ -496,7 +600,9 @@ extern const OSSymbol *           gIOPolledInterfaceActiveKey;
 extern const OSSymbol *           gIOPCIPSMethods[kIOPCIDevicePowerStateCount];
 #endif
 extern const OSSymbol *           gIOPCIExpressLinkStatusKey;
+extern const OSSymbol *           gIOPCICapabilityOffsetsKey;
 extern const OSSymbol *           gIOPCIDARTErrorData;
+extern const OSSymbol *           gIOMapperWaitForQuiesceKey;
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -506,6 +612,13 @@ __exported_push
 extern IOReturn IOPCIPlatformInitialize(void);
 extern IOReturn IOPCISetMSIInterrupt(uint32_t vector, uint32_t count, uint32_t * msiData);
 extern uint64_t IOPCISetAPICInterrupt(uint64_t entry);
+// stage remapping entries, the invalidation is held until IOPCICommitInterrupts()
+extern IOReturn IOPCISetMSIInterruptDeferred(uint32_t vector, uint32_t count, uint32_t * msiData);
+// action == NULL waits for the invalidation, otherwise action is called on the mapper workloop
+typedef void (*IOPCIInterruptCommitAction)(void * refCon, IOReturn status);
+extern IOReturn IOPCICommitInterrupts(IOPCIInterruptCommitAction action, void * refCon);
+// retarget a present entry to cpu, delivered there as destVector, deferred as above
+extern IOReturn IOPCISteerMSIInterrupt(uint32_t vector, uint32_t cpu, uint32_t destVector);
 __exported_pop
 #endif
 
@@ -646,7 +759,8 @@ public:
 
 public:
 
-	static IOInterruptVector * allocVectors(uint32_t count);
+	IOInterruptVector * allocVectors(uint32_t count);
+	void                freeVectors(IOInterruptVector * vectors, uint32_t count);
     static void initDevice(IOPCIDevice * device, IOPCIMSISave * save);
 	static void saveDeviceState(IOPCIDevice * device, IOPCIMSISave * save);
 	static void restoreDeviceState(IOPCIDevice * device, IOPCIMSISave * save);
@@ -689,12 +803,44 @@ public:
     virtual void     deallocateInterrupt(UInt32 vector);
 
     virtual uint32_t getDeviceMSILimit(IOPCIDevice* device, uint32_t numVectorsRequested);
+
+    // Vector n is delivered to cpu (n >> 8). Steering retargets the remapping
+    // entry to a free alias vector in another cpu's window, the device keeps
+    // its programmed message. A cpu here is one of getInterruptCPUCount()
+    // 256 vector windows the platform delivers to, not a logical processor,
+    // so affinity is only as fine as the windows, typically two on x86.
+    uint32_t         getInterruptCPUCount(void);
+    IOReturn         steerInterrupt(IOService * nub, int source, uint32_t cpu);
+    IOReturn         spreadDeviceInterrupts(IOService * device, uint32_t cpuMask);
+
+    IOReturn         setInterruptModeration(IOService * nub, int source, uint32_t maxRate, uint32_t intervalUS);
+    void             moderationPoll(IOPCIMSIModeration * moderation);
+
+    // msistats.h layout, *length is set to the size needed
+    IOReturn         copyStatistics(void * buffer, uint32_t * length);
 protected:
     virtual bool     allocateInterruptVectors( IOService *device,
                                                uint32_t numVectors,
                                                IORangeScalar *rangeStartOut);
 private:
+    IOReturn         steerVector(IOInterruptVectorNumber vectorNumber, uint32_t cpu);
+    inline void      dispatchVector(IOInterruptVector * vector, IOPCIMSIStats * stats, uint32_t index);
+    void             allocateStatistics(IOPCIDevice * device, uint32_t firstVector, uint32_t numVectors, bool shared);
+    void             freeStatistics(IOPCIDevice * device);
+    void             moderateVector(IOInterruptVector * vector);
+    void             stopModeration(IOPCIDevice * device, IOInterruptVector * vector);
+
 	uint32_t _domainId;
+	uint16_t * _vectorAlias;		// alias vector -> steered vector + 1
+	uint16_t * _vectorSteer;		// steered vector -> alias vector + 1
+	volatile SInt32 _moderated;		// vectors with moderation enabled
+	IOPCIMSIStats ** _vectorStats;	// vector -> device accounting, first vector only for shared msix
+
+	// interruptLock of every vector is one of these, by vector index
+	enum { kVectorLockStripes = 16 };
+	IOLock *   _vectorLocks[kVectorLockStripes];
+	IOLock *         _statsLock;
+	uint32_t         _statsCPUs;
 };
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -707,11 +853,30 @@ class IOPCIDiagnosticsClient : public IOUserClient
 
     IOPCIBridge * owner;
 
+    // page aligned physical ranges mapped for kIOPCI64BitMemorySpace accesses, kept until close
+    struct Mapping
+    {
+        uint64_t      base;
+        uint64_t      length;
+        IOMemoryMap * map;
+    };
+    IOLock *  _mapLock;
+    Mapping   _maps[8];
+    uint32_t  _mapNext;
+
+    IOReturn copyInterruptStatistics(IOExternalMethodArguments * args);
+    IOReturn accessVector(IOExternalMethodArguments * args);
+    IOReturn blockRead(IOExternalMethodArguments * args);
+    IOReturn access(IOPCIDiagnosticsParameters * params, bool write);
+    void *   mapRange(uint64_t address, uint64_t length);
+    void     unmapAll(void);
+
 public:
     virtual bool initWithTask(task_t owningTask,
 							  void * securityID,
 							  UInt32 type,
 							  OSDictionary * properties);
+    virtual void        free(void);
     virtual IOReturn    clientClose(void);
     virtual IOService * getService(void);
     virtual IOReturn    setProperties(OSObject * properties);
@@ -741,9 +906,22 @@ enum
 enum {
 	kIOPCIDiagnosticsMethodRead  = 0,
 	kIOPCIDiagnosticsMethodWrite = 1,
+	kIOPCIDiagnosticsMethodInterruptStatistics = 2,		// msistats.h
+	kIOPCIDiagnosticsMethodVector = 3,					// IOPCIDiagnosticsParameters[] in and out
+	kIOPCIDiagnosticsMethodBlockRead = 4,				// one IOPCIDiagnosticsParameters in, bytes out
 	kIOPCIDiagnosticsMethodCount
 };
 
+// IOPCIDiagnosticsParameters.options
+enum {
+	kIOPCIDiagnosticsOptionWrite = 0x00000001,			// kIOPCIDiagnosticsMethodVector
+};
+
+enum {
+	kIOPCIDiagnosticsMaxVector    = 1024,				// operations per kIOPCIDiagnosticsMethodVector
+	kIOPCIDiagnosticsMaxBlockRead = 1024 * 1024,		// bytes per kIOPCIDiagnosticsMethodBlockRead
+};
+
 struct IOPCIDiagnosticsParameters
 {
 	uint32_t			          options;
@@ -801,7 +979,7 @@ public:
     OSSet *             _publishSet;
 
     IORecursiveLock *   _eventSourceLock;
-    queue_head_t        _eventSourceQueue;
+    queue_head_t        _eventSourceQueue;	// enabled sources not bound to a device
 
     IOSimpleLock *      _allPCI2PCIBridgesLock;
     uint32_t            _allPCI2PCIBridgeState;
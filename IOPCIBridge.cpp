@@ -75,7 +75,7 @@ extern "C"
 // #define DEFERTEST	1
 
 enum { kAERISRNum     = 4 };
-enum { kIOPCIEventNum = 8 };
+enum { kIOPCIEventNum = 32 };		// default IOPCIEventSource depth
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
@@ -88,6 +88,7 @@ __kpi_unavailable const OSSymbol *		   gIOPCIThunderboltKey;
 __kpi_unavailable const OSSymbol *		   gIOPCIHotplugCapableKey;
 __kpi_unavailable const OSSymbol *		   gIOPCITunnelL1EnableKey;
 __kpi_unavailable const OSSymbol *		   gIOPCIExpressLinkStatusKey;
+__kpi_unavailable const OSSymbol *		   gIOPCICapabilityOffsetsKey;
 
 __kpi_unavailable const OSSymbol *           gIOPlatformDeviceMessageKey;
 __kpi_unavailable const OSSymbol *           gIOPlatformDeviceASPMEnableKey;
@@ -102,6 +103,7 @@ __kpi_unavailable const OSSymbol *           gIOPCIDeviceHiddenKey;
 __kpi_unavailable const OSSymbol *           gIOPCIDeviceChangedKey;
 __kpi_unavailable const OSSymbol *           gIOPCILinkUpTimeoutKey;
 __kpi_unavailable const OSSymbol *           gIOPCIDARTErrorData;
+__kpi_unavailable const OSSymbol *           gIOMapperWaitForQuiesceKey;
 
 __kpi_unavailable uint32_t gIOPCILogModeFlags;
 __kpi_unavailable uint32_t gIOPCILogFlags;
@@ -830,6 +832,8 @@ void IOPCIBridge::initialize(void)
 		= OSSymbol::withCStringNoCopy(kIOPCILinkUpTimeoutKey);
 	gIOPCIDARTErrorData
 		= OSSymbol::withCStringNoCopy(kIOPCIDARTErrorDataKey);
+	gIOMapperWaitForQuiesceKey
+		= OSSymbol::withCStringNoCopy(kIOMapperWaitForQuiesceKey);
 	gIOPlatformGetMessagedInterruptAddressKey
 		= OSSymbol::withCStringNoCopy(kIOPlatformGetMessagedInterruptAddressKey);
 	gIOPlatformGetMessagedInterruptControllerKey
@@ -877,6 +881,7 @@ void IOPCIBridge::initialize(void)
 	gIOPCIHPTypeKey             = OSSymbol::withCStringNoCopy(kIOPCIHPTypeKey);
 	gIOPCITunnelL1EnableKey     = OSSymbol::withCStringNoCopy(kIOPCITunnelL1EnableKey);
 	gIOPCIExpressLinkStatusKey  = OSSymbol::withCStringNoCopy(kIOPCIExpressLinkStatusKey);
+	gIOPCICapabilityOffsetsKey  = OSSymbol::withCStringNoCopy(kIOPCICapabilityOffsetsKey);
 	gIOPCIThunderboltKey        = OSSymbol::withCStringNoCopy("PCI-Thunderbolt");
 	gIOPCIHotplugCapableKey     = OSSymbol::withCStringNoCopy("PCIHotplugCapable");
 	gIOPolledInterfaceActiveKey = OSSymbol::withCStringNoCopy(kIOPolledInterfaceActiveKey);
@@ -1146,7 +1151,7 @@ IOReturn IOPCIBridge::configOp(configOpParams *params)
 					if (vars->_waitingPauseSet->setObject(next))
 					{
 						// initiatePause() starts the pause IOPM transition if the nub and its children have
-						// finished initializing, else it defers the transition for (at least) another 100ms.
+						// finished initializing, else it defers the transition until the nub has settled.
 						next->initiatePause();
 					}
 				}
@@ -2846,6 +2851,7 @@ IOReturn IOPCIBridge::restoreDeviceState(IOPCIDevice * device, IOOptionBits opti
 	{
 		configShadow(device)->flags &= ~kIOPCIConfigShadowValid;
 	}
+	device->invalidateProperties();
 
 	// callers expect success
 	return (kIOReturnSuccess);
@@ -3069,6 +3075,7 @@ bool IOPCIBridge::initializeNub( IOPCIDevice * nub,
 
     spaceFromProperties( from, &nub->space);
     nub->parent = this;
+    nub->reserved->configHost = this;
 
     if (ioDeviceMemory())
         nub->ioMap = ioDeviceMemory()->map();
@@ -3101,28 +3108,50 @@ bool IOPCIBridge::initializeNub( IOPCIDevice * nub,
 
 void IOPCIBridge::waitForDartToQuiesce(IOPCIDevice *nub)
 {
-// This function will be removed once rdar://115125719 is resolved
+#define DART_WAIT_TIME_MS 100 // Arbitrary
+    IOMapper* mapper = IOMapper::copyMapperForDevice(nub);
+    IOReturn err = kIOReturnUnsupported;
+    uint32_t allocs = 0;
+    AbsoluteTime deadline;
+
+    if (mapper == NULL)
+    {
+        return;
+    }
+    clock_interval_to_deadline(DART_WAIT_TIME_MS, kMillisecondScale, &deadline);
+
+    // Mappers with the drained notification wake us on their last unmap
+    err = mapper->callPlatformFunction(gIOMapperWaitForQuiesceKey,
+                                       true,
+                                       (void *)(uintptr_t) AbsoluteTime_to_scalar(&deadline),
+                                       &allocs,
+                                       NULL,
+                                       NULL);
+    if (err != kIOReturnUnsupported)
+    {
+        if (err != kIOReturnSuccess)
+        {
+            DLOG("%s: %u mappings outstanding after %d ms\n", nub->getName(), allocs, DART_WAIT_TIME_MS);
+        }
+        OSSafeReleaseNULL(mapper);
+        return;
+    }
+
+// This fallback will be removed once rdar://115125719 is resolved
 #if TARGET_CPU_ARM64 || TARGET_CPU_ARM
-    IOMapper* dartMapper = IOMapper::copyMapperForDevice(nub);
-    if(   (dartMapper != NULL)
-       && (dartMapper->metaCast("IODARTMapper") != NULL))
+    if (mapper->metaCast("IODARTMapper") != NULL)
     {
         const OSSymbol *getNumAllocations = OSSymbol::withCString(kIODARTFunctionGetNumAllocations);
-        IOReturn err = kIOReturnSuccess;
-        uint32_t allocs = 0;
-
-#define DART_WAIT_TIME_MS 100 // Arbitrary
-        AbsoluteTime deadline, now = 0;
-        clock_interval_to_deadline(DART_WAIT_TIME_MS, kMillisecondScale, &deadline);
+        AbsoluteTime now = 0;
 
         do
         {
-            err = dartMapper->callPlatformFunction(getNumAllocations,
-                                                   false,
-                                                   &allocs,
-                                                   NULL,
-                                                   NULL,
-                                                   NULL);
+            err = mapper->callPlatformFunction(getNumAllocations,
+                                               false,
+                                               &allocs,
+                                               NULL,
+                                               NULL,
+                                               NULL);
             if (allocs != 0)
             {
                 IOSleepWithLeeway(10, 10);
@@ -3135,8 +3164,8 @@ void IOPCIBridge::waitForDartToQuiesce(IOPCIDevice *nub)
 
         OSSafeReleaseNULL(getNumAllocations);
     }
-    OSSafeReleaseNULL(dartMapper);
 #endif
+    OSSafeReleaseNULL(mapper);
 }
 
 void IOPCIBridge::removeDevice( IOPCIDevice * device, IOOptionBits options )
@@ -3154,13 +3183,11 @@ void IOPCIBridge::removeDevice( IOPCIDevice * device, IOOptionBits options )
 
 	// If the nub was terminated as part of the clientCrashed handler, we've
 	// already torn down its mapper.
-#if TARGET_CPU_ARM64 || TARGET_CPU_ARM
     if (device->reserved->sessionOptions & kIOPCISessionOptionDriverkit)
     {
-        // Wait for DART allocations to be freed by process exit cleanup or the driver.
+        // Wait for mapper allocations to be freed by process exit cleanup or the driver.
         waitForDartToQuiesce(device);
     }
-#endif
 
     device->callPlatformFunction(gIOPCIDeviceChangedKey,
                                   /* waitForFunction */ false,
@@ -3205,6 +3232,8 @@ bool IOPCIBridge::publishNub( IOPCIDevice * nub, UInt32 /* index */ )
 
     if (nub)
     {
+        nub->resolveConfigHost();
+
         if (nub->space.s.functionNum)
             snprintf( location, sizeof(location), "%X,%X", nub->space.s.deviceNum,
                      nub->space.s.functionNum );
@@ -3686,10 +3715,11 @@ const OSSymbol *IOPCIBridge::getSymbolFromExtendedCapabilityID(uint32_t id)
 
 void IOPCIBridge::constructCapabilitiesDict(IOPCIDevice *nub)
 {
+	OSDictionary *capDict;
 	uint32_t capabilityID = 0;
 
-	nub->reserved->capDict = OSDictionary::withCapacity(1);
-	if (!nub->reserved->capDict)
+	capDict = OSDictionary::withCapacity(1);
+	if (!capDict)
 	{
 		return;
 	}
@@ -3716,7 +3746,7 @@ void IOPCIBridge::constructCapabilitiesDict(IOPCIDevice *nub)
 
 			if (num)
 			{
-				nub->reserved->capDict->setObject(symbol, num);
+				capDict->setObject(symbol, num);
 
 				num->release();
 			}
@@ -3729,7 +3759,7 @@ void IOPCIBridge::constructCapabilitiesDict(IOPCIDevice *nub)
 		}
 	}
 
-	if (!nub->reserved->capDict->getObject(gIOPCICapabilityIDPCIExpressSym))
+	if (!capDict->getObject(gIOPCICapabilityIDPCIExpressSym))
 	{
 		goto done;
 	}
@@ -3750,7 +3780,7 @@ void IOPCIBridge::constructCapabilitiesDict(IOPCIDevice *nub)
 
 			if (num)
 			{
-				nub->reserved->capDict->setObject(symbol, num);
+				capDict->setObject(symbol, num);
 
 				num->release();
 			}
@@ -3764,7 +3794,9 @@ void IOPCIBridge::constructCapabilitiesDict(IOPCIDevice *nub)
 	}
 
 done:
-	nub->setProperty("Capability Offsets", nub->reserved->capDict);
+	// read through IOPCIDevice::copyCapabilityOffsets(), which holds the nub lock
+	OSSafeReleaseNULL(nub->reserved->capDict);
+	nub->reserved->capDict = capDict;
 }
 
 #define kDefaultLinkUpTimeoutMS 2000
@@ -3825,7 +3857,8 @@ void IOPCIBridge::probeBusGated( probeBusParams *params )
 
                 nubs->setObject(index++, nub);
 
-                constructCapabilitiesDict(nub);
+                // kIOPCICapabilityOffsetsKey is walked from config space and
+                // published when first read, IOPCIDevice::copyCapabilityOffsets()
 
                 headerType = nub->configRead8(kIOPCIConfigHeaderType);
 
@@ -4718,6 +4751,24 @@ void IOPCIBridge::updateLinkStatusProperty(uint16_t linkStatus)
 	OSSafeReleaseNULL(childIter);
 }
 
+void IOPCIBridge::invalidateChildProperties(void)
+{
+	OSIterator *childIter = getChildIterator( gIOServicePlane );
+	OSObject *child = NULL;
+
+	while (   (childIter != NULL)
+		   && ((child = childIter->getNextObject()) != NULL))
+	{
+		IOPCIDevice *nub = OSDynamicCast(IOPCIDevice, child);
+		if (nub)
+		{
+			nub->invalidateProperties();
+		}
+	}
+
+	OSSafeReleaseNULL(childIter);
+}
+
 IOPCIDevice *IOPCIBridge::findDeviceByBDF(IOPCIAddressSpace space)
 {
 	IOService *result;
@@ -4959,35 +5010,42 @@ void IOPCI2PCIBridge::enqueueIOPCIEvent(IOPCIDevice *device, uint32_t event, IOP
 {
 	IOPCIHostBridgeData *vars = ((IOPCIBridge*)this)->reserved->hostBridgeData;
 	IOPCIEventSource *src;
-	uint8_t nextIdx;
+	queue_head_t *queues[2];
+	IORecursiveLock *locks[2];
+	uint32_t idx;
 
-	IORecursiveLockLock(vars->_eventSourceLock);
+	// an error report can follow a link or state change, reread on next serialize
+	device->invalidateProperties();
 
-	queue_iterate(&vars->_eventSourceQueue, src, IOPCIEventSource *, fQ)
-	{
-		if (src->fRoot && (this != src->fRoot)) continue;
-		if (src->fDevice && (device != src->fDevice)) continue;
+	// sources bound to the reporting device under its own lock, so root ports
+	// don't contend, then those watching every device under the host bridge's
+	queues[0] = &device->reserved->eventSourceQueue;
+	locks[0]  = device->reserved->eventSourceLock;
+	queues[1] = &vars->_eventSourceQueue;
+	locks[1]  = vars->_eventSourceLock;
 
-		nextIdx = src->fWriteIndex + 1;
-		if (nextIdx == kIOPCIEventNum) nextIdx = 0;
-		if (nextIdx != src->fReadIndex)
+	for (idx = 0; idx < arrayCount(queues); idx++)
+	{
+		IORecursiveLockLock(locks[idx]);
+		queue_iterate(queues[idx], src, IOPCIEventSource *, fQ)
 		{
-			src->fEvents[src->fWriteIndex].event = event;
-			device->retain();
-			src->fEvents[src->fWriteIndex].reporter = device;
-			memcpy(&src->fEvents[src->fWriteIndex].data[0],
-					&newEvent->data[0],
-					sizeof(src->fEvents[src->fWriteIndex].data));
-			src->fWriteIndex = nextIdx;
-		}
-		if (src->isEnabled()) src->signalWorkAvailable();
+			if (src->fRoot && (this != src->fRoot)) continue;
+			if (src->fDevice && (device != src->fDevice)) continue;
 
-		if (synchronous)
-		{
-			src->checkForWork();
+			if (!src->enqueueEvent(device, event, newEvent))
+			{
+				DLOG_PPB(AER, "%s: event %d from %s dropped (%qd)\n",
+						 fLogName, event, device->getName(), src->fDropped);
+			}
+			if (src->isEnabled()) src->signalWorkAvailable();
+
+			if (synchronous)
+			{
+				src->checkForWork();
+			}
 		}
+		IORecursiveLockUnlock(locks[idx]);
 	}
-	IORecursiveLockUnlock(vars->_eventSourceLock);
 }
 
 void IOPCI2PCIBridge::enqueueAERIOPCIEvent(IOPCIDevice *device, uint32_t status, uint32_t severity, bool correctable, IOPCIEvent *newEvent, bool synchronous)
@@ -5111,6 +5169,7 @@ void IOPCI2PCIBridge::handleInterrupt(IOInterruptEventSource * source __unused,
         DLOG_PPB(INTERRUPT, "%s: link bandwidth notification, linkStatus: 0x%x\n", fBridgeDevice->getName(), linkStatus);
 
 		updateLinkStatusProperty(linkStatus);
+		invalidateChildProperties();
 
         fBridgeDevice->configWrite16(fBridgeDevice->reserved->expressCapability + 0x12, linkStatus & linkBandwidthMask);
     }
@@ -5125,6 +5184,8 @@ void IOPCI2PCIBridge::handleInterrupt(IOInterruptEventSource * source __unused,
         if ((0 != (kNeedMask & slotStatus)) || (0 != (intsPending & kIntsHP)))
         {
             fBridgeDevice->configWrite16( fBridgeDevice->reserved->expressCapability + 0x1a, kNeedMask & slotStatus );
+            fBridgeDevice->invalidateProperties();
+            invalidateChildProperties();
 
             bool present;
             UInt32 probeTimeMS = 1;
@@ -6023,6 +6084,28 @@ IOReturn IOPCI2PCIBridge::saveDeviceState(IOPCIDevice * device,
 	return super::saveDeviceState(device, options);
 }
 
+// Nubs below may send their config accesses straight to the host bridge, see
+// IOPCIDevice::resolveConfigHost(). Once this bridge goes they take the hops
+// again, each of which checks for its removal.
+bool IOPCI2PCIBridge::willTerminate( IOService * provider, IOOptionBits options )
+{
+	IORegistryIterator * iter;
+	IORegistryEntry *    next;
+	IOPCIDevice *        nub;
+
+	if ((iter = IORegistryIterator::iterateOver(this, gIOServicePlane, kIORegistryIterateRecursively)))
+	{
+		while ((next = iter->getNextObject()))
+		{
+			if (!(nub = OSDynamicCast(IOPCIDevice, next)) || !nub->reserved || !nub->parent) continue;
+			nub->reserved->configHost = nub->parent;
+		}
+		iter->release();
+	}
+
+	return (super::willTerminate(provider, options));
+}
+
 void IOPCI2PCIBridge::stop( IOService * provider )
 {
     super::stop( provider);
@@ -6278,10 +6361,16 @@ IOPCIEventSource * IOPCIBridge::createEventSource(
 	do
 	{
 		if (!src->init(owner, (IOEventSource::Action) action)) break;
-		src->fEvents = IONew(IOPCIEvent, kIOPCIEventNum);
+		src->fLock = IOSimpleLockAlloc();
+		if (!src->fLock) break;
+		src->fDepth = (kIOPCIEventSourceDepthMask & options);
+		if (!src->fDepth) src->fDepth = kIOPCIEventNum;
+		src->fDepth++;				// one slot is always empty
+		src->fEvents = IONewZero(IOPCIEventEntry, src->fDepth);
 		if (!src->fEvents) break;
-		src->fRoot   = 0;
-		src->fDevice = 0;
+		src->fOptions = options;
+		src->fRoot    = 0;
+		src->fDevice  = 0;
 		ok = true;
 	}
 	while (false);
@@ -6353,7 +6442,25 @@ IOReturn IOPCIBridge::deviceMemoryRead(IOMemoryDescriptor* sourceBase,
 
 void IOPCIBridge::setInReset(bool inReset)
 {
+	OSIterator *  childIterator;
+	OSObject *    childObj;
+	IOPCIDevice * child;
+
 	reserved->childrenInReset = inReset;
+	OSMemoryBarrier();
+
+	// children attaching now pick the flag up in IOPCIDevice::attach()
+	if ((childIterator = getChildIterator(gIOServicePlane)))
+	{
+		while ((childObj = childIterator->getNextObject()))
+		{
+			if (!(child = OSDynamicCast(IOPCIDevice, childObj))) continue;
+			IOPCIConfigAccessUpdate(&child->reserved->configAccessState,
+									inReset ? 0 : kIOPCIConfigAccessInReset,
+									inReset ? kIOPCIConfigAccessInReset : 0);
+		}
+		childIterator->release();
+	}
 }
 
 #undef super
@@ -6394,29 +6501,17 @@ IOPCIHostBridgeData *IOPCIEventSource::getHostBridgeData(void)
 
 void IOPCIEventSource::free(void)
 {
-    IOPCIEvent       event;
-    uint32_t         nextIdx;
+    IOPCIEventEntry  entry;
 
 	if (fEvents) 
 	{
-		IOPCIHostBridgeData *vars = getHostBridgeData();
-		IORecursiveLockLock(vars->_eventSourceLock);
-		while (fReadIndex != fWriteIndex)
+		while (dequeueEvent(&entry))
 		{
-			event = fEvents[fReadIndex];
-			nextIdx = fReadIndex + 1;
-			if (nextIdx == kIOPCIEventNum) nextIdx = 0;
-			fReadIndex = nextIdx;
-			if (event.reporter)
-			{
-				IORecursiveLockUnlock(vars->_eventSourceLock);
-				event.reporter->release();
-				IORecursiveLockLock(vars->_eventSourceLock);
-			}
+			if (entry.event.reporter) entry.event.reporter->release();
 		}
-		IORecursiveLockUnlock(vars->_eventSourceLock);
-		IODelete(fEvents, IOPCIEvent, kIOPCIEventNum);
+		IODelete(fEvents, IOPCIEventEntry, fDepth);
 	}
+	if (fLock) IOSimpleLockFree(fLock);
 
 	if (fDevice) fDevice->release();
     super::free();
@@ -6425,45 +6520,126 @@ void IOPCIEventSource::free(void)
 void IOPCIEventSource::enable()
 {
 	IOPCIHostBridgeData *vars = getHostBridgeData();
+	queue_head_t *queue = fDevice ? &fDevice->reserved->eventSourceQueue : &vars->_eventSourceQueue;
+	IORecursiveLock *lock = fDevice ? fDevice->reserved->eventSourceLock : vars->_eventSourceLock;
 	super::enable();
-	IORecursiveLockLock(vars->_eventSourceLock);
-	if (!fQ.next) queue_enter(&vars->_eventSourceQueue, this, IOPCIEventSource *, fQ);
-	IORecursiveLockUnlock(vars->_eventSourceLock);
+	IORecursiveLockLock(lock);
+	if (!fQ.next) queue_enter(queue, this, IOPCIEventSource *, fQ);
+	IORecursiveLockUnlock(lock);
 }
 
 void IOPCIEventSource::disable()
 {
 	IOPCIHostBridgeData *vars = getHostBridgeData();
+	queue_head_t *queue = fDevice ? &fDevice->reserved->eventSourceQueue : &vars->_eventSourceQueue;
+	IORecursiveLock *lock = fDevice ? fDevice->reserved->eventSourceLock : vars->_eventSourceLock;
 	super::disable();
-	IORecursiveLockLock(vars->_eventSourceLock);
+	IORecursiveLockLock(lock);
 	if (fQ.next)
 	{
-		queue_remove(&vars->_eventSourceQueue, this, IOPCIEventSource *, fQ);
+		queue_remove(queue, this, IOPCIEventSource *, fQ);
 		fQ.next = 0;
 	}
-	IORecursiveLockUnlock(vars->_eventSourceLock);
+	IORecursiveLockUnlock(lock);
 }
 
-bool IOPCIEventSource::checkForWork(void)
+// Producers are serialized by the lock of the queue the source is on, its
+// device's eventSourceLock or the host bridge _eventSourceLock. fLock only
+// covers the indices against the consumer and an in place coalesce.
+bool IOPCIEventSource::enqueueEvent(IOPCIDevice * device, uint32_t event, const IOPCIEvent * newEvent)
 {
-	IOPCIEventAction pciAction = (IOPCIEventAction) action;
-	IOPCIEvent       event;
-	uint32_t         nextIdx;
-	IOPCIHostBridgeData *vars = getHostBridgeData();
+	IOPCIEventEntry * entry;
+	uint32_t          nextIdx;
+	uint64_t          now;
+	bool              queued;
+
+	now = mach_absolute_time();
+	IOSimpleLockLock(fLock);
 
-	IORecursiveLockLock(vars->_eventSourceLock);
-	while (enabled && (fReadIndex != fWriteIndex))
+	// an identical correctable error still waiting for delivery only bumps its count
+	if ((kIOPCIEventCorrectableError == event)
+	  && !(kIOPCIEventSourceNoCoalesce & fOptions)
+	  && (fReadIndex != fWriteIndex))
+	{
+		entry = &fEvents[(fWriteIndex ? fWriteIndex : fDepth) - 1];
+		if ((event == entry->event.event)
+		  && (device == entry->event.reporter)
+		  && !memcmp(&entry->event.data[0], &newEvent->data[0], sizeof(entry->event.data)))
+		{
+			entry->count++;
+			entry->lastTime = now;
+			fCoalesced++;
+			IOSimpleLockUnlock(fLock);
+			return (true);
+		}
+	}
+
+	nextIdx = fWriteIndex + 1;
+	if (nextIdx == fDepth) nextIdx = 0;
+	queued = (nextIdx != fReadIndex);
+	if (queued)
+	{
+		entry = &fEvents[fWriteIndex];
+		entry->event.event = event;
+		device->retain();
+		entry->event.reporter = device;
+		memcpy(&entry->event.data[0], &newEvent->data[0], sizeof(entry->event.data));
+		entry->count     = 1;
+		entry->firstTime = now;
+		entry->lastTime  = now;
+		fWriteIndex = nextIdx;
+	}
+	else fDropped++;
+
+	IOSimpleLockUnlock(fLock);
+
+	return (queued);
+}
+
+bool IOPCIEventSource::dequeueEvent(IOPCIEventEntry * entry)
+{
+	uint32_t nextIdx;
+	bool     found;
+
+	IOSimpleLockLock(fLock);
+	found = (fReadIndex != fWriteIndex);
+	if (found)
 	{
-		event = fEvents[fReadIndex];
+		*entry = fEvents[fReadIndex];
 		nextIdx = fReadIndex + 1;
-		if (nextIdx == kIOPCIEventNum) nextIdx = 0;
+		if (nextIdx == fDepth) nextIdx = 0;
 		fReadIndex = nextIdx;
-		IORecursiveLockUnlock(vars->_eventSourceLock);
-		(*pciAction)(owner, this, &event);
-		if (event.reporter) event.reporter->release();
-		IORecursiveLockLock(vars->_eventSourceLock);
 	}
-	IORecursiveLockUnlock(vars->_eventSourceLock);
+	IOSimpleLockUnlock(fLock);
+
+	return (found);
+}
+
+uint32_t IOPCIEventSource::getEventCount(const IOPCIEvent * event, uint64_t * firstTime, uint64_t * lastTime) const
+{
+	const IOPCIEventEntry * entry = (const IOPCIEventEntry *) event;
+
+	if (firstTime) *firstTime = entry->firstTime;
+	if (lastTime)  *lastTime  = entry->lastTime;
+
+	return (entry->count);
+}
+
+uint64_t IOPCIEventSource::getDroppedEventCount(void) const
+{
+	return (fDropped);
+}
+
+bool IOPCIEventSource::checkForWork(void)
+{
+	IOPCIEventAction pciAction = (IOPCIEventAction) action;
+	IOPCIEventEntry  entry;
+
+	while (enabled && dequeueEvent(&entry))
+	{
+		(*pciAction)(owner, this, &entry.event);
+		if (entry.event.reporter) entry.event.reporter->release();
+	}
 
 	return (false);
 }
@@ -7319,6 +7495,8 @@ IOReturn IOPCI2PCIBridge::setLinkSpeed(tIOPCILinkSpeed linkSpeed, bool retrain)
 	}
 
 	setTargetLinkSpeed(fBridgeDevice, linkSpeed);
+	fBridgeDevice->invalidateProperties();
+	invalidateChildProperties();
 
 	if (!retrain)
 	{
@@ -7621,11 +7799,26 @@ bool IOPCIDiagnosticsClient::initWithTask(task_t owningTask,
 		securityID, kIOClientPrivilegeAdministrator))                      return (false);
 	if (!PE_i_can_has_debugger(&bootArg) || !bootArg)                      return (false);
 
-    return (super::initWithTask(owningTask, securityID, type, properties));
+    if (!super::initWithTask(owningTask, securityID, type, properties))    return (false);
+    _mapLock = IOLockAlloc();
+
+    return (NULL != _mapLock);
+}
+
+void IOPCIDiagnosticsClient::free(void)
+{
+    if (_mapLock)
+    {
+        unmapAll();
+        IOLockFree(_mapLock);
+        _mapLock = NULL;
+    }
+    super::free();
 }
 
 IOReturn IOPCIDiagnosticsClient::clientClose(void)
 {
+    unmapAll();
 	terminate();
     return (kIOReturnSuccess);
 }
@@ -7644,19 +7837,24 @@ IOReturn IOPCIDiagnosticsClient::setProperties(OSObject * properties)
 IOReturn IOPCIDiagnosticsClient::externalMethod(uint32_t selector, IOExternalMethodArguments * args,
 												IOExternalMethodDispatch * dispatch, OSObject * target, void * reference)
 {
-    IOReturn                     ret = kIOReturnBadArgument;
     IOPCIDiagnosticsParameters * params;
-	IOMemoryDescriptor         * md;
-	IOMemoryMap                * map;
-	void                       * vmaddr;
 
     switch (selector)
     {
+        case kIOPCIDiagnosticsMethodInterruptStatistics:
+            return (copyInterruptStatistics(args));
+
+        case kIOPCIDiagnosticsMethodVector:
+            return (accessVector(args));
+
+        case kIOPCIDiagnosticsMethodBlockRead:
+            return (blockRead(args));
+
         case kIOPCIDiagnosticsMethodWrite:
             if (args->structureInputSize != sizeof(IOPCIDiagnosticsParameters)) return (kIOReturnBadArgument);
 
 			params = (typeof(params)) args->structureInput;
-            break;
+            return (access(params, true));
 
         case kIOPCIDiagnosticsMethodRead:
             if (args->structureInputSize  != sizeof(IOPCIDiagnosticsParameters)) return (kIOReturnBadArgument);
@@ -7664,143 +7862,375 @@ IOReturn IOPCIDiagnosticsClient::externalMethod(uint32_t selector, IOExternalMet
 
 			bcopy(args->structureInput, args->structureOutput, sizeof(IOPCIDiagnosticsParameters));
 			params = (typeof(params)) args->structureOutput;
-            break;
+            return (access(params, false));
 
         default:
-        	return (kIOReturnBadArgument);
             break;
 	}
 
-	map = 0;
-	vmaddr = 0;
-	if (kIOPCI64BitMemorySpace == params->spaceType)
+	return (kIOReturnBadArgument);
+}
+
+// _mapLock held, the kernel address of [address, address + length) through a cached mapping
+void * IOPCIDiagnosticsClient::mapRange(uint64_t address, uint64_t length)
+{
+	IOMemoryDescriptor * md;
+	IOMemoryMap        * map;
+	Mapping            * mapping;
+	uint64_t             base, end;
+	uint32_t             idx;
+
+	if (!length || ((address + length) < address)) return (NULL);
+
+	for (idx = 0; idx < arrayCount(_maps); idx++)
 	{
-		md = IOMemoryDescriptor::withAddressRange(params->address.addr64, 
-				(params->bitWidth >> 3), kIODirectionOutIn | kIOMemoryMapperNone, NULL);
-		if (md)
+		mapping = &_maps[idx];
+		if (mapping->map
+		 && (address >= mapping->base)
+		 && ((address + length) <= (mapping->base + mapping->length)))
 		{
-			map = md->map();
-			md->release();
+			return ((void *)(uintptr_t) (mapping->map->getAddress() + (address - mapping->base)));
 		}
-		if (!map) return (kIOReturnVMError);
-		vmaddr = (void *)(uintptr_t) map->getAddress();
 	}
 
-    switch (selector)
-    {
-        case kIOPCIDiagnosticsMethodWrite:
+	base = trunc_page_64(address);
+	end  = round_page_64(address + length);
+	md = IOMemoryDescriptor::withAddressRange(base, end - base,
+			kIODirectionOutIn | kIOMemoryMapperNone, NULL);
+	if (!md) return (NULL);
+	map = md->map();
+	md->release();
+	if (!map) return (NULL);
+
+	// round robin, a dump walks forward through a few BARs
+	mapping = &_maps[_mapNext];
+	_mapNext = (_mapNext + 1) % arrayCount(_maps);
+	if (mapping->map) mapping->map->release();
+	mapping->base   = base;
+	mapping->length = end - base;
+	mapping->map    = map;
+
+	return ((void *)(uintptr_t) (map->getAddress() + (address - base)));
+}
+
+void IOPCIDiagnosticsClient::unmapAll(void)
+{
+	uint32_t idx;
+
+	IOLockLock(_mapLock);
+	for (idx = 0; idx < arrayCount(_maps); idx++)
+	{
+		if (_maps[idx].map) _maps[idx].map->release();
+		_maps[idx].map = NULL;
+	}
+	IOLockUnlock(_mapLock);
+}
+
+// one access of params->bitWidth, a read returns the value in params->value
+IOReturn IOPCIDiagnosticsClient::access(IOPCIDiagnosticsParameters * params, bool write)
+{
+    IOReturn ret = kIOReturnBadArgument;
+	void   * vmaddr;
 
-			if (kIOPCI64BitMemorySpace == params->spaceType)
+	if (kIOPCI64BitMemorySpace == params->spaceType)
+	{
+		IOLockLock(_mapLock);
+		vmaddr = mapRange(params->address.addr64, (params->bitWidth >> 3));
+		if (!vmaddr) ret = kIOReturnVMError;
+		else if (write)
+		{
+			switch (params->bitWidth)
 			{
-				switch (params->bitWidth)
-				{
-					case 8:
-						*((uint8_t *) vmaddr) = params->value;
-						ret = kIOReturnSuccess;
-						break;
-					case 16:
-						*((uint16_t *) vmaddr) = params->value;
-						ret = kIOReturnSuccess;
-						break;
-					case 32:
-						*((uint32_t *) vmaddr) = static_cast<uint32_t>(params->value);
-						ret = kIOReturnSuccess;
-						break;
-					case 64:
-						*((uint64_t *) vmaddr) = params->value;
-						ret = kIOReturnSuccess;
-						break;
-					default:
-						break;
-				}
+				case 8:
+					*((uint8_t *) vmaddr) = params->value;
+					ret = kIOReturnSuccess;
+					break;
+				case 16:
+					*((uint16_t *) vmaddr) = params->value;
+					ret = kIOReturnSuccess;
+					break;
+				case 32:
+					*((uint32_t *) vmaddr) = static_cast<uint32_t>(params->value);
+					ret = kIOReturnSuccess;
+					break;
+				case 64:
+					*((uint64_t *) vmaddr) = params->value;
+					ret = kIOReturnSuccess;
+					break;
+				default:
+					break;
 			}
-			else if (kIOPCIConfigSpace == params->spaceType)
+		}
+		else
+		{
+			switch (params->bitWidth)
 			{
-				IOPCIAddressSpace space;
-				space.bits                   = 0;
-				space.es.busNum              = params->address.pci.bus;
-				space.es.deviceNum           = params->address.pci.device;
-				space.es.functionNum         = params->address.pci.function;
-				space.es.registerNumExtended = (0xF & (params->address.pci.offset >> 8));
-				switch (params->bitWidth)
-				{
-					case 8:
-						owner->configWrite8(space, params->address.pci.offset, params->value);
-						ret = kIOReturnSuccess;
-						break;
-					case 16:
-						owner->configWrite16(space, params->address.pci.offset, params->value);
-						ret = kIOReturnSuccess;
-						break;
-					case 32:
-						owner->configWrite32(space, params->address.pci.offset, static_cast<uint32_t>(params->value));
-						ret = kIOReturnSuccess;
-						break;
-					default:
-						break;
-				}
+				case 8:
+					params->value = *((uint8_t *) vmaddr);
+					ret = kIOReturnSuccess;
+					break;
+				case 16:
+					params->value = *((uint16_t *) vmaddr);
+					ret = kIOReturnSuccess;
+					break;
+				case 32:
+					params->value = *((uint32_t *) vmaddr);
+					ret = kIOReturnSuccess;
+					break;
+				case 64:
+					params->value = *((uint64_t *) vmaddr);
+					ret = kIOReturnSuccess;
+					break;
+				default:
+					break;
 			}
-			break;
-
-        case kIOPCIDiagnosticsMethodRead:
-
-			if (kIOPCI64BitMemorySpace == params->spaceType)
+		}
+		IOLockUnlock(_mapLock);
+	}
+	else if (kIOPCIConfigSpace == params->spaceType)
+	{
+		IOPCIAddressSpace space;
+		space.bits                   = 0;
+		space.es.busNum              = params->address.pci.bus;
+		space.es.deviceNum           = params->address.pci.device;
+		space.es.functionNum         = params->address.pci.function;
+		space.es.registerNumExtended = (0xF & (params->address.pci.offset >> 8));
+		if (write)
+		{
+			switch (params->bitWidth)
 			{
-				switch (params->bitWidth)
-				{
-					case 8:
-						params->value = *((uint8_t *) vmaddr);
-						ret = kIOReturnSuccess;
-						break;
-					case 16:
-						params->value = *((uint16_t *) vmaddr);
-						ret = kIOReturnSuccess;
-						break;
-					case 32:
-						params->value = *((uint32_t *) vmaddr);
-						ret = kIOReturnSuccess;
-						break;
-					case 64:
-						params->value = *((uint64_t *) vmaddr);
-						ret = kIOReturnSuccess;
-						break;
-					default:
-						break;
-				}
+				case 8:
+					owner->configWrite8(space, params->address.pci.offset, params->value);
+					ret = kIOReturnSuccess;
+					break;
+				case 16:
+					owner->configWrite16(space, params->address.pci.offset, params->value);
+					ret = kIOReturnSuccess;
+					break;
+				case 32:
+					owner->configWrite32(space, params->address.pci.offset, static_cast<uint32_t>(params->value));
+					ret = kIOReturnSuccess;
+					break;
+				default:
+					break;
 			}
-			else if (kIOPCIConfigSpace == params->spaceType)
+		}
+		else
+		{
+			switch (params->bitWidth)
 			{
-				IOPCIAddressSpace space;
-				space.bits                   = 0;
-				space.es.busNum              = params->address.pci.bus;
-				space.es.deviceNum           = params->address.pci.device;
-				space.es.functionNum         = params->address.pci.function;
-				space.es.registerNumExtended = (0xF & (params->address.pci.offset >> 8));
-				switch (params->bitWidth)
-				{
-					case 8:
-						params->value = owner->configRead8(space, params->address.pci.offset);
-						ret = kIOReturnSuccess;
-						break;
-					case 16:
-						params->value = owner->configRead16(space, params->address.pci.offset);
-						ret = kIOReturnSuccess;
-						break;
-					case 32:
-						params->value = owner->configRead32(space, params->address.pci.offset);
-						ret = kIOReturnSuccess;
-						break;
-					default:
-						break;
-				}
+				case 8:
+					params->value = owner->configRead8(space, params->address.pci.offset);
+					ret = kIOReturnSuccess;
+					break;
+				case 16:
+					params->value = owner->configRead16(space, params->address.pci.offset);
+					ret = kIOReturnSuccess;
+					break;
+				case 32:
+					params->value = owner->configRead32(space, params->address.pci.offset);
+					ret = kIOReturnSuccess;
+					break;
+				default:
+					break;
 			}
-			break;
+		}
+	}
 
-        default:
-            break;
+    return (ret);
+}
+
+// IOPCIDiagnosticsParameters[] from the struct input or its descriptor, run in order until one
+// fails. The output gets the operations that completed with read values filled in, or is omitted.
+IOReturn IOPCIDiagnosticsClient::accessVector(IOExternalMethodArguments * args)
+{
+    IOPCIDiagnosticsParameters * ops;
+    IOMemoryDescriptor         * in;
+    IOMemoryDescriptor         * out;
+    IOReturn                     ret;
+    IOByteCount                  outSize;
+    uint32_t                     size, count, idx;
+
+    in  = args->structureInputDescriptor;
+    out = args->structureOutputDescriptor;
+    size = in ? static_cast<uint32_t>(min(in->getLength(), (IOByteCount) UINT32_MAX)) : args->structureInputSize;
+    if (!size || (size % sizeof(IOPCIDiagnosticsParameters)))           return (kIOReturnBadArgument);
+    count = size / sizeof(IOPCIDiagnosticsParameters);
+    if (count > kIOPCIDiagnosticsMaxVector)                              return (kIOReturnBadArgument);
+    outSize = out ? out->getLength() : args->structureOutputSize;
+    if (outSize && (outSize < size))                                     return (kIOReturnNoSpace);
+
+    if (!(ops = (typeof(ops)) IOMallocData(size))) return (kIOReturnNoMemory);
+    ret = kIOReturnSuccess;
+    if (!in) bcopy(args->structureInput, ops, size);
+    else if (kIOReturnSuccess == (ret = in->prepare()))
+    {
+        if (size != in->readBytes(0, ops, size)) ret = kIOReturnVMError;
+        in->complete();
+    }
+
+    for (idx = 0; (kIOReturnSuccess == ret) && (idx < count); idx++)
+    {
+        ret = access(&ops[idx], (0 != (kIOPCIDiagnosticsOptionWrite & ops[idx].options)));
+        if (kIOReturnSuccess != ret) break;
+    }
+
+    size = idx * sizeof(IOPCIDiagnosticsParameters);
+    if (out && outSize)
+    {
+        if (kIOReturnSuccess == out->prepare())
+        {
+            out->writeBytes(0, ops, size);
+            out->complete();
+            args->structureOutputDescriptorSize = size;
+        }
+        else if (kIOReturnSuccess == ret) ret = kIOReturnVMError;
+    }
+    else if (outSize)
+    {
+        bcopy(ops, args->structureOutput, size);
+        args->structureOutputSize = size;
     }
+    IOFreeData(ops, count * sizeof(IOPCIDiagnosticsParameters));
 
-    if (map) map->release();
+    return (ret);
+}
+
+// params->value bytes from params->address in params->bitWidth accesses, into the struct output
+// or its descriptor. Config space reads stay within the function's 4K.
+IOReturn IOPCIDiagnosticsClient::blockRead(IOExternalMethodArguments * args)
+{
+    IOPCIDiagnosticsParameters   params;
+    IOPCIAddressSpace            space;
+    IOMemoryDescriptor         * md;
+    IOReturn                     ret;
+    uint8_t                    * buffer;
+    void                       * vmaddr;
+    uint64_t                     value;
+    uint32_t                     length, width, offset, reg;
+
+    if (args->structureInputSize != sizeof(IOPCIDiagnosticsParameters)) return (kIOReturnBadArgument);
+    bcopy(args->structureInput, &params, sizeof(params));
+
+    width = params.bitWidth >> 3;
+    if ((1 != width) && (2 != width) && (4 != width) && (8 != width))   return (kIOReturnBadArgument);
+    if (!params.value || (params.value > kIOPCIDiagnosticsMaxBlockRead)
+     || (params.value & (width - 1)))                                   return (kIOReturnBadArgument);
+    length = static_cast<uint32_t>(params.value);
+
+    if (kIOPCIConfigSpace == params.spaceType)
+    {
+        if ((width > 4)
+         || (params.address.pci.offset & (width - 1))
+         || ((params.address.pci.offset + length) > 4096))              return (kIOReturnBadArgument);
+    }
+    else if (kIOPCI64BitMemorySpace != params.spaceType)                return (kIOReturnBadArgument);
+
+    md = args->structureOutputDescriptor;
+    if (md ? (md->getLength() < length) : (args->structureOutputSize < length)) return (kIOReturnNoSpace);
+    if (!md) buffer = (uint8_t *) args->structureOutput;
+    else if (!(buffer = (uint8_t *) IOMallocData(length)))              return (kIOReturnNoMemory);
+
+    ret   = kIOReturnSuccess;
+    value = 0;
+    if (kIOPCI64BitMemorySpace == params.spaceType)
+    {
+        IOLockLock(_mapLock);
+        if (!(vmaddr = mapRange(params.address.addr64, length))) ret = kIOReturnVMError;
+        else for (offset = 0; offset < length; offset += width)
+        {
+            switch (width)
+            {
+                case 1:  value = *((volatile uint8_t *)  ((uintptr_t) vmaddr + offset)); break;
+                case 2:  value = *((volatile uint16_t *) ((uintptr_t) vmaddr + offset)); break;
+                case 4:  value = *((volatile uint32_t *) ((uintptr_t) vmaddr + offset)); break;
+                case 8:  value = *((volatile uint64_t *) ((uintptr_t) vmaddr + offset)); break;
+            }
+            bcopy(&value, buffer + offset, width);
+        }
+        IOLockUnlock(_mapLock);
+    }
+    else
+    {
+        space.bits           = 0;
+        space.es.busNum      = params.address.pci.bus;
+        space.es.deviceNum   = params.address.pci.device;
+        space.es.functionNum = params.address.pci.function;
+        for (offset = 0; offset < length; offset += width)
+        {
+            reg = params.address.pci.offset + offset;
+            space.es.registerNumExtended = (0xF & (reg >> 8));
+            switch (width)
+            {
+                case 1:  value = owner->configRead8(space, reg);  break;
+                case 2:  value = owner->configRead16(space, reg); break;
+                case 4:  value = owner->configRead32(space, reg); break;
+            }
+            bcopy(&value, buffer + offset, width);
+        }
+    }
+
+    if (!md)
+    {
+        if (kIOReturnSuccess == ret) args->structureOutputSize = length;
+        return (ret);
+    }
+    if (kIOReturnSuccess == ret)
+    {
+        if (kIOReturnSuccess == (ret = md->prepare()))
+        {
+            md->writeBytes(0, buffer, length);
+            md->complete();
+            args->structureOutputDescriptorSize = length;
+        }
+    }
+    IOFreeData(buffer, length);
+
+    return (ret);
+}
+
+// msistats.h blob, kIOReturnNoSpace with the header's length set if it does not fit
+IOReturn IOPCIDiagnosticsClient::copyInterruptStatistics(IOExternalMethodArguments * args)
+{
+    IOPCIMessagedInterruptController * controller;
+    IOMemoryDescriptor               * md;
+    IOReturn                           ret;
+    void                             * buffer;
+    uint32_t                           length, size;
+
+    if (!(controller = owner->reserved->messagedInterruptController))
+    {
+        owner->callPlatformFunction(gIOPlatformGetMessagedInterruptControllerKey, false,
+                                    (void *) owner->getProvider(), (void *) &controller,
+                                    (void *) 0, (void *) 0);
+    }
+    if (!controller) return (kIOReturnUnsupported);
+
+    if (!(md = args->structureOutputDescriptor))
+    {
+        length = args->structureOutputSize;
+        ret = controller->copyStatistics(args->structureOutput, &length);
+        args->structureOutputSize = min(length, args->structureOutputSize);
+        return (ret);
+    }
+
+    // no larger than the statistics are now, whatever the caller's buffer
+    length = 0;
+    controller->copyStatistics(NULL, &length);
+    size = static_cast<uint32_t>(min(md->getLength(), (IOByteCount) length));
+    if (!size) return (kIOReturnBadArgument);
+    if (!(buffer = IOMallocData(size))) return (kIOReturnNoMemory);
+    length = size;
+    ret = controller->copyStatistics(buffer, &length);
+    length = min(length, size);
+    if (kIOReturnSuccess == md->prepare())
+    {
+        md->writeBytes(0, buffer, length);
+        md->complete();
+        args->structureOutputDescriptorSize = length;
+    }
+    else ret = kIOReturnVMError;
+    IOFreeData(buffer, size);
 
     return (ret);
 }
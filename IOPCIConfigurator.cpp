@@ -638,6 +638,8 @@ IOReturn CLASS::addHostBridge(IOPCIHostBridge * hostBridge)
         fFlags &= ~kIOPCIConfiguratorPFM64;
     DLOG("root id 0x%x, flags 0x%x\n", fRootVendorProduct, (int) fFlags);
 
+    if (kIOPCIConfiguratorWarmBoot & fFlags) warmBootLoadSnapshot(bridge);
+
     range = IOPCIRangeAlloc();
     start = bridge->secBusNum;
     size  = bridge->subBusNum - bridge->secBusNum + 1;
@@ -708,6 +710,237 @@ IOReturn CLASS::addHostBridge(IOPCIHostBridge * hostBridge)
     return (kIOReturnSuccess);
 }
 
+//---------------------------------------------------------------------------
+
+// The snapshot lives in the NVRAM variable pci-topology-snapshot-<space>,
+// one per host bridge. Host bridges start before NVRAM on some platforms,
+// so the booter may copy it to the host bridge's provider instead.
+static void IOPCITopologyNVRAMKey(IOPCIConfigEntry * hostBridge, char * key, size_t size)
+{
+    snprintf(key, size, "%s-%08x", kIOPCITopologySnapshotKey, hostBridge->space.bits);
+}
+
+static OSData * IOPCITopologyCopyNVRAM(IOPCIConfigEntry * hostBridge)
+{
+    IORegistryEntry * options;
+    OSObject *        obj;
+    OSData *          snapshot = NULL;
+    char              key[64];
+
+    if (!(options = IORegistryEntry::fromPath("/options", gIODTPlane))) return (NULL);
+    IOPCITopologyNVRAMKey(hostBridge, key, sizeof(key));
+    if ((obj = options->copyProperty(key)))
+    {
+        if ((snapshot = OSDynamicCast(OSData, obj))) snapshot->retain();
+        obj->release();
+    }
+    options->release();
+
+    return (snapshot);
+}
+
+static const IOPCITopologyBar * IOPCITopologyBars(const IOPCITopologyRecord * record)
+{
+    return ((const IOPCITopologyBar *) (record + 1));
+}
+
+static const IOPCITopologyRecord * IOPCITopologyNextRecord(const IOPCITopologyRecord * record)
+{
+    return ((const IOPCITopologyRecord *) (IOPCITopologyBars(record) + __builtin_popcount(record->barMask)));
+}
+
+void CLASS::warmBootLoadSnapshot(IOPCIConfigEntry * hostBridge)
+{
+    OSData *                    snapshot;
+    const IOPCITopologyHeader * header;
+    const IOPCITopologyRecord * record;
+    const uint8_t *             end;
+    uint32_t                    idx;
+
+    snapshot = OSDynamicCast(OSData, hostBridge->dtNub->getProperty(kIOPCITopologySnapshotKey));
+    if (snapshot) snapshot->retain();
+    else          snapshot = IOPCITopologyCopyNVRAM(hostBridge);
+    if (!snapshot) return;
+
+    header = (const IOPCITopologyHeader *) snapshot->getBytesNoCopy();
+    end    = ((const uint8_t *) header) + snapshot->getLength();
+    record = (const IOPCITopologyRecord *) (header + 1);
+    if ((snapshot->getLength() >= sizeof(*header))
+     && (kIOPCITopologySignature == header->signature)
+     && (kIOPCITopologyVersion == header->version)
+     && (sizeof(IOPCITopologyRecord) == header->recordSize)
+     && (fRootVendorProduct == header->rootVendorProduct))
+    {
+        // records are variable length, so check they all fit before matching walks them
+        for (idx = 0; idx < header->count; idx++)
+        {
+            if (((const uint8_t *) (record + 1)) > end)                   break;
+            if (record->barMask & ~((1 << (kIOPCIRangeExpansionROM + 1)) - 1)) break;
+            record = IOPCITopologyNextRecord(record);
+            if (((const uint8_t *) record) > end)                         break;
+        }
+    }
+    else idx = 0;
+    if (!idx || (idx != header->count))
+    {
+        DLOG("host bridge " B() " ignoring snapshot\n", BRIDGE_IDENT(hostBridge));
+        snapshot->release();
+        return;
+    }
+
+    hostBridge->warmSnapshot = snapshot;
+    DLOG("host bridge " B() " snapshot of %d functions\n", BRIDGE_IDENT(hostBridge), header->count);
+}
+
+// A function reuses its record only if everything above it did, so a
+// mismatch anywhere falls back to a full probe for that whole subtree.
+const IOPCITopologyRecord * CLASS::warmBootMatch(IOPCIConfigEntry * bridge, IOPCIConfigEntry * child)
+{
+    OSData *                    snapshot;
+    const IOPCITopologyHeader * header;
+    const IOPCITopologyRecord * record;
+    uint32_t                    idx;
+
+    if (!(snapshot = child->hostBridgeEntry->warmSnapshot)) return (NULL);
+    if (!bridge->isHostBridge && !bridge->warm)            return (NULL);
+
+    header = (const IOPCITopologyHeader *) snapshot->getBytesNoCopy();
+    record = (const IOPCITopologyRecord *) (header + 1);
+    for (idx = 0; idx < header->count; idx++, record = IOPCITopologyNextRecord(record))
+    {
+        if (record->space != child->space.bits) continue;
+        if ((record->vendorProduct != child->vendorProduct)
+         || (record->classCode != ((child->classCode << 8) | child->revisionID))
+         || (record->subsystem != child->subsystem)
+         || (record->headerType != child->headerType))
+        {
+            break;
+        }
+        fWarmFunctions++;
+        return (record);
+    }
+    DLOG("  no snapshot match for " D() "\n", DEVICE_IDENT(child));
+
+    return (NULL);
+}
+
+uint32_t CLASS::warmBootRecord(IOPCIConfigEntry * bridge, OSData * records)
+{
+    IOPCITopologyRecord record;
+    IOPCITopologyBar    bars[kIOPCIRangeExpansionROM + 1];
+    IOPCIRange *        range;
+    uint32_t            count = 0, barCount;
+
+    FOREACH_CHILD(bridge, child)
+    {
+        if (kPCIDeviceStateDeadOrHidden & child->deviceState) continue;
+
+        bzero(&record, sizeof(record));
+        record.space         = child->space.bits;
+        record.vendorProduct = child->vendorProduct;
+        record.classCode     = (child->classCode << 8) | child->revisionID;
+        record.subsystem     = child->subsystem;
+        record.headerType    = child->headerType;
+        record.bar64Mask     = child->bar64Mask;
+        barCount = 0;
+        // bridge windows are sized again every boot, only BARs are recorded
+        for (int barNum = 0; barNum <= kIOPCIRangeExpansionROM; barNum++)
+        {
+            if (!(range = child->ranges[barNum])) continue;
+            if (!range->totalSize || (range->totalSize & (range->totalSize - 1)))
+            {
+                // not a size a BAR decodes, never matched
+                record.vendorProduct = 0xFFFFFFFF;
+                continue;
+            }
+            record.barMask |= (1 << barNum);
+            bzero(&bars[barCount], sizeof(bars[barCount]));
+            bars[barCount].startLow  = (uint32_t) range->start;
+            bars[barCount].startHigh = (uint32_t) (range->start >> 32);
+            bars[barCount].type      = range->type;
+            bars[barCount].sizeShift = __builtin_ctzll(range->totalSize);
+            if (kIOPCIRangeFlagBar64 & range->flags) record.clean64Mask |= (1 << barNum);
+            barCount++;
+        }
+        records->appendBytes(&record, sizeof(record));
+        records->appendBytes(&bars[0], barCount * sizeof(bars[0]));
+        count++;
+
+        if (child->isBridge) count += warmBootRecord(child, records);
+    }
+
+    return (count);
+}
+
+void CLASS::warmBootSaveSnapshot(void)
+{
+    IOPCITopologyHeader header;
+    IORegistryEntry *   options;
+    OSData *            records;
+    OSData *            snapshot;
+    OSData *            saved;
+    char                key[64];
+
+    options = IORegistryEntry::fromPath("/options", gIODTPlane);
+    FOREACH_CHILD(fRoot, hostBridge)
+    {
+        if (!hostBridge->isHostBridge) continue;
+        if (!(records = OSData::withCapacity(kIOPCITopologyMaxNVRAMSize))) continue;
+
+        bzero(&header, sizeof(header));
+        header.signature         = kIOPCITopologySignature;
+        header.version           = kIOPCITopologyVersion;
+        header.recordSize        = sizeof(IOPCITopologyRecord);
+        header.rootVendorProduct = fRootVendorProduct;
+        header.count             = warmBootRecord(hostBridge, records);
+
+        if ((snapshot = OSData::withBytes(&header, sizeof(header))))
+        {
+            snapshot->appendBytes(records);
+            hostBridge->hostBridge->setProperty(kIOPCITopologySnapshotKey, snapshot);
+            if (options)
+            {
+                // rewritten only when the configuration changed, to spare the flash
+                IOPCITopologyNVRAMKey(hostBridge, key, sizeof(key));
+                saved = IOPCITopologyCopyNVRAM(hostBridge);
+                if (snapshot->getLength() > kIOPCITopologyMaxNVRAMSize)
+                {
+                    DLOG("host bridge " B() " snapshot of %d bytes not saved\n",
+                         BRIDGE_IDENT(hostBridge), snapshot->getLength());
+                    if (saved) options->removeProperty(key);
+                }
+                else if (!saved || !saved->isEqualTo(snapshot))
+                {
+                    options->setProperty(key, snapshot);
+                }
+                OSSafeReleaseNULL(saved);
+            }
+            snapshot->release();
+        }
+        records->release();
+    }
+    OSSafeReleaseNULL(options);
+}
+
+// warm boot is off, don't leave a stale snapshot in NVRAM for when it is back on
+void CLASS::warmBootRemoveSnapshot(void)
+{
+    IORegistryEntry * options;
+    OSData *          saved;
+    char              key[64];
+
+    if (!(options = IORegistryEntry::fromPath("/options", gIODTPlane))) return;
+    FOREACH_CHILD(fRoot, hostBridge)
+    {
+        if (!hostBridge->isHostBridge) continue;
+        if (!(saved = IOPCITopologyCopyNVRAM(hostBridge))) continue;
+        IOPCITopologyNVRAMKey(hostBridge, key, sizeof(key));
+        options->removeProperty(key);
+        saved->release();
+    }
+    options->release();
+}
+
 void CLASS::free( void )
 {
     super::free();
@@ -2085,6 +2318,8 @@ void CLASS::deleteConfigEntry(IOPCIConfigEntry *entry)
 		else
 			fDeviceCount--;
 
+		OSSafeReleaseNULL(entry->warmSnapshot);
+
 		if (   (entry->dtNub != NULL)
 			&& (entry->dtNub->inPlane(gIOServicePlane) == false))
 		{
@@ -2335,8 +2570,16 @@ IOPCIConfigEntry* CLASS::bridgeProbeChild( IOPCIConfigEntry * bridge, IOPCIAddre
     child->hostBridge      = bridge->hostBridge;
     child->hostBridgeEntry = bridge->hostBridgeEntry;
     child->headerType      = configRead8(child, kIOPCIConfigHeaderType) & 0x7f;
-    child->classCode       = configRead32(child, kIOPCIConfigRevisionID) >> 8;
+    child->classCode       = configRead32(child, kIOPCIConfigRevisionID);
+    child->revisionID      = child->classCode & 0xff;
+    child->classCode     >>= 8;
     child->vendorProduct   = vendorProduct;
+    if (kIOPCIConfiguratorWarmBoot & fFlags)
+    {
+        if (kPCIHeaderType0 == child->headerType)
+            child->subsystem = configRead32(child, kIOPCIConfigSubSystemVendorID);
+        child->warm = warmBootMatch(bridge, child);
+    }
 
     if (bridge->isHostBridge)
     {
@@ -2620,6 +2863,9 @@ void CLASS::safeProbeBaseAddressRegister(IOPCIConfigEntry * device,
     uint32_t barNum;
     lastBarNum = min(lastBarNum, kIOPCIRangeExpansionROM);
 
+    // sizes from the snapshot need no BAR writes, so no rendezvous
+    if (device->warm && warmProbeBaseAddressRegister(device, lastBarNum, resetMask)) return;
+
     for (barNum = 0; barNum <= lastBarNum; barNum++)
     {
         device->ranges[barNum] = IOPCIRangeAlloc();
@@ -2749,6 +2995,7 @@ void CLASS::probeBaseAddressRegister(IOPCIConfigEntry * device, uint32_t lastBar
                     break;
 
                 case 4: /* 64-bit mem */
+                    device->bar64Mask |= (1 << barNum);
                     clean64 = ((kIOPCIResourceTypePrefetchMemory == type) || (0 == device->space.s.busNum));
                     if (!clean64) configWrite32(device, barOffset + 4, 0);
                     else
@@ -2804,6 +3051,124 @@ void CLASS::probeBaseAddressRegister(IOPCIConfigEntry * device, uint32_t lastBar
 
 //---------------------------------------------------------------------------
 
+// Size BARs from the snapshot record of the function. Each recorded BAR is
+// read once to check it still decodes the recorded type at an address aligned
+// to the recorded size, and to keep the assigned address as
+// probeBaseAddressRegister() would; if the subtree is being reset the previous
+// placement is proposed instead. Anything that doesn't fit falls back to a full probe.
+bool CLASS::warmProbeBaseAddressRegister(IOPCIConfigEntry * device, uint32_t lastBarNum, uint32_t resetMask)
+{
+    const IOPCITopologyRecord * warm = device->warm;
+    const IOPCITopologyBar *    bars[kIOPCIRangeExpansionROM + 1];
+    const IOPCITopologyBar *    bar;
+    IOPCIRange *    range;
+    uint64_t        saved[kIOPCIRangeExpansionROM + 1];
+    uint64_t        start, size, barMask;
+    uint32_t        barNum, value, type, minShift, maxShift, upperMask = 0;
+    uint16_t        command;
+    uint8_t         barOffset;
+
+    bar = IOPCITopologyBars(warm);
+    for (barNum = 0; barNum <= kIOPCIRangeExpansionROM; barNum++)
+    {
+        bars[barNum] = ((1 << barNum) & warm->barMask) ? bar++ : NULL;
+    }
+
+    for (barNum = 0; barNum <= lastBarNum; barNum++)
+    {
+        saved[barNum] = 0;
+        if (!(bar = bars[barNum])) continue;
+
+        if (kIOPCIRangeExpansionROM == barNum)
+        {
+            barOffset = kIOPCIConfigExpansionROMBase;
+            value     = configRead32(device, barOffset);
+            type      = kIOPCIResourceTypeMemory;
+            barMask   = 0x7FF;
+            minShift  = 11;
+        }
+        else
+        {
+            barOffset = kIOPCIConfigBaseAddress0 + barNum * 4;
+            value     = configRead32(device, barOffset);
+            if (value & 1)                              type = kIOPCIResourceTypeIO;
+            else if ((4 == (value & 6)) && (value & 8)) type = kIOPCIResourceTypePrefetchMemory;
+            else                                        type = kIOPCIResourceTypeMemory;
+            barMask   = (kIOPCIResourceTypeIO == type) ? 0x3 : 0xf;
+            minShift  = (kIOPCIResourceTypeIO == type) ? 2 : 4;
+        }
+        maxShift = ((1 << barNum) & warm->clean64Mask) ? 40 : 32;
+
+        if ((0xFFFFFFFF == value)
+         || (type != bar->type)
+         || ((kIOPCIRangeExpansionROM != barNum)
+          && ((4 == (value & 7)) != (0 != ((1 << barNum) & warm->bar64Mask))))
+         || (bar->sizeShift < minShift)
+         || (bar->sizeShift > maxShift))
+        {
+            DLOG("  [0x%x] 0x%x doesn't match snapshot, probing " D() "\n", barOffset, value, DEVICE_IDENT(device));
+            device->warm = NULL;
+            return (false);
+        }
+
+        saved[barNum] = value;
+        if ((1 << barNum) & warm->clean64Mask)
+            saved[barNum] |= (((uint64_t) configRead32(device, barOffset + 4)) << 32);
+        else if ((1 << barNum) & warm->bar64Mask)
+            upperMask |= (1 << barNum);
+
+        // the BAR hardwires the low address bits of its real size
+        if ((saved[barNum] & ~barMask) & ((1ULL << bar->sizeShift) - 1))
+        {
+            DLOG("  [0x%x] 0x%llx not aligned to snapshot size 0x%llx, probing " D() "\n",
+                 barOffset, saved[barNum], 1ULL << bar->sizeShift, DEVICE_IDENT(device));
+            device->warm = NULL;
+            return (false);
+        }
+    }
+
+    // probeBaseAddressRegister() places these below 4G
+    if (upperMask)
+    {
+        command = disableAccess(device, true);
+        for (barNum = 0; barNum <= lastBarNum; barNum++)
+        {
+            if ((1 << barNum) & upperMask)
+                configWrite32(device, kIOPCIConfigBaseAddress0 + barNum * 4 + 4, 0);
+        }
+        restoreAccess(device, command);
+    }
+
+    for (barNum = 0; barNum <= lastBarNum; barNum++)
+    {
+        if (!(bar = bars[barNum])) continue;
+
+        type = bar->type;
+        size = (1ULL << bar->sizeShift);
+        if (kIOPCIRangeExpansionROM == barNum)   barMask = 0x7FF;
+        else if (kIOPCIResourceTypeIO == type)   barMask = 0x3;
+        else                                     barMask = 0xf;
+        start = (resetMask & (1 << type))
+              ? ((((uint64_t) bar->startHigh) << 32) | bar->startLow)
+              : (saved[barNum] & ~barMask);
+
+        range = IOPCIRangeAlloc();
+        IOPCIRangeInit(range, type, start, size, size);
+        if (kIOPCIRangeExpansionROM != barNum) range->minAddress = minBARAddressDefault[type];
+        if ((1 << barNum) & warm->clean64Mask)
+        {
+            range->flags |= kIOPCIRangeFlagBar64;
+            if (kIOPCIConfiguratorPFM64 & fFlags) range->maxAddress = 0xFFFFFFFFFFFFFFFFULL;
+        }
+        device->ranges[barNum] = range;
+    }
+    device->bar64Mask = warm->bar64Mask;
+
+    return (true);
+}
+
+//---------------------------------------------------------------------------
+
 void CLASS::deviceProbeRanges( IOPCIConfigEntry * device, uint32_t resetMask )
 {
     uint32_t     idx;
@@ -3383,6 +3748,15 @@ void CLASS::configure(uint32_t options)
 
 	fFlags &= ~options;
 
+    if (kIOPCIConfiguratorWarmBoot & fFlags)
+    {
+        // the next boot reuses this configuration's sizing and placement
+        warmBootSaveSnapshot();
+        if (bootConfig) IOLog("[ PCI configuration reused snapshot for %d functions ]\n", fWarmFunctions);
+        fWarmFunctions = 0;
+    }
+    else if (bootConfig) warmBootRemoveSnapshot();
+
     fResetStartTime = 0;
     fResetWaitTime = 0;
     if (bootConfig) IOLog("[ PCI configuration end, bridges %d, devices %d ]\n", fBridgeCount, fDeviceCount);
@@ -4011,10 +4385,18 @@ int32_t CLASS::bridgeAllocateResources(IOPCIConfigEntry * bridge, uint32_t typeM
     if ((failTypes && !(bridge->rangeRequestChanges & typeMask)) || (kIOPCIConfiguratorForcePause & fFlags))
     {
 		bool artificialPause = !(failTypes && !(bridge->rangeRequestChanges & typeMask));
+		IOPCIConfigEntry * plan[kIOPCIPausePlanMax];
+		uint32_t           planCount = 0;
+		bool               planned   = false;
 
 		if (!artificialPause)
 		{
 			result = true;
+			if (kIOPCIConfiguratorUsePause & fFlags)
+			{
+				planCount = arrayCount(plan);
+				planned   = bridgePlanPause(bridge, failTypes, shortage, shortageAlignments, plan, &planCount);
+			}
 		}
 
 		FOREACH_CHILD(bridge, child)
@@ -4032,12 +4414,13 @@ int32_t CLASS::bridgeAllocateResources(IOPCIConfigEntry * bridge, uint32_t typeM
 			if (!(kIOPCIConfiguratorUsePause & fFlags))   				  continue;
 			// no pause for i/o
 			if ((1 << kIOPCIResourceTypeIO) == failTypes) 				  continue;
-			if ((kPCIDeviceStateRequestPause | kPCIDeviceStatePaused) 
-				& child->deviceState) 				    				  continue;
-			if ((kPCIHPTypeMask & child->supportsHotPlug) < kPCIHotPlug)  continue;
-			if (!child->dtNub || !child->dtNub->inPlane(gIOServicePlane)) continue;
-			if (treeInState(child, 
-				kPCIDeviceStatePaused, kPCIDeviceStatePaused))            continue;
+			if (!canPause(child))                                         continue;
+			if (planned)
+			{
+				uint32_t idx;
+				for (idx = 0; (idx < planCount) && (plan[idx] != child); idx++) {}
+				if (idx == planCount)                                     continue;
+			}
 
 			DLOG_A("Request pause (due to resource limit) for " D() "\n", DEVICE_IDENT(child));
 			child->deviceState |= kPCIDeviceStateRequestPause;
@@ -4064,6 +4447,120 @@ int32_t CLASS::bridgeAllocateResources(IOPCIConfigEntry * bridge, uint32_t typeM
 
 //---------------------------------------------------------------------------
 
+bool CLASS::canPause(IOPCIConfigEntry * child)
+{
+	if ((kPCIDeviceStateRequestPause | kPCIDeviceStatePaused) 
+		& child->deviceState) 				    				  return (false);
+	if ((kPCIHPTypeMask & child->supportsHotPlug) < kPCIHotPlug)  return (false);
+	if (!child->dtNub || !child->dtNub->inPlane(gIOServicePlane)) return (false);
+	if (treeInState(child, 
+		kPCIDeviceStatePaused, kPCIDeviceStatePaused))            return (false);
+
+	return (true);
+}
+
+// Devices a move of range would interrupt: none if its owner can already be relocated,
+// the owner and everything below it if it has to be paused first.
+IOPCIScalar CLASS::pausePlanCost(void * ref, IOPCIRange * range)
+{
+	CLASS *            self  = (CLASS *) ref;
+	IOPCIConfigEntry * child = range->device;
+	IOPCIConfigEntry * next;
+	IOPCIScalar        cost;
+
+	if (!child || (kIOPCIRangeFlagPermanent & range->flags))      return (kIOPCIRangePlanImmovable);
+	if (kPCIDeviceStateDead & child->deviceState)                 return (kIOPCIRangePlanImmovable);
+	if (kIOPCIRangeFlagRelocatable & range->flags)                return (0);
+	if (!(kPCIDeviceStateAttached & child->deviceState))          return (0);
+	if ((kPCIDeviceStateRequestPause | kPCIDeviceStatePaused) 
+		& child->deviceState)                                     return (0);
+	if (!self->canPause(child))                                   return (kIOPCIRangePlanImmovable);
+
+	cost = 1;
+	for (next = child->child; next; )
+	{
+		cost++;
+		if (next->child) next = next->child;
+		else
+		{
+			while (!next->peer && (next->parent != child)) next = next->parent;
+			next = next->peer;
+		}
+	}
+
+	return (cost);
+}
+
+// The fewest children whose ranges have to move to cover the shortage, or false to
+// pause every candidate as before.
+bool CLASS::bridgePlanPause(IOPCIConfigEntry * bridge, uint32_t failTypes,
+							IOPCIScalar * shortage, IOPCIScalar * shortageAlignments,
+							IOPCIConfigEntry ** plan, uint32_t * planCount)
+{
+	IOPCIRange * moves[kIOPCIPausePlanMax];
+	IOPCIRange * range;
+	IOPCIDevice * nub;
+	IOPCIScalar  moved, cost;
+	uint64_t     delayNS, maxDelayNS;
+	uint32_t     type, count, idx, planned, pauses, candidates;
+
+	planned = 0;
+	moved   = 0;
+	for (type = 0; type < kIOPCIResourceTypeCount; type++)
+	{
+		if (!((1 << type) & failTypes))             continue;
+		if (kIOPCIResourceTypeIO == type)           continue;
+		if (!shortage[type])                        continue;
+		range = bridgeGetRange(bridge, type);
+		if (!range)                                 return (false);
+
+		count = arrayCount(moves);
+		if (!IOPCIRangeListPlanHole(range, shortage[type], shortageAlignments[type],
+									&pausePlanCost, this, moves, &count, &cost))
+		{
+			DLOG_A("  %s: no pause plan for 0x%llx\n", gPCIResourceTypeName[type], shortage[type]);
+			return (false);
+		}
+		for (idx = 0; idx < count; idx++)
+		{
+			uint32_t dup;
+
+			moved += moves[idx]->size;
+			if (!moves[idx]->device)                            continue;
+			for (dup = 0; (dup < planned) && (plan[dup] != moves[idx]->device); dup++) {}
+			if (dup < planned)                                  continue;
+			if (planned == *planCount)                          return (false);
+			plan[planned++] = moves[idx]->device;
+		}
+	}
+	*planCount = planned;
+
+	// pauses go out together, the interruption is set by the slowest nub to settle
+	candidates = 0;
+	pauses     = 0;
+	maxDelayNS = 0;
+	FOREACH_CHILD(bridge, child)
+	{
+		if (canPause(child)) candidates++;
+	}
+	for (idx = 0; idx < planned; idx++)
+	{
+		if (!canPause(plan[idx]))                                       continue;
+		pauses++;
+		if (!(nub = OSDynamicCast(IOPCIDevice, plan[idx]->dtNub)))      continue;
+		delayNS = nub->pauseDelayNS();
+		if (delayNS > maxDelayNS) maxDelayNS = delayNS;
+	}
+	// nothing to pause means the allocator failed for some other reason, don't guess
+	if (!pauses) return (false);
+	DLOG_A("Pause plan for " B() ": %d of %d children, 0x%llx moved, expected wait %lld ms\n",
+		   BRIDGE_IDENT(bridge), pauses, candidates, moved, maxDelayNS / NSEC_PER_MSEC);
+
+	return (true);
+}
+
+//---------------------------------------------------------------------------
+
 uint16_t CLASS::disableAccess(IOPCIConfigEntry * device, bool disable)
 {
     uint16_t  command;
@@ -208,6 +208,12 @@ bool IOPCIDevice::attach( IOService * provider )
 {
     if (!super::attach(provider)) return (false);
 
+	// IOPCIBridge::setInReset() only reaches attached children
+	if (parent && parent->reserved->childrenInReset)
+	{
+		IOPCIConfigAccessUpdate(&reserved->configAccessState, 0, kIOPCIConfigAccessInReset);
+	}
+
 #if ACPI_SUPPORT
 	IOACPIPlatformDevice * device;
 	uint32_t               idx;
@@ -464,6 +470,8 @@ IOPCIDevice::initReserved(void)
             return (false);
 		reserved->lock = IORecursiveLockAlloc();
 		reserved->expressMaxReadRequestSize = -1;
+		queue_init(&reserved->eventSourceQueue);
+		reserved->eventSourceLock = IORecursiveLockAlloc();
     }
     return (true);
 }
@@ -502,6 +510,8 @@ void IOPCIDevice::free()
 	{
 		if (reserved->lock)
 			IORecursiveLockFree(reserved->lock);
+		if (reserved->eventSourceLock)
+			IORecursiveLockFree(reserved->eventSourceLock);
 		OSSafeReleaseNULL(reserved->republishTimer);
 		OSSafeReleaseNULL(reserved->capDict);
 		OSSafeReleaseNULL(reserved->pauseTimer);
@@ -708,10 +718,16 @@ IOReturn IOPCIDevice::setPCIPowerState(uint8_t powerState, uint32_t options)
 				}
 				break;
 		}
+		invalidateProperties();
 	}
 
 	if (kIOPCIDeviceOnState == powerState)
     {
+        // matching was refused while unpowered or paused, retry it now
+        if (atomic_load((atomic_char*)&reserved->publishPending) && reserved->republishTimer)
+        {
+            reserved->republishTimer->setTimeoutUS(0);
+        }
         if (reserved->pmeUpdate && !(kMachineRestoreDehibernate & options))
         {
             reserved->pmeUpdate = false;
@@ -968,44 +984,48 @@ void IOPCIDevice::resetNubState(void)
 	reserved->clientCrashed = false;
 }
 
-#define REPUBLISH_TIMER_DURATION_MS 100
-#define PUBLISH_MAX_RETRY_ATTEMPTS 100
+// How long a nub that isn't powered may wait for power before matching gives up.
+// Time spent paused doesn't count.
+#define PUBLISH_TIMEOUT_MS 10000
 
+void IOPCIDevice::armPublishDeadline(void)
+{
+	clock_interval_to_deadline(PUBLISH_TIMEOUT_MS, kMillisecondScale, &reserved->publishDeadline);
+	reserved->republishTimer->wakeAtTime(reserved->publishDeadline);
+}
+
+// Runs when the nub reaches kIOPCIDeviceOnState with a publish pending, or at the deadline
 void IOPCIDevice::republishTimerHandler(IOTimerEventSource * es)
 {
 	uint8_t pciPMState = atomic_load((atomic_char*)&reserved->pciPMState);
     IOPCIHostBridgeData *vars = parent->reserved->hostBridgeData;
 	bool pausing = vars->_waitingPauseSet->containsObject(this);
 
+	if (!atomic_load((atomic_char*)&reserved->publishPending)) return;
+
 	// The nub must be powered, without a pending pause, before matching.
-	if (pciPMState != kIOPCIDeviceOnState || pausing)
+	if (pciPMState == kIOPCIDeviceOnState && !pausing)
 	{
-		// If we've reached the retry attempts limit, add a debug property
-		// and give up.
-		if (reserved->publishRetryCount == PUBLISH_MAX_RETRY_ATTEMPTS)
-		{
-			DLOG(ALWAYS_ON, "[%s()] nub %s did not power on, giving up matching\n", __func__, getName());
-			setProperty(kIOPCIPublishRetryTimeoutKey, kOSBooleanTrue);
-			return;
-		}
-
-		// Otherwise retry
-		DLOG(ALWAYS_ON, "[%s()] nub %s is not powered, retrying matching in %ums\n", __func__, getName(), REPUBLISH_TIMER_DURATION_MS);
-
-		// Time spent paused doesn't count against the retry attempt limit
-		if (!(pciPMState == kIOPCIDevicePausedState || pausing))
-		{
-			reserved->publishRetryCount++;
-		}
+		atomic_store((atomic_char*)&reserved->publishPending, false);
+		registerService();
+		return;
+	}
 
-		reserved->republishTimer->setTimeoutMS(REPUBLISH_TIMER_DURATION_MS);
+	if (pciPMState == kIOPCIDevicePausedState || pausing)
+	{
+		// the unpause powers it back on and kicks the timer
+		DLOG(ALWAYS_ON, "[%s()] nub %s is pausing, matching when it is unpaused\n", __func__, getName());
+		armPublishDeadline();
+	}
+	else if (mach_absolute_time() >= reserved->publishDeadline)
+	{
+		DLOG(ALWAYS_ON, "[%s()] nub %s did not power on, giving up matching\n", __func__, getName());
+		atomic_store((atomic_char*)&reserved->publishPending, false);
+		setProperty(kIOPCIPublishRetryTimeoutKey, kOSBooleanTrue);
 	}
 	else
 	{
-		// The nub is powered; reset the retry counter and publish the nub for matching.
-		reserved->publishRetryCount = 0;
-
-		registerService();
+		reserved->republishTimer->wakeAtTime(reserved->publishDeadline);
 	}
 }
 
@@ -1022,22 +1042,46 @@ bool IOPCIDevice::isInitializing(void)
 	return (getBusyState() > 0 || deltaNS < (NUB_SETTLED_GRACE_PERIOD_S * NSEC_PER_SEC));
 }
 
-#define PAUSE_TIMER_DURATION_MS 100
 void IOPCIDevice::initiatePause(void)
 {
+	uint64_t delayNS;
+
+	// set before looking at the busy state, busyStateChange() arms the timer once it is idle
+	atomic_store((atomic_char*)&reserved->pauseDeferred, true);
 	if (isInitializing()) {
-		DLOG(ENUMERATION, "%s(0x%qx) still initializing, deferring pause\n", getName(), getRegistryEntryID());
-		reserved->pauseTimer->setTimeoutMS(PAUSE_TIMER_DURATION_MS);
+		if (getBusyState() > 0) {
+			DLOG(ENUMERATION, "%s(0x%qx) still initializing, deferring pause until idle\n", getName(), getRegistryEntryID());
+		} else {
+			delayNS = pauseDelayNS();
+			DLOG(ENUMERATION, "%s(0x%qx) still initializing, deferring pause %llums\n", getName(), getRegistryEntryID(), delayNS / NSEC_PER_MSEC);
+			reserved->pauseTimer->setTimeoutUS(static_cast<uint32_t>(delayNS / NSEC_PER_USEC) + 1);
+		}
 	} else {
+		atomic_store((atomic_char*)&reserved->pauseDeferred, false);
 		DLOG(ALWAYS_ON, "configOp:->deferredRequestPause: %s(0x%qx)\n", getName(), getRegistryEntryID());
 		changePowerStateToPriv(kIOPCIDevicePausedState);
 		powerOverrideOnPriv();
 	}
 }
 
+// How long initiatePause() will defer the transition, for planning. A busy nub is
+// assumed to need a whole grace period once it goes idle.
+uint64_t IOPCIDevice::pauseDelayNS(void)
+{
+	uint64_t deltaNS = 0;
+	uint64_t graceNS = NUB_SETTLED_GRACE_PERIOD_S * NSEC_PER_SEC;
+
+	if (getBusyState() > 0) return (graceNS);
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - reserved->busyTimestamp, &deltaNS);
+	if (deltaNS >= graceNS) return (0);
+
+	return (graceNS - deltaNS);
+}
+
 void IOPCIDevice::pauseTimerHandler(IOTimerEventSource * es)
 {
-	initiatePause();
+	if (atomic_load((atomic_char*)&reserved->pauseDeferred)) initiatePause();
 }
 
 // Fires when the nub's busy state becomes busy or non-busy
@@ -1050,6 +1094,12 @@ IOReturn IOPCIDevice::busyStateChange(void * target, void * refCon,
 	if (self) {
 		__DLOG(self->reserved->domainId, LIFE_CYCLE, "[%s()] nub %s(0x%qx) has busy state %u\n", __func__, self->getName(), self->getRegistryEntryID(), self->getBusyState());
 		self->reserved->busyTimestamp = mach_absolute_time();
+
+		// a deferred pause can go once the nub has been idle for the grace period
+		if (atomic_load((atomic_char*)&self->reserved->pauseDeferred)) {
+			if (self->getBusyState() > 0) self->reserved->pauseTimer->cancelTimeout();
+			else self->reserved->pauseTimer->setTimeoutMS(NUB_SETTLED_GRACE_PERIOD_S * 1000);
+		}
 	}
 
 	return kIOReturnSuccess;
@@ -1062,18 +1112,25 @@ IOReturn IOPCIDevice::getResources( void )
 	// function's memory space(s).
 	if (atomic_load((atomic_char*)&reserved->pciPMState) != kIOPCIDeviceOnState)
 	{
-		DLOG(ALWAYS_ON, "[%s()] nub %s is not powered, retrying matching in %ums\n", __func__, getName(), REPUBLISH_TIMER_DURATION_MS);
+		DLOG(ALWAYS_ON, "[%s()] nub %s is not powered, matching when it powers on\n", __func__, getName());
 
-		// Start the 100ms re-publish timer. This timer will be restarted
-		// until either the nub's IOPM state reaches kIOPCIDeviceOnState or 10
-		// seconds elapses and IOPCIDevice gives up, whichever happens first.
-		reserved->republishTimer->setTimeoutMS(REPUBLISH_TIMER_DURATION_MS);
+		// setPCIPowerState() kicks the re-publish timer when the nub's IOPM state
+		// reaches kIOPCIDeviceOnState. Until then it only fires to give up after
+		// PUBLISH_TIMEOUT_MS.
+		atomic_store((atomic_char*)&reserved->publishPending, true);
+		armPublishDeadline();
+
+		// it may have powered on since the check
+		if (atomic_load((atomic_char*)&reserved->pciPMState) == kIOPCIDeviceOnState)
+		{
+			reserved->republishTimer->setTimeoutUS(0);
+		}
 
 		// Return an error to cancel this attempt at matching.
 		return kIOReturnError;
 	}
 
-	reserved->publishRetryCount = 0;
+	atomic_store((atomic_char*)&reserved->publishPending, false);
 
     if (getProperty(kIOPCIResourcedKey) && !getChildEntry(gIOServicePlane))
 	{
@@ -1158,7 +1215,7 @@ UInt32 IOPCIDevice::configRead32( IOPCIAddressSpace _space,
                                   UInt8 offset )
 {
 	if (!parent) return (0xFFFFFFFF);
-    return (parent->configRead32(_space, offset));
+    return (reserved->configHost->configRead32(_space, offset));
 }
 
 void IOPCIDevice::configWrite32( IOPCIAddressSpace _space,
@@ -1172,14 +1229,14 @@ void IOPCIDevice::configWrite32( IOPCIAddressSpace _space,
 	{
 		data = configWrite32Filter(offset, data);
 	}
-    parent->configWrite32( _space, offset, data );
+    reserved->configHost->configWrite32( _space, offset, data );
 }
 
 UInt16 IOPCIDevice::configRead16( IOPCIAddressSpace _space,
                                   UInt8 offset )
 {
 	if (!parent) return (0xFFFF);
-    return (parent->configRead16(_space, offset));
+    return (reserved->configHost->configRead16(_space, offset));
 }
 
 void IOPCIDevice::configWrite16( IOPCIAddressSpace _space,
@@ -1190,14 +1247,14 @@ void IOPCIDevice::configWrite16( IOPCIAddressSpace _space,
 	{
 		data = configWrite16Filter(offset, data);
 	}
-    parent->configWrite16( _space, offset, data );
+    reserved->configHost->configWrite16( _space, offset, data );
 }
 
 UInt8 IOPCIDevice::configRead8( IOPCIAddressSpace _space,
                                 UInt8 offset )
 {
 	if (!parent) return (0xFF);
-    return (parent->configRead8(_space, offset));
+    return (reserved->configHost->configRead8(_space, offset));
 }
 
 void IOPCIDevice::configWrite8( IOPCIAddressSpace _space,
@@ -1208,17 +1265,45 @@ void IOPCIDevice::configWrite8( IOPCIAddressSpace _space,
 	{
 		data = configWrite8Filter(offset, data);
 	}
-    parent->configWrite8( _space, offset, data );
+    reserved->configHost->configWrite8( _space, offset, data );
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// A config access recurses through each bridge, and the bridge's own nub, up
+// to the host bridge that does it. When every hop is the family's plain
+// forwarding, send this nub's accesses to the host bridge directly. A bridge
+// on the way puts its nubs back on the hops in IOPCI2PCIBridge::willTerminate().
+
+void IOPCIDevice::resolveConfigHost(void)
+{
+	IOPCIBridge *     bridge;
+	IOPCI2PCIBridge * p2p;
+	IOPCIDevice *     bridgeDevice;
+
+	reserved->configHost = parent;
+	if (!parent || !reserved->hostBridge) return;
+
+	for (bridge = parent; bridge != reserved->hostBridge; bridge = bridgeDevice->parent)
+	{
+		p2p = OSDynamicCast(IOPCI2PCIBridge, bridge);
+		if (!p2p || (p2p->getMetaClass() != IOPCI2PCIBridge::metaClass) || p2p->isInactive()) return;
+		bridgeDevice = p2p->fBridgeDevice;
+		if (!bridgeDevice
+		 || (bridgeDevice->getMetaClass() != IOPCIDevice::metaClass)
+		 || bridgeDevice->isInactive()
+		 || !bridgeDevice->parent) return;
+	}
+	reserved->configHost = reserved->hostBridge;
+}
+
 bool IOPCIDevice::configAccess(bool write)
 {
 	bool ok = (!isInactive()
 			&& reserved
-			&& parent && !parent->reserved->childrenInReset
-			&& (0 == ((write ? VM_PROT_WRITE : VM_PROT_READ) & reserved->configProt)));
+			&& parent
+			&& (0 == ((write ? kIOPCIConfigAccessWriteBlocked : kIOPCIConfigAccessReadBlocked)
+					  & reserved->configAccessState)));
 	if (!ok && !ml_at_interrupt_context() && (gIOPCILogModeFlags & kPCI_LOG_MODE_IOLOG))
 	{
 		OSReportWithBacktrace("config protect fail(2) for device " BDF() "\n",
@@ -1232,40 +1317,40 @@ bool IOPCIDevice::configAccess(bool write)
 UInt32 IOPCIDevice::configRead32( UInt8 offset )
 {
 	if (!configAccess(false)) return (0xFFFFFFFF);
-    return (parent->configRead32(space, offset));
+    return (reserved->configHost->configRead32(space, offset));
 }
 
 void IOPCIDevice::configWrite32( UInt8 offset, UInt32 data )
 {
 	if (!configAccess(true)) return;
 	data = configWrite32Filter(offset, data);
-    parent->configWrite32( space, offset, data );
+    reserved->configHost->configWrite32( space, offset, data );
 }
 
 UInt16 IOPCIDevice::configRead16( UInt8 offset )
 {
 	if (!configAccess(false)) return (0xFFFF);
-    return (parent->configRead16(space, offset));
+    return (reserved->configHost->configRead16(space, offset));
 }
 
 void IOPCIDevice::configWrite16( UInt8 offset, UInt16 data )
 {
 	if (!configAccess(true)) return;
 	data = configWrite16Filter(offset, data);
-    parent->configWrite16( space, offset, data );
+    reserved->configHost->configWrite16( space, offset, data );
 }
 
 UInt8 IOPCIDevice::configRead8( UInt8 offset )
 {
 	if (!configAccess(false)) return (0xFF);
-    return (parent->configRead8(space, offset));
+    return (reserved->configHost->configRead8(space, offset));
 }
 
 void IOPCIDevice::configWrite8( UInt8 offset, UInt8 data )
 {
 	if (!configAccess(true)) return;
 	data = configWrite8Filter(offset, data);
-    parent->configWrite8( space, offset, data );
+    reserved->configHost->configWrite8( space, offset, data );
 }
 
 #endif /* APPLE_KEXT_VTABLE_PADDING */
@@ -1811,11 +1896,26 @@ bool IOPCIDevice::serializeLinkStatus(void *ref __unused, OSSerialize *serialize
 		return true;
 	}
 
-	if (reserved->expressCapability && (isFunctionAccessible(this) == true))
+	// A registry walk serializes every nub, and reading the link status
+	// checks every link above it, so serve it from the last read until
+	// invalidateProperties() or kIOPCIPropertyCacheMS.
+	IORecursiveLockLock(reserved->lock);
+	if (propertyCacheValid(reserved->linkStatusGeneration, reserved->linkStatusTime))
 	{
-		linkStatus = extendedConfigRead16(reserved->expressCapability + 0x12);
-		DLOG(ALWAYS_ON, "[%s()] " BDF() " (%s) has linkStatus 0x%x\n", __func__, PCI_ADDRESS_TUPLE(this), getName(), linkStatus);
+		linkStatus = reserved->linkStatusValue;
 	}
+	else
+	{
+		reserved->linkStatusGeneration = reserved->propertyGeneration;
+		if (reserved->expressCapability && (isFunctionAccessible(this) == true))
+		{
+			linkStatus = extendedConfigRead16(reserved->expressCapability + 0x12);
+			DLOG(ALWAYS_ON, "[%s()] " BDF() " (%s) has linkStatus 0x%x\n", __func__, PCI_ADDRESS_TUPLE(this), getName(), linkStatus);
+		}
+		reserved->linkStatusValue = linkStatus;
+		reserved->linkStatusTime  = mach_absolute_time();
+	}
+	IORecursiveLockUnlock(reserved->lock);
 
 	OSNumber* value = OSNumber::withNumber(linkStatus, 32);
 	if (value == NULL)
@@ -1831,6 +1931,64 @@ bool IOPCIDevice::serializeLinkStatus(void *ref __unused, OSSerialize *serialize
 	return true;
 }
 
+OSDictionary * IOPCIDevice::copyCapabilityOffsets(void)
+{
+	OSDictionary * capabilities;
+	UInt32         generation;
+	bool           walked;
+
+	// Built on first read rather than at publish, and rebuilt after an
+	// invalidating event while the function can be reached. A walk made
+	// while config access is blocked reads all-ones, so it is not cached.
+	walked = false;
+	IORecursiveLockLock(reserved->lock);
+	generation = reserved->propertyGeneration;
+	if (   !isInactive()
+		&& (!reserved->capDict || (reserved->capDictGeneration != generation))
+		&& configAccess(false)
+		&& isFunctionAccessible(this)
+		&& (0xFFFFFFFF != configRead32(kIOPCIConfigVendorID)))
+	{
+		parent->constructCapabilitiesDict(this);
+		if (configAccess(false) && (0xFFFFFFFF != configRead32(kIOPCIConfigVendorID)))
+		{
+			reserved->capDictGeneration = generation;
+			walked = true;
+		}
+	}
+	if ((capabilities = reserved->capDict)) capabilities->retain();
+	IORecursiveLockUnlock(reserved->lock);
+
+	// published as a plain dictionary for getProperty() and matching
+	if (walked && capabilities) setProperty(gIOPCICapabilityOffsetsKey, capabilities);
+
+	return (capabilities);
+}
+
+bool IOPCIDevice::serializeProperties(OSSerialize * serialize) const
+{
+	OSDictionary * capabilities;
+
+	if ((capabilities = const_cast<IOPCIDevice *>(this)->copyCapabilityOffsets())) capabilities->release();
+
+	return (super::serializeProperties(serialize));
+}
+
+void IOPCIDevice::invalidateProperties(void)
+{
+	OSIncrementAtomic((volatile SInt32 *) &reserved->propertyGeneration);
+}
+
+bool IOPCIDevice::propertyCacheValid(UInt32 generation, uint64_t timestamp) const
+{
+	uint64_t maxAge;
+
+	if (!timestamp || (generation != reserved->propertyGeneration)) return (false);
+	nanoseconds_to_absolutetime(kIOPCIPropertyCacheMS * kMillisecondScale, &maxAge);
+
+	return ((mach_absolute_time() - timestamp) < maxAge);
+}
+
 OSObject* IOPCIDevice::getProperty(const OSSymbol * aKey) const
 {
     OSObject *value;
@@ -1865,7 +2023,21 @@ OSObject* IOPCIDevice::getProperty(const OSSymbol * aKey) const
     } else if (aKey == gIOPCIExpressLinkStatusKey && !parent->reserved->hostBridgeData->_useLinkStatusSerializer) {
 		// Update cached Link Status register
 		IOPCIDevice *device = (IOPCIDevice *)this; // strip 'const' qualifier
-		device->checkLink(kCheckLinkForPower);
+		bool         check;
+		IORecursiveLockLock(reserved->lock);
+		check = !propertyCacheValid(reserved->linkStatusGeneration, reserved->linkStatusTime);
+		if (check)
+		{
+			reserved->linkStatusGeneration = reserved->propertyGeneration;
+			reserved->linkStatusTime = mach_absolute_time();
+		}
+		IORecursiveLockUnlock(reserved->lock);
+		// checkLink() sets properties on other nubs, so not under the nub lock
+		if (check) device->checkLink(kCheckLinkForPower);
+		value = super::getProperty(aKey);
+	} else if (aKey == gIOPCICapabilityOffsetsKey) {
+		OSDictionary * capabilities;
+		if ((capabilities = const_cast<IOPCIDevice *>(this)->copyCapabilityOffsets())) capabilities->release();
 		value = super::getProperty(aKey);
 	} else if (aKey == gIOPCIDARTErrorData) {
 		value = super::getProperty(aKey);
@@ -1881,7 +2053,8 @@ IOPCIDevice::configureInterrupts(UInt32 interruptType, UInt32 numRequired, UInt3
 {
     IOReturn       ret = kIOReturnBadArgument;
 
-    if (!numRequired || !numRequested || (numRequired > numRequested) || options) return ret;
+    if (!numRequired || !numRequested || (numRequired > numRequested)) return ret;
+    if (options & ~(kIOPCIInterruptAffinitySpread | kIOPCIInterruptAffinityCPUMask)) return ret;
     IORecursiveLockLock(reserved->lock);
     if (reserved->interruptVectorsResolved) // TODO add cleanup support on numRequired == 0 (if needed).
     {
@@ -1954,10 +2127,39 @@ IOPCIDevice::configureInterrupts(UInt32 interruptType, UInt32 numRequired, UInt3
     {
         reserved->interruptVectorsResolved = 0;
     }
+    else if ((kIOPCIInterruptAffinitySpread & options)
+          && (kIOInterruptTypeLevel != interruptType)
+          && parent->reserved->messagedInterruptController)
+    {
+        // best effort, the vectors work wherever they land
+        IOReturn spread = parent->reserved->messagedInterruptController->spreadDeviceInterrupts(this,
+                                (options & kIOPCIInterruptAffinityCPUMask) >> kIOPCIInterruptAffinityCPUShift);
+        if (kIOReturnSuccess != spread) DLOG(INTERRUPT, "%s: interrupt spread 0x%x\n", getName(), spread);
+    }
     IORecursiveLockUnlock(reserved->lock);
     return ret;
 }
 
+IOReturn
+IOPCIDevice::setInterruptAffinity(int source, uint32_t cpu)
+{
+    IOPCIMessagedInterruptController * controller;
+
+    if (!(controller = parent->reserved->messagedInterruptController)) return (kIOReturnUnsupported);
+
+    return (controller->steerInterrupt(this, source, cpu));
+}
+
+IOReturn
+IOPCIDevice::setInterruptModeration(int source, uint32_t maxRate, uint32_t intervalUS)
+{
+    IOPCIMessagedInterruptController * controller;
+
+    if (!(controller = parent->reserved->messagedInterruptController)) return (kIOReturnUnsupported);
+
+    return (controller->setInterruptModeration(this, source, maxRate, intervalUS));
+}
+
 IOReturn
 IOPCIDevice::setProperties(OSObject * properties)
 {
@@ -2088,7 +2290,10 @@ IOReturn IOPCIDevice::protectDevice(uint32_t space, uint32_t prot)
 	if (space != kIOPCIConfigSpace)
 		return (kIOReturnUnsupported);
 
-	reserved->configProt = prot;
+	IOPCIConfigAccessUpdate(&reserved->configAccessState,
+							kIOPCIConfigAccessReadProtect | kIOPCIConfigAccessWriteProtect,
+							((prot & VM_PROT_READ)  ? kIOPCIConfigAccessReadProtect  : 0)
+							| ((prot & VM_PROT_WRITE) ? kIOPCIConfigAccessWriteProtect : 0));
 
     return (parent->protectDevice(this, space, prot));
 }
@@ -2856,6 +3061,146 @@ IOReturn IOPCIDevice::deviceMemoryWrite8(uint8_t      memoryIndex,
 	deviceMemoryWrite8(memoryIndex, offset, data, 0);
 }
 
+// validate a whole block once, and on ARM decide once whether it goes to the host bridge
+IOReturn IOPCIDevice::deviceMemoryBlockRange(uint8_t          memoryIndex,
+                                             uint64_t         offset,
+                                             IOByteCount      length,
+                                             IOVirtualAddress * address,
+                                             IOOptionBits     options,
+                                             IODeviceMemory   ** offload)
+{
+    IOMemoryMap* deviceMemoryMap;
+    uint64_t     end = 0;
+
+    if(offload != NULL)
+    {
+        *offload = NULL;
+    }
+    if(memoryIndex > kIOPCIRangeExpansionROM)
+    {
+        return kIOReturnBadArgument;
+    }
+    deviceMemoryMap = reserved->deviceMemoryMap[memoryIndex];
+    if(deviceMemoryMap == NULL)
+    {
+        DLOG(ALWAYS_ON, "IOPCIDevice::deviceMemoryBlockRange: index %u could not get mapping\n", memoryIndex);
+        return kIOReturnNoMemory;
+    }
+    if(   (os_add_overflow(offset, length, &end))
+       || (end > deviceMemoryMap->getLength()))
+    {
+        return kIOReturnOverrun;
+    }
+    *address = deviceMemoryMap->getVirtualAddress() + offset;
+
+#if TARGET_CPU_ARM || TARGET_CPU_ARM64
+    if(   (offload != NULL)
+       && ((reserved->offloadEngineMMIODisable == 0) || (options & kIOPCIAccessLatencyTolerantHint))
+       && (ml_get_interrupts_enabled() == true)
+       && (ml_at_interrupt_context() == false))
+    {
+        IODeviceMemory* deviceMemoryDescriptor = reserved->deviceMemory[memoryIndex];
+        if(deviceMemoryDescriptor == NULL)
+        {
+            DLOG(ALWAYS_ON, "IOPCIDevice::deviceMemoryBlockRange: failed to get memory for index %u\n", memoryIndex);
+            return kIOReturnBadArgument;
+        }
+
+        IOPCIAddressSpace addressSpace;
+        addressSpace.bits = static_cast<uint32_t>(deviceMemoryDescriptor->getTag());
+
+        if(   (addressSpace.s.space != kIOPCI32BitMemorySpace)
+           && (addressSpace.s.space != kIOPCI64BitMemorySpace))
+        {
+            DLOG(ALWAYS_ON, "IOPCIDevice::deviceMemoryBlockRange: index %u is not MMIO space\n", memoryIndex);
+            return kIOReturnBadArgument;
+        }
+        *offload = deviceMemoryDescriptor;
+    }
+#endif
+
+    return kIOReturnSuccess;
+}
+
+// widest naturally aligned access that fits what is left
+static IOByteCount IOPCIDeviceMemoryAccessSize(IOVirtualAddress address, IOByteCount remaining)
+{
+    IOByteCount size = sizeof(uint64_t);
+
+    while ((size > remaining) || (address & (size - 1))) size >>= 1;
+
+    return (size);
+}
+
+IOReturn IOPCIDevice::deviceMemoryReadBlock(uint8_t      memoryIndex,
+                                            uint64_t     offset,
+                                            void*        data,
+                                            IOByteCount  length,
+                                            IOOptionBits options)
+{
+    IODeviceMemory*  offload = NULL;
+    IOVirtualAddress address = 0;
+    IOByteCount      done, size;
+    uint64_t         value;
+    IOReturn         result;
+
+    result = deviceMemoryBlockRange(memoryIndex, offset, length, &address, options, &offload);
+    if((result != kIOReturnSuccess) || (length == 0))
+    {
+        return result;
+    }
+
+#if TARGET_CPU_ARM || TARGET_CPU_ARM64
+    if(offload != NULL)
+    {
+        result = reserved->hostBridge->deviceMemoryRead(offload, offset, data, length);
+        if(result != kIOReturnUnsupported)
+        {
+            return result;
+        }
+    }
+#endif
+
+    // little endian hosts, the low bytes of each access are the first in the buffer
+    for(done = 0; done < length; done += size)
+    {
+        size  = IOPCIDeviceMemoryAccessSize(address + done, length - done);
+        value = ml_io_read(address + done, (int) size);
+        memcpy(static_cast<uint8_t*>(data) + done, &value, size);
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOPCIDevice::deviceMemoryWriteBlock(uint8_t      memoryIndex,
+                                             uint64_t     offset,
+                                             const void*  data,
+                                             IOByteCount  length,
+                                             IOOptionBits options)
+{
+    IOVirtualAddress address = 0;
+    IOByteCount      done, size;
+    uint64_t         value;
+    IOReturn         result;
+
+    // the host bridge only offloads reads, writes are posted anyway
+    result = deviceMemoryBlockRange(memoryIndex, offset, length, &address, options, NULL);
+    if(result != kIOReturnSuccess)
+    {
+        return result;
+    }
+
+    for(done = 0; done < length; done += size)
+    {
+        size  = IOPCIDeviceMemoryAccessSize(address + done, length - done);
+        value = 0;
+        memcpy(&value, static_cast<const uint8_t*>(data) + done, size);
+        ml_io_write(address + done, value, (int) size);
+    }
+
+    return kIOReturnSuccess;
+}
+
 IOReturn IOPCIDevice::setLinkSpeed(tIOPCILinkSpeed linkSpeed,
 								   bool            retrain)
 {
@@ -2887,12 +3232,107 @@ void IOPCIDevice::launchReprobeThread(void)
 	}
 }
 
+// Readiness Time Reporting times are a 9 bit value scaled by 32^scale ns (sec 7.9.17)
+static uint64_t
+IOPCIReadinessTimeNS(uint32_t field)
+{
+	uint32_t scale = (field >> 9) & 7;
+
+	if (scale > 5) return (UINT64_MAX);
+	return ((uint64_t)(field & 0x1FF) << (5 * scale));
+}
+
+// FRS Queuing capability (sec 7.8.9): +0x04 FRS Queue Max Depth in bits 11:0,
+// +0x08 FRS Message Overflow in bit 0, +0x0C the oldest message with the
+// number queued in bits 31:20. Any write to +0x0C dequeues the oldest.
+static uint32_t
+IOPCIFRSQueueDepth(IOPCIDevice * rootPort, uint16_t queue)
+{
+	uint32_t depth = rootPort->extendedConfigRead32(queue + 0x04) & 0xFFF;
+
+	return (depth ? depth : 1);
+}
+
+// Pop the oldest FRS message, 0 if the queue is empty
+static uint32_t
+IOPCIFRSDequeue(IOPCIDevice * rootPort, uint16_t queue)
+{
+	uint32_t message = rootPort->extendedConfigRead32(queue + 0x0C);
+
+	// FRS Message Queue Depth, all ones from a port that stopped answering
+	if (!(message >> 20) || (message == 0xFFFFFFFF)) return (0);
+	rootPort->extendedConfigWrite32(queue + 0x0C, 0);
+	return (message);
+}
+
+// Decide before the reset, while the function still answers, how completeFLR()
+// will know it is ready again.
+void IOPCIDevice::probeFLRReadiness(void)
+{
+	IOPCIConfigEntry * rootPortEntry;
+	IOPCIDevice *      rootPort;
+	IOByteCount        offset;
+	uint32_t           depth, idx;
+
+	reserved->flrReadiness = kIOPCIFLRReadyWait;
+	reserved->flrRootPort  = NULL;
+
+	// Immediate Readiness
+	if (configRead16(kIOPCIConfigStatus) & 0x0001)
+	{
+		reserved->flrReadiness = kIOPCIFLRReadyImmediate;
+		return;
+	}
+
+	offset = 0;
+	if (extendedFindPCICapability(kIOPCIExpressCapabilityIDReadinessTimeReporting, &offset)
+	 && (extendedConfigRead32(offset + 0x04) & (1U << 31)))
+	{
+		reserved->flrReadyNS = IOPCIReadinessTimeNS(extendedConfigRead32(offset + 0x08) & 0xFFF);
+		// may round past 100ms, but a time beyond the CRS limit is not believable
+		if (reserved->flrReadyNS <= (kIOPCIFLRCRSWaitMS * kMillisecondScale))
+		{
+			reserved->flrReadiness = kIOPCIFLRReadyReported;
+			return;
+		}
+	}
+
+	rootPortEntry = reserved->configEntry ? reserved->configEntry->rootPortEntry : NULL;
+	if (!rootPortEntry || (rootPortEntry == reserved->configEntry)) return;
+	rootPort = OSDynamicCast(IOPCIDevice, rootPortEntry->dtNub);
+	if (!rootPort || !rootPort->reserved->expressCapability) return;
+	reserved->flrRootPort = rootPort;
+
+	// FRS Supported, and a root port that queues FRS messages
+	offset = 0;
+	if (reserved->expressCapability
+	 && (extendedConfigRead32(reserved->expressCapability + 0x24) & (1U << 31))
+	 && rootPort->extendedFindPCICapability(kIOPCIExpressCapabilityIDFRSQueueing, &offset))
+	{
+		reserved->flrFRSQueue  = offset;
+		reserved->flrReadiness = kIOPCIFLRReadyFRS;
+		// only messages from here on count, drain the queue and clear FRS Message Overflow
+		depth = IOPCIFRSQueueDepth(rootPort, offset);
+		for (idx = 0; (idx < depth) && IOPCIFRSDequeue(rootPort, offset); idx++) {}
+		rootPort->extendedConfigWrite16(offset + 0x08, 0x0001);
+		return;
+	}
+
+	// CRS Software Visibility Enable
+	if (rootPort->configRead16(rootPort->reserved->expressCapability + 0x1C) & 0x0010)
+	{
+		reserved->flrReadiness = kIOPCIFLRReadyCRS;
+	}
+}
+
 void IOPCIDevice::prepareFLR(void)
 {
 	// Prepare for the FLR by preventing new upstream transactions and flushing
 	// in-flight ones, in order to satisfy the requirement that software "must
 	// not initialize the Function until allowing adequate time for any
-	// associated Completions to arrive."
+	// associated Completions to arrive." The flush is waitForTransactions().
+
+	probeFLRReadiness();
 
 	// Clear the function's Bus Lead and SERR bits, and set the Interrupt Disable bit,
 	// to prevent the function from initiating new transactions.
@@ -2900,21 +3340,31 @@ void IOPCIDevice::prepareFLR(void)
 	command &= ~(kIOPCICommandBusLead | kIOPCICommandSERR);
 	command |= kIOPCICommandInterruptDisable;
 	extendedConfigWrite16(kIOPCIConfigCommand, command);
+}
 
-	// Poll the transactions pending bit for up to 50ms
+void IOPCIDevice::waitForTransactions(IOPCIDevice ** functions, uint32_t count)
+{
+	// Poll the transactions pending bits for up to 50ms, most functions have none
 	const uint32_t tpTimeoutMs = 50;
 	AbsoluteTime deadline, now = 0;
 	uint16_t deviceStatus = 0;
+	uint32_t idx;
+	bool pending;
 
 	clock_interval_to_deadline(tpTimeoutMs, kMillisecondScale, &deadline);
-	do
+	while (true)
 	{
-		deviceStatus = extendedConfigRead8(reserved->expressCapability + 0x0A);
-		IOSleep(2);
+		pending = false;
+		for (idx = 0; idx < count; idx++)
+		{
+			deviceStatus = functions[idx]->extendedConfigRead8(functions[idx]->reserved->expressCapability + 0x0A);
+			if (deviceStatus & (1 << 5)) pending = true;
+		}
+		if (!pending) break;
 		clock_get_uptime(&now);
+		if (AbsoluteTime_to_scalar(&now) >= AbsoluteTime_to_scalar(&deadline)) break;
+		IOSleep(1);
 	}
-	while (    (deviceStatus & (1 << 5))
-			&& (AbsoluteTime_to_scalar(&now) < AbsoluteTime_to_scalar(&deadline)));
 }
 
 void IOPCIDevice::flr(void)
@@ -2922,49 +3372,297 @@ void IOPCIDevice::flr(void)
 	// Initiate FLR
 	uint16_t control = extendedConfigRead16(reserved->expressCapability + 0x08);
 	control |= (1 << 15);
+	reserved->flrReady = false;
+	reserved->flrStart = mach_absolute_time();
 	extendedConfigWrite16(reserved->expressCapability + 0x08, control);
 }
 
-void IOPCIDevice::completeFLR(void)
+// Look for FLR Completed messages in the root port's FRS queue, marking every
+// function of the reset they belong to. Nothing else consumes the queue, so
+// messages for functions outside the reset are dropped. A message lost to an
+// overflow leaves its function waiting out the deadline.
+bool IOPCIDevice::waitForFRS(uint64_t deadline, IOPCIDevice ** functions, uint32_t count)
+{
+	IOPCIDevice * rootPort = reserved->flrRootPort;
+	IOPCIDevice * function;
+	uint16_t      queue    = reserved->flrFRSQueue;
+	uint32_t      depth, idx, next, message, requesterID;
+
+	depth = IOPCIFRSQueueDepth(rootPort, queue);
+
+	while (!reserved->flrReady)
+	{
+		for (idx = 0; idx < depth; idx++)
+		{
+			message = IOPCIFRSDequeue(rootPort, queue);
+			if (!message) break;
+			// FLR Completed
+			if (((message >> 16) & 0xF) != 0x3) continue;
+			for (next = 0; next < count; next++)
+			{
+				function    = functions[next];
+				requesterID = (function->space.s.busNum << 8) | (function->space.s.deviceNum << 3) | function->space.s.functionNum;
+				if ((message & 0xFFFF) == requesterID) function->reserved->flrReady = true;
+			}
+		}
+		if (reserved->flrReady) break;
+		if (mach_absolute_time() >= deadline) return (false);
+		IOSleep(1);
+	}
+	return (true);
+}
+
+static void
+IOPCISleepUntil(uint64_t deadline)
 {
-	// Wait 100ms
-	IOSleep(100);
+	uint64_t now, ns;
+
+	now = mach_absolute_time();
+	if (deadline <= now) return;
+	absolutetime_to_nanoseconds(deadline - now, &ns);
+	if (ns >= kMillisecondScale) IOSleep((uint32_t)((ns + kMillisecondScale - 1) / kMillisecondScale));
+	else                         IODelay((uint32_t)((ns + kMicrosecondScale - 1) / kMicrosecondScale));
 }
 
-IOReturn IOPCIDevice::resetFunction(tIOPCIDeviceResetOptions options)
+// Waits are measured from flr(), so completing several functions reset
+// together takes as long as the slowest, not the sum.
+void IOPCIDevice::completeFLR(IOPCIDevice ** functions, uint32_t count)
+{
+	uint64_t interval, deadline;
+	uint32_t vendorProduct;
+
+	clock_interval_to_absolutetime_interval(kIOPCIFLRWaitMS, kMillisecondScale, &interval);
+	switch (reserved->flrReadiness)
+	{
+		case kIOPCIFLRReadyImmediate:
+			break;
+
+		case kIOPCIFLRReadyReported:
+			nanoseconds_to_absolutetime(reserved->flrReadyNS, &interval);
+			IOPCISleepUntil(reserved->flrStart + interval);
+			break;
+
+		case kIOPCIFLRReadyFRS:
+			if (!waitForFRS(reserved->flrStart + interval, functions, count))
+			{
+				DLOG(ALWAYS_ON, "[%s()] " BDF() " no FRS message after %d ms\n", __func__, PCI_ADDRESS_TUPLE(this), kIOPCIFLRWaitMS);
+			}
+			break;
+
+		case kIOPCIFLRReadyCRS:
+			// Requests during the FLR itself may be discarded, so the 100ms still
+			// applies. A function that needs longer answers CRS until it is ready.
+			IOPCISleepUntil(reserved->flrStart + interval);
+			clock_interval_to_deadline(kIOPCIFLRCRSWaitMS, kMillisecondScale, &deadline);
+			while (true)
+			{
+				vendorProduct = extendedConfigRead32(kIOPCIConfigVendorID);
+				if (   (vendorProduct != 0)
+					&& (vendorProduct != 0xFFFFFFFFUL)
+					&& (vendorProduct != 0xFFFF0001UL)) break;
+				if (mach_absolute_time() >= deadline)
+				{
+					DLOG(ALWAYS_ON, "[%s()] " BDF() " not ready after FLR\n", __func__, PCI_ADDRESS_TUPLE(this));
+					break;
+				}
+				IOSleep(1);
+			}
+			break;
+
+		default:
+			IOPCISleepUntil(reserved->flrStart + interval);
+			break;
+	}
+}
+
+struct IOPCIFLRRestore
+{
+	thread_call_t call;
+	IOLock *      lock;
+	uint32_t *    pending;
+};
+
+void IOPCIDevice::flrRestoreThreadCall(struct IOPCIFLRRestore * restore)
+{
+	thread_call_t call = restore->call;
+
+	parent->restoreDeviceState(this, 0);
+
+	IOLockLock(restore->lock);
+	if (!--*restore->pending) IOLockWakeup(restore->lock, restore->pending, false);
+	IOLockUnlock(restore->lock);
+
+	thread_call_free(call);
+	release();
+}
+
+// Restore order: parents before children. Functions of the same rank restore
+// concurrently.
+static uint32_t
+IOPCIFLRRank(IOPCIDevice * function)
+{
+	IOPCIConfigEntry * entry;
+	uint32_t           depth = 0;
+
+	for (entry = function->reserved->configEntry; entry && entry->parent; entry = entry->parent) depth++;
+
+	return (depth);
+}
+
+static uint32_t
+IOPCIFLRRequesterID(IOPCIDevice * function)
+{
+	return ((function->space.s.busNum << 8) | (function->space.s.deviceNum << 3) | function->space.s.functionNum);
+}
+
+// A physical function's FLR clears VF Enable, and the SR-IOV
+// state is not saved, so its virtual functions can't be reset alongside it.
+static bool
+IOPCIFLRResetsVFs(IOPCIDevice * function, IOPCIDevice ** functions, uint32_t count)
 {
-	if (!supportsFLR())
+	IOByteCount offset = 0;
+	uint32_t    rid, numVFs, first, stride, delta, idx;
+
+	if (!function->extendedFindPCICapability(kIOPCIExpressCapabilityIDSRIOV, &offset)) return (false);
+	// SR-IOV Control VF Enable
+	if (!(function->extendedConfigRead16(offset + 0x08) & 0x0001)) return (false);
+	numVFs = function->extendedConfigRead16(offset + 0x10);
+	first  = function->extendedConfigRead16(offset + 0x14);
+	stride = function->extendedConfigRead16(offset + 0x16);
+	rid    = IOPCIFLRRequesterID(function);
+
+	// VF n is at the PF's requester ID + First VF Offset + n * VF Stride
+	for (idx = 0; idx < count; idx++)
+	{
+		if (IOPCIFLRRequesterID(functions[idx]) < rid + first) continue;
+		delta = IOPCIFLRRequesterID(functions[idx]) - rid - first;
+		if (stride ? (!(delta % stride) && ((delta / stride) < numVFs)) : (!delta && numVFs)) return (true);
+	}
+	return (false);
+}
+
+IOReturn IOPCIDevice::resetFunctions(IOPCIDevice ** functions, uint32_t count, tIOPCIDeviceResetOptions options)
+{
+	IOPCIDevice **    sorted;
+	uint32_t *        ranks;
+	IOPCIFLRRestore * restores;
+	IOPCIDevice *     swap;
+	IOLock *          lock;
+	uint32_t          idx, next, first, last, pending, rank;
+
+	if (!functions || !count) return (kIOReturnBadArgument);
+	for (idx = 0; idx < count; idx++)
+	{
+		if (!functions[idx]->supportsFLR())
+		{
+			__DLOG(functions[idx]->reserved->domainId, ALWAYS_ON, "[%s()] Function " BDF() " does not support FLR\n", __func__, PCI_ADDRESS_TUPLE(functions[idx]));
+			return kIOReturnUnsupported;
+		}
+		if ((count > 1) && IOPCIFLRResetsVFs(functions[idx], functions, count))
+		{
+			__DLOG(functions[idx]->reserved->domainId, ALWAYS_ON, "[%s()] Function " BDF() " is reset with its virtual functions\n", __func__, PCI_ADDRESS_TUPLE(functions[idx]));
+			return kIOReturnBadArgument;
+		}
+	}
+
+	sorted   = IONew(IOPCIDevice *, count);
+	ranks    = IONew(uint32_t, count);
+	restores = IONewZero(IOPCIFLRRestore, count);
+	lock     = IOLockAlloc();
+	if (!sorted || !ranks || !restores || !lock)
 	{
-		DLOG(ALWAYS_ON, "[%s()] Function " BDF() " does not support FLR\n", __func__, PCI_ADDRESS_TUPLE(this));
-		return kIOReturnUnsupported;
+		if (sorted)   IODelete(sorted, IOPCIDevice *, count);
+		if (ranks)    IODelete(ranks, uint32_t, count);
+		if (restores) IODelete(restores, IOPCIFLRRestore, count);
+		if (lock)     IOLockFree(lock);
+		return (kIOReturnNoMemory);
+	}
+
+	for (idx = 0; idx < count; idx++)
+	{
+		sorted[idx] = functions[idx];
+		ranks[idx]  = IOPCIFLRRank(functions[idx]);
+		for (next = idx; next && (ranks[next - 1] > ranks[next]); next--)
+		{
+			swap = sorted[next]; sorted[next] = sorted[next - 1]; sorted[next - 1] = swap;
+			rank = ranks[next];  ranks[next]  = ranks[next - 1];  ranks[next - 1]  = rank;
+		}
 	}
 
 	// Save device state
 	if (!(options & kIOPCIDeviceResetOptionTerminate))
 	{
-		parent->saveDeviceState(this, kIOPCIConfigShadowVolatile);
+		for (idx = 0; idx < count; idx++) sorted[idx]->parent->saveDeviceState(sorted[idx], kIOPCIConfigShadowVolatile);
 	}
 
-	prepareFLR();
-	flr();
-	completeFLR();
+	for (idx = 0; idx < count; idx++) sorted[idx]->prepareFLR();
+	waitForTransactions(sorted, count);
+	for (idx = 0; idx < count; idx++) sorted[idx]->flr();
+	for (idx = 0; idx < count; idx++) sorted[idx]->completeFLR(sorted, count);
 
-	// Restore device state
+	// Restore device state, a rank at a time
 	if (!(options & kIOPCIDeviceResetOptionTerminate))
 	{
-		parent->restoreDeviceState(this, 0);
+		for (first = 0; first < count; first = last)
+		{
+			for (last = first + 1; (last < count) && (ranks[last] == ranks[first]); last++) {}
+
+			pending = 0;
+			for (idx = first + 1; idx < last; idx++)
+			{
+				restores[idx].lock    = lock;
+				restores[idx].pending = &pending;
+				restores[idx].call    = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t,
+																				  sorted[idx],
+																				  &IOPCIDevice::flrRestoreThreadCall),
+															 sorted[idx]);
+				if (!restores[idx].call)
+				{
+					sorted[idx]->parent->restoreDeviceState(sorted[idx], 0);
+					continue;
+				}
+				sorted[idx]->retain();
+				IOLockLock(lock);
+				pending++;
+				IOLockUnlock(lock);
+				thread_call_enter1(restores[idx].call, &restores[idx]);
+			}
+
+			sorted[first]->parent->restoreDeviceState(sorted[first], 0);
+
+			IOLockLock(lock);
+			while (pending) IOLockSleep(lock, &pending, THREAD_UNINT);
+			IOLockUnlock(lock);
+		}
 	}
 
 	if (options & kIOPCIDeviceResetOptionTerminate)
 	{
-		terminate(kIOServiceTerminateNeedWillTerminate);
+		for (idx = 0; idx < count; idx++) sorted[idx]->terminate(kIOServiceTerminateNeedWillTerminate);
 
-		launchReprobeThread();
+		// one reprobe per bridge
+		for (idx = 0; idx < count; idx++)
+		{
+			for (next = 0; (next < idx) && (sorted[next]->parent != sorted[idx]->parent); next++) {}
+			if (next == idx) sorted[idx]->launchReprobeThread();
+		}
 	}
 
+	IODelete(sorted, IOPCIDevice *, count);
+	IODelete(ranks, uint32_t, count);
+	IODelete(restores, IOPCIFLRRestore, count);
+	IOLockFree(lock);
+
 	return kIOReturnSuccess;
 }
 
+IOReturn IOPCIDevice::resetFunction(tIOPCIDeviceResetOptions options)
+{
+	IOPCIDevice * function = this;
+
+	return (resetFunctions(&function, 1, options));
+}
+
 IOReturn IOPCIDevice::reset(tIOPCIDeviceResetTypes type, tIOPCIDeviceResetOptions options)
 {
     DLOG(ALWAYS_ON, "%s[%p]::%s(0x%x, 0x%x)\n", getName(), this, __func__, type, options);
@@ -3393,6 +4091,84 @@ IMPL(IOPCIDevice, _MemoryAccess)
     return result;
 }
 
+kern_return_t
+IMPL(IOPCIDevice, _MemoryAccessBlock)
+{
+    if ((forClient == NULL) || (isOpen(forClient) == false))
+    {
+        DLOG(ALWAYS_ON, "IOPCIDevice::%s: device not open for client %s\n", __FUNCTION__, (forClient != NULL) ? forClient->getName() : "unknown client");
+        return kIOReturnNotOpen;
+    }
+
+	uint8_t memoryIndex = operation & kPCIDriverKitMemoryAccessOperationDeviceMemoryIndexMask;
+	if(memoryIndex > kIOPCIRangeExpansionROM)
+	{
+		DLOG(ALWAYS_ON, "IOPCIDevice::%s: invalid index %u for client %s\n", __FUNCTION__, memoryIndex, forClient->getName());
+		return kIOReturnBadArgument;
+	}
+
+    IODirection direction;
+    switch (operation & (~kPCIDriverKitMemoryAccessOperationDeviceMemoryIndexMask))
+    {
+        case kPCIDriverKitMemoryAccessOperationDeviceRead:
+        {
+            direction = kIODirectionIn;
+            break;
+        }
+        case kPCIDriverKitMemoryAccessOperationDeviceWrite:
+        {
+            direction = kIODirectionOut;
+            break;
+        }
+        default:
+        {
+            return kIOReturnUnsupported;
+        }
+    }
+
+    uint64_t end = 0;
+    if(   (buffer == NULL)
+       || ((buffer->getDirection() & direction) != direction)
+       || (os_add_overflow(bufferOffset, length, &end))
+       || (end > buffer->getLength()))
+    {
+        DLOG(ALWAYS_ON, "IOPCIDevice::%s: bad buffer for client %s\n", __FUNCTION__, forClient->getName());
+        return kIOReturnBadArgument;
+    }
+    if(length == 0)
+    {
+        return kIOReturnSuccess;
+    }
+
+    IOReturn result = buffer->prepare(direction);
+    if(result != kIOReturnSuccess)
+    {
+        return result;
+    }
+
+    IOMemoryMap* bufferMap = buffer->createMappingInTask(kernel_task, 0, kIOMapAnywhere, bufferOffset, length);
+    if(bufferMap != NULL)
+    {
+        void* data = reinterpret_cast<void*>(bufferMap->getVirtualAddress());
+        if(direction == kIODirectionIn)
+        {
+            result = deviceMemoryReadBlock(memoryIndex, offset, data, length, options);
+        }
+        else
+        {
+            result = deviceMemoryWriteBlock(memoryIndex, offset, data, length, options);
+        }
+        OSSafeReleaseNULL(bufferMap);
+    }
+    else
+    {
+        result = kIOReturnNoMemory;
+    }
+    buffer->complete(direction);
+
+    return result;
+}
+
 kern_return_t
 IMPL(IOPCIDevice, _CopyDeviceMemoryWithIndex)
 {
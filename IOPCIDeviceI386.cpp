@@ -102,4 +102,116 @@ void IOPCIDevice::ioWrite8( UInt16 offset, UInt8 value,
 }
 
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Port I/O instructions are serializing, so the relaxed accessors are the
+ * ordered ones and ioBarrier() only has to stop the compiler.
+ */
+
+UInt32 IOPCIDevice::ioRead32Relaxed( UInt16 offset, IOMemoryMap * map )
+{
+    return (ioRead32(offset, map));
+}
+
+UInt16 IOPCIDevice::ioRead16Relaxed( UInt16 offset, IOMemoryMap * map )
+{
+    return (ioRead16(offset, map));
+}
+
+UInt8 IOPCIDevice::ioRead8Relaxed( UInt16 offset, IOMemoryMap * map )
+{
+    return (ioRead8(offset, map));
+}
+
+void IOPCIDevice::ioWrite32Relaxed( UInt16 offset, UInt32 value,
+                                    IOMemoryMap * map )
+{
+    ioWrite32(offset, value, map);
+}
+
+void IOPCIDevice::ioWrite16Relaxed( UInt16 offset, UInt16 value,
+                                    IOMemoryMap * map )
+{
+    ioWrite16(offset, value, map);
+}
+
+void IOPCIDevice::ioWrite8Relaxed( UInt16 offset, UInt8 value,
+                                   IOMemoryMap * map )
+{
+    ioWrite8(offset, value, map);
+}
+
+void IOPCIDevice::ioBarrier( void )
+{
+    __asm__ volatile("" ::: "memory");
+}
+
+IOReturn IOPCIDevice::ioReadBlock( UInt16 offset, void * data, IOByteCount count,
+                                   UInt8 size, IOMemoryMap * map )
+{
+    IOVirtualAddress port;
+    IOByteCount      idx;
+
+    if (0 == map)
+        map = ioMap;
+    if (0 == map)
+        return (kIOReturnNoMemory);
+    port = map->getVirtualAddress() + offset;
+
+    switch (size)
+    {
+        case sizeof(UInt32):
+            for (idx = 0; idx < count; idx++)
+                ((UInt32 *) data)[idx] = inl(port);
+            break;
+        case sizeof(UInt16):
+            for (idx = 0; idx < count; idx++)
+                ((UInt16 *) data)[idx] = inw(port);
+            break;
+        case sizeof(UInt8):
+            for (idx = 0; idx < count; idx++)
+                ((UInt8 *) data)[idx] = inb(port);
+            break;
+        default:
+            return (kIOReturnBadArgument);
+    }
+
+    return (kIOReturnSuccess);
+}
+
+IOReturn IOPCIDevice::ioWriteBlock( UInt16 offset, const void * data, IOByteCount count,
+                                    UInt8 size, IOMemoryMap * map )
+{
+    IOVirtualAddress port;
+    IOByteCount      idx;
+
+    if (0 == map)
+        map = ioMap;
+    if (0 == map)
+        return (kIOReturnNoMemory);
+    port = map->getVirtualAddress() + offset;
+
+    switch (size)
+    {
+        case sizeof(UInt32):
+            for (idx = 0; idx < count; idx++)
+                outl(port, ((const UInt32 *) data)[idx]);
+            break;
+        case sizeof(UInt16):
+            for (idx = 0; idx < count; idx++)
+                outw(port, ((const UInt16 *) data)[idx]);
+            break;
+        case sizeof(UInt8):
+            for (idx = 0; idx < count; idx++)
+                outb(port, ((const UInt8 *) data)[idx]);
+            break;
+        default:
+            return (kIOReturnBadArgument);
+    }
+
+    return (kIOReturnSuccess);
+}
+
+
 #endif // __i386__
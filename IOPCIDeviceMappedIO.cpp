@@ -128,6 +128,160 @@ void IOPCIDevice::ioWrite8( UInt16 offset, UInt8 value,
     OSSynchronizeIO();
 }
 
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+UInt32 IOPCIDevice::ioRead32Relaxed( UInt16 offset, IOMemoryMap * map )
+{
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return (0);
+    }
+
+    return (OSReadLittleInt32( (volatile void *)map->getVirtualAddress(), offset));
+}
+
+UInt16 IOPCIDevice::ioRead16Relaxed( UInt16 offset, IOMemoryMap * map )
+{
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return (0);
+    }
+
+    return (OSReadLittleInt16( (volatile void *)map->getVirtualAddress(), offset));
+}
+
+UInt8 IOPCIDevice::ioRead8Relaxed( UInt16 offset, IOMemoryMap * map )
+{
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return (0);
+    }
+
+    return (((volatile UInt8 *) map->getVirtualAddress())[ offset ]);
+}
+
+void IOPCIDevice::ioWrite32Relaxed( UInt16 offset, UInt32 value,
+                                    IOMemoryMap * map )
+{
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return ;
+    }
+
+    OSWriteLittleInt32( (volatile void *)map->getVirtualAddress(), offset, value);
+}
+
+void IOPCIDevice::ioWrite16Relaxed( UInt16 offset, UInt16 value,
+                                    IOMemoryMap * map )
+{
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return ;
+    }
+
+    OSWriteLittleInt16( (volatile void *)map->getVirtualAddress(), offset, value);
+}
+
+void IOPCIDevice::ioWrite8Relaxed( UInt16 offset, UInt8 value,
+                                   IOMemoryMap * map )
+{
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return ;
+    }
+
+    ((volatile UInt8 *) map->getVirtualAddress())[ offset ] = value;
+}
+
+void IOPCIDevice::ioBarrier( void )
+{
+    OSSynchronizeIO();
+}
+
+IOReturn IOPCIDevice::ioReadBlock( UInt16 offset, void * data, IOByteCount count,
+                                   UInt8 size, IOMemoryMap * map )
+{
+    volatile void * base;
+    IOByteCount     idx;
+
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return (kIOReturnNoMemory);
+    }
+    base = (volatile void *) map->getVirtualAddress();
+
+    switch (size)
+    {
+        case sizeof(UInt32):
+            for (idx = 0; idx < count; idx++)
+                ((UInt32 *) data)[idx] = OSReadLittleInt32(base, offset);
+            break;
+        case sizeof(UInt16):
+            for (idx = 0; idx < count; idx++)
+                ((UInt16 *) data)[idx] = OSReadLittleInt16(base, offset);
+            break;
+        case sizeof(UInt8):
+            for (idx = 0; idx < count; idx++)
+                ((UInt8 *) data)[idx] = ((volatile UInt8 *) base)[ offset ];
+            break;
+        default:
+            return (kIOReturnBadArgument);
+    }
+    OSSynchronizeIO();
+
+    return (kIOReturnSuccess);
+}
+
+IOReturn IOPCIDevice::ioWriteBlock( UInt16 offset, const void * data, IOByteCount count,
+                                    UInt8 size, IOMemoryMap * map )
+{
+    volatile void * base;
+    IOByteCount     idx;
+
+    if (0 == map)
+    {
+        map = ioMap;
+        if (0 == map)
+            return (kIOReturnNoMemory);
+    }
+    base = (volatile void *) map->getVirtualAddress();
+
+    switch (size)
+    {
+        case sizeof(UInt32):
+            for (idx = 0; idx < count; idx++)
+                OSWriteLittleInt32(base, offset, ((const UInt32 *) data)[idx]);
+            break;
+        case sizeof(UInt16):
+            for (idx = 0; idx < count; idx++)
+                OSWriteLittleInt16(base, offset, ((const UInt16 *) data)[idx]);
+            break;
+        case sizeof(UInt8):
+            for (idx = 0; idx < count; idx++)
+                ((volatile UInt8 *) base)[ offset ] = ((const UInt8 *) data)[idx];
+            break;
+        default:
+            return (kIOReturnBadArgument);
+    }
+    OSSynchronizeIO();
+
+    return (kIOReturnSuccess);
+}
+
 #endif //  !defined(__i386__) && !defined(__x86_64__)
 
 
@@ -30,6 +30,11 @@
 #include <IOKit/IODeviceTreeSupport.h>
 #include <IOKit/IOPlatformExpert.h>
 #include <IOKit/IOMapper.h>
+#include "msistats.h"
+
+#include <kern/cpu_number.h>
+#include <machine/machine_routines.h>
+#define msiStatsCPUCount()  (ml_get_max_cpus())
 
 #define kMSIFreeCountKey    "MSIFree"
 
@@ -52,6 +57,9 @@ extern uint32_t gIOPCIFlags;
 
 #if !ACPI_SUPPORT
 #define IOPCISetMSIInterrupt(a,b,c)		kIOReturnUnsupported
+#define IOPCISetMSIInterruptDeferred(a,b,c)	kIOReturnUnsupported
+#define IOPCICommitInterrupts(a,b)		kIOReturnUnsupported
+#define IOPCISteerMSIInterrupt(a,b,c)	kIOReturnUnsupported
 #endif
 
 #undef  super
@@ -80,6 +88,37 @@ OSDefineMetaClassAndStructors(IOPCIMessagedInterruptController, IOInterruptContr
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// One cpu's counts for one vector. A vector is only delivered to the cpu of
+// its interrupt window, so the dispatch path writes its cpu's entry without
+// locks; each cpu's entries are whole cache lines of their own.
+struct IOPCIMSIVectorStats
+{
+	uint64_t deliveries;
+	uint64_t spurious;
+	uint64_t maskedPending;
+	uint64_t handlerTime;
+	uint32_t handlerTimeHist[kMSIStatsHistBuckets];
+};
+static_assert(0 == (sizeof(IOPCIMSIVectorStats) & 63), "IOPCIMSIVectorStats not cache line sized");
+
+struct IOPCIMSIStats
+{
+	IOPCIDevice *         device;
+	IOPCIMSIVectorStats * entries;		// [cpus][count]
+	vm_size_t             size;
+	uint32_t              firstVector;
+	uint32_t              count;
+	bool                  shared;
+};
+
+static inline IOPCIMSIVectorStats * msiStatsEntry(IOPCIMSIStats * stats, uint32_t cpus, uint32_t index)
+{
+	if (!stats || (index >= stats->count)) return (NULL);
+	return (&stats->entries[(cpu_number() % cpus) * stats->count + index]);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
 static uint32_t msiModeToInterruptType(const uint8_t msiMode)
 {
     uint32_t interruptType = (kIOInterruptTypeEdge | kIOInterruptTypePCIMessaged);
@@ -93,6 +132,75 @@ static uint32_t msiModeToInterruptType(const uint8_t msiMode)
     return interruptType;
 }
 
+inline void IOPCIMessagedInterruptController::dispatchVector(IOInterruptVector * vector,
+                                                             IOPCIMSIStats * stats, uint32_t index)
+{
+	IOPCIMSIVectorStats * entry;
+	uint64_t              start = 0, time;
+	uint32_t              bucket;
+
+	if ((entry = msiStatsEntry(stats, _statsCPUs, index))) entry->deliveries++;
+
+	vector->interruptActive = 1;
+	if (vector->interruptRegistered)
+	{
+		if (vector->interruptDisabledHard)
+		{
+			vector->interruptRegistered = 3;
+			if (entry) entry->maskedPending++;
+		}
+		else
+		{
+			if (entry) start = mach_absolute_time();
+			vector->handler(vector->target, vector->refCon, vector->nub, vector->source);
+			if (entry)
+			{
+				time    = mach_absolute_time() - start;
+				bucket  = time ? (64 - __builtin_clzll(time)) : 0;
+				if (bucket >= kMSIStatsHistBuckets) bucket = kMSIStatsHistBuckets - 1;
+				entry->handlerTime += time;
+				entry->handlerTimeHist[bucket]++;
+			}
+			if (_moderated) moderateVector(vector);
+		}
+	}
+	else if (entry) entry->spurious++;
+	vector->interruptActive = 0;
+}
+
+// Track registered shared msix sub vectors, so handleInterrupt() only reads
+// the pba words that can matter. Word bits are left set until the sub vectors
+// are freed, a stale one costs a read but never loses an interrupt.
+static void msiRegisteredMaskUpdate(IOService * nub, IOInterruptVectorNumber index, bool registered)
+{
+	IOPCIDevice * device;
+	uint32_t    * mask;
+
+	if (!(device = OSDynamicCast(IOPCIDevice, nub))) return;
+	if (!(mask = device->reserved->msiRegisteredMask)) return;
+
+	if (registered)
+	{
+		OSBitOrAtomic(1U << (index & 31), &mask[index >> 5]);
+		OSBitOrAtomic(1U << (index >> 6), &device->reserved->msiRegisteredWords);
+	}
+	else
+	{
+		OSBitAndAtomic(~(1U << (index & 31)), &mask[index >> 5]);
+	}
+}
+
+// A moderated vector is masked at the table, but its pba bit still shows when
+// a sibling fires. Leave it for the unmask in moderationPoll(), which has the
+// device deliver it.
+static inline bool msiVectorModerated(IOPCIDevice * device, uint32_t index)
+{
+	IOPCIMSIModeration ** table;
+
+	if (!(table = device->reserved->msiModeration)) return (false);
+	return (table[index] && table[index]->moderated);
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 IOReturn IOPCIMessagedInterruptController::registerInterrupt(IOService *nub, int source,
@@ -126,6 +234,8 @@ IOReturn IOPCIMessagedInterruptController::registerInterrupt(IOService *nub, int
 	vector->interruptDisabledSoft = 1;
 	vector->interruptRegistered   = 1;
 
+	if (subVectors) msiRegisteredMaskUpdate(nub, vectorNumber, true);
+
 	IOLockUnlock(vector->interruptLock);
 
     IOPCIDevice * device = OSDynamicCast(IOPCIDevice, nub);
@@ -151,9 +261,14 @@ IOReturn IOPCIMessagedInterruptController::unregisterInterrupt(IOService *nub, i
 	// Soft disable the source.
 	disableInterrupt(nub, source);
 
+	// No moderation poll may unmask it again.
+	if (_moderated) stopModeration(OSDynamicCast(IOPCIDevice, nub), vector);
+
 	// Turn the source off at hardware. 
 	disableVectorHard(vectorNumber, vector);
 
+	if (subVectors) msiRegisteredMaskUpdate(nub, vectorNumber, false);
+
 	// Clear all the storage for the vector except for interruptLock.
 	vector->interruptActive = 0;
 	vector->interruptDisabledSoft = 0;
@@ -203,9 +318,10 @@ IOReturn IOPCIMessagedInterruptController::enableInterrupt(IOService *nub, int s
 		{
 			while (vector->interruptActive) {}
 		}
-		if (vector->interruptDisabledHard) 
+		// one enabler unmasks
+		if (vector->interruptDisabledHard
+		 && OSCompareAndSwap8(1, 0, (volatile UInt8 *) &vector->interruptDisabledHard))
 		{
-			vector->interruptDisabledHard = 0;
 			enableVector(vectorNumber, vector);
 		}
 	}
@@ -232,37 +348,28 @@ IOReturn IOPCIMessagedInterruptController::disableInterrupt(IOService *nub, int
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// The vector lock only serializes the register/unregister/steer slow paths,
+// dispatch and enable/disable never take it. Rather than a lock allocation per
+// vector, thousands for msix, vectors share a few striped locks. No path holds
+// two vector locks at once.
 IOInterruptVector * IOPCIMessagedInterruptController::allocVectors(uint32_t count)
 {
     IOInterruptVector * vectors;
 
-    vectors = IONew(IOInterruptVector, count);
+    vectors = IONewZero(IOInterruptVector, count);
     if (!vectors) return (0);
-    bzero(vectors, sizeof(IOInterruptVector) * count);
 
-    // Allocate locks for the vectors.
     for (uint32_t i = 0; i < count; i++)
     {
-        vectors[i].interruptLock = IOLockAlloc();
-        if (!vectors[i].interruptLock)
-        {
-            goto fail;
-        }
+        vectors[i].interruptLock = _vectorLocks[i % kVectorLockStripes];
     }
 
     return (vectors);
+}
 
-fail:
-    for (uint32_t i = 0; i < count; i++)
-    {
-        if (vectors[i].interruptLock)
-        {
-            IOLockFree(vectors[i].interruptLock);
-            vectors[i].interruptLock = NULL;
-        }
-    }
-    IOSafeDeleteNULL(vectors, IOInterruptVector, count);
-    return (0);
+void IOPCIMessagedInterruptController::freeVectors(IOInterruptVector * vectors, uint32_t count)
+{
+    IODelete(vectors, IOInterruptVector, count);
 }
 
 bool IOPCIMessagedInterruptController::init(UInt32 numVectors, UInt32 baseVector, uint32_t domainId)
@@ -279,9 +386,21 @@ bool IOPCIMessagedInterruptController::init(UInt32 numVectors, UInt32 baseVector
     setProperty(kVectorCountKey, _vectorCount, 32);
 	if (-1 != baseVector) setProperty(kBaseVectorNumberKey, baseVector, 32);
 
+    for (uint32_t i = 0; i < kVectorLockStripes; i++)
+    {
+        _vectorLocks[i] = IOLockAlloc();
+        if (!_vectorLocks[i]) return (false);
+    }
+
     // Allocate the memory for the vectors shared with the superclass.
 	vectors = allocVectors(_vectorCount);
     if (!vectors) return (false);
+    _vectorAlias = IONewZero(uint16_t, _vectorCount);
+    _vectorSteer = IONewZero(uint16_t, _vectorCount);
+    if (!_vectorAlias || !_vectorSteer) return (false);
+    _vectorStats = IONewZero(IOPCIMSIStats *, _vectorCount);
+    _statsLock   = IOLockAlloc();
+    if (!_vectorStats || !_statsLock) return (false);
 
     attach(getPlatform());
     sym = copyName();
@@ -291,6 +410,8 @@ bool IOPCIMessagedInterruptController::init(UInt32 numVectors, UInt32 baseVector
 
     num = OSDynamicCast(OSNumber, getProperty(kBaseVectorNumberKey));
     if (num) _vectorBase = num->unsigned32BitValue();
+    // one record per cpu that can dispatch, not per interrupt cpu window
+    _statsCPUs = msiStatsCPUCount();
 
     _messagedInterruptsAllocator = IORangeAllocator::withRange(0, 0, 4, IORangeAllocator::kLocking);
     _messagedInterruptsAllocator->deallocate(0, _vectorCount);
@@ -494,6 +615,9 @@ IOReturn IOPCIMessagedInterruptController::allocateDeviceInterrupts(
     if (numRequested) msiPhysVectors = numVectors;
 
 	firstVector = static_cast<uint32_t>(rangeStart);
+	// late interrupts of a freed steering alias may still arrive, but no longer once reused
+	for (vector = firstVector; vector < (firstVector + numVectors); vector++) _vectorAlias[vector] = 0;
+
 	ret = entry->callPlatformFunction(gIOPlatformGetMessagedInterruptAddressKey,
 				/* waitForFunction */ false,
 				/* nub             */ entry,
@@ -506,7 +630,10 @@ IOReturn IOPCIMessagedInterruptController::allocateDeviceInterrupts(
         uint32_t interruptFlags = (kIOInterruptTypeEdge | kIOInterruptTypePCIMessaged);
         if (device)
         {
-            IOPCISetMSIInterrupt(firstVector + _vectorBase, numVectors, &message[0]);
+            // staged, the first enableDeviceMSI() commits every device allocated since
+            IOPCISetMSIInterruptDeferred(firstVector + _vectorBase, numVectors, &message[0]);
+            // callers programming their own message may use it as soon as we return
+            if (!msiCapability) IOPCICommitInterrupts(NULL, NULL);
         }
 
         if (msiAddress) *msiAddress = message[0] | (((uint64_t)message[1]) << 32);
@@ -533,6 +660,8 @@ IOReturn IOPCIMessagedInterruptController::allocateDeviceInterrupts(
 			  && (numVectors < msiPhysVectors))
 			{
 				device->reserved->msiVectors = allocVectors(msiPhysVectors);
+				device->reserved->msiRegisteredMask  = IONewZero(uint32_t, 2 * ((msiPhysVectors + 63) >> 6));
+				device->reserved->msiRegisteredWords = 0;
 				IOInterruptVector * ivector = &vectors[firstVector];
 				// Fill in vector with the IOPCIMessagedInterruptController info
 				ivector->handler = OSMemberFunctionCast(IOInterruptHandler,
@@ -567,6 +696,8 @@ IOReturn IOPCIMessagedInterruptController::allocateDeviceInterrupts(
 			saved->data     = message[2];
 			device->reserved->msiPhysVectorCount = msiPhysVectors;
 			device->reserved->msiVectorCount     = numVectors;
+			if (vectors[firstVector].sharedController) allocateStatistics(device, firstVector, msiPhysVectors, true);
+			else                                       allocateStatistics(device, firstVector, numVectors, false);
 
             if (kMSIX & device->reserved->msiMode)
             {
@@ -663,6 +794,9 @@ void IOPCIMessagedInterruptController::enableDeviceMSI(IOPCIDevice *device)
             IOByteCount msi = device->reserved->msiCapability;
             uint16_t control;
 
+            // remapping entries must be live before the device can send
+            IOPCICommitInterrupts(NULL, NULL);
+
             control = device->reserved->msiControl;
             if (kMSIX & device->reserved->msiMode)
             {
@@ -782,6 +916,18 @@ IOReturn IOPCIMessagedInterruptController::deallocateDeviceInterrupts(IOService
     }
     myName->release();
 
+    IOPCIDevice * pciDevice = OSDynamicCast(IOPCIDevice, device);
+    if (pciDevice && pciDevice->reserved->msiModeration)
+    {
+        // entries went with unregisterInterrupt()
+        IODelete(pciDevice->reserved->msiModeration, IOPCIMSIModeration *, pciDevice->reserved->msiPhysVectorCount);
+        pciDevice->reserved->msiModeration = NULL;
+    }
+    if (pciDevice) freeStatistics(pciDevice);
+
+    // one remapping invalidate for all the vectors released
+    IOPCICommitInterrupts(NULL, NULL);
+
     return (kIOReturnSuccess);
 }
 
@@ -793,17 +939,530 @@ void IOPCIMessagedInterruptController::deallocateInterrupt(UInt32 vector)
 
 	if ((subVectors = (IOInterruptVector *) vectors[vector].sharedController))
 	{
+		IOPCIDevice * device = (IOPCIDevice *) vectors[vector].nub;
+
 		count = (typeof(count))(uintptr_t) vectors[vector].refCon;
 		vectors[vector].sharedController = 0;
-	    IODelete(subVectors, IOInterruptVector, count);
+	    freeVectors(subVectors, count);
+		if (device->reserved->msiRegisteredMask)
+		{
+			IODelete(device->reserved->msiRegisteredMask, uint32_t, 2 * ((count + 63) >> 6));
+			device->reserved->msiRegisteredMask  = NULL;
+			device->reserved->msiRegisteredWords = 0;
+		}
+	}
+
+	if (_vectorSteer[vector])
+	{
+		_messagedInterruptsAllocator->deallocate(_vectorSteer[vector] - 1, 1);
+		_vectorSteer[vector] = 0;
 	}
 
 	rangeStart = vector;
     _messagedInterruptsAllocator->deallocate(rangeStart, 1);
-    IOPCISetMSIInterrupt(static_cast<uint32_t>(rangeStart + _vectorBase), 1, NULL);
+    IOPCISetMSIInterruptDeferred(static_cast<uint32_t>(rangeStart + _vectorBase), 1, NULL);
     setProperty(kMSIFreeCountKey, _messagedInterruptsAllocator->getFreeCount(), 32);
 }
 
+uint32_t IOPCIMessagedInterruptController::getInterruptCPUCount(void)
+{
+    return (((_vectorBase + _vectorCount - 1) >> 8) + 1);
+}
+
+IOReturn IOPCIMessagedInterruptController::steerVector(IOInterruptVectorNumber vectorNumber, uint32_t cpu)
+{
+    IOReturn      ret;
+    IORangeScalar alias;
+    uint32_t      platformVector, first, last;
+    uint16_t      prior;
+    bool          allocated;
+
+    platformVector = static_cast<uint32_t>(vectorNumber + _vectorBase);
+    prior          = _vectorSteer[vectorNumber];
+
+    if (cpu == (platformVector >> 8))
+    {
+        // home window, no alias
+        if (!prior) return (kIOReturnSuccess);
+        ret = IOPCISteerMSIInterrupt(platformVector, cpu, platformVector);
+        if (kIOReturnSuccess != ret) return (ret);
+        _vectorSteer[vectorNumber] = 0;
+    }
+    else
+    {
+        first = max(cpu << 8, (uint32_t) _vectorBase);
+        last  = min((cpu + 1) << 8, (uint32_t) (_vectorBase + _vectorCount));
+        for (allocated = false, alias = first; !allocated && (alias < last); alias++)
+        {
+            allocated = _messagedInterruptsAllocator->allocateRange(alias - _vectorBase, 1);
+        }
+        if (!allocated) return (kIOReturnNoSpace);
+        alias -= (1 + _vectorBase);
+
+        _vectorAlias[alias] = static_cast<uint16_t>(vectorNumber + 1);
+        ret = IOPCISteerMSIInterrupt(platformVector, cpu, static_cast<uint32_t>(alias + _vectorBase));
+        if (kIOReturnSuccess != ret)
+        {
+            _vectorAlias[alias] = 0;
+            _messagedInterruptsAllocator->deallocate(alias, 1);
+            return (ret);
+        }
+        _vectorSteer[vectorNumber] = static_cast<uint16_t>(alias + 1);
+    }
+
+    // the prior alias keeps forwarding until it is reallocated
+    if (prior) _messagedInterruptsAllocator->deallocate(prior - 1, 1);
+    setProperty(kMSIFreeCountKey, _messagedInterruptsAllocator->getFreeCount(), 32);
+
+    return (kIOReturnSuccess);
+}
+
+IOReturn IOPCIMessagedInterruptController::steerInterrupt(IOService * nub, int source, uint32_t cpu)
+{
+    const OSSymbol *        myName;
+    OSArray *               controllers;
+    OSObject *              controller;
+    OSArray *               specs;
+    OSData *                spec;
+    IOInterruptVectorNumber vectorNumber;
+    IOReturn                ret;
+    bool                    owned;
+
+    if (cpu >= getInterruptCPUCount()) return (kIOReturnBadArgument);
+
+    // shared msix sub vectors all resolve to, and move with, the device's vector
+    controllers = OSDynamicCast(OSArray, nub->getProperty(gIOInterruptControllersKey));
+    specs = OSDynamicCast(OSArray, nub->getProperty(gIOInterruptSpecifiersKey));
+    if (!controllers || !specs || (source < 0)) return (kIOReturnBadArgument);
+    controller = controllers->getObject(source);
+    myName = copyName();
+    owned = (controller && myName && controller->isEqualTo(myName));
+    OSSafeReleaseNULL(myName);
+    if (!owned) return (kIOReturnBadArgument);
+    spec = OSDynamicCast(OSData, specs->getObject(source));
+    if (!spec || (spec->getLength() < sizeof(uint32_t))) return (kIOReturnBadArgument);
+    vectorNumber = *((uint32_t *) spec->getBytesNoCopy());
+    if ((vectorNumber >= _vectorCount) || _vectorAlias[vectorNumber]) return (kIOReturnBadArgument);
+
+    IOLockLock(vectors[vectorNumber].interruptLock);
+    ret = steerVector(vectorNumber, cpu);
+    IOLockUnlock(vectors[vectorNumber].interruptLock);
+
+    if (kIOReturnSuccess == ret) ret = IOPCICommitInterrupts(NULL, NULL);
+
+    return (ret);
+}
+
+IOReturn IOPCIMessagedInterruptController::spreadDeviceInterrupts(IOService * device, uint32_t cpuMask)
+{
+    const OSSymbol * myName;
+    OSArray *        controllers;
+    OSObject *       controller;
+    OSArray *        specs;
+    OSData *         spec;
+    uint32_t         index, firstVector, cpu, cpuCount, allMask;
+    IOReturn         ret;
+
+    // the mask has a bit per vector window, windows past 31 can't be named
+    cpuCount = min(getInterruptCPUCount(), 32U);
+    allMask  = (cpuCount >= 32) ? -1U : ((1U << cpuCount) - 1);
+    cpuMask &= allMask;
+    if (!cpuMask) cpuMask = allMask;
+
+    myName = copyName();
+
+    controllers = OSDynamicCast(OSArray, device->getProperty(gIOInterruptControllersKey));
+    specs = OSDynamicCast(OSArray, device->getProperty(gIOInterruptSpecifiersKey));
+
+    if (!myName || !controllers || !specs)
+    {
+        OSSafeReleaseNULL(myName);
+        return (kIOReturnBadArgument);
+    }
+
+    ret = kIOReturnSuccess;
+    cpu = 0;
+	for (index = 0, firstVector = -1U;
+        (spec = OSDynamicCast(OSData, specs->getObject(index)))
+		  && (controller = controllers->getObject(index));
+		index++)
+    {
+        if (!controller->isEqualTo(myName)) continue;
+
+		uint32_t vector = *((uint32_t *) spec->getBytesNoCopy());
+		if (vector == firstVector) continue;
+		if (-1U == firstVector)    firstVector = vector;
+
+        // next cpu in the mask, round robin
+        while (!(cpuMask & (1U << cpu))) cpu = (cpu + 1) % cpuCount;
+
+        IOLockLock(vectors[vector].interruptLock);
+        ret = steerVector(vector, cpu);
+        IOLockUnlock(vectors[vector].interruptLock);
+        if (kIOReturnSuccess != ret) break;
+
+        cpu = (cpu + 1) % cpuCount;
+    }
+    myName->release();
+
+    // one remapping invalidate for the device
+    IOPCICommitInterrupts(NULL, NULL);
+
+    return (ret);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Accounting lives with the device's vectors, it is kept across unregister
+// so a driver's counts can still be read, and goes when they are freed.
+
+void IOPCIMessagedInterruptController::allocateStatistics(IOPCIDevice * device, uint32_t firstVector,
+                                                          uint32_t count, bool shared)
+{
+    IOPCIMSIStats * stats;
+    uint32_t        vector;
+
+    freeStatistics(device);
+    if (!count) return;
+
+    stats = IONewZero(IOPCIMSIStats, 1);
+    if (!stats) return;
+    stats->size    = _statsCPUs * count * sizeof(IOPCIMSIVectorStats);
+    stats->entries = (typeof(stats->entries)) IOMallocAligned(stats->size, 64);
+    if (!stats->entries)
+    {
+        IODelete(stats, IOPCIMSIStats, 1);
+        return;
+    }
+    bzero(stats->entries, stats->size);
+    stats->device      = device;
+    stats->firstVector = firstVector;
+    stats->count       = count;
+    stats->shared      = shared;
+
+    IOLockLock(_statsLock);
+    device->reserved->msiStats = stats;
+    for (vector = firstVector; vector < (firstVector + (shared ? 1 : count)); vector++) _vectorStats[vector] = stats;
+    IOLockUnlock(_statsLock);
+}
+
+void IOPCIMessagedInterruptController::freeStatistics(IOPCIDevice * device)
+{
+    IOPCIMSIStats * stats;
+    uint32_t        vector;
+
+    IOLockLock(_statsLock);
+    if ((stats = device->reserved->msiStats))
+    {
+        device->reserved->msiStats = NULL;
+        for (vector = stats->firstVector; vector < (stats->firstVector + (stats->shared ? 1 : stats->count)); vector++)
+        {
+            if (stats == _vectorStats[vector]) _vectorStats[vector] = NULL;
+        }
+    }
+    IOLockUnlock(_statsLock);
+
+    if (!stats) return;
+    IOFreeAligned(stats->entries, stats->size);
+    IODelete(stats, IOPCIMSIStats, 1);
+}
+
+IOReturn IOPCIMessagedInterruptController::copyStatistics(void * buffer, uint32_t * length)
+{
+    msi_stats_header_t        header;
+    msi_stats_vector_t        record;
+    IOPCIMSIStats *           stats;
+    IOPCIMSIVectorStats *     entry;
+    IOInterruptVector *       vector;
+    mach_timebase_info_data_t timebase;
+    uint32_t                  idx, index, cpu, offset;
+
+    bzero(&header, sizeof(header));
+    offset = sizeof(header);
+
+    IOLockLock(_statsLock);
+    for (idx = 0; idx < _vectorCount; idx++)
+    {
+        if (!(stats = _vectorStats[idx])) continue;
+        // a shared device's sub vectors are all reached from its first vector
+        for (index = (stats->shared ? 0 : (idx - stats->firstVector));
+             index < (stats->shared ? stats->count : (idx - stats->firstVector + 1));
+             index++)
+        {
+            vector = stats->shared ? &((IOInterruptVector *) vectors[idx].sharedController)[index] : &vectors[idx];
+            for (cpu = 0; cpu < _statsCPUs; cpu++)
+            {
+                entry = &stats->entries[cpu * stats->count + index];
+                if (!entry->deliveries) continue;
+
+                bzero(&record, sizeof(record));
+                strlcpy(record.name, stats->device->getName(), sizeof(record.name));
+                record.location = (stats->device->getBusNumber() << 8)
+                                | (stats->device->getDeviceNumber() << 3)
+                                | stats->device->getFunctionNumber();
+                record.vector   = idx + _vectorBase;
+                record.index    = index;
+                record.cpu      = cpu;
+                if (vector->interruptRegistered)                     record.flags |= kMSIStatsVectorRegistered;
+                if (stats->shared)                                   record.flags |= kMSIStatsVectorShared;
+                if (kMSIX & stats->device->reserved->msiMode)        record.flags |= kMSIStatsVectorMSIX;
+                // racy against the dispatching cpu, good enough for counts
+                record.deliveries     = entry->deliveries;
+                record.spurious       = entry->spurious;
+                record.masked_pending = entry->maskedPending;
+                record.handler_time   = entry->handlerTime;
+                bcopy(&entry->handlerTimeHist[0], &record.handler_time_hist[0], sizeof(record.handler_time_hist));
+
+                if ((offset + sizeof(record)) <= *length) bcopy(&record, ((uint8_t *) buffer) + offset, sizeof(record));
+                offset += sizeof(record);
+                header.vectors++;
+            }
+        }
+    }
+    IOLockUnlock(_statsLock);
+
+    clock_timebase_info(&timebase);
+    header.magic          = kMSIStatsMagic;
+    header.version        = kMSIStatsVersion;
+    header.header_length  = sizeof(header);
+    header.length         = offset;
+    header.vector_length  = sizeof(record);
+    header.cpus           = _statsCPUs;
+    header.timebase_numer = timebase.numer;
+    header.timebase_denom = timebase.denom;
+    header.time           = mach_absolute_time();
+    if (sizeof(header) <= *length) bcopy(&header, buffer, sizeof(header));
+
+    if (offset > *length)
+    {
+        *length = offset;
+        return (kIOReturnNoSpace);
+    }
+    *length = offset;
+
+    return (kIOReturnSuccess);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Software moderation of msix vectors. Above threshold interrupts in a window
+// the vector is masked after each dispatch and a poll unmasks it every interval,
+// letting the device's pending bit deliver one interrupt for the whole backlog.
+// A poll that finds no interrupt since the last one ends moderation.
+
+#define kMSIModerationWindowUS      (10000)
+#define kMSIModerationIntervalUS    (50)
+
+static void moderationFree(IOPCIMSIModeration * moderation)
+{
+    if (moderation->poll) thread_call_free(moderation->poll);
+    if (moderation->lock) IOSimpleLockFree(moderation->lock);
+    IODelete(moderation, IOPCIMSIModeration, 1);
+}
+
+IOReturn IOPCIMessagedInterruptController::setInterruptModeration(IOService * nub, int source,
+                                                                  uint32_t maxRate, uint32_t intervalUS)
+{
+    IOPCIDevice *         device;
+    IOPCIMSIModeration ** table;
+    IOPCIMSIModeration *  moderation;
+    IOInterruptState      is;
+    uint32_t              index, count;
+    uint64_t              window, interval;
+
+    if (!(device = OSDynamicCast(IOPCIDevice, nub))) return (kIOReturnBadArgument);
+    if (!nub->_interruptSources || (source < 0) || (source >= nub->_numInterruptSources)) return (kIOReturnBadArgument);
+
+    API_ENTRY();
+
+    // masking needs the msix table
+    if (!device->reserved->msiTable || !device->reserved->msiVectors) return (kIOReturnUnsupported);
+    count = device->reserved->msiPhysVectorCount;
+    index = static_cast<uint32_t>(vector - device->reserved->msiVectors);
+    if (index >= count) return (kIOReturnBadArgument);
+
+    if (!intervalUS) intervalUS = kMSIModerationIntervalUS;
+    clock_interval_to_absolutetime_interval(kMSIModerationWindowUS, kMicrosecondScale, &window);
+    clock_interval_to_absolutetime_interval(intervalUS, kMicrosecondScale, &interval);
+
+    IOLockLock(vector->interruptLock);
+
+    if (!vector->interruptRegistered)
+    {
+        IOLockUnlock(vector->interruptLock);
+        return (kIOReturnNotReady);
+    }
+
+    if (!maxRate)
+    {
+        if (_moderated) stopModeration(device, vector);
+        IOLockUnlock(vector->interruptLock);
+        return (kIOReturnSuccess);
+    }
+
+    if (!(table = device->reserved->msiModeration))
+    {
+        table = IONewZero(IOPCIMSIModeration *, count);
+        if (!table)
+        {
+            IOLockUnlock(vector->interruptLock);
+            return (kIOReturnNoMemory);
+        }
+        if (!OSCompareAndSwapPtr(NULL, table, &device->reserved->msiModeration))
+        {
+            IODelete(table, IOPCIMSIModeration *, count);
+            table = device->reserved->msiModeration;
+        }
+    }
+
+    if (!(moderation = table[index]))
+    {
+        moderation = IONewZero(IOPCIMSIModeration, 1);
+        if (moderation)
+        {
+            moderation->lock = IOSimpleLockAlloc();
+            moderation->poll = thread_call_allocate_with_priority(
+                                    OSMemberFunctionCast(thread_call_func_t, this,
+                                                         &IOPCIMessagedInterruptController::moderationPoll),
+                                    this, THREAD_CALL_PRIORITY_HIGH);
+        }
+        if (!moderation || !moderation->lock || !moderation->poll)
+        {
+            if (moderation) moderationFree(moderation);
+            IOLockUnlock(vector->interruptLock);
+            return (kIOReturnNoMemory);
+        }
+        moderation->device = device;
+        moderation->vector = vector;
+        moderation->index  = index;
+    }
+
+    is = IOSimpleLockLockDisableInterrupt(moderation->lock);
+    moderation->window    = window;
+    moderation->interval  = interval;
+    moderation->threshold = max(1U, static_cast<uint32_t>((maxRate * (uint64_t) kMSIModerationWindowUS) / 1000000ULL));
+    IOSimpleLockUnlockEnableInterrupt(moderation->lock, is);
+
+    if (!table[index])
+    {
+        OSMemoryBarrier();
+        table[index] = moderation;
+        OSIncrementAtomic(&_moderated);
+    }
+
+    IOLockUnlock(vector->interruptLock);
+
+    DLOG(INTERRUPT, "%s: moderation index %d threshold %d interval %dus\n",
+         device->getName(), index, moderation->threshold, intervalUS);
+
+    return (kIOReturnSuccess);
+}
+
+// called with the vector's interruptLock held, never at interrupt level
+void IOPCIMessagedInterruptController::stopModeration(IOPCIDevice * device, IOInterruptVector * vector)
+{
+    IOPCIMSIModeration ** table;
+    IOPCIMSIModeration *  moderation;
+    IOInterruptState      is;
+    uint32_t              index;
+
+    if (!device || !(table = device->reserved->msiModeration)) return;
+    index = static_cast<uint32_t>(vector - device->reserved->msiVectors);
+    if (index >= device->reserved->msiPhysVectorCount) return;
+    if (!(moderation = table[index])) return;
+
+    is = IOSimpleLockLockDisableInterrupt(moderation->lock);
+    table[index] = NULL;
+    moderation->moderated = false;
+    IOSimpleLockUnlockEnableInterrupt(moderation->lock, is);
+
+    // a dispatch that found the entry finishes, then the poll it may have armed
+    while (vector->interruptActive) {}
+    thread_call_cancel_wait(moderation->poll);
+
+    if (vector->interruptRegistered && !vector->interruptDisabledHard) enableVector(index, vector);
+
+    moderationFree(moderation);
+    OSDecrementAtomic(&_moderated);
+}
+
+void IOPCIMessagedInterruptController::moderateVector(IOInterruptVector * vector)
+{
+    IOPCIDevice *         device;
+    IOPCIMSIModeration ** table;
+    IOPCIMSIModeration *  moderation;
+    uint64_t              now;
+    uint32_t              index;
+    bool                  mask, arm;
+
+    device = (IOPCIDevice *) vector->nub;
+    if (OSTypeID(IOPCIDevice) != device->getMetaClass()) return;
+    if (!(table = device->reserved->msiModeration)) return;
+    index = static_cast<uint32_t>(vector - device->reserved->msiVectors);
+    if (index >= device->reserved->msiPhysVectorCount) return;
+    if (!(moderation = table[index])) return;
+
+    now  = mach_absolute_time();
+    mask = arm = false;
+
+    IOSimpleLockLock(moderation->lock);
+    if (moderation->moderated)
+    {
+        moderation->pending++;
+        mask = true;
+    }
+    else
+    {
+        if ((now - moderation->windowStart) >= moderation->window)
+        {
+            moderation->windowStart = now;
+            moderation->count       = 0;
+        }
+        if (++moderation->count > moderation->threshold)
+        {
+            // the triggering interrupt counts, the first poll always unmasks
+            moderation->moderated = true;
+            moderation->pending   = 1;
+            moderation->moderations++;
+            mask = arm = true;
+        }
+    }
+    if (mask) disableVectorHard(index, vector);
+    if (arm)  thread_call_enter1_delayed(moderation->poll, moderation, now + moderation->interval);
+    IOSimpleLockUnlock(moderation->lock);
+}
+
+void IOPCIMessagedInterruptController::moderationPoll(IOPCIMSIModeration * moderation)
+{
+    IOInterruptVector * vector;
+    IOInterruptState    is;
+    uint64_t            now;
+
+    vector = moderation->vector;
+    now    = mach_absolute_time();
+
+    is = IOSimpleLockLockDisableInterrupt(moderation->lock);
+    if (moderation->moderated)
+    {
+        moderation->polls++;
+        if (!moderation->pending)
+        {
+            // drained
+            moderation->moderated   = false;
+            moderation->windowStart = now;
+            moderation->count       = 0;
+        }
+        else
+        {
+            moderation->pending = 0;
+            thread_call_enter1_delayed(moderation->poll, moderation, now + moderation->interval);
+        }
+        // a pending bit set while masked delivers now
+        if (!vector->interruptDisabledHard) enableVector(moderation->index, vector);
+    }
+    IOSimpleLockUnlockEnableInterrupt(moderation->lock, is);
+}
+
 IOReturn
 IOPCIMessagedInterruptController::handleInterrupt( void *      state,
                                                    IOService * nub,
@@ -811,13 +1470,19 @@ IOPCIMessagedInterruptController::handleInterrupt( void *      state,
 {
     IOInterruptVector * vector;
 	IOInterruptVector * subVectors;
+	IOPCIMSIStats     * stats;
+	IOPCIMSIVectorStats * entry;
 	uint64_t            bits;
-	uint32_t            count, bit;
+	uint32_t            words, word, bit, count, index;
+	uint32_t          * mask;
+	bool                dispatched;
 
     source -= _vectorBase;
-    if ((source < 0) || (source > (int) _vectorCount)) return (kIOReturnSuccess);
+    if ((source < 0) || (source >= (int) _vectorCount)) return (kIOReturnSuccess);
+    if (_vectorAlias[source]) source = _vectorAlias[source] - 1;
 
     vector = &vectors[source];
+    stats  = _vectorStats[source];
 	if ((subVectors = (IOInterruptVector *) vector->sharedController))
 	{
 		IOPCIDevice * device;
@@ -827,48 +1492,51 @@ IOPCIMessagedInterruptController::handleInterrupt( void *      state,
 
 //      if (!(kIOPCICommandMemorySpace & device->configRead16(kIOPCIConfigCommand))) return (kIOReturnSuccess);
 
-		count = (typeof(count))(uintptr_t) vector->refCon;
-		bits = 0;
-		for (source = 0; source < count; source++)
-		{
-            if (device->reserved->msiEnable == 1)
+        if (device->reserved->msiEnable == 1)
+        {
+            dispatchVector(&subVectors[0], stats, 0);
+        }
+        else if ((mask = device->reserved->msiRegisteredMask))
+        {
+            // only pba words holding registered vectors, then only their set bits
+            dispatched = false;
+            words = device->reserved->msiRegisteredWords;
+            while (words)
             {
-                vector = &subVectors[0];
-                count = 1;
+                word   = __builtin_ctz(words);
+                words &= (words - 1);
+                bits   = ((volatile uint64_t *) device->reserved->msiPBA)[word];
+                bits  &= ((((uint64_t) mask[2 * word + 1]) << 32) | mask[2 * word]);
+                while (bits)
+                {
+                    bit   = __builtin_ctzll(bits);
+                    bits &= (bits - 1);
+                    dispatched = true;
+                    if (_moderated && msiVectorModerated(device, (word << 6) + bit)) continue;
+                    dispatchVector(&subVectors[(word << 6) + bit], stats, (word << 6) + bit);
+                }
             }
-            else
+            // nothing pending, charged to the first entry
+            if (!dispatched && (entry = msiStatsEntry(stats, _statsCPUs, 0))) entry->spurious++;
+        }
+        else
+        {
+            // no registered mask, every pba bit of the device
+            count = (typeof(count))(uintptr_t) vector->refCon;
+            bits  = 0;
+            for (index = 0; index < count; index++)
             {
-                bit = (source & 63);
-                if (!bit) bits = ((volatile uint64_t *) device->reserved->msiPBA)[source >> 6];
+                bit = (index & 63);
+                if (!bit) bits = ((volatile uint64_t *) device->reserved->msiPBA)[index >> 6];
                 if (!(bits & (1ULL << bit))) continue;
-
-                vector = &subVectors[source];
-//                if (!vector->interruptRegistered && source) vector = &subVectors[0];
+                if (_moderated && msiVectorModerated(device, index)) continue;
+                dispatchVector(&subVectors[index], stats, index);
             }
-			vector->interruptActive = 1;
-			if (vector->interruptRegistered)
-			{
-				if (vector->interruptDisabledHard) vector->interruptRegistered = 3;
-				else
-				{
-					vector->handler(vector->target, vector->refCon, vector->nub, vector->source);
-				}
-			}
-			vector->interruptActive = 0;
-		}
+        }
 	}
 	else
     {
-		vector->interruptActive = 1;
-		if (vector->interruptRegistered)
-		{
-			if (vector->interruptDisabledHard) vector->interruptRegistered = 3;
-			else
-			{
-				vector->handler(vector->target, vector->refCon, vector->nub, vector->source);
-			}
-		}
-		vector->interruptActive = 0;
+		dispatchVector(vector, stats, stats ? (source - stats->firstVector) : 0);
     }
 
     return (kIOReturnSuccess);
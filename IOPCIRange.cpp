@@ -564,6 +564,164 @@ IOPCIScalar IOPCIRangeListSize(IOPCIRange * first)
 	return (prevAddr);
 }
 
+#define kIOPCIRangePlanMaxGaps  (64)
+
+struct IOPCIRangePlanGap
+{
+    IOPCIScalar start;
+    IOPCIScalar end;
+};
+
+// Would the count allocations from first still fit somewhere once [holeStart, holeEnd) is
+// taken, placing the most aligned first as the configurator does.
+static bool IOPCIRangePlanFits(IOPCIRange * headRange, IOPCIRange * first, uint32_t count,
+                               IOPCIScalar holeStart, IOPCIScalar holeEnd)
+{
+    IOPCIRangePlanGap gaps[kIOPCIRangePlanMaxGaps];
+    IOPCIRange *      moves[kIOPCIPausePlanMax];
+    IOPCIRange *      range;
+    IOPCIRange *      swap;
+    IOPCIScalar       pos, start;
+    uint32_t          gapCount, idx, next, moved;
+
+    if (!count)                      return (true);
+    if (count > kIOPCIPausePlanMax)  return (false);
+    for (idx = 0, range = first; idx < count; idx++, range = range->nextSubRange) moves[idx] = range;
+
+    gapCount = 0;
+    for (; headRange; headRange = headRange->next)
+    {
+        if (!headRange->size) continue;
+        pos = headRange->start;
+        for (range = headRange->allocations; ; range = range->nextSubRange)
+        {
+            if (range == first)
+            {
+                // the moved run is free
+                for (idx = 0; idx < count; idx++) range = range->nextSubRange;
+            }
+            // [pos, range->start) less the hole
+            if ((pos < holeStart) && (range->start > pos))
+            {
+                if (gapCount == kIOPCIRangePlanMaxGaps) return (false);
+                gaps[gapCount].start = pos;
+                gaps[gapCount].end   = (range->start < holeStart) ? range->start : holeStart;
+                gapCount++;
+            }
+            start = (pos > holeEnd) ? pos : holeEnd;
+            if (range->start > start)
+            {
+                if (gapCount == kIOPCIRangePlanMaxGaps) return (false);
+                gaps[gapCount].start = start;
+                gaps[gapCount].end   = range->start;
+                gapCount++;
+            }
+            if (!range->size) break;
+            pos = range->end;
+        }
+    }
+
+    for (moved = 0; moved < count; moved++)
+    {
+        for (next = moved + 1; next < count; next++)
+        {
+            if ((moves[next]->alignment > moves[moved]->alignment)
+             || ((moves[next]->alignment == moves[moved]->alignment) && (moves[next]->size > moves[moved]->size)))
+            {
+                swap = moves[moved]; moves[moved] = moves[next]; moves[next] = swap;
+            }
+        }
+        range = moves[moved];
+        for (idx = 0; idx < gapCount; idx++)
+        {
+            start = IOPCIScalarAlign(gaps[idx].start, range->alignment);
+            if ((start >= gaps[idx].start) && ((start + range->size) <= gaps[idx].end)) break;
+        }
+        if (idx == gapCount) return (false);
+        if (start > gaps[idx].start)
+        {
+            if (gapCount == kIOPCIRangePlanMaxGaps) return (false);
+            gaps[gapCount].start = gaps[idx].start;
+            gaps[gapCount].end   = start;
+            gapCount++;
+        }
+        gaps[idx].start = start + range->size;
+    }
+
+    return (true);
+}
+
+// Find the cheapest run of allocations whose removal leaves an aligned hole of size, with
+// room elsewhere in the list for what it displaces. plan gets the allocations to move.
+bool IOPCIRangeListPlanHole(IOPCIRange * headRange, IOPCIScalar size, IOPCIScalar alignment,
+                            IOPCIRangePlanCost cost, void * ref,
+                            IOPCIRange ** plan, uint32_t * planCount, IOPCIScalar * planCost)
+{
+    IOPCIRange * head;
+    IOPCIRange * first;
+    IOPCIRange * last;
+    IOPCIRange * range;
+    IOPCIRange * bestFirst;
+    IOPCIScalar  pos, hole, total, moved, rangeCost;
+    IOPCIScalar  bestCost, bestMoved;
+    uint32_t     count, bestCount, idx;
+
+    if (!size) return (false);
+    if (!alignment) alignment = 1;
+
+    bestFirst = NULL;
+    bestCount = 0;
+    bestCost  = kIOPCIRangePlanImmovable;
+    bestMoved = 0;
+    for (head = headRange; head; head = head->next)
+    {
+        if (!head->size) continue;
+
+        // the hole starts after first's predecessor and ends at last
+        pos = head->start;
+        for (first = head->allocations; ; pos = first->end, first = first->nextSubRange)
+        {
+            total = 0;
+            moved = 0;
+            count = 0;
+            hole  = IOPCIScalarAlign(pos, alignment);
+            for (last = first; ; last = last->nextSubRange)
+            {
+                if (((hole + size) <= last->start)
+                 && ((total < bestCost) || ((total == bestCost) && (moved < bestMoved)))
+                 && IOPCIRangePlanFits(headRange, first, count, hole, hole + size))
+                {
+                    bestFirst = first;
+                    bestCount = count;
+                    bestCost  = total;
+                    bestMoved = moved;
+                    break;
+                }
+                if (!last->size)                                    break;
+                rangeCost = (*cost)(ref, last);
+                if (kIOPCIRangePlanImmovable == rangeCost)          break;
+                total += rangeCost;
+                moved += last->size;
+                count++;
+                if (total > bestCost)                               break;
+            }
+            if (!first->size) break;
+        }
+    }
+
+    if (!bestFirst) return (false);
+    if (bestCount > *planCount)
+    {
+        *planCount = bestCount;
+        return (false);
+    }
+    for (idx = 0, range = bestFirst; idx < bestCount; idx++, range = range->nextSubRange) plan[idx] = range;
+    *planCount = bestCount;
+    if (planCost) *planCost = bestCost;
+
+    return (true);
+}
+
 void IOPCIRangeDump(IOPCIRange * head)
 {
 #if !DEVELOPMENT && !defined(__x86_64__) && defined(KERNEL)
@@ -603,7 +761,7 @@ void IOPCIRangeDump(IOPCIRange * head)
 #endif
 }
 
-#ifndef KERNEL
+#if !defined(KERNEL) && !defined(IOPCIRANGE_LIBRARY)
 
 int main(int argc, char **argv)
 {
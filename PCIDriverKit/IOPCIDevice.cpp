@@ -548,3 +548,204 @@ IOPCIDevice::MemoryWrite8(uint8_t  memoryIndex,
 {
 	MemoryWrite8(memoryIndex, offset, data, 0);
 }
+
+// widest naturally aligned access that fits what is left
+static uint64_t
+MemoryBlockAccessSize(uint64_t address, uint64_t remaining)
+{
+    uint64_t size = sizeof(uint64_t);
+
+    while((size > remaining) || (address & (size - 1)))
+    {
+        size >>= 1;
+    }
+    return size;
+}
+
+static void
+MemoryBlockCopy(uint64_t destination, uint64_t source, uint64_t length, bool toDevice)
+{
+    uint64_t size;
+
+    for(uint64_t done = 0; done < length; done += size)
+    {
+        // only the device side needs aligned accesses
+        size = MemoryBlockAccessSize((toDevice ? destination : source) + done, length - done);
+        switch(size)
+        {
+            case sizeof(uint64_t):
+            {
+                uint64_t value;
+                if(toDevice)
+                {
+                    __builtin_memcpy(&value, reinterpret_cast<void*>(source + done), size);
+                    *reinterpret_cast<volatile uint64_t*>(destination + done) = value;
+                }
+                else
+                {
+                    value = *reinterpret_cast<volatile uint64_t*>(source + done);
+                    __builtin_memcpy(reinterpret_cast<void*>(destination + done), &value, size);
+                }
+                break;
+            }
+            case sizeof(uint32_t):
+            {
+                uint32_t value;
+                if(toDevice)
+                {
+                    __builtin_memcpy(&value, reinterpret_cast<void*>(source + done), size);
+                    *reinterpret_cast<volatile uint32_t*>(destination + done) = value;
+                }
+                else
+                {
+                    value = *reinterpret_cast<volatile uint32_t*>(source + done);
+                    __builtin_memcpy(reinterpret_cast<void*>(destination + done), &value, size);
+                }
+                break;
+            }
+            case sizeof(uint16_t):
+            {
+                uint16_t value;
+                if(toDevice)
+                {
+                    __builtin_memcpy(&value, reinterpret_cast<void*>(source + done), size);
+                    *reinterpret_cast<volatile uint16_t*>(destination + done) = value;
+                }
+                else
+                {
+                    value = *reinterpret_cast<volatile uint16_t*>(source + done);
+                    __builtin_memcpy(reinterpret_cast<void*>(destination + done), &value, size);
+                }
+                break;
+            }
+            default:
+            {
+                if(toDevice)
+                {
+                    *reinterpret_cast<volatile uint8_t*>(destination + done) = *reinterpret_cast<uint8_t*>(source + done);
+                }
+                else
+                {
+                    *reinterpret_cast<uint8_t*>(destination + done) = *reinterpret_cast<volatile uint8_t*>(source + done);
+                }
+                break;
+            }
+        }
+    }
+}
+
+// copy through the dext's own mapping of the device, if it has one and may use it
+static kern_return_t
+MemoryBlockDirect(IOMemoryMap*        deviceMemory,
+                  uint64_t            offset,
+                  IOMemoryDescriptor* buffer,
+                  uint64_t            bufferOffset,
+                  uint64_t            length,
+                  bool                toDevice)
+{
+    IOBufferMemoryDescriptor* localBuffer = OSDynamicCast(IOBufferMemoryDescriptor, buffer);
+    IOMemoryMap*              bufferMap   = NULL;
+    IOAddressSegment          range;
+    uint64_t                  end;
+    kern_return_t             result;
+
+    if(   __builtin_add_overflow(offset, length, &end)
+       || (end > deviceMemory->GetLength()))
+    {
+        return kIOReturnOverrun;
+    }
+    if(length == 0)
+    {
+        return kIOReturnSuccess;
+    }
+
+    // a buffer the dext allocated is already mapped, anything else gets mapped for the copy
+    if((localBuffer != NULL) && (localBuffer->GetAddressRange(&range) == kIOReturnSuccess))
+    {
+        if(   __builtin_add_overflow(bufferOffset, length, &end)
+           || (end > range.length))
+        {
+            return kIOReturnBadArgument;
+        }
+        range.address += bufferOffset;
+    }
+    else
+    {
+        result = buffer->CreateMapping(0, 0, bufferOffset, length, 0, &bufferMap);
+        if(result != kIOReturnSuccess)
+        {
+            return result;
+        }
+        range.address = bufferMap->GetAddress();
+    }
+
+    if(toDevice)
+    {
+        MemoryBlockCopy(deviceMemory->GetAddress() + offset, range.address, length, true);
+    }
+    else
+    {
+        MemoryBlockCopy(range.address, deviceMemory->GetAddress() + offset, length, false);
+    }
+    OSSafeReleaseNULL(bufferMap);
+
+    return kIOReturnSuccess;
+}
+
+kern_return_t
+IOPCIDevice::MemoryReadBlock(uint8_t             memoryIndex,
+                             uint64_t            offset,
+                             IOMemoryDescriptor* buffer,
+                             uint64_t            bufferOffset,
+                             uint64_t            length,
+                             IOOptionBits        options)
+{
+    if((memoryIndex >= ivars->numDeviceMemoryMappings) || (buffer == NULL))
+    {
+        return kIOReturnBadArgument;
+    }
+
+    IOMemoryMap* deviceMemory = ivars->deviceMemoryMappings[memoryIndex];
+
+    if(deviceMemory && !ivars->useMemoryAccess && !(options & kIOPCIAccessLatencyTolerantHint))
+    {
+        return MemoryBlockDirect(deviceMemory, offset, buffer, bufferOffset, length, false);
+    }
+
+    return _MemoryAccessBlock(kPCIDriverKitMemoryAccessOperationDeviceRead | memoryIndex,
+                              offset,
+                              buffer,
+                              bufferOffset,
+                              length,
+                              ivars->deviceClient,
+                              options);
+}
+
+kern_return_t
+IOPCIDevice::MemoryWriteBlock(uint8_t             memoryIndex,
+                              uint64_t            offset,
+                              IOMemoryDescriptor* buffer,
+                              uint64_t            bufferOffset,
+                              uint64_t            length,
+                              IOOptionBits        options)
+{
+    if((memoryIndex >= ivars->numDeviceMemoryMappings) || (buffer == NULL))
+    {
+        return kIOReturnBadArgument;
+    }
+
+    IOMemoryMap* deviceMemory = ivars->deviceMemoryMappings[memoryIndex];
+
+    if(deviceMemory && !ivars->useMemoryAccess && !(options & kIOPCIAccessLatencyTolerantHint))
+    {
+        return MemoryBlockDirect(deviceMemory, offset, buffer, bufferOffset, length, true);
+    }
+
+    return _MemoryAccessBlock(kPCIDriverKitMemoryAccessOperationDeviceWrite | memoryIndex,
+                              offset,
+                              buffer,
+                              bufferOffset,
+                              length,
+                              ivars->deviceClient,
+                              options);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2012-2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+#pragma once
+
+#ifndef KERNEL
+#include <stdint.h>
+#endif
+
+/*
+ * Layout of the messaged interrupt statistics returned by the
+ * kIOPCIDiagnosticsMethodInterruptStatistics selector, shared with
+ * tools/msistats.c. A header followed by one record per vector per cpu that
+ * saw an interrupt. Decoders use vector_length to step records; fields are
+ * only ever appended.
+ */
+
+#define kMSIStatsMagic          (0x4d534953)        /* 'MSIS' */
+#define kMSIStatsVersion        (1)
+#define kMSIStatsHistBuckets    (24)
+#define kMSIStatsNameLength     (32)
+
+enum
+{
+	kMSIStatsVectorRegistered = 0x00000001,
+	kMSIStatsVectorShared     = 0x00000002,		// msix sub vector behind one platform vector
+	kMSIStatsVectorMSIX       = 0x00000004,
+};
+
+struct msi_stats_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_length;
+	uint32_t length;				// whole blob, may exceed what was returned
+	uint32_t vectors;				// records
+	uint32_t vector_length;
+	uint32_t cpus;
+	uint32_t timebase_numer;		// mach absolute time to ns
+	uint32_t timebase_denom;
+	uint64_t time;					// absolute time of the snapshot
+};
+typedef struct msi_stats_header msi_stats_header_t;
+
+struct msi_stats_vector
+{
+	char     name[kMSIStatsNameLength];
+	uint32_t location;				// bus << 8 | device << 3 | function
+	uint32_t vector;				// platform vector
+	uint32_t index;					// msi(x) entry
+	uint32_t cpu;
+	uint32_t flags;
+	uint32_t _resv;
+	uint64_t deliveries;
+	uint64_t spurious;				// no pending bit set, or nothing registered
+	uint64_t masked_pending;		// arrived while hard disabled, replayed on enable
+	uint64_t handler_time;			// absolute time total
+	uint32_t handler_time_hist[kMSIStatsHistBuckets];	// bucket n counts times < (1 << n)
+};
+typedef struct msi_stats_vector msi_stats_vector_t;
+
+#ifndef KERNEL
+
+/* decoder, tools/msistats.c */
+
+#include <stddef.h>
+#include <stdio.h>
+
+// returns the header if the blob is a well formed statistics dump, else NULL
+const msi_stats_header_t * msi_stats_validate(const void * blob, size_t length);
+const msi_stats_vector_t * msi_stats_vector(const msi_stats_header_t * header, uint32_t idx);
+// convert an absolute time value to ns
+uint64_t msi_stats_ns(const msi_stats_header_t * header, uint64_t value);
+// vectors by handler time, busiest first
+void msi_stats_print(FILE * file, const msi_stats_header_t * header, uint32_t histograms);
+
+#endif /* !KERNEL */
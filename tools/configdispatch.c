@@ -0,0 +1,298 @@
+/*
+cc tools/configdispatch.c -o /tmp/configdispatch -O2 -Wall -lpthread
+ */
+
+/*
+ * Cost of dispatching a config read from a device at the end of a chain of
+ * switches, such as a Thunderbolt daisy chain. IOPCIDevice::configRead32
+ * checks the nub and calls its parent bridge, IOPCI2PCIBridge::configRead32
+ * forwards to the bridge's own nub, which calls its parent, and so on up to
+ * the host bridge that does the access: two virtual calls per level. With
+ * the host bridge resolved at publish time the nub checks its access state
+ * word and calls the host bridge once. Each call here goes through a
+ * function pointer table, the host access is a read of a simulated config
+ * space, and every thread reads config space of devices across the chain.
+ * Also checks both paths read the same values and honour a reset.
+ *
+ * configdispatch [-t threads] [-n reads per thread] [-d depth]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMaxDepth      (8)
+#define kMaxThreads    (64)
+#define kDevicesPerBus (4)
+#define kConfigAccessInReset (0x4)
+
+struct bridge;
+
+struct device
+{
+	const struct deviceVtable * vt;
+	struct bridge *             parent;
+	struct bridge *             configHost;		// reserved->configHost
+	uint32_t                    space;
+	volatile uint32_t           configAccessState;
+	volatile int                inactive;
+	uint8_t                     configProt;
+};
+
+struct bridge
+{
+	const struct bridgeVtable * vt;
+	struct device *             bridgeDevice;	// fBridgeDevice, NULL for the host bridge
+	volatile int                childrenInReset;
+	volatile uint32_t *         config;			// host bridge only, [bus][device][dword]
+};
+
+struct deviceVtable
+{
+	uint32_t (*configRead32Space)(struct device * device, uint32_t space, uint8_t offset);
+};
+
+struct bridgeVtable
+{
+	uint32_t (*configRead32)(struct bridge * bridge, uint32_t space, uint8_t offset);
+};
+
+struct chain
+{
+	struct bridge  host;
+	struct bridge  bridges[kMaxDepth];
+	struct device  bridgeDevices[kMaxDepth];
+	struct device  devices[kMaxDepth][kDevicesPerBus];
+	uint32_t       depth;
+};
+
+struct worker
+{
+	struct chain * chain;
+	uint32_t       reads;
+	uint32_t       seed;
+	int            direct;
+	uint64_t       sum;
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// the platform host bridge, an ECAM style read
+static __attribute__((noinline)) uint32_t
+hostConfigRead32(struct bridge * bridge, uint32_t space, uint8_t offset)
+{
+	return (bridge->config[(space << 6) | (offset >> 2)]);
+}
+
+// IOPCIDevice::configRead32(IOPCIAddressSpace, UInt8), before and after
+static __attribute__((noinline)) uint32_t
+deviceConfigRead32Space(struct device * device, uint32_t space, uint8_t offset)
+{
+	if (!device->parent) return (0xFFFFFFFF);
+	return (device->parent->vt->configRead32(device->parent, space, offset));
+}
+
+static __attribute__((noinline)) uint32_t
+deviceConfigRead32SpaceHost(struct device * device, uint32_t space, uint8_t offset)
+{
+	if (!device->parent) return (0xFFFFFFFF);
+	return (device->configHost->vt->configRead32(device->configHost, space, offset));
+}
+
+// IOPCI2PCIBridge::configRead32
+static __attribute__((noinline)) uint32_t
+p2pConfigRead32(struct bridge * bridge, uint32_t space, uint8_t offset)
+{
+	return (bridge->bridgeDevice->vt->configRead32Space(bridge->bridgeDevice, space, offset));
+}
+
+static const struct bridgeVtable hostVtable   = { &hostConfigRead32 };
+static const struct bridgeVtable p2pVtable    = { &p2pConfigRead32 };
+static const struct deviceVtable deviceVtable = { &deviceConfigRead32Space };
+static const struct deviceVtable directVtable = { &deviceConfigRead32SpaceHost };
+
+// IOPCIDevice::configRead32(UInt8) with the checks configAccess() did
+static uint32_t
+configRead32Recursive(struct device * device, uint8_t offset)
+{
+	if (device->inactive || !device->parent || device->parent->childrenInReset || (device->configProt & 1)) return (0xFFFFFFFF);
+	return (device->parent->vt->configRead32(device->parent, device->space, offset));
+}
+
+// and with the access state word and the resolved host bridge
+static uint32_t
+configRead32Direct(struct device * device, uint8_t offset)
+{
+	if (device->inactive || !device->parent || (device->configAccessState & (kConfigAccessInReset | 1))) return (0xFFFFFFFF);
+	return (device->configHost->vt->configRead32(device->configHost, device->space, offset));
+}
+
+static void
+build(struct chain * chain, uint32_t depth, int direct)
+{
+	struct bridge * above;
+	uint32_t        level, idx, dword;
+
+	memset(chain, 0, sizeof(*chain));
+	chain->depth       = depth;
+	chain->host.vt     = &hostVtable;
+	chain->host.config = calloc((kMaxDepth + 1) << 6 << 3, sizeof(uint32_t));
+	for (dword = 0; dword < (((kMaxDepth + 1) << 6 << 3)); dword++) chain->host.config[dword] = dword * 2654435761U;
+
+	above = &chain->host;
+	for (level = 0; level < depth; level++)
+	{
+		// the switch port nub on this bus, and the bridge it provides
+		chain->bridgeDevices[level].vt         = direct ? &directVtable : &deviceVtable;
+		chain->bridgeDevices[level].parent     = above;
+		chain->bridgeDevices[level].configHost = direct ? &chain->host : above;
+		chain->bridgeDevices[level].space      = (level << 3);
+		chain->bridges[level].vt               = &p2pVtable;
+		chain->bridges[level].bridgeDevice     = &chain->bridgeDevices[level];
+		above = &chain->bridges[level];
+
+		for (idx = 0; idx < kDevicesPerBus; idx++)
+		{
+			chain->devices[level][idx].vt         = direct ? &directVtable : &deviceVtable;
+			chain->devices[level][idx].parent     = above;
+			chain->devices[level][idx].configHost = direct ? &chain->host : above;
+			chain->devices[level][idx].space      = ((level + 1) << 3) | idx;
+		}
+	}
+}
+
+static void *
+workerThread(void * arg)
+{
+	struct worker * worker = arg;
+	struct device * device;
+	uint32_t        idx, level;
+	uint64_t        sum = 0;
+
+	for (idx = 0; idx < worker->reads; idx++)
+	{
+		// mostly the deepest devices, as a driver behind the chain would
+		level  = worker->chain->depth - 1 - ((rand_r(&worker->seed) & 7) ? 0 : (rand_r(&worker->seed) % worker->chain->depth));
+		device = &worker->chain->devices[level][idx % kDevicesPerBus];
+		sum += worker->direct ? configRead32Direct(device, (uint8_t) (idx & 0x3C))
+							  : configRead32Recursive(device, (uint8_t) (idx & 0x3C));
+	}
+	worker->sum = sum;
+	return (NULL);
+}
+
+static double
+run(uint32_t depth, uint32_t threads, uint32_t reads, int direct, uint64_t * sum)
+{
+	struct chain    chain;
+	struct worker   workers[kMaxThreads];
+	pthread_t       thread[kMaxThreads];
+	uint64_t        start, elapsed;
+	uint32_t        idx;
+
+	build(&chain, depth, direct);
+	start = now();
+	for (idx = 0; idx < threads; idx++)
+	{
+		workers[idx].chain  = &chain;
+		workers[idx].reads  = reads;
+		workers[idx].seed   = idx + 1;
+		workers[idx].direct = direct;
+		pthread_create(&thread[idx], NULL, &workerThread, &workers[idx]);
+	}
+	*sum = 0;
+	for (idx = 0; idx < threads; idx++)
+	{
+		pthread_join(thread[idx], NULL);
+		*sum += workers[idx].sum;
+	}
+	elapsed = now() - start;
+	free((void *) chain.host.config);
+
+	return ((double) elapsed / reads);
+}
+
+static uint32_t
+check(uint32_t depth)
+{
+	struct chain recursive, direct;
+	uint32_t     level, idx, offset, failures = 0;
+
+	build(&recursive, depth, 0);
+	build(&direct, depth, 1);
+	for (level = 0; level < depth; level++)
+	for (idx = 0; idx < kDevicesPerBus; idx++)
+	for (offset = 0; offset < 256; offset += 4)
+	{
+		if (configRead32Recursive(&recursive.devices[level][idx], offset)
+		 != configRead32Direct(&direct.devices[level][idx], offset)) failures++;
+	}
+
+	// a bridge reset blocks its children on both paths
+	recursive.bridges[depth - 1].childrenInReset = 1;
+	direct.devices[depth - 1][0].configAccessState |= kConfigAccessInReset;
+	if ((configRead32Recursive(&recursive.devices[depth - 1][0], 0) != 0xFFFFFFFF)
+	 || (configRead32Direct(&direct.devices[depth - 1][0], 0) != 0xFFFFFFFF)) failures++;
+
+	free((void *) recursive.host.config);
+	free((void *) direct.host.config);
+	if (failures) printf("depth %u: %u reads differ\n", depth, failures);
+	return (failures);
+}
+
+int main(int argc, char * argv[])
+{
+	uint32_t threads = 8;
+	uint32_t reads   = 4000000;
+	uint32_t only    = 0;
+	uint32_t depth, failures;
+	uint64_t recursiveSum, directSum;
+	double   recursiveNS, directNS;
+	int      ch;
+
+	while (-1 != (ch = getopt(argc, argv, "t:n:d:")))
+	{
+		switch (ch)
+		{
+			case 't': threads = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'n': reads   = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'd': only    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-t threads] [-n reads per thread] [-d depth]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!threads || (threads > kMaxThreads)) threads = kMaxThreads;
+	if (only > kMaxDepth) only = kMaxDepth;
+	if (!reads) reads = 1;
+
+	printf("%u threads x %u reads, ns per read per thread\n", threads, reads);
+	printf("%6s %12s %12s %10s\n", "depth", "recursive", "direct", "speedup");
+	failures = 0;
+	for (depth = only ? only : 4; depth <= (only ? only : 6); depth++)
+	{
+		failures += check(depth);
+		recursiveNS = run(depth, threads, reads, 0, &recursiveSum);
+		directNS    = run(depth, threads, reads, 1, &directSum);
+		if (recursiveSum != directSum)
+		{
+			printf("depth %u: sums differ\n", depth);
+			failures++;
+		}
+		printf("%6u %12.2f %12.2f %9.1fx\n", depth, recursiveNS, directNS, recursiveNS / directNS);
+	}
+	printf("%u failures\n", failures);
+
+	return (failures ? 1 : 0);
+}
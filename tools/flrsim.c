@@ -0,0 +1,528 @@
+/*
+cc tools/flrsim.c -o /tmp/flrsim -O2 -Wall
+ */
+
+/*
+ * Simulated config space for IOPCIDevice::completeFLR(). Each function is
+ * given a time to complete the FLR and a later time at which it is ready for
+ * configuration, along with what it reports: Immediate Readiness, a
+ * Readiness Time Reporting FLR Time, FRS support, or nothing, and whether its
+ * root port has CRS Software Visibility enabled. Requests while the FLR is in
+ * progress are discarded, and requests after it but before the function is
+ * ready get CRS. The readiness probe and wait from IOPCIDevice run on a
+ * simulated clock, and the config restore that follows is checked to land on
+ * a ready function. FRS goes through a register model of the root port's FRS
+ * Queuing capability, seeded with stale messages and fed unrelated traffic,
+ * which the probe has to drain and the wait has to dequeue. Prints the reset
+ * turnaround against the fixed 100ms.
+ * With -b, also resets sets of that many functions of one device, one at a
+ * time as IOPCIDevice::reset() does and together as
+ * IOPCIDevice::resetFunctions() does, including each function's restore.
+ *
+ * flrsim [-n functions] [-b functions per set] [-s seed]
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kMS                 (1000000ULL)
+#define kFLRWaitMS          (100)			// kIOPCIFLRWaitMS
+#define kFLRCRSWaitMS       (1000)			// kIOPCIFLRCRSWaitMS
+#define kVendorProduct      (0x12348086U)
+#define kConfigNS           (2000)			// one config access
+#define kMaxSet             (256)
+#define kFRSMaxDepth        (8)				// the root port's FRS Queue Max Depth
+#define kFRSDRSReceived     (0x1)
+#define kFRSFLRCompleted    (0x3)
+
+enum
+{
+	kReadyWait,
+	kReadyImmediate,
+	kReadyReported,
+	kReadyFRS,
+	kReadyCRS,
+	kReadyCount
+};
+
+static const char * names[kReadyCount] = { "none", "immediate", "reported", "frs", "crs" };
+
+struct function
+{
+	uint64_t startNS;			// when flr() was issued
+	uint64_t restoreNS;			// restoreDeviceState(), mostly the driver's power on handler
+	uint64_t flrNS;				// FLR done, requests are discarded before this
+	uint64_t readyNS;			// CRS between flrNS and here
+	int      immediate;
+	int      rtrValid;
+	uint32_t rtrFLRTime;		// encoded, at least readyNS
+	int      frs;
+	int      crsVisible;
+	uint16_t rid;				// requester ID, the FRS message's function ID
+	int      inFLR;				// flr() issued, FLR Completed goes out once ready
+	int      frsReady;			// flrReady
+};
+
+// the root port's FRS Queuing capability, as its registers behave
+struct frsQueue
+{
+	uint32_t messages[kFRSMaxDepth];	// reason and function ID, oldest first
+	uint32_t depth;
+	uint16_t status;					// FRS Message Overflow
+};
+
+struct sim
+{
+	uint64_t          now;			// since the FLR was initiated
+	uint32_t          discarded;
+	uint32_t          early;
+	uint32_t          frsTimeouts;	// FRS waits that ran to the deadline
+	struct frsQueue   port;
+	struct function * set;			// the functions being reset, what waitForFRS() is given
+	uint32_t          count;
+};
+
+// IOPCIReadinessTimeNS()
+static uint64_t
+readinessTimeNS(uint32_t field)
+{
+	uint32_t scale = (field >> 9) & 7;
+
+	if (scale > 5) return (UINT64_MAX);
+	return ((uint64_t)(field & 0x1FF) << (5 * scale));
+}
+
+// the smallest encoding no shorter than ns
+static uint32_t
+readinessTimeEncode(uint64_t ns)
+{
+	uint32_t scale;
+
+	for (scale = 0; scale <= 5; scale++)
+	{
+		uint64_t unit  = 1ULL << (5 * scale);
+		uint64_t value = (ns + unit - 1) / unit;
+
+		if (value <= 0x1FF) return ((scale << 9) | (uint32_t) value);
+	}
+	return (0xFFF);
+}
+
+static uint32_t
+configReadVendor(struct sim * sim, struct function * fn)
+{
+	if (sim->now < fn->startNS + fn->flrNS)
+	{
+		sim->discarded++;
+		return (0xFFFFFFFFU);
+	}
+	if (sim->now < fn->startNS + fn->readyNS)
+	{
+		if (fn->crsVisible) return (0xFFFF0001U);
+		// the root complex retries the request itself until the function answers
+		sim->now = fn->startNS + fn->readyNS;
+	}
+	return (kVendorProduct);
+}
+
+static void
+frsPost(struct frsQueue * port, uint32_t reason, uint16_t rid)
+{
+	if (port->depth == kFRSMaxDepth)
+	{
+		port->status |= 0x0001;
+		return;
+	}
+	port->messages[port->depth++] = (reason << 16) | rid;
+}
+
+// functions that became ready send FLR Completed, and other functions chatter
+static void
+frsArrive(struct sim * sim)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < sim->count; idx++)
+	{
+		struct function * fn = &sim->set[idx];
+
+		if (!fn->frs || !fn->inFLR || (sim->now < fn->startNS + fn->readyNS)) continue;
+		frsPost(&sim->port, kFRSFLRCompleted, fn->rid);
+		fn->inFLR = 0;
+	}
+	if (!(random() % 256)) frsPost(&sim->port, kFRSDRSReceived, 0xFF00 | (random() & 0xFF));
+}
+
+static uint32_t
+frsRead32(struct sim * sim, uint32_t offset)
+{
+	sim->now += kConfigNS;
+	frsArrive(sim);
+	switch (offset)
+	{
+		case 0x04: return (kFRSMaxDepth);
+		case 0x0C: return (sim->port.depth ? ((sim->port.depth << 20) | sim->port.messages[0]) : 0);
+		default:   return (0);
+	}
+}
+
+static void
+frsWrite32(struct sim * sim, uint32_t offset, uint32_t value)
+{
+	sim->now += kConfigNS;
+	if ((0x0C != offset) || !sim->port.depth) return;
+	sim->port.depth--;
+	memmove(&sim->port.messages[0], &sim->port.messages[1], sim->port.depth * sizeof(sim->port.messages[0]));
+}
+
+static void
+frsWrite16(struct sim * sim, uint32_t offset, uint16_t value)
+{
+	sim->now += kConfigNS;
+	if (0x08 == offset) sim->port.status &= ~(value & 0x0001);
+}
+
+// IOPCIFRSQueueDepth()
+static uint32_t
+frsQueueDepth(struct sim * sim)
+{
+	uint32_t depth = frsRead32(sim, 0x04) & 0xFFF;
+
+	return (depth ? depth : 1);
+}
+
+// IOPCIFRSDequeue()
+static uint32_t
+frsDequeue(struct sim * sim)
+{
+	uint32_t message = frsRead32(sim, 0x0C);
+
+	if (!(message >> 20) || (message == 0xFFFFFFFFU)) return (0);
+	frsWrite32(sim, 0x0C, 0);
+	return (message);
+}
+
+// left over from earlier resets and other functions, a stale FLR Completed among them
+static void
+frsStale(struct sim * sim, struct function * fn)
+{
+	frsPost(&sim->port, kFRSDRSReceived, 0xFF00 | (random() & 0xFF));
+	frsPost(&sim->port, kFRSFLRCompleted, fn->rid);
+}
+
+// IOSleep() sleeps at least ms, to the next tick, IODelay() is exact
+static void
+sleepMS(struct sim * sim, uint32_t ms)
+{
+	sim->now = ((sim->now + ms * kMS + kMS - 1) / kMS) * kMS;
+}
+
+// IOPCISleepUntil()
+static void
+sleepUntil(struct sim * sim, uint64_t deadline)
+{
+	if (deadline <= sim->now) return;
+	if (deadline - sim->now >= kMS) sleepMS(sim, (uint32_t)((deadline - sim->now + kMS - 1) / kMS));
+	else                            sim->now = deadline;
+}
+
+// IOPCIDevice::probeFLRReadiness(), done before the reset
+static int
+probe(struct sim * sim, struct function * fn, uint64_t * readyNS)
+{
+	uint32_t depth, idx;
+
+	if (fn->immediate) return (kReadyImmediate);
+	if (fn->rtrValid)
+	{
+		*readyNS = readinessTimeNS(fn->rtrFLRTime);
+		if (*readyNS <= kFLRCRSWaitMS * kMS) return (kReadyReported);
+	}
+	if (fn->frs)
+	{
+		depth = frsQueueDepth(sim);
+		for (idx = 0; (idx < depth) && frsDequeue(sim); idx++) {}
+		frsWrite16(sim, 0x08, 0x0001);
+		return (kReadyFRS);
+	}
+	if (fn->crsVisible) return (kReadyCRS);
+	return (kReadyWait);
+}
+
+// IOPCIDevice::waitForFRS()
+static void
+frsWait(struct sim * sim, struct function * fn, uint64_t deadline)
+{
+	uint32_t depth, idx, next, message;
+
+	depth = frsQueueDepth(sim);
+	while (!fn->frsReady)
+	{
+		for (idx = 0; idx < depth; idx++)
+		{
+			message = frsDequeue(sim);
+			if (!message) break;
+			if (((message >> 16) & 0xF) != kFRSFLRCompleted) continue;
+			for (next = 0; next < sim->count; next++)
+			{
+				if ((message & 0xFFFF) == sim->set[next].rid) sim->set[next].frsReady = 1;
+			}
+		}
+		if (fn->frsReady) break;
+		if (sim->now >= deadline)
+		{
+			sim->frsTimeouts++;
+			break;
+		}
+		sleepMS(sim, 1);
+	}
+}
+
+// IOPCIDevice::completeFLR()
+static void
+complete(struct sim * sim, struct function * fn, int readiness, uint64_t readyNS)
+{
+	uint64_t deadline;
+	uint32_t vendorProduct;
+
+	switch (readiness)
+	{
+		case kReadyImmediate:
+			break;
+
+		case kReadyReported:
+			sleepUntil(sim, fn->startNS + readyNS);
+			break;
+
+		case kReadyFRS:
+			frsWait(sim, fn, fn->startNS + kFLRWaitMS * kMS);
+			break;
+
+		case kReadyCRS:
+			sleepUntil(sim, fn->startNS + kFLRWaitMS * kMS);
+			deadline = sim->now + kFLRCRSWaitMS * kMS;
+			while (true)
+			{
+				vendorProduct = configReadVendor(sim, fn);
+				if ((vendorProduct != 0) && (vendorProduct != 0xFFFFFFFFU) && (vendorProduct != 0xFFFF0001U)) break;
+				if (sim->now >= deadline) break;
+				sleepMS(sim, 1);
+			}
+			break;
+
+		default:
+			sleepUntil(sim, fn->startNS + kFLRWaitMS * kMS);
+			break;
+	}
+
+	// restoreDeviceState()
+	if (sim->now < fn->startNS + fn->readyNS) sim->early++;
+}
+
+static uint64_t
+randomNS(uint64_t maxNS)
+{
+	return ((((uint64_t) random() << 31) ^ random()) % maxNS);
+}
+
+// functions that keep to the spec: FLR done within 100ms, reports no shorter than the truth
+static int
+makeFunction(struct function * fn)
+{
+	int kind = random() % kReadyCount;
+
+	memset(fn, 0, sizeof(*fn));
+	fn->restoreNS = 200000 + randomNS(5 * kMS);
+	fn->flrNS   = randomNS(kFLRWaitMS * kMS);
+	fn->readyNS = fn->flrNS;
+	switch (kind)
+	{
+		case kReadyImmediate:
+			fn->immediate = 1;
+			fn->flrNS = fn->readyNS = 0;
+			break;
+		case kReadyReported:
+			fn->rtrValid   = 1;
+			fn->rtrFLRTime = readinessTimeEncode(fn->readyNS);
+			break;
+		case kReadyFRS:
+			fn->frs = 1;
+			break;
+		case kReadyCRS:
+			// may keep answering CRS well past the FLR
+			fn->crsVisible = 1;
+			fn->readyNS    = fn->flrNS + randomNS(4 * kFLRWaitMS * kMS);
+			break;
+		default:
+			break;
+	}
+	return (kind);
+}
+
+// IOPCIDevice::resetFunction() for each function in turn
+static uint64_t
+resetSerial(struct sim * sim, struct function * set, uint32_t count)
+{
+	uint64_t readyNS;
+	uint32_t idx;
+	int      readiness;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		sim->set   = &set[idx];
+		sim->count = 1;
+		frsStale(sim, &set[idx]);
+		readyNS   = 0;
+		readiness = probe(sim, &set[idx], &readyNS);
+		sim->now += 2 * kConfigNS;
+		set[idx].startNS = sim->now;
+		set[idx].inFLR   = 1;
+		complete(sim, &set[idx], readiness, readyNS);
+		sim->now += set[idx].restoreNS;
+	}
+	return (sim->now);
+}
+
+// IOPCIDevice::resetFunctions(), the functions of one device all restore concurrently
+static uint64_t
+resetTogether(struct sim * sim, struct function * set, uint32_t count)
+{
+	uint64_t readyNS[kMaxSet], slowest;
+	int      readiness[kMaxSet];
+	uint32_t idx;
+
+	sim->set   = set;
+	sim->count = count;
+	for (idx = 0; idx < count; idx++) frsStale(sim, &set[idx]);
+	for (idx = 0; idx < count; idx++)
+	{
+		readyNS[idx]   = 0;
+		readiness[idx] = probe(sim, &set[idx], &readyNS[idx]);
+		sim->now += kConfigNS;
+	}
+	for (idx = 0; idx < count; idx++)
+	{
+		sim->now += kConfigNS;
+		set[idx].startNS = sim->now;
+		set[idx].inFLR   = 1;
+	}
+	for (idx = 0; idx < count; idx++) complete(sim, &set[idx], readiness[idx], readyNS[idx]);
+
+	for (slowest = 0, idx = 0; idx < count; idx++) if (set[idx].restoreNS > slowest) slowest = set[idx].restoreNS;
+	sim->now += slowest;
+
+	return (sim->now);
+}
+
+static void
+bulk(uint32_t count, uint32_t sets)
+{
+	static struct function set[kMaxSet];
+	struct sim             sim;
+	uint64_t               serialNS, togetherNS;
+	uint32_t               idx, fn, early, timeouts;
+
+	serialNS = togetherNS = 0;
+	early = timeouts = 0;
+	for (idx = 0; idx < sets; idx++)
+	{
+		for (fn = 0; fn < count; fn++)
+		{
+			makeFunction(&set[fn]);
+			set[fn].rid = (uint16_t) (0x0100 + fn);
+		}
+
+		memset(&sim, 0, sizeof(sim));
+		serialNS += resetSerial(&sim, set, count);
+		early    += sim.early + sim.discarded;
+		timeouts += sim.frsTimeouts;
+		for (fn = 0; fn < count; fn++) set[fn].inFLR = set[fn].frsReady = 0;
+
+		memset(&sim, 0, sizeof(sim));
+		togetherNS += resetTogether(&sim, set, count);
+		early      += sim.early + sim.discarded;
+		timeouts   += sim.frsTimeouts;
+	}
+	printf("\n%u sets of %u functions: one at a time %.1f ms, together %.1f ms, %u restores before ready, %u FRS waits timed out\n",
+			sets, count, (double) serialNS / sets / kMS, (double) togetherNS / sets / kMS, early, timeouts);
+}
+
+int main(int argc, char * argv[])
+{
+	struct function fn;
+	struct sim      sim;
+	uint64_t        newNS[kReadyCount], oldNS[kReadyCount], readyNS;
+	uint32_t        count[kReadyCount], oldEarly[kReadyCount];
+	uint32_t        functions = 100000;
+	uint32_t        seed      = 1;
+	uint32_t        setSize   = 0;
+	uint32_t        idx, discarded, early, timeouts;
+	int             kind, readiness, ch;
+
+	while (-1 != (ch = getopt(argc, argv, "n:b:s:")))
+	{
+		switch (ch)
+		{
+			case 'n': functions = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'b': setSize   = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 's': seed      = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n functions] [-b functions per set] [-s seed]\n", argv[0]);
+				exit(1);
+		}
+	}
+	srandom(seed);
+	memset(newNS, 0, sizeof(newNS));
+	memset(oldNS, 0, sizeof(oldNS));
+	memset(count, 0, sizeof(count));
+	memset(oldEarly, 0, sizeof(oldEarly));
+	discarded = early = timeouts = 0;
+
+	for (idx = 0; idx < functions; idx++)
+	{
+		kind = makeFunction(&fn);
+		fn.rid = 0x0100;
+		count[kind]++;
+
+		memset(&sim, 0, sizeof(sim));
+		sim.set   = &fn;
+		sim.count = 1;
+		frsStale(&sim, &fn);
+		readyNS   = 0;
+		readiness = probe(&sim, &fn, &readyNS);
+		if (readiness != kind) printf("function %u: probed %s, is %s\n", idx, names[readiness], names[kind]), early++;
+		// timed from flr(), the probe's config accesses come before it
+		sim.now  = 0;
+		fn.inFLR = 1;
+		complete(&sim, &fn, readiness, readyNS);
+		newNS[kind] += sim.now;
+		discarded   += sim.discarded;
+		early       += sim.early;
+		timeouts    += sim.frsTimeouts;
+
+		// the fixed 100ms
+		memset(&sim, 0, sizeof(sim));
+		sleepMS(&sim, kFLRWaitMS);
+		oldNS[kind] += sim.now;
+		if (sim.now < fn.readyNS) oldEarly[kind]++;
+	}
+
+	printf("%u functions\n", functions);
+	printf("%-10s %10s %14s %14s %16s\n", "readiness", "functions", "fixed ms", "ready ms", "fixed too early");
+	for (kind = 0; kind < kReadyCount; kind++)
+	{
+		if (!count[kind]) continue;
+		printf("%-10s %10u %14.2f %14.2f %16u\n", names[kind], count[kind],
+				(double) oldNS[kind] / count[kind] / kMS, (double) newNS[kind] / count[kind] / kMS, oldEarly[kind]);
+	}
+	printf("%u requests discarded during an FLR, %u restores before the function was ready, %u FRS waits timed out\n", discarded, early, timeouts);
+
+	if (setSize > kMaxSet) setSize = kMaxSet;
+	if (setSize) bulk(setSize, (functions / setSize) ? (functions / setSize) : 1);
+
+	return ((discarded || early) ? 1 : 0);
+}
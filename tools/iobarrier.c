@@ -0,0 +1,153 @@
+/*
+cc tools/iobarrier.c -o /tmp/iobarrier -O2 -Wall
+ */
+
+/*
+ * Barrier cost of the I/O space accessors in IOPCIDeviceMappedIO.cpp. A
+ * driver polls a status block of a few consecutive registers, or drains a
+ * data port, through a simulated mapping: with ioRead32(), which issues
+ * OSSynchronizeIO() after every access, with ioRead32Relaxed() and one
+ * ioBarrier() per batch, and with ioReadBlock(). The mapping is ordinary
+ * memory, so the numbers are the barrier overhead alone, without the bus
+ * latency of a real port; OSSynchronizeIO() is modeled as a full fence.
+ *
+ * iobarrier [-n batches] [-b batch size]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kPorts (64)
+
+static volatile uint32_t ioSpace[kPorts];
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// OSSynchronizeIO
+static inline void
+synchronizeIO(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t
+ioRead32(uint16_t offset)
+{
+	uint32_t value = ioSpace[offset];
+
+	synchronizeIO();
+	return (value);
+}
+
+static inline uint32_t
+ioRead32Relaxed(uint16_t offset)
+{
+	return (ioSpace[offset]);
+}
+
+static inline void
+ioReadBlock(uint16_t offset, uint32_t * data, uint32_t count)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < count; idx++) data[idx] = ioSpace[offset];
+	synchronizeIO();
+}
+
+static double
+ordered(uint32_t batches, uint32_t batch)
+{
+	uint64_t start;
+	uint32_t idx, reg, sum = 0;
+
+	start = now();
+	for (idx = 0; idx < batches; idx++)
+		for (reg = 0; reg < batch; reg++) sum += ioRead32(reg % kPorts);
+	ioSpace[0] = sum;
+	return ((double) (now() - start) / ((double) batches * batch));
+}
+
+static double
+relaxed(uint32_t batches, uint32_t batch)
+{
+	uint64_t start;
+	uint32_t idx, reg, sum = 0;
+
+	start = now();
+	for (idx = 0; idx < batches; idx++)
+	{
+		for (reg = 0; reg < batch; reg++) sum += ioRead32Relaxed(reg % kPorts);
+		synchronizeIO();					// ioBarrier
+	}
+	ioSpace[0] = sum;
+	return ((double) (now() - start) / ((double) batches * batch));
+}
+
+static double
+block(uint32_t batches, uint32_t batch, uint32_t * data)
+{
+	uint64_t start;
+	uint32_t idx, sum = 0;
+
+	start = now();
+	for (idx = 0; idx < batches; idx++)
+	{
+		ioReadBlock(idx % kPorts, data, batch);
+		sum += data[batch - 1];
+	}
+	ioSpace[0] = sum;
+	return ((double) (now() - start) / ((double) batches * batch));
+}
+
+int main(int argc, char * argv[])
+{
+	static const uint32_t sizes[] = { 1, 2, 4, 8, 16, 64, 256 };
+	uint32_t *            data;
+	uint32_t              batches = 1000000;
+	uint32_t              only    = 0;
+	uint32_t              idx, batch;
+	double                o, r, b;
+	int                   ch;
+
+	while (-1 != (ch = getopt(argc, argv, "n:b:")))
+	{
+		switch (ch)
+		{
+			case 'n': batches = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'b': only    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n batches] [-b batch size]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!batches) batches = 1;
+	data = calloc(only > 256 ? only : 256, sizeof(uint32_t));
+	if (!data) return (1);
+
+	// warm up the clock and the caches before the first row
+	ordered(batches, 1);
+	printf("%u batches, ns per access\n", batches);
+	printf("%8s %10s %10s %10s %10s\n", "batch", "ordered", "relaxed", "block", "speedup");
+	for (idx = 0; idx < sizeof(sizes) / sizeof(sizes[0]); idx++)
+	{
+		batch = only ? only : sizes[idx];
+		o = ordered(batches, batch);
+		r = relaxed(batches, batch);
+		b = block(batches, batch, data);
+		printf("%8u %10.2f %10.2f %10.2f %9.1fx\n", batch, o, r, b, o / (r < b ? r : b));
+		if (only) break;
+	}
+	free(data);
+
+	return (0);
+}
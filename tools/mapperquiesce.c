@@ -0,0 +1,237 @@
+/*
+cc tools/mapperquiesce.c -o /tmp/mapperquiesce -O2 -Wall -lpthread
+ */
+
+/*
+ * Simulated device mapper for IOPCIBridge::waitForDartToQuiesce(). Driver
+ * threads hold a number of mappings and drop them at random over a few ms,
+ * as process exit cleanup does, while the bridge tears the nub down. The
+ * mapper counts mappings the way AppleVTDDeviceMapper does: an atomic
+ * increment on map, an atomic decrement on unmap, and the lock and wakeup
+ * only on the last one. The bridge either sleeps on that wakeup with a
+ * deadline (kIOMapperWaitForQuiesceKey) or polls the count every 10ms as it
+ * does for IODARTMapper. Prints how long after the last unmap each teardown
+ * returns, and fails if a notified teardown ever took longer than the limit.
+ *
+ * mapperquiesce [-n teardowns] [-t threads] [-m mappings] [-l limit us] [-s seed]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMaxThreads     (16)
+#define kDeadlineMS     (100)			// DART_WAIT_TIME_MS
+#define kPollMS         (10)
+#define kMaxHoldUS      (5000)
+
+struct mapper
+{
+	pthread_mutex_t lock;
+	pthread_cond_t  wakeup;
+	atomic_int      mappings;
+	atomic_ullong   lastUnmap;
+};
+
+struct driver
+{
+	struct mapper * mapper;
+	uint32_t        mappings;
+	uint32_t        seed;
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+sleepNS(uint64_t ns)
+{
+	struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+
+	nanosleep(&ts, NULL);
+}
+
+// AppleVTDDeviceMapper::iovmMapMemory
+static void
+mapperMap(struct mapper * mapper)
+{
+	atomic_fetch_add(&mapper->mappings, 1);
+}
+
+// AppleVTDDeviceMapper::iovmUnmapMemory
+static void
+mapperUnmap(struct mapper * mapper)
+{
+	unsigned long long last, stamp = now();
+
+	// stamped before the count drops, so the waiter never sees zero without it
+	last = atomic_load(&mapper->lastUnmap);
+	while ((stamp > last) && !atomic_compare_exchange_weak(&mapper->lastUnmap, &last, stamp)) {}
+	if (1 == atomic_fetch_sub(&mapper->mappings, 1))
+	{
+		pthread_mutex_lock(&mapper->lock);
+		pthread_cond_broadcast(&mapper->wakeup);
+		pthread_mutex_unlock(&mapper->lock);
+	}
+}
+
+// AppleVTDDeviceMapper::waitForQuiesce
+static int
+mapperWaitForQuiesce(struct mapper * mapper, uint64_t deadline)
+{
+	struct timespec ts;
+	int             timedOut = 0;
+
+	ts.tv_sec  = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	pthread_mutex_lock(&mapper->lock);
+	while (atomic_load(&mapper->mappings) > 0)
+	{
+		if (ETIMEDOUT == pthread_cond_timedwait(&mapper->wakeup, &mapper->lock, &ts))
+		{
+			timedOut = (atomic_load(&mapper->mappings) > 0);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mapper->lock);
+
+	return (timedOut);
+}
+
+// kIODARTFunctionGetNumAllocations every 10ms
+static int
+mapperPollQuiesce(struct mapper * mapper, uint64_t deadline)
+{
+	while (atomic_load(&mapper->mappings) > 0)
+	{
+		if (now() >= deadline) return (1);
+		sleepNS(kPollMS * 1000000ULL);
+	}
+	return (0);
+}
+
+static void *
+driverThread(void * arg)
+{
+	struct driver * driver = arg;
+	uint32_t        idx;
+
+	for (idx = 0; idx < driver->mappings; idx++)
+	{
+		sleepNS((rand_r(&driver->seed) % (kMaxHoldUS / driver->mappings + 1)) * 1000ULL);
+		mapperUnmap(driver->mapper);
+	}
+	return (NULL);
+}
+
+static int
+compareU64(const void * a, const void * b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return ((x > y) - (x < y));
+}
+
+// one nub teardown, returns ns from the last unmap to the bridge moving on
+static uint64_t
+teardown(int notified, uint32_t threads, uint32_t mappings, uint32_t seed, int * timedOut)
+{
+	struct mapper      mapper;
+	pthread_condattr_t attr;
+	struct driver   drivers[kMaxThreads];
+	pthread_t       thread[kMaxThreads];
+	uint64_t        deadline, done;
+	uint32_t        idx, map;
+
+	memset(&mapper, 0, sizeof(mapper));
+	pthread_mutex_init(&mapper.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mapper.wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (idx = 0; idx < threads; idx++)
+	{
+		drivers[idx].mapper   = &mapper;
+		drivers[idx].mappings = mappings;
+		drivers[idx].seed     = seed * kMaxThreads + idx;
+		for (map = 0; map < mappings; map++) mapperMap(&mapper);
+	}
+	for (idx = 0; idx < threads; idx++) pthread_create(&thread[idx], NULL, &driverThread, &drivers[idx]);
+
+	deadline  = now() + kDeadlineMS * 1000000ULL;
+	*timedOut = notified ? mapperWaitForQuiesce(&mapper, deadline) : mapperPollQuiesce(&mapper, deadline);
+	done      = now();
+
+	for (idx = 0; idx < threads; idx++) pthread_join(thread[idx], NULL);
+	pthread_cond_destroy(&mapper.wakeup);
+	pthread_mutex_destroy(&mapper.lock);
+
+	return ((done > atomic_load(&mapper.lastUnmap)) ? (done - atomic_load(&mapper.lastUnmap)) : 0);
+}
+
+int main(int argc, char * argv[])
+{
+	static uint64_t notifiedNS[100000], polledNS[100000];
+	uint32_t        teardowns = 200;
+	uint32_t        threads   = 4;
+	uint32_t        mappings  = 32;
+	uint32_t        limitUS   = 1000;
+	uint32_t        seed      = 1;
+	uint32_t        idx, timeouts;
+	int             timedOut, ch, failed;
+
+	while (-1 != (ch = getopt(argc, argv, "n:t:m:l:s:")))
+	{
+		switch (ch)
+		{
+			case 'n': teardowns = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 't': threads   = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'm': mappings  = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'l': limitUS   = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 's': seed      = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n teardowns] [-t threads] [-m mappings] [-l limit us] [-s seed]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!threads || (threads > kMaxThreads)) threads = kMaxThreads;
+	if (!mappings) mappings = 1;
+	if (!teardowns || (teardowns > 100000)) teardowns = 100000;
+
+	timeouts = 0;
+	for (idx = 0; idx < teardowns; idx++)
+	{
+		notifiedNS[idx] = teardown(1, threads, mappings, seed + idx, &timedOut);
+		timeouts += timedOut;
+		polledNS[idx]   = teardown(0, threads, mappings, seed + idx, &timedOut);
+		timeouts += timedOut;
+	}
+	qsort(notifiedNS, teardowns, sizeof(notifiedNS[0]), &compareU64);
+	qsort(polledNS, teardowns, sizeof(polledNS[0]), &compareU64);
+
+	printf("%u teardowns, %u threads x %u mappings, %u hit the %u ms deadline\n",
+			teardowns, threads, mappings, timeouts, kDeadlineMS);
+	printf("%-10s %12s %12s %12s (us after the last unmap)\n", "wait", "median", "p99", "max");
+	printf("%-10s %12.1f %12.1f %12.1f\n", "notified",
+			notifiedNS[teardowns / 2] / 1000.0, notifiedNS[(teardowns * 99) / 100] / 1000.0, notifiedNS[teardowns - 1] / 1000.0);
+	printf("%-10s %12.1f %12.1f %12.1f\n", "polled",
+			polledNS[teardowns / 2] / 1000.0, polledNS[(teardowns * 99) / 100] / 1000.0, polledNS[teardowns - 1] / 1000.0);
+
+	failed = (timeouts != 0) || (notifiedNS[teardowns - 1] > limitUS * 1000ULL);
+	if (failed) printf("FAILED: notified teardown over %u us or a deadline was hit\n", limitUS);
+
+	return (failed ? 1 : 0);
+}
@@ -0,0 +1,211 @@
+/*
+cc tools/mmioblock.c -o /tmp/mmioblock -O2 -Wall
+ */
+
+/*
+ * Checks the access pattern of IOPCIDevice::deviceMemoryReadBlock() and
+ * deviceMemoryWriteBlock() against a simulated BAR, and compares a block
+ * copy with the per register loop ring and log readers did before: one
+ * deviceMemoryRead32() per dword, each redoing the range check and, on ARM,
+ * the offload checks and descriptor tag lookup. Every device access is
+ * checked to be naturally aligned and inside the range, and every copy is
+ * compared byte for byte, for all small offsets, lengths and buffer
+ * alignments. Prints device accesses and modeled time per copy, with each
+ * non posted read costing the given latency.
+ *
+ * mmioblock [-b bytes] [-r read latency ns] [-c check ns]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kBARSize (64 * 1024)
+
+static uint8_t  bar[kBARSize];
+static uint64_t reads, writes, checks, bad;
+
+// deviceMemoryBlockRange, or the range check at the top of each scalar accessor
+static int
+rangeCheck(uint64_t offset, uint64_t length)
+{
+	uint64_t end;
+
+	checks++;
+	return (!__builtin_add_overflow(offset, length, &end) && (end <= kBARSize));
+}
+
+// ml_io_read
+static uint64_t
+ioRead(uint64_t offset, uint64_t size)
+{
+	uint64_t value = 0;
+
+	if ((offset & (size - 1)) || ((offset + size) > kBARSize)) bad++;
+	reads++;
+	memcpy(&value, &bar[offset], size);
+	return (value);
+}
+
+// ml_io_write
+static void
+ioWrite(uint64_t offset, uint64_t value, uint64_t size)
+{
+	if ((offset & (size - 1)) || ((offset + size) > kBARSize)) bad++;
+	writes++;
+	memcpy(&bar[offset], &value, size);
+}
+
+// IOPCIDeviceMemoryAccessSize
+static uint64_t
+accessSize(uint64_t address, uint64_t remaining)
+{
+	uint64_t size = sizeof(uint64_t);
+
+	while ((size > remaining) || (address & (size - 1))) size >>= 1;
+	return (size);
+}
+
+static int
+readBlock(uint64_t offset, void * data, uint64_t length)
+{
+	uint64_t done, size, value;
+
+	if (!rangeCheck(offset, length)) return (0);
+	for (done = 0; done < length; done += size)
+	{
+		size  = accessSize(offset + done, length - done);
+		value = ioRead(offset + done, size);
+		memcpy((uint8_t *) data + done, &value, size);
+	}
+	return (1);
+}
+
+static int
+writeBlock(uint64_t offset, const void * data, uint64_t length)
+{
+	uint64_t done, size, value;
+
+	if (!rangeCheck(offset, length)) return (0);
+	for (done = 0; done < length; done += size)
+	{
+		size  = accessSize(offset + done, length - done);
+		value = 0;
+		memcpy(&value, (const uint8_t *) data + done, size);
+		ioWrite(offset + done, value, size);
+	}
+	return (1);
+}
+
+// a dword ring or log reader before, one deviceMemoryRead32 per dword
+static int
+readScalar(uint64_t offset, void * data, uint64_t length)
+{
+	uint64_t done;
+	uint32_t value;
+
+	for (done = 0; done < length; done += sizeof(uint32_t))
+	{
+		if (!rangeCheck(offset + done, sizeof(uint32_t))) return (0);
+		value = (uint32_t) ioRead(offset + done, sizeof(uint32_t));
+		memcpy((uint8_t *) data + done, &value, sizeof(uint32_t));
+	}
+	return (1);
+}
+
+static uint32_t
+check(void)
+{
+	static uint8_t buffer[256 + 8], expect[256];
+	uint64_t       offset, length, align, idx;
+	uint32_t       failures = 0;
+
+	for (idx = 0; idx < kBARSize; idx++) bar[idx] = (uint8_t) (idx * 131 + 7);
+	for (offset = 0; offset < 16; offset++)
+	for (length = 0; length <= 64; length++)
+	for (align = 0; align < 8; align++)
+	{
+		memset(buffer, 0xA5, sizeof(buffer));
+		readBlock(kBARSize - 128 + offset, buffer + align, length);
+		if (memcmp(buffer + align, &bar[kBARSize - 128 + offset], length)
+		 || ((align + length < sizeof(buffer)) && (buffer[align + length] != 0xA5)))
+		{
+			printf("read: offset %llu length %llu buffer +%llu\n",
+					(unsigned long long) offset, (unsigned long long) length, (unsigned long long) align);
+			failures++;
+		}
+
+		for (idx = 0; idx < length; idx++) buffer[align + idx] = expect[idx] = (uint8_t) (offset ^ length ^ idx ^ 0x5A);
+		memcpy(&expect[length], &bar[offset + length], 8);
+		writeBlock(offset, buffer + align, length);
+		if (memcmp(&bar[offset], expect, length + 8))
+		{
+			printf("write: offset %llu length %llu buffer +%llu\n",
+					(unsigned long long) offset, (unsigned long long) length, (unsigned long long) align);
+			failures++;
+		}
+		for (idx = 0; idx < length + 8; idx++) bar[offset + idx] = (uint8_t) ((offset + idx) * 131 + 7);
+	}
+
+	// the whole range is refused before any access
+	reads = 0;
+	if (readBlock(kBARSize - 8, buffer, 16) || readBlock(UINT64_MAX - 3, buffer, 8) || reads)
+	{
+		printf("overrun: accepted\n");
+		failures++;
+	}
+	if (bad)
+	{
+		printf("%llu misaligned or out of range device accesses\n", (unsigned long long) bad);
+		failures++;
+	}
+	return (failures);
+}
+
+int main(int argc, char * argv[])
+{
+	static uint8_t buffer[kBARSize];
+	uint64_t       bytes   = 4096;
+	uint64_t       readNS  = 600;
+	uint64_t       checkNS = 40;
+	uint64_t       scalarReads, scalarChecks;
+	uint32_t       failures;
+	int            ch;
+
+	while (-1 != (ch = getopt(argc, argv, "b:r:c:")))
+	{
+		switch (ch)
+		{
+			case 'b': bytes   = strtoull(optarg, NULL, 0); break;
+			case 'r': readNS  = strtoull(optarg, NULL, 0); break;
+			case 'c': checkNS = strtoull(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-b bytes] [-r read latency ns] [-c check ns]\n", argv[0]);
+				exit(1);
+		}
+	}
+	bytes &= ~3ULL;
+	if (!bytes || (bytes > kBARSize)) bytes = kBARSize;
+
+	failures = check();
+
+	reads = checks = 0;
+	readScalar(0, buffer, bytes);
+	scalarReads  = reads;
+	scalarChecks = checks;
+	reads = checks = 0;
+	readBlock(0, buffer, bytes);
+
+	printf("%llu byte copy, %llu ns per read, %llu ns per check\n",
+			(unsigned long long) bytes, (unsigned long long) readNS, (unsigned long long) checkNS);
+	printf("%-10s %10s %10s %12s\n", "copy", "reads", "checks", "modeled us");
+	printf("%-10s %10llu %10llu %12.1f\n", "scalar32", (unsigned long long) scalarReads, (unsigned long long) scalarChecks,
+			(scalarReads * readNS + scalarChecks * checkNS) / 1000.0);
+	printf("%-10s %10llu %10llu %12.1f\n", "block", (unsigned long long) reads, (unsigned long long) checks,
+			(reads * readNS + checks * checkNS) / 1000.0);
+	printf("%u failures\n", failures);
+
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,224 @@
+/*
+cc tools/msimodsim.c -o /tmp/msimodsim -O2 -Wall -lm
+ */
+
+/*
+ * Userspace model of the MSI-X software moderation in
+ * IOPCIMessagedInterruptController::moderateVector() and moderationPoll().
+ * Work arrives at a device that raises one message per arrival while its
+ * vector is unmasked and sets its pending bit while masked. The handler
+ * drains everything queued. Reports interrupts taken, work per interrupt and
+ * the latency moderation adds, for a few arrival processes.
+ *
+ * msimodsim [-r rate/s] [-m maxRate/s] [-i intervalUS] [-t seconds] [-s seed]
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kWindowUS       (10000.0)
+#define kLatencyBuckets (64)
+
+enum { kPoisson, kBursty, kConstant, kProcessCount };
+static const char * processNames[kProcessCount] = { "poisson", "bursty", "constant" };
+
+struct moderation
+{
+	uint32_t threshold;
+	double   interval;
+	double   windowStart;
+	uint32_t count;
+	uint32_t pending;
+	int      moderated;
+	double   pollTime;
+	uint64_t moderations;
+	uint64_t polls;
+};
+
+struct result
+{
+	uint64_t interrupts;
+	uint64_t work;
+	double   latencySum;
+	uint64_t latency[kLatencyBuckets];		// bucket n counts latencies < (1 << n) us
+};
+
+static double
+uniform(void)
+{
+	return ((random() + 1.0) / (RAND_MAX + 2.0));
+}
+
+// next arrival after now, us
+static double
+nextArrival(int process, double now, double rate)
+{
+	double mean = 1e6 / rate;
+
+	switch (process)
+	{
+		case kPoisson:
+			return (now - mean * log(uniform()));
+		case kBursty:
+			// 1ms bursts at 10x the rate, then 9ms idle
+			now -= (mean / 10.0) * log(uniform());
+			if (fmod(now, 10000.0) >= 1000.0) now += 10000.0 - fmod(now, 10000.0);
+			return (now);
+		default:
+			return (now + mean);
+	}
+}
+
+static void
+record(struct result * result, double latency)
+{
+	uint32_t bucket = 0;
+
+	result->work++;
+	result->latencySum += latency;
+	while ((bucket < kLatencyBuckets - 1) && (latency >= (double) (1ULL << bucket))) bucket++;
+	result->latency[bucket]++;
+}
+
+static double
+percentile(struct result * result, double fraction)
+{
+	uint64_t total = 0, limit = (uint64_t) (result->work * fraction);
+	uint32_t bucket;
+
+	for (bucket = 0; bucket < kLatencyBuckets; bucket++)
+	{
+		total += result->latency[bucket];
+		if (total > limit) return ((double) (1ULL << bucket));
+	}
+	return (0);
+}
+
+static void
+simulate(int process, double rate, uint32_t maxRate, double interval, double duration,
+		 uint32_t seed, struct result * result, struct moderation * mod)
+{
+	double * queue;
+	size_t   queueMax, queued;
+	double   now, arrival;
+	int      masked, pendingBit, intr;
+	size_t   idx;
+
+	memset(result, 0, sizeof(*result));
+	memset(mod, 0, sizeof(*mod));
+	mod->threshold   = maxRate ? (uint32_t) fmax(1.0, maxRate * kWindowUS / 1e6) : 0;
+	mod->interval    = interval;
+	mod->windowStart = -kWindowUS;
+
+	queueMax = 1024;
+	queue    = malloc(queueMax * sizeof(double));
+	queued   = 0;
+	masked   = pendingBit = 0;
+
+	srandom(seed);
+	arrival = nextArrival(process, 0, rate);
+	// past the end only polls run, until the backlog drains
+	while ((arrival < duration) || mod->moderated)
+	{
+		intr = 0;
+		if (mod->moderated && ((mod->pollTime <= arrival) || (arrival >= duration)))
+		{
+			// moderationPoll()
+			now = mod->pollTime;
+			mod->polls++;
+			if (!mod->pending) mod->moderated = 0, mod->windowStart = now, mod->count = 0;
+			else               mod->pending = 0, mod->pollTime = now + mod->interval;
+			masked = 0;
+			if (pendingBit) pendingBit = 0, intr = 1;
+		}
+		else
+		{
+			now = arrival;
+			if (queued == queueMax) queue = realloc(queue, (queueMax *= 2) * sizeof(double));
+			queue[queued++] = arrival;
+			if (masked) pendingBit = 1;
+			else        intr = 1;
+			arrival = nextArrival(process, arrival, rate);
+		}
+		if (!intr) continue;
+
+		// handler drains the queue
+		result->interrupts++;
+		for (idx = 0; idx < queued; idx++) record(result, now - queue[idx]);
+		queued = 0;
+
+		// moderateVector()
+		if (!mod->threshold) continue;
+		if (mod->moderated)
+		{
+			mod->pending++;
+			masked = 1;
+			continue;
+		}
+		if ((now - mod->windowStart) >= kWindowUS) mod->windowStart = now, mod->count = 0;
+		if (++mod->count > mod->threshold)
+		{
+			mod->moderated = 1;
+			mod->pending   = 1;
+			mod->moderations++;
+			mod->pollTime  = now + mod->interval;
+			masked = 1;
+		}
+	}
+	free(queue);
+}
+
+int main(int argc, char * argv[])
+{
+	struct result     off, on;
+	struct moderation modOff, modOn;
+	double   rate     = 200000;
+	uint32_t maxRate  = 20000;
+	double   interval = 50;
+	double   seconds  = 1;
+	uint32_t seed     = 1;
+	int      process, ch;
+
+	while (-1 != (ch = getopt(argc, argv, "r:m:i:t:s:")))
+	{
+		switch (ch)
+		{
+			case 'r': rate     = strtod(optarg, NULL); break;
+			case 'm': maxRate  = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'i': interval = strtod(optarg, NULL); break;
+			case 't': seconds  = strtod(optarg, NULL); break;
+			case 's': seed     = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-r rate/s] [-m maxRate/s] [-i intervalUS] [-t seconds] [-s seed]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!(rate > 0) || !(interval > 0) || !(seconds > 0)) exit(1);
+
+	printf("rate %.0f/s maxRate %u/s interval %.0fus %.1fs\n", rate, maxRate, interval, seconds);
+	printf("%-10s %-4s %12s %10s %10s %8s %8s %10s\n",
+			"", "", "intr/s", "work/intr", "lat avg", "lat p50", "lat p99", "moderations");
+	for (process = 0; process < kProcessCount; process++)
+	{
+		simulate(process, rate, 0, interval, seconds * 1e6, seed, &off, &modOff);
+		simulate(process, rate, maxRate, interval, seconds * 1e6, seed, &on, &modOn);
+		printf("%-10s %-4s %12.0f %10.2f %8.1fus %6.0fus %6.0fus %10s\n", processNames[process], "off",
+				off.interrupts / seconds, (double) off.work / off.interrupts,
+				off.latencySum / off.work, percentile(&off, 0.5), percentile(&off, 0.99), "-");
+		printf("%-10s %-4s %12.0f %10.2f %8.1fus %6.0fus %6.0fus %10llu\n", "", "on",
+				on.interrupts / seconds, (double) on.work / on.interrupts,
+				on.latencySum / on.work, percentile(&on, 0.5), percentile(&on, 0.99),
+				(unsigned long long) modOn.moderations);
+		if (off.work != on.work)
+		{
+			fprintf(stderr, "work lost\n");
+			exit(1);
+		}
+	}
+
+	return (0);
+}
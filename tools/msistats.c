@@ -0,0 +1,252 @@
+/*
+cc tools/msistats.c -o /tmp/msistats -framework IOKit -framework CoreFoundation -g -Wall
+cc tools/msistats.c -o /tmp/msistats -g -Wall		(decode dumps only, -f)
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#if __APPLE__
+#include <IOKit/IOKitLib.h>
+#include <IOKit/pci/IOPCIPrivate.h>
+#endif
+#include "../msistats.h"
+
+const msi_stats_header_t *
+msi_stats_validate(const void * blob, size_t length)
+{
+	const msi_stats_header_t * header = (const msi_stats_header_t *) blob;
+
+	if (length < sizeof(*header))                           return (NULL);
+	if (kMSIStatsMagic != header->magic)                    return (NULL);
+	if (header->header_length < sizeof(*header))            return (NULL);
+	if ((header->length > length) || (header->length < header->header_length)) return (NULL);
+	// newer versions only append fields
+	if (header->vector_length < sizeof(msi_stats_vector_t)) return (NULL);
+	if (((uint64_t) header->vector_length * header->vectors) > (header->length - header->header_length)) return (NULL);
+
+	return (header);
+}
+
+const msi_stats_vector_t *
+msi_stats_vector(const msi_stats_header_t * header, uint32_t idx)
+{
+	if (idx >= header->vectors) return (NULL);
+	return ((const msi_stats_vector_t *) (((const uint8_t *) header) + header->header_length
+											+ idx * header->vector_length));
+}
+
+uint64_t
+msi_stats_ns(const msi_stats_header_t * header, uint64_t value)
+{
+	if (!header->timebase_denom) return (value);
+	return (value * header->timebase_numer / header->timebase_denom);
+}
+
+static const msi_stats_header_t * gSortHeader;
+
+static int
+msi_stats_compare(const void * a, const void * b)
+{
+	const msi_stats_vector_t * va = msi_stats_vector(gSortHeader, *(const uint32_t *) a);
+	const msi_stats_vector_t * vb = msi_stats_vector(gSortHeader, *(const uint32_t *) b);
+
+	if (va->handler_time != vb->handler_time) return ((va->handler_time > vb->handler_time) ? -1 : 1);
+	if (va->deliveries != vb->deliveries)     return ((va->deliveries > vb->deliveries) ? -1 : 1);
+	return (0);
+}
+
+static void
+msi_stats_print_histogram(FILE * file, const msi_stats_header_t * header, const msi_stats_vector_t * vector)
+{
+	uint64_t total;
+	uint32_t idx, last;
+
+	for (total = 0, last = 0, idx = 0; idx < kMSIStatsHistBuckets; idx++)
+	{
+		total += vector->handler_time_hist[idx];
+		if (vector->handler_time_hist[idx]) last = idx;
+	}
+	if (!total) return;
+
+	for (idx = 0; idx <= last; idx++)
+	{
+		fprintf(file, "      < %-12lluns %12u %6.2f%%\n",
+				(unsigned long long) msi_stats_ns(header, 1ULL << idx),
+				vector->handler_time_hist[idx], vector->handler_time_hist[idx] * 100.0 / total);
+	}
+}
+
+void
+msi_stats_print(FILE * file, const msi_stats_header_t * header, uint32_t histograms)
+{
+	const msi_stats_vector_t * vector;
+	uint32_t                 * order;
+	uint64_t                   total, handled;
+	uint32_t                   idx;
+
+	fprintf(file, "version %d, %d vectors, %d cpus\n", header->version, header->vectors, header->cpus);
+	if (!header->vectors) return;
+
+	order = malloc(header->vectors * sizeof(uint32_t));
+	assert(order);
+	for (total = 0, idx = 0; idx < header->vectors; idx++)
+	{
+		order[idx] = idx;
+		total += msi_stats_vector(header, idx)->handler_time;
+	}
+	gSortHeader = header;
+	qsort(order, header->vectors, sizeof(uint32_t), &msi_stats_compare);
+	if (!total) total = 1;
+
+	fprintf(file, "%-24s %-8s %5s %5s %3s %-5s %12s %10s %10s %12s %8s %6s\n",
+			"device", "location", "vec", "index", "cpu", "flags",
+			"deliveries", "spurious", "masked", "handler ms", "avg ns", "share");
+	for (idx = 0; idx < header->vectors; idx++)
+	{
+		vector  = msi_stats_vector(header, order[idx]);
+		handled = vector->deliveries - vector->spurious - vector->masked_pending;
+		fprintf(file, "%-24.*s %02x:%02x.%x 0x%03x %5d %3d %c%c%c   %12llu %10llu %10llu %12.3f %8llu %5.1f%%\n",
+				(int) sizeof(vector->name), vector->name,
+				(vector->location >> 8) & 0xff, (vector->location >> 3) & 0x1f, vector->location & 7,
+				vector->vector, vector->index, vector->cpu,
+				(kMSIStatsVectorRegistered & vector->flags) ? 'r' : '-',
+				(kMSIStatsVectorShared     & vector->flags) ? 's' : '-',
+				(kMSIStatsVectorMSIX       & vector->flags) ? 'x' : '-',
+				(unsigned long long) vector->deliveries,
+				(unsigned long long) vector->spurious,
+				(unsigned long long) vector->masked_pending,
+				msi_stats_ns(header, vector->handler_time) / 1e6,
+				(unsigned long long) (handled ? (msi_stats_ns(header, vector->handler_time) / handled) : 0),
+				vector->handler_time * 100.0 / total);
+		if (idx < histograms) msi_stats_print_histogram(file, header, vector);
+	}
+	free(order);
+}
+
+static int printStatistics(const void * bytes, size_t length, uint32_t histograms)
+{
+	const msi_stats_header_t * header;
+
+	header = msi_stats_validate(bytes, length);
+	if (!header)
+	{
+		fprintf(stderr, "not an interrupt statistics dump\n");
+		return (1);
+	}
+	msi_stats_print(stdout, header, histograms);
+	return (0);
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-n histograms] [-w dumpfile] [-f dumpfile]\n"
+					"  -n  print handler time histograms of the busiest vectors\n"
+					"  -w  capture the statistics to a file\n"
+					"  -f  decode a captured file\n", name);
+	exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+	const char * readFile   = NULL;
+	const char * writeFile  = NULL;
+	uint32_t     histograms = 0;
+	int          ch;
+
+	while (-1 != (ch = getopt(argc, argv, "n:w:f:")))
+	{
+		switch (ch)
+		{
+			case 'n': histograms = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'w': writeFile  = optarg; break;
+			case 'f': readFile   = optarg; break;
+			default:  usage(argv[0]);
+		}
+	}
+
+	if (readFile)
+	{
+		FILE * file;
+		void * bytes;
+		long   length;
+		int    result;
+
+		file = fopen(readFile, "r");
+		if (!file)
+		{
+			perror(readFile);
+			exit(1);
+		}
+		fseek(file, 0, SEEK_END);
+		length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		bytes = malloc(length);
+		assert(bytes);
+		if (length != (long) fread(bytes, 1, length, file))
+		{
+			perror(readFile);
+			exit(1);
+		}
+		fclose(file);
+		result = printStatistics(bytes, length, histograms);
+		free(bytes);
+		exit(result);
+	}
+
+#if __APPLE__
+	io_service_t  service;
+	io_connect_t  connect;
+	kern_return_t status;
+	void        * bytes;
+	size_t        length;
+
+	service = IOServiceGetMatchingService(kIOMainPortDefault, IOServiceMatching("IOPCIBridge"));
+	assert(service);
+	status = IOServiceOpen(service, mach_task_self(), kIOPCIDiagnosticsClientType, &connect);
+	IOObjectRelease(service);
+	assert(kIOReturnSuccess == status);
+
+	// the header says how much is needed, vectors may come and go between calls
+	length = 64 * 1024;
+	do
+	{
+		bytes = malloc(length);
+		assert(bytes);
+		status = IOConnectCallStructMethod(connect, kIOPCIDiagnosticsMethodInterruptStatistics,
+											NULL, 0, bytes, &length);
+		if (kIOReturnNoSpace == status)
+		{
+			length = ((const msi_stats_header_t *) bytes)->length + 16 * sizeof(msi_stats_vector_t);
+			free(bytes);
+		}
+	}
+	while (kIOReturnNoSpace == status);
+	IOServiceClose(connect);
+	if (kIOReturnSuccess != status)
+	{
+		fprintf(stderr, "kIOPCIDiagnosticsMethodInterruptStatistics 0x%x\n", status);
+		exit(1);
+	}
+
+	if (writeFile)
+	{
+		FILE * file = fopen(writeFile, "w");
+		if (!file || (1 != fwrite(bytes, length, 1, file)))
+		{
+			perror(writeFile);
+			exit(1);
+		}
+		fclose(file);
+		exit(0);
+	}
+
+	exit(printStatistics(bytes, length, histograms));
+#else
+	(void) writeFile;
+	usage(argv[0]);
+#endif
+}
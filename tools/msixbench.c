@@ -0,0 +1,271 @@
+/*
+cc tools/msixbench.c -o /tmp/msixbench -O2 -Wall -lpthread
+ */
+
+/*
+ * Userspace model of the shared MSI-X dispatch in
+ * IOPCIMessagedInterruptController::handleInterrupt(). The pending bit array
+ * is simulated, each read of it is counted as the uncached MMIO read it is
+ * on hardware. Compares the full scan against dispatching only set bits of
+ * the pba words that hold registered vectors.
+ *
+ * With -a, models allocVectors() instead: a lock allocated per vector against
+ * the striped vector locks, for footprint, allocation time and
+ * register/unregister churn over all the vectors.
+ *
+ * msixbench [-a] [-v vectors] [-r registered] [-p pending] [-n iterations]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMaxVectors		(2048)
+#define kLockStripes	(16)
+
+struct vector
+{
+	uint32_t registered;
+	uint32_t disabledHard;
+	uint64_t calls;
+};
+
+static uint64_t         pba[kMaxVectors / 64];
+static uint32_t         mask[2 * kMaxVectors / 64];
+static uint32_t         maskWords;
+static struct vector    vectors[kMaxVectors];
+static uint64_t         mmioReads;
+
+static inline uint64_t
+pbaRead(uint32_t word)
+{
+	mmioReads++;
+	return (((volatile uint64_t *) pba)[word]);
+}
+
+static inline void
+dispatchVector(struct vector * vector)
+{
+	if (vector->registered)
+	{
+		if (vector->disabledHard) vector->registered = 3;
+		else                      vector->calls++;
+	}
+}
+
+// the loop before, every pba word and every bit
+static void
+dispatchScan(uint32_t count)
+{
+	uint64_t bits = 0;
+	uint32_t source, bit;
+
+	for (source = 0; source < count; source++)
+	{
+		bit = (source & 63);
+		if (!bit) bits = pbaRead(source >> 6);
+		if (!(bits & (1ULL << bit))) continue;
+		dispatchVector(&vectors[source]);
+	}
+}
+
+// registered words only, set bits only
+static void
+dispatchSetBits(void)
+{
+	uint64_t bits;
+	uint32_t words, word, bit;
+
+	words = maskWords;
+	while (words)
+	{
+		word   = __builtin_ctz(words);
+		words &= (words - 1);
+		bits   = pbaRead(word);
+		bits  &= ((((uint64_t) mask[2 * word + 1]) << 32) | mask[2 * word]);
+		while (bits)
+		{
+			bit   = __builtin_ctzll(bits);
+			bits &= (bits - 1);
+			dispatchVector(&vectors[(word << 6) + bit]);
+		}
+	}
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+setup(uint32_t registered, uint32_t pending, uint32_t seed)
+{
+	uint32_t idx, vector;
+
+	bzero(pba, sizeof(pba));
+	bzero(mask, sizeof(mask));
+	bzero(vectors, sizeof(vectors));
+	maskWords = 0;
+
+	// drivers register from the bottom, as msix queues are allocated
+	for (idx = 0; idx < registered; idx++)
+	{
+		vectors[idx].registered = 1;
+		mask[idx >> 5] |= (1U << (idx & 31));
+		maskWords      |= (1U << (idx >> 6));
+	}
+	srandom(seed);
+	for (idx = 0; idx < pending; idx++)
+	{
+		vector = random() % registered;
+		pba[vector >> 6] |= (1ULL << (vector & 63));
+	}
+}
+
+static uint64_t
+calls(uint32_t count)
+{
+	uint64_t total = 0;
+	uint32_t idx;
+
+	for (idx = 0; idx < count; idx++) total += vectors[idx].calls;
+	return (total);
+}
+
+struct lockedVector
+{
+	pthread_mutex_t * lock;
+	uint32_t          registered;
+};
+
+static struct lockedVector lockedVectors[kMaxVectors];
+static pthread_mutex_t     stripes[kLockStripes];
+
+static void
+allocBench(uint32_t count, uint32_t iterations)
+{
+	uint64_t start, allocTime[2], churnTime[2], bytes[2];
+	uint32_t idx, iter, striped;
+
+	for (striped = 0; striped < 2; striped++)
+	{
+		start = now_ns();
+		for (iter = 0; iter < iterations; iter++)
+		{
+			for (idx = 0; idx < count; idx++)
+			{
+				if (striped)
+				{
+					if (!idx) for (uint32_t s = 0; s < kLockStripes; s++) pthread_mutex_init(&stripes[s], NULL);
+					lockedVectors[idx].lock = &stripes[idx % kLockStripes];
+				}
+				else
+				{
+					lockedVectors[idx].lock = malloc(sizeof(pthread_mutex_t));
+					pthread_mutex_init(lockedVectors[idx].lock, NULL);
+				}
+			}
+			if (iter == (iterations - 1)) break;
+			for (idx = 0; !striped && (idx < count); idx++) free(lockedVectors[idx].lock);
+		}
+		allocTime[striped] = now_ns() - start;
+		bytes[striped] = striped ? (kLockStripes * sizeof(pthread_mutex_t)) : (count * sizeof(pthread_mutex_t));
+
+		// registerInterrupt()/unregisterInterrupt() of every vector
+		start = now_ns();
+		for (iter = 0; iter < iterations; iter++)
+		{
+			for (idx = 0; idx < count; idx++)
+			{
+				pthread_mutex_lock(lockedVectors[idx].lock);
+				lockedVectors[idx].registered ^= 1;
+				pthread_mutex_unlock(lockedVectors[idx].lock);
+			}
+		}
+		churnTime[striped] = now_ns() - start;
+
+		for (idx = 0; !striped && (idx < count); idx++) free(lockedVectors[idx].lock);
+	}
+
+	printf("vectors %u iterations %u\n", count, iterations);
+	printf("%-10s %12s %14s %14s\n", "", "lock bytes", "alloc ns/vec", "churn ns/vec");
+	printf("%-10s %12llu %14.1f %14.1f\n", "per vector", (unsigned long long) bytes[0],
+			(double) allocTime[0] / iterations / count, (double) churnTime[0] / iterations / count);
+	printf("%-10s %12llu %14.1f %14.1f\n", "striped", (unsigned long long) bytes[1],
+			(double) allocTime[1] / iterations / count, (double) churnTime[1] / iterations / count);
+}
+
+int main(int argc, char * argv[])
+{
+	uint32_t count      = kMaxVectors;
+	uint32_t registered = 0;
+	uint32_t pending    = 1;
+	uint32_t iterations = 1000000;
+	uint32_t idx;
+	uint64_t start, scanTime, setTime, scanReads, setReads, scanCalls, setCalls;
+	int      ch, alloc = 0;
+
+	while (-1 != (ch = getopt(argc, argv, "av:r:p:n:")))
+	{
+		switch (ch)
+		{
+			case 'a': alloc      = 1; break;
+			case 'v': count      = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'r': registered = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'p': pending    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'n': iterations = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-a] [-v vectors] [-r registered] [-p pending] [-n iterations]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!count || (count > kMaxVectors)) count = kMaxVectors;
+	if (!registered || (registered > count)) registered = count;
+	if (!iterations) iterations = 1;
+
+	if (alloc)
+	{
+		allocBench(count, (iterations > 1000) ? 1000 : iterations);
+		return (0);
+	}
+
+	setup(registered, pending, 1);
+	mmioReads = 0;
+	start = now_ns();
+	for (idx = 0; idx < iterations; idx++) dispatchScan(count);
+	scanTime  = now_ns() - start;
+	scanReads = mmioReads;
+	scanCalls = calls(count);
+
+	setup(registered, pending, 1);
+	mmioReads = 0;
+	start = now_ns();
+	for (idx = 0; idx < iterations; idx++) dispatchSetBits();
+	setTime  = now_ns() - start;
+	setReads = mmioReads;
+	setCalls = calls(count);
+
+	printf("vectors %u registered %u pending %u iterations %u\n", count, registered, pending, iterations);
+	printf("%-10s %12s %14s %14s\n", "", "ns/intr", "pba reads/intr", "handlers/intr");
+	printf("%-10s %12.1f %14.2f %14.2f\n", "scan",
+			(double) scanTime / iterations, (double) scanReads / iterations, (double) scanCalls / iterations);
+	printf("%-10s %12.1f %14.2f %14.2f\n", "set bits",
+			(double) setTime / iterations, (double) setReads / iterations, (double) setCalls / iterations);
+
+	if (scanCalls != setCalls)
+	{
+		fprintf(stderr, "handler calls differ\n");
+		exit(1);
+	}
+
+	return (0);
+}
@@ -36,6 +36,37 @@ static uint32_t configRead32(io_connect_t connect, uint32_t segment,
     return ((uint32_t) param.value);
 }
 
+// whole block in one call, falling back to a dword per call on kernels without the selector
+static void configReadBlock(io_connect_t connect, uint32_t segment,
+                                uint32_t bus, uint32_t device, uint32_t function,
+                                uint32_t offset, uint32_t * data, uint32_t length)
+{
+    IOPCIDiagnosticsParameters param;
+    kern_return_t              status;
+    uint32_t                   off;
+
+    param.spaceType = kIOPCIConfigSpace;
+    param.bitWidth  = 32;
+    param.options   = 0;
+
+    param.address.pci.offset   = offset;
+    param.address.pci.function = function;
+    param.address.pci.device   = device;
+    param.address.pci.bus      = bus;
+    param.address.pci.segment  = segment;
+    param.address.pci.reserved = 0;
+    param.value                = length;
+
+    size_t outSize = length;
+    status = IOConnectCallStructMethod(connect, kIOPCIDiagnosticsMethodBlockRead,
+                                       &param, sizeof(param),
+                                       data, &outSize);
+    if ((kIOReturnSuccess == status) && (outSize == length))
+        return;
+
+    for (off = 0; off < length; off += 4)
+        data[off >> 2] = configRead32(connect, segment, bus, device, function, offset + off);
+}
 
 static void configWrite32(io_connect_t connect, uint32_t segment,
                                 uint32_t bus, uint32_t device, uint32_t function,
@@ -168,6 +199,8 @@ io_registry_entry_t lookService(uint32_t segment,
     return (service);
 }
 
+static int extended;
+
 static void dump( const uint8_t * bytes, size_t len )
 {
     int i;
@@ -191,7 +224,6 @@ dumpDevice(io_connect_t connect, uint32_t segment,
     kern_return_t       status;
     io_name_t           name;
     uint64_t     		entryID;
-    uint32_t off;
     uint32_t vendProd;
     uint32_t vend;
     uint32_t prod;
@@ -199,11 +231,11 @@ dumpDevice(io_connect_t connect, uint32_t segment,
     uint32_t priBusNum;
     uint32_t secBusNum;
     uint32_t subBusNum;
-    uint32_t data[256/sizeof(uint32_t)];
+    uint32_t data[4096/sizeof(uint32_t)];
     uint8_t *bytes = (uint8_t *)&data[0];
+    uint32_t length = extended ? 4096 : 256;
 
-    for(off = 0; off < 256; off += 4)
-        data[off >> 2] = configRead32(connect, segment, bus, device, fn, off);
+    configReadBlock(connect, segment, bus, device, fn, 0, data, length);
 
     vendProd = data[0];
     vend = vendProd & 0xffff;
@@ -243,7 +275,7 @@ dumpDevice(io_connect_t connect, uint32_t segment,
             *maxBus = subBusNum;
     }
 
-    dump(bytes, sizeof(data));
+    dump(bytes, length);
     printf("\n");
 }
 
@@ -270,6 +302,14 @@ int main(int argc, char **argv)
     uint32_t bus, device, fn, maxFn;
     uint32_t vendProd;
 
+    // -x dumps the whole 4K of extended config space
+    if ((argc > 1) && !strcmp(argv[1], "-x"))
+    {
+        extended = 1;
+        argc--;
+        argv++;
+    }
+
     if (argc > 3)
     {
         bus    = strtoul(argv[1], NULL, 0);
@@ -0,0 +1,295 @@
+/*
+cc tools/pciplan.cpp IOPCIRange.cpp -DIOPCIRANGE_LIBRARY -I. -o /tmp/pciplan -Wall -g -lstdc++ -framework IOKit -framework CoreFoundation
+ */
+
+/*
+ * Simulates hot plugs into a fragmented bridge window and compares the pause
+ * the configurator asks for when a new device doesn't fit: every hot plug
+ * capable child, as before, against the set IOPCIRangeListPlanHole() picks.
+ * Each child owns one range, may sit above a few more devices, and takes a
+ * while to settle and to pause. Pauses go out together and nothing unpauses
+ * until the last one is paused, so a hot plug's service interruption is set
+ * by the slowest child paused. Every plan is checked by actually moving the
+ * planned ranges and allocating the new device.
+ *
+ * pciplan [-n hot plugs] [-c children] [-w window MB] [-s seed]
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "IOKit/pci/IOPCIConfigurator.h"
+
+#define kMaxChildren (32)
+#define kMB          (1024ULL * 1024ULL)
+#define kWindowBase  (0x80000000ULL)
+#define kMemoryType  (0)			// kIOPCIResourceTypeMemory
+
+struct IOPCIConfigEntry
+{
+	IOPCIRange range;
+	int        present;
+	int        attached;
+	int        fixed;			// static, never paused
+	uint32_t   devices;			// itself and everything below it
+	uint32_t   settleMS;		// pauseDelayNS()
+	uint32_t   pauseMS;			// driver pause and unpause
+};
+
+struct topology
+{
+	IOPCIRange *     head;
+	IOPCIConfigEntry children[kMaxChildren];
+	IOPCIConfigEntry plugged;
+	uint32_t         count;
+};
+
+struct result
+{
+	uint32_t devices;
+	uint32_t pausedChildren;
+	uint32_t interruptionMS;
+	uint64_t deviceMS;
+	int      ok;
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static IOPCIScalar
+randomSize(void)
+{
+	return (kMB << (random() % 7));			// 1MB .. 64MB
+}
+
+static void
+plug(IOPCIRange * head, IOPCIConfigEntry * child)
+{
+	IOPCIRangeInit(&child->range, kMemoryType, 0, randomSize());
+	child->range.device = child;
+	child->attached = (random() % 8) != 0;
+	child->fixed    = (random() % 6) == 0;
+	child->devices  = 1 + (random() % 4);
+	child->settleMS = ((random() % 3) == 0) ? 100 * (1 + (random() % 20)) : 0;
+	child->pauseMS  = 5 + (random() % 46);
+	child->present  = IOPCIRangeListAllocateSubRange(head, &child->range);
+}
+
+// the same children from the same seed, after enough plugs and unplugs to leave holes
+static void
+build(struct topology * topo, uint32_t seed, uint32_t count, IOPCIScalar window)
+{
+	IOPCIConfigEntry * child;
+	uint32_t           idx;
+
+	srandom(seed);
+	memset(topo, 0, sizeof(*topo));
+	IOPCIRangeListAddRange(&topo->head, kMemoryType, kWindowBase, window, kMB);
+	topo->count = count;
+	for (idx = 0; idx < 8 * count; idx++)
+	{
+		child = &topo->children[random() % count];
+		if (!child->present) plug(topo->head, child);
+		else
+		{
+			IOPCIRangeListDeallocateSubRange(topo->head, &child->range);
+			child->present = 0;
+		}
+	}
+	IOPCIRangeInit(&topo->plugged.range, kMemoryType, 0, randomSize());
+	topo->plugged.range.device = &topo->plugged;
+}
+
+static IOPCIScalar
+cost(void * ref, IOPCIRange * range)
+{
+	IOPCIConfigEntry * child = range->device;
+
+	if (!child || child->fixed) return (kIOPCIRangePlanImmovable);
+	if (!child->attached)       return (0);
+	return (child->devices);
+}
+
+// free the movers, place the new device, then put the movers back largest first
+static int
+relocate(struct topology * topo, IOPCIConfigEntry ** movers, uint32_t count)
+{
+	IOPCIConfigEntry * sorted[kMaxChildren];
+	IOPCIConfigEntry * swap;
+	uint32_t           idx, next;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		IOPCIRangeListDeallocateSubRange(topo->head, &movers[idx]->range);
+		sorted[idx] = movers[idx];
+	}
+	if (!IOPCIRangeListAllocateSubRange(topo->head, &topo->plugged.range)) return (0);
+	for (idx = 0; idx < count; idx++)
+	{
+		for (next = idx + 1; next < count; next++)
+		{
+			if (sorted[next]->range.size > sorted[idx]->range.size)
+			{
+				swap = sorted[idx]; sorted[idx] = sorted[next]; sorted[next] = swap;
+			}
+		}
+		if (!IOPCIRangeListAllocateSubRange(topo->head, &sorted[idx]->range)) return (0);
+	}
+	return (1);
+}
+
+static void
+account(struct result * result, IOPCIConfigEntry ** movers, uint32_t count)
+{
+	uint32_t idx, slowest;
+
+	slowest = 0;
+	for (idx = 0; idx < count; idx++)
+	{
+		if (!movers[idx]->attached) continue;
+		if ((movers[idx]->settleMS + movers[idx]->pauseMS) > slowest) slowest = movers[idx]->settleMS + movers[idx]->pauseMS;
+	}
+	for (idx = 0; idx < count; idx++)
+	{
+		if (!movers[idx]->attached) continue;
+		result->pausedChildren++;
+		result->devices  += movers[idx]->devices;
+		// out from its own pause until the unpause after the slowest
+		result->deviceMS += (uint64_t) movers[idx]->devices
+							* (slowest - movers[idx]->settleMS + movers[idx]->pauseMS);
+	}
+	result->interruptionMS = slowest ? (slowest + 50) : 0;
+}
+
+// every attached hot plug child, and the unattached ones the allocator moves anyway
+static void
+pauseAll(struct topology * topo, struct result * result)
+{
+	IOPCIConfigEntry * movers[kMaxChildren];
+	uint32_t           idx, count;
+
+	for (idx = count = 0; idx < topo->count; idx++)
+	{
+		if (topo->children[idx].present && !topo->children[idx].fixed) movers[count++] = &topo->children[idx];
+	}
+	account(result, movers, count);
+	result->ok = relocate(topo, movers, count);
+}
+
+static int
+pausePlanned(struct topology * topo, struct result * result, uint64_t * planNS)
+{
+	IOPCIConfigEntry * movers[kMaxChildren];
+	IOPCIRange *       plan[kIOPCIPausePlanMax];
+	IOPCIScalar        planCost;
+	uint32_t           idx, count;
+	uint64_t           start;
+	bool               ok;
+
+	count = kIOPCIPausePlanMax;
+	start = now();
+	ok = IOPCIRangeListPlanHole(topo->head, topo->plugged.range.proposedSize, topo->plugged.range.alignment,
+								&cost, NULL, plan, &count, &planCost);
+	*planNS += now() - start;
+	if (!ok) return (0);
+
+	for (idx = 0; idx < count; idx++) movers[idx] = plan[idx]->device;
+	account(result, movers, count);
+	result->ok = relocate(topo, movers, count);
+	return (1);
+}
+
+int main(int argc, char * argv[])
+{
+	static struct topology topo;
+	struct result          all, planned, sumAll, sumPlanned;
+	IOPCIScalar            window   = 512 * kMB;
+	uint32_t               hotPlugs = 10000;
+	uint32_t               children = 16;
+	uint32_t               seed     = 1;
+	uint32_t               idx, fits, pauses, noPlan, allFailed;
+	uint64_t               planNS;
+	int                    ch;
+
+	while (-1 != (ch = getopt(argc, argv, "n:c:w:s:")))
+	{
+		switch (ch)
+		{
+			case 'n': hotPlugs = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'c': children = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'w': window   = strtoull(optarg, NULL, 0) * kMB; break;
+			case 's': seed     = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n hot plugs] [-c children] [-w window MB] [-s seed]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!children || (children > kMaxChildren)) children = kMaxChildren;
+
+	memset(&sumAll, 0, sizeof(sumAll));
+	memset(&sumPlanned, 0, sizeof(sumPlanned));
+	fits = pauses = noPlan = allFailed = 0;
+	planNS = 0;
+	for (idx = 0; idx < hotPlugs; idx++)
+	{
+		build(&topo, seed + idx, children, window);
+		if (IOPCIRangeListAllocateSubRange(topo.head, &topo.plugged.range))
+		{
+			fits++;
+			continue;
+		}
+
+		memset(&all, 0, sizeof(all));
+		pauseAll(&topo, &all);
+		if (!all.ok)
+		{
+			// no pause helps, the bridge window has to grow
+			allFailed++;
+			continue;
+		}
+		pauses++;
+		sumAll.devices        += all.devices;
+		sumAll.pausedChildren += all.pausedChildren;
+		sumAll.interruptionMS += all.interruptionMS;
+		sumAll.deviceMS       += all.deviceMS;
+
+		build(&topo, seed + idx, children, window);
+		memset(&planned, 0, sizeof(planned));
+		if (!pausePlanned(&topo, &planned, &planNS) || !planned.ok)
+		{
+			// the configurator falls back to pausing everything
+			noPlan++;
+			planned = all;
+		}
+		sumPlanned.devices        += planned.devices;
+		sumPlanned.pausedChildren += planned.pausedChildren;
+		sumPlanned.interruptionMS += planned.interruptionMS;
+		sumPlanned.deviceMS       += planned.deviceMS;
+	}
+
+	printf("%u hot plugs, %u children, %llu MB window: %u fit, %u need a pause, %u need the window to grow\n",
+			hotPlugs, children, (unsigned long long) (window / kMB), fits, pauses, allFailed);
+	if (!pauses) return (0);
+	printf("%-10s %12s %12s %16s %16s\n", "policy", "children", "devices", "interruption ms", "device ms");
+	printf("%-10s %12.2f %12.2f %16.1f %16.1f\n", "all",
+			(double) sumAll.pausedChildren / pauses, (double) sumAll.devices / pauses,
+			(double) sumAll.interruptionMS / pauses, (double) sumAll.deviceMS / pauses);
+	printf("%-10s %12.2f %12.2f %16.1f %16.1f\n", "planned",
+			(double) sumPlanned.pausedChildren / pauses, (double) sumPlanned.devices / pauses,
+			(double) sumPlanned.interruptionMS / pauses, (double) sumPlanned.deviceMS / pauses);
+	printf("%u fell back to pausing all, %.1f us per plan\n", noPlan, (double) planNS / 1000.0 / pauses);
+
+	return (0);
+}
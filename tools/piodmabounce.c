@@ -0,0 +1,125 @@
+/*
+cc tools/piodmabounce.c -o /tmp/piodmabounce -O2 -Wall
+ */
+
+/*
+ * Picks the ApplePIODMA zero copy threshold ("piodma-zero-copy-threshold").
+ * A bounced scalar costs a copy into the request's bounce buffer and, on
+ * completion, a copy back out. A direct one costs creating and wiring a
+ * descriptor over the caller's memory plus a mapper map and unmap, a fixed
+ * part and a per page part that only the target can measure. This measures
+ * the round trip copy on the host, hot and with the caller's data out of
+ * cache, and prints the size above which mapping in place is cheaper for a
+ * range of mapping costs.
+ *
+ * piodmabounce [-m fixed ns] [-p per page ns] [-i iterations]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMinSize   (64)
+#define kMaxSize   (256 * 1024)
+#define kPageSize  (4096)
+#define kColdBytes (64 * 1024 * 1024)
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// ns per bounced transfer of size, copy in and back out
+static double
+bounce(uint8_t * callers, size_t span, uint8_t * bounceBuffer, size_t size, uint32_t iterations)
+{
+	uint64_t start, elapsed;
+	size_t   offset;
+	uint32_t idx;
+
+	offset = 0;
+	start  = now();
+	for (idx = 0; idx < iterations; idx++)
+	{
+		memcpy(bounceBuffer, callers + offset, size);
+		__asm__ volatile("" : : "r" (bounceBuffer) : "memory");
+		memcpy(callers + offset, bounceBuffer, size);
+		offset += size;
+		if (offset + size > span) offset = 0;
+	}
+	elapsed = now() - start;
+
+	return ((double) elapsed / iterations);
+}
+
+static double
+direct(size_t size, double fixed, double perPage)
+{
+	return (fixed + perPage * ((size + kPageSize - 1) / kPageSize));
+}
+
+int main(int argc, char * argv[])
+{
+	static const double fixedCosts[] = { 1000, 2000, 5000, 10000 };
+	double    hot[32], cold[32];
+	double    fixed      = 0;
+	double    perPage    = 100;
+	uint32_t  iterations = 20000;
+	uint8_t * callers;
+	uint8_t * bounceBuffer;
+	size_t    size;
+	uint32_t  idx, cost, sizes;
+	int       ch;
+
+	while (-1 != (ch = getopt(argc, argv, "m:p:i:")))
+	{
+		switch (ch)
+		{
+			case 'm': fixed      = strtod(optarg, NULL); break;
+			case 'p': perPage    = strtod(optarg, NULL); break;
+			case 'i': iterations = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-m fixed ns] [-p per page ns] [-i iterations]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	callers      = malloc(kColdBytes);
+	bounceBuffer = aligned_alloc(kPageSize, kMaxSize);
+	if (!callers || !bounceBuffer) exit(1);
+	memset(callers, 0x5a, kColdBytes);
+	memset(bounceBuffer, 0, kMaxSize);
+
+	printf("%10s %12s %12s\n", "size", "hot ns", "cold ns");
+	for (sizes = 0, size = kMinSize; size <= kMaxSize; size *= 2, sizes++)
+	{
+		hot[sizes]  = bounce(callers, size, bounceBuffer, size, iterations);
+		cold[sizes] = bounce(callers, kColdBytes, bounceBuffer, size, iterations);
+		printf("%10zu %12.1f %12.1f\n", size, hot[sizes], cold[sizes]);
+	}
+
+	printf("\nbounce is cheaper up to (per page mapping cost %.0fns)\n", perPage);
+	printf("%10s %12s %12s\n", "fixed ns", "hot", "cold");
+	for (cost = 0; cost <= sizeof(fixedCosts) / sizeof(fixedCosts[0]); cost++)
+	{
+		double   f = (cost < sizeof(fixedCosts) / sizeof(fixedCosts[0])) ? fixedCosts[cost] : fixed;
+		size_t   hotCrossover = 0, coldCrossover = 0;
+
+		if ((cost == sizeof(fixedCosts) / sizeof(fixedCosts[0])) && !fixed) break;
+		for (idx = 0, size = kMinSize; idx < sizes; idx++, size *= 2)
+		{
+			if (hot[idx]  < direct(size, f, perPage)) hotCrossover  = size;
+			if (cold[idx] < direct(size, f, perPage)) coldCrossover = size;
+		}
+		printf("%10.0f %12zu %12zu\n", f, hotCrossover, coldCrossover);
+	}
+
+	return (0);
+}
@@ -0,0 +1,212 @@
+/*
+cc tools/piodmachain.c tools/piodmamodel.c -o /tmp/piodmachain -g -Wall
+ */
+
+/*
+ * Reference model of the PIODMA engine walking a multi-packet command, for
+ * checking the encoding built by ApplePIODMARequest::prepareChain(),
+ * appendTransfer() and finishChain() without hardware. The command block is
+ * placed in a simulated bus address space, walked from the command source
+ * address and command size the engine is given, and every decoded packet is
+ * compared with what was appended.
+ *
+ * piodmachain [-n iterations] [-s seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "piodmamodel.h"
+
+#define kBusBlocks   (64)
+#define kAddressMask ((1ULL << 36) - 1)
+
+struct block
+{
+	piodma_block_t chain;
+	uint32_t       words[kApplePIODMAChainBlockSize / sizeof(uint32_t)];
+	int            used;
+};
+
+// the bus, a handful of blocks scattered over a 36 bit address space
+static struct block bus[kBusBlocks];
+
+static const uint32_t *
+busFetch(void * context, uint64_t address, uint32_t words)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < kBusBlocks; idx++)
+	{
+		if (bus[idx].used && (bus[idx].chain.address == address))
+		{
+			return ((words <= kApplePIODMAChainBlockSize / sizeof(uint32_t)) ? bus[idx].words : NULL);
+		}
+	}
+	return (NULL);
+}
+
+static void
+busReset(void)
+{
+	uint32_t idx;
+
+	memset(bus, 0, sizeof(bus));
+	for (idx = 0; idx < kBusBlocks; idx++)
+	{
+		bus[idx].chain.address = ((((uint64_t) random() << 31) ^ random()) & kAddressMask) & ~((uint64_t) kApplePIODMAChainBlockSize - 1);
+		bus[idx].chain.words   = bus[idx].words;
+	}
+}
+
+// ApplePIODMARequest::prepareChain .. finishChain, returns the command size in words
+static uint32_t
+build(const piodma_packet_t * packets, uint32_t count, uint64_t * source)
+{
+	struct block * block;
+
+	// whichever request the pool hands out
+	block       = &bus[random() % kBusBlocks];
+	block->used = 1;
+
+	*source = block->chain.address;
+	return (piodma_chain_build(&block->chain, packets, count));
+}
+
+static int
+walk(uint64_t source, uint32_t size, piodma_packet_t * packets, uint32_t max)
+{
+	return (piodma_chain_walk(&busFetch, NULL, source, size, packets, max));
+}
+
+static int
+check(const char * name, const piodma_packet_t * packets, uint32_t count)
+{
+	piodma_packet_t decoded[kPIODMAModelMaxChainPackets];
+	uint64_t      source;
+	uint32_t      size, idx;
+	int           walked;
+
+	busReset();
+	size   = build(packets, count, &source);
+	walked = walk(source, size, decoded, kPIODMAModelMaxChainPackets);
+	if (walked != (int) count)
+	{
+		printf("%s: %u packets, walked %d\n", name, count, walked);
+		return (1);
+	}
+	for (idx = 0; idx < count; idx++)
+	{
+		if ((packets[idx].buffer     != decoded[idx].buffer)
+		 || (packets[idx].target     != decoded[idx].target)
+		 || (packets[idx].size       != decoded[idx].size)
+		 || (packets[idx].bufferType != decoded[idx].bufferType)
+		 || (packets[idx].targetType != decoded[idx].targetType)
+		 || (packets[idx].bufferBAR  != decoded[idx].bufferBAR)
+		 || (packets[idx].targetBAR  != decoded[idx].targetBAR))
+		{
+			printf("%s: packet %u buffer 0x%llx/0x%llx target 0x%llx/0x%llx size %u/%u\n", name, idx,
+					(unsigned long long) packets[idx].buffer, (unsigned long long) decoded[idx].buffer,
+					(unsigned long long) packets[idx].target, (unsigned long long) decoded[idx].target,
+					packets[idx].size, decoded[idx].size);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+static void
+randomPacket(piodma_packet_t * packet)
+{
+	packet->buffer     = (((uint64_t) random() << 31) ^ random()) & kAddressMask;
+	packet->target     = (((uint64_t) random() << 31) ^ random()) & kAddressMask;
+	packet->size       = (uint32_t) random();
+	packet->bufferType = random() & 1;
+	packet->targetType = random() & 1;
+	packet->bufferBAR  = random() & 7;
+	packet->targetBAR  = random() & 7;
+}
+
+int main(int argc, char * argv[])
+{
+	piodma_packet_t packets[kPIODMAModelMaxChainPackets];
+	uint32_t      iterations = 10000;
+	uint32_t      seed       = 1;
+	uint32_t      idx, count, failures;
+	uint64_t      source;
+	uint32_t      size;
+	int           ch;
+
+	while (-1 != (ch = getopt(argc, argv, "n:s:")))
+	{
+		switch (ch)
+		{
+			case 'n': iterations = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 's': seed       = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n iterations] [-s seed]\n", argv[0]);
+				exit(1);
+		}
+	}
+	srandom(seed);
+	failures = 0;
+
+	// a single packet is the unchained command the engine has always been given
+	randomPacket(&packets[0]);
+	failures += check("single", packets, 1);
+	busReset();
+	if (kApplePIODMAGenericPacketSize != build(packets, 1, &source)) printf("single: command size\n"), failures++;
+
+	// a full command block, and one packet more than it holds
+	for (count = kApplePIODMAChainBlockMaxPackets - 1; count <= kApplePIODMAChainBlockMaxPackets; count++)
+	{
+		for (idx = 0; idx < count; idx++) randomPacket(&packets[idx]);
+		failures += check("full", packets, count);
+	}
+	busReset();
+	if (build(packets, kApplePIODMAChainBlockMaxPackets + 1, &source)) printf("overflow: built\n"), failures++;
+
+	// extremes of every field
+	for (idx = 0; idx < 2; idx++)
+	{
+		packets[idx].buffer     = idx ? kAddressMask : 0;
+		packets[idx].target     = idx ? kAddressMask : 0;
+		packets[idx].size       = idx ? UINT32_MAX : 0;
+		packets[idx].bufferType = packets[idx].targetType = idx;
+		packets[idx].bufferBAR  = packets[idx].targetBAR  = idx ? 7 : 0;
+	}
+	failures += check("extremes", packets, 2);
+
+	for (idx = 0; idx < iterations; idx++)
+	{
+		count = 1 + (random() % kPIODMAModelMaxChainPackets);
+		for (size = 0; size < count; size++) randomPacket(&packets[size]);
+		failures += check("random", packets, count);
+	}
+
+	// the walk has to stop at the command size and refuse one that splits a packet or covers anything but packets
+	for (idx = 0; idx < kApplePIODMAChainBlockMaxPackets; idx++) randomPacket(&packets[idx]);
+	busReset();
+	size = build(packets, kApplePIODMAChainBlockMaxPackets - 1, &source);
+	if (walk(source, size - kApplePIODMAGenericPacketSize, packets, kPIODMAModelMaxChainPackets) != kApplePIODMAChainBlockMaxPackets - 2)
+	{
+		printf("truncated: walked past the command size\n");
+		failures++;
+	}
+	if (walk(source, size - 1, packets, kPIODMAModelMaxChainPackets) >= 0)
+	{
+		printf("misaligned: accepted\n");
+		failures++;
+	}
+	if (walk(source, size + kApplePIODMAGenericPacketSize, packets, kPIODMAModelMaxChainPackets) >= 0)
+	{
+		printf("overlong: accepted\n");
+		failures++;
+	}
+
+	printf("%u packets per command, %u iterations, %u failures\n",
+			(uint32_t) kApplePIODMAChainBlockMaxPackets, iterations, failures);
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,775 @@
+/*
+cc -c tools/piodmamodel.c -o /tmp/piodmamodel.o -Wall && c++ tools/piodmaengine.cpp tools/piodmakit.cpp ApplePIODMA/ApplePIODMA*.cpp /tmp/piodmamodel.o -Itools -IApplePIODMA -o /tmp/piodmaengine -O2 -Wall -Wno-unknown-pragmas -lpthread
+ */
+
+/*
+ * Software PIODMA engine under the kext's own ApplePIODMA, ApplePIODMARequest
+ * and ApplePIODMARequestPool, built against the userspace IOKit in
+ * piodmakit.h. A minimal ApplePIODMA subclass stands in for the hardware
+ * driver: executeRequestGated() tags the request and pushes its command source
+ * and size into the engine's command FIFO before calling the base, and
+ * interruptOccurred() hands finished tags to completeRequestGated(). The
+ * engine takes commands from a FIFO as deep as the pool, walks them with the
+ * command model, copies buffer to target through the mapper and the device
+ * BARs, and raises completions after a configurable service time and
+ * interrupt latency, optionally failing some.
+ *
+ * Requests come from the kext's pool and are prepared with its own entry
+ * points, in a mix of scalar writes and reads of every size (bounced, zero
+ * copy and spilled), multi-packet commands over a mapped descriptor and over
+ * one the pool doesn't know, and commands of scalars. Some go through the
+ * synchronous path. Every transfer's data is checked, a failed one must leave
+ * its destination alone, and the mapper must be empty once the driver has
+ * stopped. Throughput and submit to completion latency are reported across
+ * FIFO depths.
+ *
+ * piodmaengine [-n requests] [-l setup ns] [-b MB/s] [-i interrupt ns] [-e error rate] [-y sync rate] [-s seed]
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "piodmakit.h"
+#include "ApplePIODMA.h"
+#include "piodmamodel.h"
+
+#define kMaxDepth        (16)				// kApplePIODMADefaultFIFOSize
+#define kSlots           (kMaxDepth + 2)	// a retired request is back in the pool before its callback has run
+#define kSlotBytes       (128 * 1024 + 2 * PAGE_SIZE)
+#define kMaxTransferSize (4096)				// "piodma-max-transfer-size", the requests' bounce buffers
+#define kZeroCopy        (2048)				// "piodma-zero-copy-threshold"
+#define kNumBars         (7)				// kApplePIODMADefaultNumBars
+#define kBarBase         (0x800000000ULL)
+#define kBarStride       (0x010000000ULL)
+#define kBarBytes        (kSlots * kSlotBytes)
+#define kLatencyBuckets  (40)
+
+enum { kStatusSuccess = 0, kStatusError = 1 };
+
+enum
+{
+	kKindScalarWrite = 0,		// buffer scalar to a raw BAR offset
+	kKindScalarRead,			// raw BAR offset to a target scalar
+	kKindChainMapped,			// appendTransfer over the pool mapped host descriptor
+	kKindChainOwn,				// appendTransfer over a descriptor the pool doesn't know
+	kKindChainScalars,			// appendScalar
+	kKindCount
+};
+
+struct transfer
+{
+	uint32_t             slot;
+	uint32_t             kind;
+	uint8_t            * source;
+	uint8_t            * destination;
+	uint32_t             size;
+	uint32_t             pattern;
+	uint32_t             packets;
+	uint64_t             submitted;
+	IOMemoryDescriptor * descriptor;		// kKindChainOwn's, wired by the caller
+	bool                 busy;
+};
+
+struct fifoEntry
+{
+	uint8_t  tag;
+	uint64_t source;
+	uint32_t size;
+	uint32_t status;
+	uint64_t due;
+};
+
+struct fifo
+{
+	struct fifoEntry entries[kMaxDepth];
+	uint32_t         head, tail, count, depth;
+	pthread_cond_t   notEmpty;
+};
+
+struct results
+{
+	uint64_t completed;
+	uint64_t errors;
+	uint64_t injected;
+	uint64_t faults;
+	uint64_t mismatches;
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t kinds[kKindCount];
+	uint64_t latencySum;
+	uint64_t latency[kLatencyBuckets];			// bucket n counts latencies < (1 << n) ns
+};
+
+static struct
+{
+	uint32_t setupNs;
+	double   bytesPerNs;
+	uint32_t interruptNs;
+	double   errorRate;
+	double   syncRate;
+} config = { 500, 2.0, 2000, 0, 0.05 };
+
+static uint8_t  * hostMemory;
+static uint8_t  * barMemory[kNumBars];
+static uint64_t   baseAddressOffsets[kNumBars];	// "piodma-base-address", BAR 0 has no offset
+static struct transfer transfers[kSlots];
+static struct results  results;					// updated in the driver's gate
+
+// hardware: command FIFO into the engine, completions out of it
+static pthread_mutex_t hardware = PTHREAD_MUTEX_INITIALIZER;
+static struct fifo     commandFIFO, completionFIFO;
+static int             stopping;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+spinUntil(uint64_t deadline)
+{
+	while (now() < deadline) {}
+}
+
+static void
+fifoPush(struct fifo * fifo, const struct fifoEntry * entry)
+{
+	if (fifo->count == fifo->depth) panic("FIFO overflow");
+	fifo->entries[fifo->tail] = *entry;
+	fifo->tail = (fifo->tail + 1) % fifo->depth;
+	fifo->count++;
+	pthread_cond_signal(&fifo->notEmpty);
+}
+
+// hardware lock held, returns 0 once stopping with nothing left
+static int
+fifoWait(struct fifo * fifo)
+{
+	while (!fifo->count)
+	{
+		if (stopping) return (0);
+		pthread_cond_wait(&fifo->notEmpty, &hardware);
+	}
+	return (1);
+}
+
+static void
+fifoPop(struct fifo * fifo, struct fifoEntry * entry)
+{
+	*entry = fifo->entries[fifo->head];
+	fifo->head = (fifo->head + 1) % fifo->depth;
+	fifo->count--;
+}
+
+// the hardware driver, as thin as a real one: tag, push, retire
+
+class PIODMAModel : public ApplePIODMA
+{
+	OSDeclareDefaultStructors(PIODMAModel);
+
+public:
+	void     interrupt() { _interruptEventSource->interruptOccurred(NULL, NULL, 0); }
+	IOReturn executeRequestSync(ApplePIODMARequest * request);
+	void     retireSync(struct transfer * transfer, IOReturn status);
+
+protected:
+	virtual IOReturn executeRequestGated(ApplePIODMARequest * request) override;
+	virtual void     interruptOccurred(IOInterruptEventSource * source, int count) override;
+
+	uint8_t _nextTag;
+};
+
+OSDefineMetaClassAndStructors(PIODMAModel, ApplePIODMA)
+
+IOReturn
+PIODMAModel::executeRequestSync(ApplePIODMARequest * request)
+{
+	executeRequest(request);
+	return (request->completionStatus());
+}
+
+IOReturn
+PIODMAModel::executeRequestGated(ApplePIODMARequest * request)
+{
+	struct fifoEntry command;
+
+	request->setCommandTag(_nextTag++);
+
+	command.tag    = request->commandTag();
+	command.source = request->commandSource();
+	command.size   = request->commandSize();
+	command.status = kStatusSuccess;
+	command.due    = 0;
+	pthread_mutex_lock(&hardware);
+	// the request pool is FIFO sized, the FIFO can't overflow
+	fifoPush(&commandFIFO, &command);
+	pthread_mutex_unlock(&hardware);
+
+	return (ApplePIODMA::executeRequestGated(request));
+}
+
+void
+PIODMAModel::interruptOccurred(IOInterruptEventSource * source, int count)
+{
+	struct fifoEntry completion;
+	uint64_t         time = now();
+
+	pthread_mutex_lock(&hardware);
+	while (completionFIFO.count && (completionFIFO.entries[completionFIFO.head].due <= time))
+	{
+		fifoPop(&completionFIFO, &completion);
+		pthread_mutex_unlock(&hardware);
+		completeRequestGated(completion.tag, (kStatusSuccess == completion.status) ? kIOReturnSuccess : kIOReturnIOError);
+		pthread_mutex_lock(&hardware);
+	}
+	pthread_mutex_unlock(&hardware);
+}
+
+// the provider, register space at index 0
+class PIODMANub : public IOService
+{
+	OSDeclareDefaultStructors(PIODMANub);
+
+public:
+	virtual IODeviceMemory * getDeviceMemoryWithIndex(unsigned int index) override;
+
+protected:
+	virtual void free() override;
+
+	IODeviceMemory * _registers;
+};
+
+OSDefineMetaClassAndStructors(PIODMANub, IOService)
+
+IODeviceMemory *
+PIODMANub::getDeviceMemoryWithIndex(unsigned int index)
+{
+	if (index) return (NULL);
+	if (!_registers) _registers = IODeviceMemory::withRange(0, PAGE_SIZE);
+	return (_registers);
+}
+
+void
+PIODMANub::free()
+{
+	OSSafeReleaseNULL(_registers);
+	IOService::free();
+}
+
+// engine
+
+static uint8_t *
+resolve(uint64_t address, uint32_t size, uint32_t type, uint32_t bar)
+{
+	uint64_t bus;
+
+	if (kApplePIODMAGenericPacketDeviceTypeMemory == type)
+	{
+		if (bar) return (NULL);
+		return (IOMapper::gSystem->iovmTranslate(address, size));
+	}
+	if (!bar || (bar >= kNumBars)) return (NULL);
+	bus = address + baseAddressOffsets[bar];
+	if ((bus < baseAddressOffsets[bar]) || (bus + size > baseAddressOffsets[bar] + kBarBytes)) return (NULL);
+	return (barMemory[bar] + (bus - baseAddressOffsets[bar]));
+}
+
+static const uint32_t *
+busFetch(void * context, uint64_t address, uint32_t words)
+{
+	return ((const uint32_t *) IOMapper::gSystem->iovmTranslate(address, words * sizeof(uint32_t)));
+}
+
+static uint32_t
+engineExecute(const struct fifoEntry * command, uint64_t * bytes)
+{
+	piodma_packet_t packets[kPIODMAModelMaxChainPackets];
+	uint8_t       * buffer;
+	uint8_t       * target;
+	int             count, idx;
+
+	*bytes = 0;
+	count = piodma_chain_walk(&busFetch, NULL, command->source, command->size, packets, kPIODMAModelMaxChainPackets);
+	if (count <= 0) return (kStatusError);
+
+	for (idx = 0; idx < count; idx++)
+	{
+		buffer = resolve(packets[idx].buffer, packets[idx].size, packets[idx].bufferType, packets[idx].bufferBAR);
+		target = resolve(packets[idx].target, packets[idx].size, packets[idx].targetType, packets[idx].targetBAR);
+		if (!buffer || !target) return (kStatusError);
+
+		memcpy(target, buffer, packets[idx].size);
+		*bytes += packets[idx].size;
+	}
+	return (kStatusSuccess);
+}
+
+static void *
+engineThread(void * arg)
+{
+	struct fifoEntry command;
+	uint64_t         start, bytes;
+
+	pthread_mutex_lock(&hardware);
+	while (fifoWait(&commandFIFO))
+	{
+		fifoPop(&commandFIFO, &command);
+		pthread_mutex_unlock(&hardware);
+
+		start = now();
+		if ((config.errorRate > 0) && ((random() / (RAND_MAX + 1.0)) < config.errorRate))
+		{
+			command.status = kStatusError;
+			bytes          = 0;
+			__atomic_add_fetch(&results.injected, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			command.status = engineExecute(&command, &bytes);
+			if (kStatusSuccess != command.status) __atomic_add_fetch(&results.faults, 1, __ATOMIC_RELAXED);
+		}
+		spinUntil(start + config.setupNs + (uint64_t) (bytes / config.bytesPerNs));
+		command.due = now() + config.interruptNs;
+
+		pthread_mutex_lock(&hardware);
+		fifoPush(&completionFIFO, &command);
+	}
+	pthread_mutex_unlock(&hardware);
+	return (NULL);
+}
+
+// raises the interrupt once the oldest completion is due, the handler takes everything due by then
+static void *
+interruptThread(void * arg)
+{
+	PIODMAModel * driver = (PIODMAModel *) arg;
+	uint64_t      due;
+
+	pthread_mutex_lock(&hardware);
+	while (fifoWait(&completionFIFO))
+	{
+		due = completionFIFO.entries[completionFIFO.head].due;
+		pthread_mutex_unlock(&hardware);
+
+		spinUntil(due);
+		driver->interrupt();
+
+		pthread_mutex_lock(&hardware);
+	}
+	pthread_mutex_unlock(&hardware);
+	return (NULL);
+}
+
+// client
+
+static uint32_t
+randomBetween(unsigned int * seed, uint32_t low, uint32_t high)
+{
+	return (low + (uint32_t) (rand_r(seed) % (high - low + 1)));
+}
+
+// every path the kext stages a scalar on: bounce buffer, zero copy and spill, aligned or not
+static uint32_t
+scalarSize(unsigned int * seed, uint32_t * offset)
+{
+	uint32_t size;
+
+	switch (rand_r(seed) % 5)
+	{
+		case 0:  size = randomBetween(seed, 1, 64); break;
+		case 1:  size = randomBetween(seed, 65, kMaxTransferSize); break;
+		case 2:  size = randomBetween(seed, kZeroCopy, 16 * 1024); break;
+		case 3:  size = randomBetween(seed, 16 * 1024, 60 * 1024); break;
+		default: size = randomBetween(seed, 64 * 1024, 128 * 1024); break;
+	}
+	*offset = (rand_r(seed) & 1) ? (uint32_t) (rand_r(seed) % PAGE_SIZE) : 4 * (uint32_t) (rand_r(seed) % 64);
+	if (!(*offset & 3)) size = (size + 3) & ~3U;
+	return (size);
+}
+
+static void
+fill(struct transfer * transfer)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < transfer->size; idx++)
+	{
+		transfer->source[idx]      = (uint8_t) (transfer->pattern + idx);
+		transfer->destination[idx] = (uint8_t) ~(transfer->pattern + idx);
+	}
+}
+
+// a transfer that failed must not have touched its destination
+static bool
+verify(const struct transfer * transfer, bool succeeded)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < transfer->size; idx++)
+	{
+		uint8_t expected = (uint8_t) (transfer->pattern + idx);
+		if (transfer->source[idx] != expected)                                return (false);
+		if (transfer->destination[idx] != (succeeded ? expected : (uint8_t) ~expected)) return (false);
+	}
+	return (true);
+}
+
+// in the driver's gate
+static void
+retire(struct transfer * transfer, IOReturn status)
+{
+	uint64_t latency;
+	uint32_t bucket;
+
+	if (kIOReturnSuccess != status) results.errors++;
+	if (!verify(transfer, kIOReturnSuccess == status)) results.mismatches++;
+	if (kIOReturnSuccess == status) results.bytes += transfer->size;
+	results.packets += transfer->packets;
+	results.kinds[transfer->kind]++;
+
+	latency = now() - transfer->submitted;
+	for (bucket = 0; (bucket < kLatencyBuckets - 1) && (latency >= (1ULL << bucket)); bucket++) {}
+	results.latency[bucket]++;
+	results.latencySum += latency;
+	results.completed++;
+
+	if (transfer->descriptor)
+	{
+		transfer->descriptor->complete();
+		OSSafeReleaseNULL(transfer->descriptor);
+	}
+	__atomic_store_n(&transfer->busy, false, __ATOMIC_RELEASE);
+}
+
+void
+PIODMAModel::retireSync(struct transfer * transfer, IOReturn status)
+{
+	_workLoop->closeGate();
+	retire(transfer, status);
+	_workLoop->openGate();
+}
+
+static void
+transferCompleted(void * target, void * parameter, IOReturn status, ApplePIODMARequest * request)
+{
+	retire((struct transfer *) parameter, status);
+}
+
+static struct transfer *
+getTransfer(void)
+{
+	uint32_t slot;
+
+	for (;;)
+	{
+		for (slot = 0; slot < kSlots; slot++)
+		{
+			bool idle = false;
+			if (__atomic_compare_exchange_n(&transfers[slot].busy, &idle, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			{
+				return (&transfers[slot]);
+			}
+		}
+	}
+}
+
+// lays a transfer out in its slot and prepares the request for it with the kext's own calls
+static IOReturn
+prepare(ApplePIODMARequest * request, struct transfer * transfer, IOMemoryDescriptor * hostDescriptor, unsigned int * seed)
+{
+	uint8_t  * host      = hostMemory + transfer->slot * kSlotBytes;
+	uint32_t   bar       = 1 + rand_r(seed) % (kNumBars - 1);
+	uint32_t   device    = transfer->slot * kSlotBytes + 4 * (rand_r(seed) % 1024);
+	uint32_t   offset, done, length, pieces;
+	IOReturn   result;
+
+	transfer->kind       = rand_r(seed) % kKindCount;
+	transfer->pattern    = rand_r(seed);
+	transfer->descriptor = NULL;
+
+	switch (transfer->kind)
+	{
+		case kKindScalarWrite:
+			transfer->size        = scalarSize(seed, &offset);
+			transfer->source      = host + offset;
+			transfer->destination = barMemory[bar] + device;
+			fill(transfer);
+			return (request->prepareGenericPacket((void *) transfer->source, (IOMemoryDescriptor *) NULL, device,
+												  kApplePIODMAGenericPacketDeviceTypeMemory, kApplePIODMAGenericPacketDeviceTypePIO,
+												  transfer->size, 0, 0, bar));
+
+		case kKindScalarRead:
+			transfer->size        = scalarSize(seed, &offset);
+			transfer->source      = barMemory[bar] + device;
+			transfer->destination = host + offset;
+			fill(transfer);
+			return (request->prepareGenericPacket((IOMemoryDescriptor *) NULL, device, (void *) transfer->destination,
+												  kApplePIODMAGenericPacketDeviceTypePIO, kApplePIODMAGenericPacketDeviceTypeMemory,
+												  transfer->size, 0, bar, 0));
+
+		case kKindChainMapped:
+			// scattered pages are a packet each, keep within the command block
+			transfer->size = randomBetween(seed, 1, 10 * PAGE_SIZE);
+			offset         = transfer->slot * kSlotBytes + (uint32_t) (rand_r(seed) % PAGE_SIZE);
+			transfer->source      = hostMemory + offset;
+			transfer->destination = barMemory[bar] + device;
+			fill(transfer);
+			result = request->prepareChain(hostDescriptor, NULL, kApplePIODMAGenericPacketDeviceTypeMemory,
+										   kApplePIODMAGenericPacketDeviceTypePIO, 0, 0, bar);
+			pieces = randomBetween(seed, 1, 3);
+			for (done = 0; (kIOReturnSuccess == result) && (done < transfer->size); done += length, pieces--)
+			{
+				length = (pieces > 1) ? randomBetween(seed, 1, transfer->size - done) : transfer->size - done;
+				result = request->appendTransfer(offset + done, device + done, length);
+			}
+			break;
+
+		case kKindChainOwn:
+			// the request's own DMA command takes no more than the maximum transfer size
+			transfer->size        = randomBetween(seed, 1, kMaxTransferSize);
+			offset                = (uint32_t) (rand_r(seed) % (2 * PAGE_SIZE));
+			transfer->source      = host + offset;
+			transfer->destination = barMemory[bar] + device;
+			fill(transfer);
+			transfer->descriptor = IOMemoryDescriptor::withAddressRange((mach_vm_address_t) (uintptr_t) transfer->source,
+																		transfer->size, kIODirectionOut, kernel_task);
+			if (!transfer->descriptor) return (kIOReturnNoMemory);
+			transfer->descriptor->prepare();
+			result = request->prepareChain(transfer->descriptor, NULL, kApplePIODMAGenericPacketDeviceTypeMemory,
+										   kApplePIODMAGenericPacketDeviceTypePIO, 0, 0, bar);
+			if (kIOReturnSuccess == result) result = request->appendTransfer(0, device, transfer->size);
+			break;
+
+		default:
+			// scalars take an aligned slot each of the shared scalar buffer
+			pieces = randomBetween(seed, 1, 4);
+			transfer->size        = 4 * randomBetween(seed, pieces, kMaxTransferSize / 4 / pieces);
+			transfer->source      = host + (uint32_t) (rand_r(seed) % PAGE_SIZE);
+			transfer->destination = barMemory[bar] + device;
+			fill(transfer);
+			result = request->prepareChain(NULL, NULL, kApplePIODMAGenericPacketDeviceTypeMemory,
+										   kApplePIODMAGenericPacketDeviceTypePIO, 0, 0, bar);
+			for (done = 0; (kIOReturnSuccess == result) && (done < transfer->size); done += length, pieces--)
+			{
+				length = (pieces > 1) ? 4 * randomBetween(seed, 1, (transfer->size - done) / 4 - pieces + 1) : transfer->size - done;
+				result = request->appendScalar(transfer->source + done, device + done, length);
+			}
+			break;
+	}
+
+	if (kIOReturnSuccess == result) result = request->finishChain();
+	return (result);
+}
+
+static void
+run(uint32_t depth, uint32_t count, unsigned int seed, uint32_t * failures)
+{
+	PIODMAModel         * driver   = new PIODMAModel;
+	PIODMANub           * nub      = new PIODMANub;
+	IOMemoryDescriptor  * hostDescriptor;
+	ApplePIODMACompletion completion = { NULL, &transferCompleted, NULL };
+	pthread_t             engine, interrupt;
+	uint32_t              value, idx;
+	OSData              * data;
+	IOReturn              result;
+
+	memset(&results, 0, sizeof(results));
+	memset(transfers, 0, sizeof(transfers));
+	for (idx = 0; idx < kSlots; idx++) transfers[idx].slot = idx;
+	stopping = 0;
+	commandFIFO.head    = commandFIFO.tail    = commandFIFO.count    = 0;
+	completionFIFO.head = completionFIFO.tail = completionFIFO.count = 0;
+	commandFIFO.depth   = completionFIFO.depth = depth;
+
+	// the properties the platform would publish
+	data = OSData::withBytes(&depth, sizeof(depth));
+	driver->setProperty(kApplePIODMAFIFOSize, data);
+	data->release();
+	value = kMaxTransferSize;
+	data  = OSData::withBytes(&value, sizeof(value));
+	driver->setProperty(kApplePIODMAMaxTransferSize, data);
+	data->release();
+	value = kZeroCopy;
+	data  = OSData::withBytes(&value, sizeof(value));
+	driver->setProperty(kApplePIODMAZeroCopyThreshold, data);
+	data->release();
+	data = OSData::withBytes(baseAddressOffsets, sizeof(baseAddressOffsets));
+	driver->setProperty(kApplePIODMABaseAddresses, data);
+	data->release();
+
+	if (!driver->start(nub) || (kIOReturnSuccess != driver->enable()))
+	{
+		fprintf(stderr, "driver didn't start\n");
+		exit(1);
+	}
+
+	hostDescriptor = IOMemoryDescriptor::withAddressRange((mach_vm_address_t) (uintptr_t) hostMemory, kSlots * kSlotBytes,
+														  kIODirectionInOut, kernel_task);
+	hostDescriptor->prepare();
+	result = driver->mapDescriptor(hostDescriptor);
+	if (kIOReturnSuccess != result)
+	{
+		fprintf(stderr, "couldn't map host memory, 0x%x\n", result);
+		exit(1);
+	}
+
+	pthread_create(&engine, NULL, &engineThread, NULL);
+	pthread_create(&interrupt, NULL, &interruptThread, driver);
+
+	for (idx = 0; idx < count; idx++)
+	{
+		ApplePIODMARequest * request  = driver->getRequest(true);
+		struct transfer    * transfer = getTransfer();
+		bool                 sync     = (rand_r(&seed) / (RAND_MAX + 1.0)) < config.syncRate;
+
+		result = prepare(request, transfer, hostDescriptor, &seed);
+		if (kIOReturnSuccess != result)
+		{
+			printf("      couldn't prepare a kind %u transfer of %u bytes, 0x%x\n", transfer->kind, transfer->size, result);
+			(*failures)++;
+			driver->returnRequest(request);
+			if (transfer->descriptor)
+			{
+				transfer->descriptor->complete();
+				OSSafeReleaseNULL(transfer->descriptor);
+			}
+			__atomic_store_n(&transfer->busy, false, __ATOMIC_RELEASE);
+			continue;
+		}
+		transfer->packets   = request->packetCount();
+		transfer->submitted = now();
+
+		if (sync)
+		{
+			// copied back when the request is returned
+			result = driver->executeRequestSync(request);
+			driver->returnRequest(request);
+			driver->retireSync(transfer, result);
+			continue;
+		}
+
+		completion.parameter = transfer;
+		result = driver->executeRequestAsync(request, &completion);
+		if (kIOReturnSuccess != result)
+		{
+			printf("      couldn't submit, 0x%x\n", result);
+			(*failures)++;
+			driver->returnRequest(request);
+			__atomic_store_n(&transfer->busy, false, __ATOMIC_RELEASE);
+		}
+	}
+
+	// drain
+	for (idx = 0; idx < kSlots; idx++)
+	{
+		while (__atomic_load_n(&transfers[idx].busy, __ATOMIC_ACQUIRE)) usleep(10);
+	}
+
+	pthread_mutex_lock(&hardware);
+	stopping = 1;
+	pthread_cond_broadcast(&commandFIFO.notEmpty);
+	pthread_cond_broadcast(&completionFIFO.notEmpty);
+	pthread_mutex_unlock(&hardware);
+	pthread_join(engine, NULL);
+	pthread_join(interrupt, NULL);
+
+	driver->unmapDescriptor(hostDescriptor);
+	hostDescriptor->complete();
+	hostDescriptor->release();
+	driver->stop(nub);
+	driver->release();
+	nub->release();
+}
+
+static double
+percentile(double fraction)
+{
+	uint64_t total = 0, limit = (uint64_t) (results.completed * fraction);
+	uint32_t bucket;
+
+	for (bucket = 0; bucket < kLatencyBuckets; bucket++)
+	{
+		total += results.latency[bucket];
+		if (total > limit) return ((double) (1ULL << bucket) / 1000.0);
+	}
+	return (0);
+}
+
+int main(int argc, char * argv[])
+{
+	static const uint32_t depths[] = { 1, 2, 4, 8, 16 };
+	uint32_t count    = 5000;
+	uint32_t seed     = 1;
+	uint32_t failures = 0;
+	uint32_t d, bar, kind;
+	uint64_t start, elapsed;
+	int      ch;
+
+	while (-1 != (ch = getopt(argc, argv, "n:l:b:i:e:y:s:")))
+	{
+		switch (ch)
+		{
+			case 'n': count              = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'l': config.setupNs     = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'b': config.bytesPerNs  = strtod(optarg, NULL) / 1000.0; break;
+			case 'i': config.interruptNs = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'e': config.errorRate   = strtod(optarg, NULL); break;
+			case 'y': config.syncRate    = strtod(optarg, NULL); break;
+			case 's': seed               = (uint32_t) strtoul(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-n requests] [-l setup ns] [-b MB/s] [-i interrupt ns] [-e error rate] [-y sync rate] [-s seed]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!(config.bytesPerNs > 0)) exit(1);
+	srandom(seed);
+
+	if (posix_memalign((void **) &hostMemory, PAGE_SIZE, kSlots * kSlotBytes)) exit(1);
+	for (bar = 1; bar < kNumBars; bar++)
+	{
+		barMemory[bar]          = (uint8_t *) calloc(1, kBarBytes);
+		baseAddressOffsets[bar] = kBarBase + bar * kBarStride;
+		if (!barMemory[bar]) exit(1);
+	}
+	pthread_cond_init(&commandFIFO.notEmpty, NULL);
+	pthread_cond_init(&completionFIFO.notEmpty, NULL);
+
+	printf("setup %uns, %.0fMB/s, interrupt %uns, error rate %g, sync rate %g, %u requests\n",
+			config.setupNs, config.bytesPerNs * 1000.0, config.interruptNs, config.errorRate, config.syncRate, count);
+	printf("%5s %10s %9s %9s %9s %9s %8s %7s\n", "depth", "req/s", "MB/s", "lat avg", "lat p50", "lat p99", "pkts/cmd", "errors");
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+	{
+		start = now();
+		run(depths[d], count, seed + d, &failures);
+		elapsed = now() - start;
+
+		printf("%5u %10.0f %9.1f %7.1fus %7.1fus %7.1fus %8.2f %7llu\n", depths[d],
+				results.completed * 1e9 / elapsed, results.bytes * 1e3 / elapsed,
+				results.latencySum / 1000.0 / results.completed, percentile(0.5), percentile(0.99),
+				(double) results.packets / results.completed, (unsigned long long) results.errors);
+
+		if ((results.completed != count) || results.mismatches || results.faults
+		 || (results.errors != results.injected) || IOMapper::gSystem->iovmMappedPages())
+		{
+			printf("      completed %llu, data mismatches %llu, engine faults %llu, errors %llu of %llu injected, %u pages left mapped\n",
+					(unsigned long long) results.completed, (unsigned long long) results.mismatches,
+					(unsigned long long) results.faults, (unsigned long long) results.errors,
+					(unsigned long long) results.injected, IOMapper::gSystem->iovmMappedPages());
+			failures++;
+		}
+	}
+
+	printf("transfers:");
+	for (kind = 0; kind < kKindCount; kind++) printf(" %llu", (unsigned long long) results.kinds[kind]);
+	printf(" (scalar write, scalar read, chain mapped, chain own, chain scalars at depth %u)\n", depths[d - 1]);
+
+	return (failures ? 1 : 0);
+}
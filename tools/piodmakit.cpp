@@ -0,0 +1,716 @@
+/*
+ * Userspace stand-ins for IOKit, see piodmakit.h. Built into
+ * tools/piodmaengine.cpp along with the ApplePIODMA sources.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include "piodmakit.h"
+
+const OSMetaClass         OSObject::gMetaClass("OSObject", NULL);
+const OSMetaClass * const OSObject::metaClass = &OSObject::gMetaClass;
+const IORegistryPlane * gIOServicePlane = NULL;
+IOMapper * IOMapper::gSystem = NULL;
+
+void
+clock_get_system_microtime(clock_sec_t * secs, clock_usec_t * microsecs)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	*secs      = (clock_sec_t) ts.tv_sec;
+	*microsecs = (clock_usec_t) (ts.tv_nsec / 1000);
+}
+
+bool
+PE_parse_boot_argn(const char * arg_string, void * arg_ptr, int max_arg)
+{
+	// no boot-args in the model, every class logs kApplePIODMADebugLoggingAlways only
+	return (false);
+}
+
+// OSObject
+
+void
+OSObject::retain() const
+{
+	__atomic_add_fetch(&fRetainCount, 1, __ATOMIC_RELAXED);
+}
+
+void
+OSObject::release() const
+{
+	if (!__atomic_sub_fetch(&fRetainCount, 1, __ATOMIC_ACQ_REL)) const_cast<OSObject *>(this)->free();
+}
+
+int
+OSObject::getRetainCount() const
+{
+	return (__atomic_load_n(&fRetainCount, __ATOMIC_RELAXED));
+}
+
+void
+OSObject::free()
+{
+	delete this;
+}
+
+OSDefineMetaClassAndStructors(OSData, OSObject)
+
+OSData *
+OSData::withBytes(const void * bytes, unsigned int numBytes)
+{
+	OSData * data = new OSData;
+
+	data->fData   = malloc(numBytes ? numBytes : 1);
+	data->fLength = numBytes;
+	if (!data->fData)
+	{
+		data->release();
+		return (NULL);
+	}
+	memcpy(data->fData, bytes, numBytes);
+	return (data);
+}
+
+void
+OSData::free()
+{
+	::free(fData);
+	OSObject::free();
+}
+
+// IOService, a property table and a location
+
+OSDefineMetaClassAndStructors(IOService, OSObject)
+
+bool
+IOService::start(IOService * provider)
+{
+	return (true);
+}
+
+void
+IOService::stop(IOService * provider)
+{
+}
+
+IODeviceMemory *
+IOService::getDeviceMemoryWithIndex(unsigned int index)
+{
+	return (NULL);
+}
+
+OSObject *
+IOService::getProperty(const char * key, const IORegistryPlane * plane)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < kMaxProperties; idx++)
+	{
+		if (fProperties[idx].key && !strcmp(fProperties[idx].key, key)) return (fProperties[idx].value);
+	}
+	return (NULL);
+}
+
+bool
+IOService::setProperty(const char * key, OSObject * object)
+{
+	unsigned int idx, empty = kMaxProperties;
+
+	for (idx = 0; idx < kMaxProperties; idx++)
+	{
+		if (fProperties[idx].key && !strcmp(fProperties[idx].key, key)) break;
+		if (!fProperties[idx].key && (empty == kMaxProperties)) empty = idx;
+	}
+	if (idx == kMaxProperties) idx = empty;
+	if (idx == kMaxProperties) return (false);
+
+	object->retain();
+	if (fProperties[idx].value) fProperties[idx].value->release();
+	fProperties[idx].key   = key;
+	fProperties[idx].value = object;
+	return (true);
+}
+
+void
+IOService::setLocation(const char * location)
+{
+	snprintf(fLocation, sizeof(fLocation), "%s", location);
+}
+
+void
+IOService::free()
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < kMaxProperties; idx++) OSSafeReleaseNULL(fProperties[idx].value);
+	OSObject::free();
+}
+
+// event sources and the workloop gate
+
+OSDefineMetaClassAndStructors(IOEventSource, OSObject)
+
+bool
+IOEventSource::initWithOwner(OSObject * owner, OSFunctionPointer action)
+{
+	fOwner   = owner;
+	fAction  = action;
+	fEnabled = true;
+	return (OSObject::init());
+}
+
+OSDefineMetaClassAndStructors(IOWorkLoop, OSObject)
+
+IOWorkLoop *
+IOWorkLoop::workLoop()
+{
+	IOWorkLoop * workLoop = new IOWorkLoop;
+
+	if (!workLoop->init()) OSSafeReleaseNULL(workLoop);
+	return (workLoop);
+}
+
+bool
+IOWorkLoop::init()
+{
+	pthread_mutex_init(&fGateLock, NULL);
+	pthread_cond_init(&fGateWakeup, NULL);
+	return (OSObject::init());
+}
+
+void
+IOWorkLoop::free()
+{
+	pthread_cond_destroy(&fGateWakeup);
+	pthread_mutex_destroy(&fGateLock);
+	OSObject::free();
+}
+
+IOReturn
+IOWorkLoop::addEventSource(IOEventSource * source)
+{
+	source->retain();
+	source->setWorkLoop(this);
+	return (kIOReturnSuccess);
+}
+
+IOReturn
+IOWorkLoop::removeEventSource(IOEventSource * source)
+{
+	source->setWorkLoop(NULL);
+	source->release();
+	return (kIOReturnSuccess);
+}
+
+// the gate is recursive, like the workloop's IORecursiveLock
+void
+IOWorkLoop::closeGate()
+{
+	pthread_mutex_lock(&fGateLock);
+	if (fGateCount && pthread_equal(fGateOwner, pthread_self()))
+	{
+		fGateCount++;
+		pthread_mutex_unlock(&fGateLock);
+		return;
+	}
+	while (fGateCount) pthread_cond_wait(&fGateWakeup, &fGateLock);
+	fGateOwner = pthread_self();
+	fGateCount = 1;
+	pthread_mutex_unlock(&fGateLock);
+}
+
+void
+IOWorkLoop::openGate()
+{
+	pthread_mutex_lock(&fGateLock);
+	if (!--fGateCount) pthread_cond_broadcast(&fGateWakeup);
+	pthread_mutex_unlock(&fGateLock);
+}
+
+bool
+IOWorkLoop::inGate()
+{
+	bool result;
+
+	pthread_mutex_lock(&fGateLock);
+	result = fGateCount && pthread_equal(fGateOwner, pthread_self());
+	pthread_mutex_unlock(&fGateLock);
+	return (result);
+}
+
+// gives the gate up however deeply it is held until woken for event, then takes it back
+int
+IOWorkLoop::sleepGate(void * event, UInt32 interruptibleType)
+{
+	Sleeper  sleeper = { event, false, NULL };
+	uint32_t count;
+
+	pthread_mutex_lock(&fGateLock);
+	if (!fGateCount || !pthread_equal(fGateOwner, pthread_self())) panic("sleepGate outside the gate");
+	sleeper.next = fSleepers;
+	fSleepers    = &sleeper;
+	count        = fGateCount;
+	fGateCount   = 0;
+	pthread_cond_broadcast(&fGateWakeup);
+
+	while (!sleeper.awakened || fGateCount) pthread_cond_wait(&fGateWakeup, &fGateLock);
+	fGateOwner = pthread_self();
+	fGateCount = count;
+	pthread_mutex_unlock(&fGateLock);
+	return (THREAD_AWAKENED);
+}
+
+void
+IOWorkLoop::wakeupGate(void * event, bool oneThread)
+{
+	Sleeper ** link;
+	Sleeper *  sleeper;
+
+	pthread_mutex_lock(&fGateLock);
+	for (link = &fSleepers; (sleeper = *link);)
+	{
+		if (sleeper->event != event)
+		{
+			link = &sleeper->next;
+			continue;
+		}
+		sleeper->awakened = true;
+		*link             = sleeper->next;
+		if (oneThread) break;
+	}
+	pthread_cond_broadcast(&fGateWakeup);
+	pthread_mutex_unlock(&fGateLock);
+}
+
+OSDefineMetaClassAndStructors(IOCommandGate, IOEventSource)
+
+IOCommandGate *
+IOCommandGate::commandGate(OSObject * owner, Action action)
+{
+	IOCommandGate * gate = new IOCommandGate;
+
+	if (!gate->initWithOwner(owner, (OSFunctionPointer) action)) OSSafeReleaseNULL(gate);
+	return (gate);
+}
+
+IOReturn
+IOCommandGate::runAction(Action action, void * arg0, void * arg1, void * arg2, void * arg3)
+{
+	IOReturn result;
+
+	if (!fWorkLoop) return (kIOReturnNotReady);
+	fWorkLoop->closeGate();
+	result = action(fOwner, arg0, arg1, arg2, arg3);
+	fWorkLoop->openGate();
+	return (result);
+}
+
+IOReturn
+IOCommandGate::commandSleep(void * event, UInt32 interruptible)
+{
+	return (fWorkLoop->sleepGate(event, interruptible));
+}
+
+void
+IOCommandGate::commandWakeup(void * event, bool oneThread)
+{
+	fWorkLoop->wakeupGate(event, oneThread);
+}
+
+OSDefineMetaClassAndStructors(IOInterruptEventSource, IOEventSource)
+
+IOInterruptEventSource *
+IOInterruptEventSource::interruptEventSource(OSObject * owner, Action action, IOService * provider, int intIndex)
+{
+	IOInterruptEventSource * source = new IOInterruptEventSource;
+
+	if (!source->initWithOwner(owner, (OSFunctionPointer) action)) OSSafeReleaseNULL(source);
+	else source->fEnabled = false;
+	return (source);
+}
+
+void
+IOInterruptEventSource::interruptOccurred(void * refcon, IOService * nub, int source)
+{
+	IOWorkLoop * workLoop = fWorkLoop;
+
+	if (!workLoop) return;
+	workLoop->closeGate();
+	if (fEnabled) ((Action) fAction)(fOwner, this, 1);
+	workLoop->openGate();
+}
+
+// command pool, blocking for a command sleeps in the workloop's gate
+
+OSDefineMetaClassAndStructors(IOCommand, OSObject)
+
+OSDefineMetaClassAndStructors(IOCommandPool, OSObject)
+
+bool
+IOCommandPool::initWithWorkLoop(IOWorkLoop * workLoop)
+{
+	fWorkLoop = workLoop;
+	fWorkLoop->retain();
+	return (OSObject::init());
+}
+
+void
+IOCommandPool::free()
+{
+	IOCommand * command;
+
+	while ((command = fQueueHead))
+	{
+		fQueueHead = command->fCommandChain;
+		command->release();
+	}
+	OSSafeReleaseNULL(fWorkLoop);
+	OSObject::free();
+}
+
+IOCommand *
+IOCommandPool::getCommand(bool blockForCommand)
+{
+	IOCommand * command;
+
+	fWorkLoop->closeGate();
+	while (!fQueueHead && blockForCommand) fWorkLoop->sleepGate(&fQueueHead, THREAD_UNINT);
+	if ((command = fQueueHead)) fQueueHead = command->fCommandChain;
+	fWorkLoop->openGate();
+	return (command);
+}
+
+void
+IOCommandPool::returnCommand(IOCommand * command)
+{
+	fWorkLoop->closeGate();
+	command->fCommandChain = fQueueHead;
+	fQueueHead             = command;
+	fWorkLoop->wakeupGate(&fQueueHead, true);
+	fWorkLoop->openGate();
+}
+
+// memory
+
+OSDefineMetaClassAndStructors(IOMemoryDescriptor, OSObject)
+
+IOMemoryDescriptor *
+IOMemoryDescriptor::withAddressRange(mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options, task_t task)
+{
+	IOMemoryDescriptor * md = new IOMemoryDescriptor;
+
+	md->fAddress = (uint8_t *) (uintptr_t) address;
+	md->fLength  = length;
+	md->fOptions = options & ~kIOMemoryPhysicallyContiguous;
+	return (md);
+}
+
+IOReturn
+IOMemoryDescriptor::prepare(IODirection forDirection)
+{
+	fWireCount++;
+	return (kIOReturnSuccess);
+}
+
+IOReturn
+IOMemoryDescriptor::complete(IODirection forDirection)
+{
+	if (fWireCount <= 0) panic("IOMemoryDescriptor::complete without prepare");
+	fWireCount--;
+	return (kIOReturnSuccess);
+}
+
+IOMemoryMap *
+IOMemoryDescriptor::map(IOOptionBits options)
+{
+	return (new IOMemoryMap);
+}
+
+OSDefineMetaClassAndStructors(IOBufferMemoryDescriptor, IOMemoryDescriptor)
+
+IOBufferMemoryDescriptor *
+IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options, unsigned long capacity,
+											unsigned long alignment, uint32_t kernTag, uint32_t userTag)
+{
+	IOBufferMemoryDescriptor * md = new IOBufferMemoryDescriptor;
+	void *                     buffer;
+
+	if (alignment < sizeof(void *)) alignment = sizeof(void *);
+	if (posix_memalign(&buffer, alignment, capacity ? capacity : 1))
+	{
+		md->release();
+		return (NULL);
+	}
+	md->fAddress   = (uint8_t *) buffer;
+	md->fLength    = capacity;
+	md->fOptions   = options;
+	md->fWireCount = 1;						// wired for its lifetime
+	return (md);
+}
+
+void
+IOBufferMemoryDescriptor::free()
+{
+	::free(fAddress);
+	IOMemoryDescriptor::free();
+}
+
+OSDefineMetaClassAndStructors(IODeviceMemory, IOMemoryDescriptor)
+
+IODeviceMemory *
+IODeviceMemory::withRange(IOPhysicalAddress start, IOPhysicalLength length)
+{
+	IODeviceMemory * md = new IODeviceMemory;
+
+	md->fAddress   = NULL;
+	md->fLength    = length;
+	md->fOptions   = kIOMemoryPhysicallyContiguous;
+	md->fWireCount = 1;
+	return (md);
+}
+
+OSDefineMetaClassAndStructors(IOMemoryMap, OSObject)
+
+// the mapper, a page table over a 4GB IOVM space
+
+OSDefineMetaClassAndStructors(IOMapper, OSObject)
+
+IOMapper *
+IOMapper::copyMapperForDevice(IOService * device)
+{
+	if (!gSystem)
+	{
+		gSystem = new IOMapper;
+		if (!gSystem->init()) OSSafeReleaseNULL(gSystem);
+	}
+	if (gSystem) gSystem->retain();
+	return (gSystem);
+}
+
+bool
+IOMapper::init()
+{
+	pthread_mutex_init(&fLock, NULL);
+	fTable = (const uint8_t **) calloc(kIOVMPages, sizeof(fTable[0]));
+	fSeed  = 1;
+	return (fTable && OSObject::init());
+}
+
+void
+IOMapper::free()
+{
+	::free(fTable);
+	pthread_mutex_destroy(&fLock);
+	OSObject::free();
+}
+
+IOReturn
+IOMapper::iovmMapPages(const uint8_t * address, IOByteCount length, bool contiguous, uint64_t * pages)
+{
+	const uint8_t * page  = (const uint8_t *) ((uintptr_t) address & ~PAGE_MASK);
+	uint32_t        count = (uint32_t) ((((uintptr_t) address & PAGE_MASK) + length + PAGE_MASK) >> PAGE_SHIFT);
+	uint32_t        idx, run, used, tries;
+	uint64_t        start;
+
+	pthread_mutex_lock(&fLock);
+	if (fMapped + count > kIOVMPages / 2)
+	{
+		pthread_mutex_unlock(&fLock);
+		return (kIOReturnNoResources);
+	}
+
+	// page 0 stays unmapped; contiguous memory gets a run of pages, the rest a page anywhere
+	for (idx = 0; idx < count; idx += run)
+	{
+		run = contiguous ? count : 1;
+		for (tries = 0; ; tries++)
+		{
+			fSeed = fSeed * 1103515245 + 12345;
+			start = 1 + (fSeed >> 8) % (kIOVMPages - run - 1);
+			for (used = 0; (used < run) && !fTable[start + used]; used++) {}
+			if (used == run) break;
+			if (tries == 64)
+			{
+				pthread_mutex_unlock(&fLock);
+				iovmUnmapPages(pages, idx);
+				return (kIOReturnNoResources);
+			}
+		}
+		for (used = 0; used < run; used++)
+		{
+			pages[idx + used]         = start + used;
+			fTable[start + used]      = page + (idx + used) * PAGE_SIZE;
+		}
+		fMapped += run;
+	}
+	pthread_mutex_unlock(&fLock);
+	return (kIOReturnSuccess);
+}
+
+void
+IOMapper::iovmUnmapPages(const uint64_t * pages, uint32_t count)
+{
+	uint32_t idx;
+
+	pthread_mutex_lock(&fLock);
+	for (idx = 0; idx < count; idx++) fTable[pages[idx]] = NULL;
+	fMapped -= count;
+	pthread_mutex_unlock(&fLock);
+}
+
+uint8_t *
+IOMapper::iovmTranslate(uint64_t address, IOByteCount length)
+{
+	uint64_t        page = address >> PAGE_SHIFT;
+	uint64_t        last = (address + length - 1) >> PAGE_SHIFT;
+	const uint8_t * base;
+	uint64_t        idx;
+
+	if (!length || (last >= kIOVMPages)) return (NULL);
+	pthread_mutex_lock(&fLock);
+	for (base = fTable[page], idx = page + 1; base && (idx <= last); idx++)
+	{
+		if (fTable[idx] != base + (idx - page) * PAGE_SIZE) base = NULL;
+	}
+	pthread_mutex_unlock(&fLock);
+	return (base ? (uint8_t *) base + (address & PAGE_MASK) : NULL);
+}
+
+// DMA commands
+
+OSDefineMetaClassAndStructors(IODMACommand, OSObject)
+
+IODMACommand *
+IODMACommand::withSpecification(SegmentFunction outSegFunc, UInt8 numAddressBits, UInt64 maxSegmentSize,
+								MappingOptions mappingOptions, UInt64 maxTransferSize,
+								UInt32 alignment, IOMapper * mapper, void * refCon)
+{
+	IODMACommand * command = new IODMACommand;
+
+	command->fNumAddressBits  = numAddressBits;
+	command->fMaxSegmentSize  = maxSegmentSize ? maxSegmentSize : UINT64_MAX;
+	command->fMaxTransferSize = maxTransferSize ? maxTransferSize : UINT64_MAX;
+	command->fMapper          = mapper ? mapper : IOMapper::gSystem;
+	if (!command->fMapper)
+	{
+		command->release();
+		return (NULL);
+	}
+	command->fMapper->retain();
+	return (command);
+}
+
+void
+IODMACommand::free()
+{
+	clearMemoryDescriptor();
+	OSSafeReleaseNULL(fMapper);
+	OSObject::free();
+}
+
+IOReturn
+IODMACommand::setMemoryDescriptor(IOMemoryDescriptor * mem, bool autoPrepare)
+{
+	IOReturn result = kIOReturnSuccess;
+
+	if (mem == fMemory) return (kIOReturnSuccess);
+	if (fMemory)
+	{
+		if (fActive) return (kIOReturnBusy);
+		clearMemoryDescriptor();
+	}
+	if (!mem) return (kIOReturnSuccess);
+
+	fMemory = mem;
+	fMemory->retain();
+	if (autoPrepare)
+	{
+		result = prepare();
+		if (kIOReturnSuccess != result) clearMemoryDescriptor();
+	}
+	return (result);
+}
+
+IOReturn
+IODMACommand::clearMemoryDescriptor(bool autoComplete)
+{
+	if (fActive && !autoComplete) return (kIOReturnNotReady);
+	while (fActive) complete();
+	OSSafeReleaseNULL(fMemory);
+	return (kIOReturnSuccess);
+}
+
+IOReturn
+IODMACommand::prepare()
+{
+	IOReturn result;
+	uint32_t count;
+
+	if (!fMemory)                                return (kIOReturnNotReady);
+	if (fMemory->getLength() > fMaxTransferSize) return (kIOReturnNoSpace);
+	if (!fMemory->isPrepared())                  return (kIOReturnNotReady);
+	if (fActive++)                               return (kIOReturnSuccess);
+
+	count  = (uint32_t) ((((uintptr_t) fMemory->getVirtualAddress() & PAGE_MASK) + fMemory->getLength() + PAGE_MASK) >> PAGE_SHIFT);
+	fPages = (uint64_t *) calloc(count ? count : 1, sizeof(fPages[0]));
+	result = fPages ? kIOReturnSuccess : kIOReturnNoMemory;
+	if (kIOReturnSuccess == result)
+	{
+		result = fMapper->iovmMapPages(fMemory->getVirtualAddress(), fMemory->getLength(), fMemory->isPhysicallyContiguous(), fPages);
+	}
+	if (kIOReturnSuccess != result)
+	{
+		::free(fPages);
+		fPages = NULL;
+		fActive--;
+		return (result);
+	}
+	fPageCount = count;
+	return (kIOReturnSuccess);
+}
+
+IOReturn
+IODMACommand::complete()
+{
+	if (!fActive)   return (kIOReturnNotReady);
+	if (--fActive)  return (kIOReturnSuccess);
+
+	fMapper->iovmUnmapPages(fPages, fPageCount);
+	::free(fPages);
+	fPages     = NULL;
+	fPageCount = 0;
+	return (kIOReturnSuccess);
+}
+
+IOReturn
+IODMACommand::genIOVMSegments(UInt64 * offsetP, Segment64 * segments, UInt32 * numSegments)
+{
+	uintptr_t base = (uintptr_t) fMemory->getVirtualAddress();
+	UInt64    offset = *offsetP;
+	UInt32    count;
+
+	if (!fActive)                        return (kIOReturnNotReady);
+	if (offset >= fMemory->getLength())  return (kIOReturnOverrun);
+
+	for (count = 0; (count < *numSegments) && (offset < fMemory->getLength()); count++)
+	{
+		uintptr_t address = base + offset;
+		uint32_t  page    = (uint32_t) ((address >> PAGE_SHIFT) - (base >> PAGE_SHIFT));
+		UInt64    length  = PAGE_SIZE - (address & PAGE_MASK);
+
+		// a run goes on while the mapper put the next page right after
+		while ((page + 1 < fPageCount) && (fPages[page + 1] == fPages[page] + 1)) length += PAGE_SIZE, page++;
+		if (length > fMemory->getLength() - offset) length = fMemory->getLength() - offset;
+		if (length > fMaxSegmentSize)               length = fMaxSegmentSize;
+
+		segments[count].fIOVMAddr = (fPages[(address >> PAGE_SHIFT) - (base >> PAGE_SHIFT)] << PAGE_SHIFT) | (address & PAGE_MASK);
+		segments[count].fLength   = length;
+		if ((fNumAddressBits < 64) && ((segments[count].fIOVMAddr + length - 1) >> fNumAddressBits)) return (kIOReturnMessageTooLarge);
+		offset += length;
+	}
+	*offsetP     = offset;
+	*numSegments = count;
+	return (kIOReturnSuccess);
+}
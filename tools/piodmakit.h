@@ -0,0 +1,496 @@
+/*
+ * Userspace stand-ins for the IOKit pieces ApplePIODMA uses, so that
+ * tools/piodmaengine.cpp runs the kext's own ApplePIODMA, ApplePIODMARequest
+ * and ApplePIODMARequestPool code. The ApplePIODMA sources include this in
+ * place of the kernel headers when KERNEL is not defined.
+ *
+ * Only what those sources call is here, with the kernel's semantics where the
+ * kext depends on them: retain counts and free(), a workloop gate that
+ * commandSleep() gives up, a command pool that blocks for a command, and DMA
+ * commands that refuse more than their maximum transfer size and hand out one
+ * segment per run the mapper made. There is no workloop thread, whoever holds
+ * the gate is on the workloop. The mapper scatters the pages of memory that
+ * isn't physically contiguous over its IOVM space, so multi-page transfers
+ * really are several runs.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef int32_t            IOReturn;
+typedef uint32_t           IOOptionBits;
+typedef unsigned long long IOByteCount;
+typedef unsigned long long IOPhysicalAddress;
+typedef unsigned long long IOPhysicalLength;
+typedef unsigned long long mach_vm_address_t;
+typedef unsigned long long mach_vm_size_t;
+typedef uint64_t           UInt64;
+typedef uint32_t           UInt32;
+typedef uint8_t            UInt8;
+typedef unsigned long      clock_sec_t;
+typedef uint32_t           clock_usec_t;
+typedef void *             task_t;
+
+#define iokit_common_err(return) ((IOReturn) (0xe0000000 | (return)))
+#define kIOReturnSuccess      ((IOReturn) 0)
+#define kIOReturnError        iokit_common_err(0x2bc)
+#define kIOReturnNoMemory     iokit_common_err(0x2bd)
+#define kIOReturnNoResources  iokit_common_err(0x2be)
+#define kIOReturnBadArgument  iokit_common_err(0x2c2)
+#define kIOReturnUnsupported  iokit_common_err(0x2c7)
+#define kIOReturnIOError      iokit_common_err(0x2ca)
+#define kIOReturnBusy         iokit_common_err(0x2d5)
+#define kIOReturnNotReady     iokit_common_err(0x2d8)
+#define kIOReturnNoSpace      iokit_common_err(0x2db)
+#define kIOReturnNoPower      iokit_common_err(0x2e3)
+#define kIOReturnOverrun      iokit_common_err(0x2e8)
+#define kIOReturnAborted      iokit_common_err(0x2eb)
+#define kIOReturnMessageTooLarge iokit_common_err(0x2e1)
+
+#define THREAD_UNINT     (0)
+#define THREAD_AWAKENED  (0)
+
+#undef PAGE_SHIFT
+#undef PAGE_SIZE
+#undef PAGE_MASK
+#define PAGE_SHIFT (12)
+#define PAGE_SIZE  (1UL << PAGE_SHIFT)
+#define PAGE_MASK  (PAGE_SIZE - 1)
+
+#define kernel_task ((task_t) NULL)
+
+enum IODirection
+{
+	kIODirectionNone  = 0,
+	kIODirectionIn    = 1,
+	kIODirectionOut   = 2,
+	kIODirectionInOut = 3
+};
+
+enum
+{
+	kIOMemoryPhysicallyContiguous = 0x00000010
+};
+
+#define panic(ex, ...)         do { fprintf(stderr, "panic: %s\n", # ex); abort(); } while (0)
+#define IOLog(fmt, args...)    fprintf(stderr, fmt, ##args)
+#define kprintf(fmt, args...)  fprintf(stderr, fmt, ##args)
+
+void clock_get_system_microtime(clock_sec_t * secs, clock_usec_t * microsecs);
+bool PE_parse_boot_argn(const char * arg_string, void * arg_ptr, int max_arg);
+static inline bool ml_at_interrupt_context(void) { return (false); }
+
+#define IONewZero(type, count)               ((type *) calloc((count), sizeof(type)))
+#define IODelete(ptr, type, count)           ::free(ptr)
+#define IOSafeDeleteNULL(ptr, type, count)   do { ::free(ptr); (ptr) = NULL; } while (0)
+
+typedef pthread_mutex_t  IOLock;
+typedef pthread_rwlock_t IORWLock;
+
+static inline IOLock * IOLockAlloc(void)
+{
+	IOLock * lock = (IOLock *) malloc(sizeof(IOLock));
+	if (lock) pthread_mutex_init(lock, NULL);
+	return (lock);
+}
+static inline void IOLockFree(IOLock * lock)   { pthread_mutex_destroy(lock); free(lock); }
+static inline void IOLockLock(IOLock * lock)   { pthread_mutex_lock(lock); }
+static inline void IOLockUnlock(IOLock * lock) { pthread_mutex_unlock(lock); }
+
+static inline IORWLock * IORWLockAlloc(void)
+{
+	IORWLock * lock = (IORWLock *) malloc(sizeof(IORWLock));
+	if (lock) pthread_rwlock_init(lock, NULL);
+	return (lock);
+}
+static inline void IORWLockFree(IORWLock * lock)   { pthread_rwlock_destroy(lock); free(lock); }
+static inline void IORWLockRead(IORWLock * lock)   { pthread_rwlock_rdlock(lock); }
+static inline void IORWLockWrite(IORWLock * lock)  { pthread_rwlock_wrlock(lock); }
+static inline void IORWLockUnlock(IORWLock * lock) { pthread_rwlock_unlock(lock); }
+
+// libkern
+
+class OSMetaClass
+{
+public:
+	OSMetaClass(const char * className, const OSMetaClass * superClass) : fClassName(className), fSuperClass(superClass) {}
+	const char *        getClassName() const { return (fClassName); }
+	const OSMetaClass * getSuperClass() const { return (fSuperClass); }
+
+private:
+	const char *        fClassName;
+	const OSMetaClass * fSuperClass;
+};
+
+#define OSDeclareCommonStructors(className)                                  \
+	public:                                                                  \
+	static const OSMetaClass         gMetaClass;                             \
+	static const OSMetaClass * const metaClass;                              \
+	virtual const OSMetaClass * getMetaClass() const override { return (metaClass); }
+
+#define OSDeclareDefaultStructors(className)                                 \
+	OSDeclareCommonStructors(className)                                      \
+	className();                                                             \
+	protected:                                                               \
+	virtual ~className();                                                    \
+	private:
+
+#define OSDeclareAbstractStructors(className) OSDeclareDefaultStructors(className)
+
+#define OSDefineMetaClassAndStructors(className, superclassName)             \
+	const OSMetaClass         className::gMetaClass(#className, superclassName::metaClass); \
+	const OSMetaClass * const className::metaClass = &className::gMetaClass; \
+	className::className() {}                                                \
+	className::~className() {}
+
+#define OSDefineMetaClassAndAbstractStructors(className, superclassName)     \
+	OSDefineMetaClassAndStructors(className, superclassName)
+
+class OSObject
+{
+public:
+	static const OSMetaClass         gMetaClass;
+	static const OSMetaClass * const metaClass;
+	virtual const OSMetaClass * getMetaClass() const { return (metaClass); }
+
+	// objects start out zeroed, as in the kernel
+	static void * operator new(size_t size) { return (calloc(1, size)); }
+	static void   operator delete(void * mem) { ::free(mem); }
+
+	OSObject() : fRetainCount(1) {}
+	virtual bool init() { return (true); }
+	void retain() const;
+	void release() const;
+	int  getRetainCount() const;
+
+protected:
+	virtual ~OSObject() {}
+	virtual void free();
+
+private:
+	mutable int fRetainCount;
+};
+
+#define OSDynamicCast(type, inst)   dynamic_cast<type *>(inst)
+#define OSSafeReleaseNULL(inst)     do { if (inst) (inst)->release(); (inst) = NULL; } while (0)
+
+// a member function as the C function the kernel calls with the object first, looked up in the vtable if virtual
+typedef void (*OSFunctionPointer)(void);
+
+template <typename T>
+static inline OSFunctionPointer
+_ptmf2ptf(const OSObject * self, T func)
+{
+	union
+	{
+		T func;
+		struct
+		{
+			uintptr_t pfn;
+			ptrdiff_t delta;
+		} ptmf;
+	} map;
+	const char * thisPtr;
+	uintptr_t    vtable;
+
+	map.func = func;
+#if defined(__arm__) || defined(__arm64__) || defined(__aarch64__)
+	if (map.ptmf.delta & 1)
+	{
+		thisPtr = (const char *) self + (map.ptmf.delta >> 1);
+		vtable  = *(const uintptr_t *) thisPtr;
+		return (*(const OSFunctionPointer *) (vtable + map.ptmf.pfn));
+	}
+#else
+	if (map.ptmf.pfn & 1)
+	{
+		thisPtr = (const char *) self + map.ptmf.delta;
+		vtable  = *(const uintptr_t *) thisPtr;
+		return (*(const OSFunctionPointer *) (vtable + map.ptmf.pfn - 1));
+	}
+#endif
+	return ((OSFunctionPointer) map.ptmf.pfn);
+}
+
+#define OSMemberFunctionCast(cptrtype, self, func) reinterpret_cast<cptrtype>(_ptmf2ptf(self, func))
+
+class OSData : public OSObject
+{
+	OSDeclareDefaultStructors(OSData);
+
+public:
+	static OSData * withBytes(const void * bytes, unsigned int numBytes);
+	const void *    getBytesNoCopy() const { return (fData); }
+	unsigned int    getLength() const { return (fLength); }
+
+protected:
+	virtual void free() override;
+
+	void *       fData;
+	unsigned int fLength;
+};
+
+// IOKit
+
+class IOService;
+class IOWorkLoop;
+class IOMapper;
+class IOMemoryMap;
+class IODeviceMemory;
+
+struct IORegistryPlane;
+extern const IORegistryPlane * gIOServicePlane;
+
+class IOService : public OSObject
+{
+	OSDeclareDefaultStructors(IOService);
+
+public:
+	virtual bool start(IOService * provider);
+	virtual void stop(IOService * provider);
+	virtual IODeviceMemory * getDeviceMemoryWithIndex(unsigned int index);
+
+	OSObject *   getProperty(const char * key, const IORegistryPlane * plane = NULL);
+	bool         setProperty(const char * key, OSObject * object);
+	const char * getName() const { return (getMetaClass()->getClassName()); }
+	const char * getLocation() const { return (fLocation[0] ? fLocation : NULL); }
+	void         setLocation(const char * location);
+
+protected:
+	virtual void free() override;
+
+	enum { kMaxProperties = 16 };
+	struct
+	{
+		const char * key;
+		OSObject *   value;
+	}          fProperties[kMaxProperties];
+	char       fLocation[32];
+};
+
+class IOEventSource : public OSObject
+{
+	OSDeclareDefaultStructors(IOEventSource);
+
+public:
+	virtual void enable()  { fEnabled = true; }
+	virtual void disable() { fEnabled = false; }
+	bool         isEnabled() const { return (fEnabled); }
+	void         setWorkLoop(IOWorkLoop * workLoop) { fWorkLoop = workLoop; }
+	IOWorkLoop * getWorkLoop() const { return (fWorkLoop); }
+
+protected:
+	bool initWithOwner(OSObject * owner, OSFunctionPointer action);
+
+	OSObject *        fOwner;
+	OSFunctionPointer fAction;
+	bool              fEnabled;
+	IOWorkLoop *      fWorkLoop;
+};
+
+class IOWorkLoop : public OSObject
+{
+	OSDeclareDefaultStructors(IOWorkLoop);
+
+public:
+	static IOWorkLoop * workLoop();
+	IOReturn addEventSource(IOEventSource * source);
+	IOReturn removeEventSource(IOEventSource * source);
+
+	void closeGate();
+	void openGate();
+	bool inGate();
+	int  sleepGate(void * event, UInt32 interruptibleType);
+	void wakeupGate(void * event, bool oneThread);
+
+protected:
+	virtual bool init() override;
+	virtual void free() override;
+
+	struct Sleeper
+	{
+		void *    event;
+		bool      awakened;
+		Sleeper * next;
+	};
+
+	pthread_mutex_t fGateLock;
+	pthread_cond_t  fGateWakeup;
+	pthread_t       fGateOwner;
+	uint32_t        fGateCount;
+	Sleeper *       fSleepers;
+};
+
+class IOCommandGate : public IOEventSource
+{
+	OSDeclareDefaultStructors(IOCommandGate);
+
+public:
+	typedef IOReturn (*Action)(OSObject * owner, void * arg0, void * arg1, void * arg2, void * arg3);
+
+	static IOCommandGate * commandGate(OSObject * owner, Action action = NULL);
+	IOReturn runAction(Action action, void * arg0 = NULL, void * arg1 = NULL, void * arg2 = NULL, void * arg3 = NULL);
+	IOReturn commandSleep(void * event, UInt32 interruptible = THREAD_UNINT);
+	void     commandWakeup(void * event, bool oneThread = false);
+};
+
+class IOInterruptEventSource : public IOEventSource
+{
+	OSDeclareDefaultStructors(IOInterruptEventSource);
+
+public:
+	typedef void (*Action)(OSObject * owner, IOInterruptEventSource * sender, int count);
+
+	static IOInterruptEventSource * interruptEventSource(OSObject * owner, Action action, IOService * provider = NULL, int intIndex = 0);
+	// the model's interrupt, runs the action on the calling thread in the workloop's gate
+	void interruptOccurred(void * refcon, IOService * nub, int source);
+};
+
+class IOCommand : public OSObject
+{
+	OSDeclareDefaultStructors(IOCommand);
+
+public:
+	IOCommand * fCommandChain;
+};
+
+class IOCommandPool : public OSObject
+{
+	OSDeclareDefaultStructors(IOCommandPool);
+
+public:
+	virtual IOCommand * getCommand(bool blockForCommand = true);
+	virtual void        returnCommand(IOCommand * command);
+
+protected:
+	bool initWithWorkLoop(IOWorkLoop * workLoop);
+	virtual void free() override;
+
+	IOWorkLoop * fWorkLoop;
+	IOCommand *  fQueueHead;
+};
+
+class IOMemoryDescriptor : public OSObject
+{
+	OSDeclareDefaultStructors(IOMemoryDescriptor);
+
+public:
+	static IOMemoryDescriptor * withAddressRange(mach_vm_address_t address, mach_vm_size_t length, IOOptionBits options, task_t task);
+	IOByteCount       getLength() const { return (fLength); }
+	virtual IOReturn  prepare(IODirection forDirection = kIODirectionNone);
+	virtual IOReturn  complete(IODirection forDirection = kIODirectionNone);
+	IOMemoryMap *     map(IOOptionBits options = 0);
+
+	// the model's view of the memory
+	uint8_t *         getVirtualAddress() const { return (fAddress); }
+	bool              isPhysicallyContiguous() const { return (fOptions & kIOMemoryPhysicallyContiguous); }
+	bool              isPrepared() const { return (fWireCount > 0); }
+
+protected:
+	uint8_t *    fAddress;
+	IOByteCount  fLength;
+	IOOptionBits fOptions;
+	int          fWireCount;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+	OSDeclareDefaultStructors(IOBufferMemoryDescriptor);
+
+public:
+	static IOBufferMemoryDescriptor * inTaskWithOptions(task_t inTask, IOOptionBits options, unsigned long capacity,
+														unsigned long alignment = 1, uint32_t kernTag = 0, uint32_t userTag = 0);
+	void * getBytesNoCopy() { return (fAddress); }
+
+protected:
+	virtual void free() override;
+};
+
+class IODeviceMemory : public IOMemoryDescriptor
+{
+	OSDeclareDefaultStructors(IODeviceMemory);
+
+public:
+	static IODeviceMemory * withRange(IOPhysicalAddress start, IOPhysicalLength length);
+};
+
+class IOMemoryMap : public OSObject
+{
+	OSDeclareDefaultStructors(IOMemoryMap);
+};
+
+class IOMapper : public OSObject
+{
+	OSDeclareDefaultStructors(IOMapper);
+
+public:
+	static IOMapper * gSystem;
+	static IOMapper * copyMapperForDevice(IOService * device);
+
+	// page numbers of the IOVM pages given to each page of a range, consecutive if contiguous
+	IOReturn iovmMapPages(const uint8_t * address, IOByteCount length, bool contiguous, uint64_t * pages);
+	void     iovmUnmapPages(const uint64_t * pages, uint32_t count);
+	// memory behind an IOVM range, NULL unless every page is mapped and the range is contiguous behind the mapper
+	uint8_t * iovmTranslate(uint64_t address, IOByteCount length);
+	uint32_t  iovmMappedPages() const { return (fMapped); }
+
+protected:
+	virtual bool init() override;
+	virtual void free() override;
+
+	enum { kIOVMPages = 1 << 20 };			// 4GB of IOVM space
+
+	pthread_mutex_t  fLock;
+	const uint8_t ** fTable;
+	uint32_t         fMapped;
+	uint32_t         fSeed;
+};
+
+#define kIODMACommandOutputHost64 (64)
+
+class IODMACommand : public OSObject
+{
+	OSDeclareDefaultStructors(IODMACommand);
+
+public:
+	typedef uint32_t SegmentFunction;
+
+	enum MappingOptions
+	{
+		kMapped = 0x00000000
+	};
+
+	struct Segment64
+	{
+		UInt64 fIOVMAddr;
+		UInt64 fLength;
+	};
+
+	static IODMACommand * withSpecification(SegmentFunction outSegFunc, UInt8 numAddressBits, UInt64 maxSegmentSize,
+											MappingOptions mappingOptions = kMapped, UInt64 maxTransferSize = 0,
+											UInt32 alignment = 1, IOMapper * mapper = NULL, void * refCon = NULL);
+
+	IOReturn setMemoryDescriptor(IOMemoryDescriptor * mem, bool autoPrepare = true);
+	IOReturn clearMemoryDescriptor(bool autoComplete = true);
+	IOReturn prepare();
+	IOReturn complete();
+	IOReturn genIOVMSegments(UInt64 * offset, Segment64 * segments, UInt32 * numSegments);
+
+protected:
+	virtual void free() override;
+
+	UInt8                fNumAddressBits;
+	UInt64               fMaxSegmentSize;
+	UInt64               fMaxTransferSize;
+	IOMapper *           fMapper;
+	IOMemoryDescriptor * fMemory;
+	uint32_t             fActive;
+	uint64_t *           fPages;
+	uint32_t             fPageCount;
+};
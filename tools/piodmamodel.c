@@ -0,0 +1,70 @@
+/*
+cc -c tools/piodmamodel.c -o /tmp/piodmamodel.o -Wall
+*/
+
+#include "piodmamodel.h"
+
+uint32_t
+piodma_chain_build(piodma_block_t * block, const piodma_packet_t * packets, uint32_t count)
+{
+	uint32_t idx;
+
+	if (count > kApplePIODMAChainBlockMaxPackets) return (0);
+	block->length = 0;
+	for (idx = 0; idx < count; idx++)
+	{
+		applePIODMAEncodeGenericPacket((ApplePIODMAGenericPacket *) &block->words[block->length],
+										packets[idx].buffer, packets[idx].target,
+										packets[idx].bufferType, packets[idx].targetType,
+										packets[idx].size, packets[idx].bufferBAR, packets[idx].targetBAR);
+		block->length += kApplePIODMAGenericPacketSize;
+	}
+
+	return (block->length);
+}
+
+static uint32_t
+field(uint64_t value, uint64_t mask, uint32_t phase)
+{
+	return ((uint32_t) ((value & mask) >> phase));
+}
+
+int
+piodma_chain_walk(piodma_fetch_t fetch, void * context, uint64_t source, uint32_t size,
+				  piodma_packet_t * packets, uint32_t max)
+{
+	const uint32_t * words;
+	uint32_t         offset, count, type, extended;
+
+	if (!size)                                                return (-1);
+	if (size > kApplePIODMAChainBlockSize / sizeof(uint32_t)) return (-1);
+	words = fetch(context, source, size);
+	if (!words)                                               return (-1);
+
+	// generic packets only, anything else in the command is malformed
+	for (count = 0, offset = 0; offset < size; offset += kApplePIODMAGenericPacketSize, count++)
+	{
+		const ApplePIODMAGenericPacket * generic = (const ApplePIODMAGenericPacket *) &words[offset];
+
+		type     = field(words[offset], kApplePIODMAGenericPacketWord0Type, kApplePIODMAGenericPacketWord0TypePhase);
+		extended = field(words[offset], kApplePIODMAGenericPacketWord0ExtendedType, kApplePIODMAGenericPacketWord0ExtendedTypePhase);
+		if ((kApplePIODMAGenericPacketWord0TypeValue != type)
+		 || (kApplePIODMAGenericPacketWord0ExtendedTypeValue != extended)) return (-1);
+		if (offset + kApplePIODMAGenericPacketSize > size)                 return (-1);
+		if (count == max)                                                  return (-1);
+
+		packets[count].buffer     = field(generic->word0, kApplePIODMAGenericPacketWord0BufferAddrOffset, kApplePIODMAGenericPacketWord0BufferAddrOffsetPhase)
+								  | ((uint64_t) field(generic->word1, kApplePIODMAGenericPacketWord1BufferAddrOffset, kApplePIODMAGenericPacketWord1BufferAddrOffsetPhase)
+										<< kApplePIODMAGenericPacketWord0BufferAddrOffsetWidth);
+		packets[count].target     = field(generic->word1, kApplePIODMAGenericPacketWord1TargetAddrOffset, kApplePIODMAGenericPacketWord1TargetAddrOffsetPhase)
+								  | ((uint64_t) generic->word2 << kApplePIODMAGenericPacketWord1TargetAddrOffsetWidth);
+		packets[count].size       = generic->word3;
+		// the driver puts the buffer type in the target type field and the reverse
+		packets[count].bufferType = field(generic->word0, kApplePIODMAGenericPacketWord0TargetDeviceType, kApplePIODMAGenericPacketWord0TargetDeviceTypePhase);
+		packets[count].targetType = field(generic->word0, kApplePIODMAGenericPacketWord0BufferDeviceType, kApplePIODMAGenericPacketWord0BufferDeviceTypePhase);
+		packets[count].bufferBAR  = field(generic->word0, kApplePIODMAGenericPacketWord0BufferBarSel, kApplePIODMAGenericPacketWord0BufferBarSelPhase);
+		packets[count].targetBAR  = field(generic->word0, kApplePIODMAGenericPacketWord0TargetBARSel, kApplePIODMAGenericPacketWord0TargetBARSelPhase);
+	}
+
+	return ((int) count);
+}
@@ -0,0 +1,50 @@
+/*
+ * Software model of the PIODMA engine's command format, shared by
+ * tools/piodmachain.c and tools/piodmaengine.cpp. Packets are encoded with the
+ * inline helpers in ApplePIODMADefinitions.h, so the model checks the same
+ * encoding the kext builds.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "../ApplePIODMA/ApplePIODMADefinitions.h"
+
+#define kPIODMAModelMaxChainPackets (kApplePIODMAChainBlockMaxPackets)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct piodma_packet
+{
+	uint64_t buffer;
+	uint64_t target;
+	uint32_t size;
+	uint32_t bufferType;
+	uint32_t targetType;
+	uint32_t bufferBAR;
+	uint32_t targetBAR;
+};
+typedef struct piodma_packet piodma_packet_t;
+
+struct piodma_block
+{
+	uint64_t   address;				// bus address of words
+	uint32_t * words;				// kApplePIODMAChainBlockSize bytes
+	uint32_t   length;				// words in use
+};
+typedef struct piodma_block piodma_block_t;
+
+// bus memory as the engine sees it, NULL if the words at address are not backed
+typedef const uint32_t * (*piodma_fetch_t)(void * context, uint64_t address, uint32_t words);
+
+// lay packets out as ApplePIODMARequest::prepareChain .. finishChain does in the request's command block.
+// Returns the command size in words, 0 if count packets don't fit; the command source is block->address
+uint32_t piodma_chain_build(piodma_block_t * block, const piodma_packet_t * packets, uint32_t count);
+// walk a command as the engine does, returns packets decoded or -1 if the command is malformed
+int piodma_chain_walk(piodma_fetch_t fetch, void * context, uint64_t source, uint32_t size,
+					  piodma_packet_t * packets, uint32_t max);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,343 @@
+/*
+cc tools/propcache.c -o /tmp/propcache -O2 -Wall
+ */
+
+/*
+ * Config space cost of the "Capability Offsets" and link status properties
+ * of IOPCIDevice, for a simulated Thunderbolt style topology of root ports
+ * and chained switches. Before, every nub walked its capability lists at
+ * publish and built the dictionary, and every serialization of the link
+ * status (an ioreg -l, or any tool walking the registry) checked each link
+ * above the function through isFunctionAccessible() and read its Link
+ * Status register. Now the capabilities are walked on first read, and both
+ * are served from the cache until invalidateProperties() (AER, link, power
+ * and reset events) or for at most kIOPCIPropertyCacheMS. Counts config
+ * reads and dictionary objects allocated, and models time with each config
+ * read costing the given latency. Also checks every cached value against
+ * the simulated hardware after invalidating events, and that a change with
+ * no event is seen within the cache age.
+ *
+ * propcache [-r root ports] [-d switch depth] [-p ports per switch]
+ *           [-w walks] [-i walk interval ms] [-l read latency ns]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kPropertyCacheMS   (1000)		// kIOPCIPropertyCacheMS
+#define kMaxNodes          (4096)
+#define kLinkActive        (1 << 13)
+#define kStdCaps           (5)			// PM, MSI, MSI-X, Express, vendor
+#define kExtCaps           (7)			// AER, LTR, L1SS, DPC, PTM, ...
+
+struct node
+{
+	struct node * parent;				// the bridge nub above, NULL below a root complex
+	int           downstream;			// downstream facing switch or root port
+	int           dllla;				// Data Link Layer Link Active reporting capable
+	uint16_t      linkStatus;			// the hardware
+
+	// IOPCIDeviceExpansionData
+	uint32_t      propertyGeneration;
+	uint32_t      linkStatusGeneration;
+	uint64_t      linkStatusTime;
+	uint16_t      linkStatusValue;
+	uint32_t      capDictGeneration;
+	int           capDict;
+};
+
+struct topology
+{
+	struct node nodes[kMaxNodes];
+	uint32_t    count;
+};
+
+static uint64_t reads, allocs, clockMS;
+
+static struct node *
+addNode(struct topology * topo, struct node * parent, int downstream)
+{
+	struct node * node;
+
+	if (topo->count >= kMaxNodes) return (NULL);
+	node = &topo->nodes[topo->count++];
+	memset(node, 0, sizeof(*node));
+	node->parent     = parent;
+	node->downstream = downstream;
+	node->dllla      = downstream;
+	node->linkStatus = kLinkActive | 0x0044;
+	return (node);
+}
+
+// an upstream port, its downstream ports, the next switch below the first
+static void
+addSwitch(struct topology * topo, struct node * port, uint32_t level, uint32_t depth, uint32_t ports)
+{
+	struct node * up;
+	struct node * down;
+	uint32_t      idx;
+
+	if (!(up = addNode(topo, port, 0))) return;
+	for (idx = 0; idx < ports; idx++)
+	{
+		if (!(down = addNode(topo, up, 1))) return;
+		if (!idx && ((level + 1) < depth)) addSwitch(topo, down, level + 1, depth, ports);
+		else                               addNode(topo, down, 0);
+	}
+}
+
+static void
+build(struct topology * topo, uint32_t roots, uint32_t depth, uint32_t ports)
+{
+	struct node * root;
+	uint32_t      idx;
+
+	topo->count = 0;
+	for (idx = 0; idx < roots; idx++)
+	{
+		if (!(root = addNode(topo, NULL, 1))) return;
+		if (depth) addSwitch(topo, root, 0, depth, ports);
+		else       addNode(topo, root, 0);
+	}
+}
+
+static uint16_t
+configRead16(struct node * node)
+{
+	reads++;
+	return (node->linkStatus);
+}
+
+// IOPCIDevice::isFunctionAccessible
+static int
+isFunctionAccessible(struct node * node, struct node * function)
+{
+	uint16_t linkStatus;
+
+	if (node->parent && !isFunctionAccessible(node->parent, NULL)) return (0);
+	if ((function == node) && node->downstream)                   return (1);
+	reads++;											// Link Capabilities
+	if (!node->downstream || !node->dllla)                        return (1);
+	linkStatus = configRead16(node);
+	return ((0xFFFF != linkStatus) && (kLinkActive & linkStatus));
+}
+
+// IOPCIBridge::constructCapabilitiesDict
+static void
+constructCapabilitiesDict(struct node * node)
+{
+	reads  += 1 + kStdCaps + kExtCaps;
+	allocs += 1 + kStdCaps + kExtCaps;
+	node->capDict = 1;
+}
+
+static void
+invalidateProperties(struct node * node)
+{
+	node->propertyGeneration++;
+}
+
+static int
+propertyCacheValid(struct node * node, uint32_t generation, uint64_t timestamp)
+{
+	if (!timestamp || (generation != node->propertyGeneration)) return (0);
+	return ((clockMS - timestamp) < kPropertyCacheMS);
+}
+
+// IOPCIDevice::serializeLinkStatus
+static uint16_t
+serializeLinkStatus(struct node * node, int cached)
+{
+	uint16_t linkStatus = 0xFFFF;
+
+	allocs++;											// the OSNumber serialized
+	if (cached && propertyCacheValid(node, node->linkStatusGeneration, node->linkStatusTime))
+	{
+		return (node->linkStatusValue);
+	}
+	node->linkStatusGeneration = node->propertyGeneration;
+	if (isFunctionAccessible(node, node)) linkStatus = configRead16(node);
+	node->linkStatusValue = linkStatus;
+	node->linkStatusTime  = clockMS + 1;				// nonzero once read
+	return (linkStatus);
+}
+
+// IOPCIDevice::copyCapabilityOffsets, from serializeProperties()
+static void
+copyCapabilityOffsets(struct node * node)
+{
+	if ((!node->capDict || (node->capDictGeneration != node->propertyGeneration))
+	 && isFunctionAccessible(node, node))
+	{
+		node->capDictGeneration = node->propertyGeneration;
+		constructCapabilitiesDict(node);
+	}
+}
+
+static void
+publish(struct topology * topo, int lazy)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < topo->count; idx++)
+	{
+		if (!lazy) constructCapabilitiesDict(&topo->nodes[idx]);
+	}
+}
+
+static void
+walk(struct topology * topo, int cached)
+{
+	uint32_t idx;
+
+	for (idx = 0; idx < topo->count; idx++)
+	{
+		serializeLinkStatus(&topo->nodes[idx], cached);
+		if (cached) copyCapabilityOffsets(&topo->nodes[idx]);
+	}
+}
+
+// the value a fresh read gives, without counting it
+static uint16_t
+expected(struct node * node)
+{
+	uint64_t saved = reads;
+	uint16_t linkStatus;
+
+	linkStatus = isFunctionAccessible(node, node) ? node->linkStatus : 0xFFFF;
+	reads = saved;
+	return (linkStatus);
+}
+
+static uint32_t
+check(struct topology * topo)
+{
+	struct node * bridge;
+	struct node * endpoint;
+	uint32_t      idx, failures = 0;
+	uint64_t      start;
+
+	clockMS = 0;
+	publish(topo, 1);
+	walk(topo, 1);
+
+	// a link goes down under a switch, the bridge and its children are invalidated
+	bridge   = &topo->nodes[topo->count - 2];
+	endpoint = &topo->nodes[topo->count - 1];
+	if (bridge != endpoint->parent) return (1);
+	bridge->linkStatus = 0x0044;
+	invalidateProperties(bridge);
+	invalidateProperties(endpoint);
+	clockMS += 10;
+	walk(topo, 1);
+	for (idx = 0; idx < topo->count; idx++)
+	{
+		if (serializeLinkStatus(&topo->nodes[idx], 1) != expected(&topo->nodes[idx])) failures++;
+	}
+	if (serializeLinkStatus(endpoint, 1) != 0xFFFF) failures++;
+
+	// and comes back with no event, seen within the cache age
+	bridge->linkStatus = kLinkActive | 0x0044;
+	start = clockMS;
+	while (serializeLinkStatus(endpoint, 1) != expected(endpoint))
+	{
+		clockMS += 10;
+		if ((clockMS - start) > (kPropertyCacheMS + 10))
+		{
+			failures++;
+			break;
+		}
+	}
+	if (failures) printf("%u stale values\n", failures);
+	return (failures);
+}
+
+int main(int argc, char * argv[])
+{
+	static struct topology topo;
+	uint32_t roots    = 4;
+	uint32_t depth    = 3;
+	uint32_t ports    = 4;
+	uint32_t walks    = 10;
+	uint32_t interval = 200;
+	uint64_t latency  = 800;
+	uint64_t eagerReads, eagerAllocs, beforeReads, beforeAllocs;
+	uint64_t firstReads, firstAllocs;
+	uint32_t idx, failures;
+	int      ch;
+
+	while (-1 != (ch = getopt(argc, argv, "r:d:p:w:i:l:")))
+	{
+		switch (ch)
+		{
+			case 'r': roots    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'd': depth    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'p': ports    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'w': walks    = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'i': interval = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'l': latency  = strtoull(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-r root ports] [-d switch depth] [-p ports per switch]\n"
+						"          [-w walks] [-i walk interval ms] [-l read latency ns]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!roots) roots = 1;
+	if (!ports) ports = 1;
+	if (!walks) walks = 1;
+
+	build(&topo, roots, depth, ports);
+	failures = check(&topo);
+
+	build(&topo, roots, depth, ports);
+	reads = allocs = 0;
+	publish(&topo, 0);
+	eagerReads  = reads;
+	eagerAllocs = allocs;
+	reads = allocs = 0;
+	publish(&topo, 1);
+
+	printf("%u nubs, %u root ports, switch depth %u x %u ports, %llu ns per config read\n",
+			topo.count, roots, depth, ports, (unsigned long long) latency);
+	printf("%-22s %12s %12s %12s\n", "", "config reads", "objects", "modeled us");
+	printf("%-22s %12llu %12llu %12.1f\n", "publish before", (unsigned long long) eagerReads,
+			(unsigned long long) eagerAllocs, eagerReads * latency / 1000.0);
+	printf("%-22s %12llu %12llu %12.1f\n", "publish after", (unsigned long long) reads,
+			(unsigned long long) allocs, reads * latency / 1000.0);
+
+	// a registry walk every interval, with an AER event halfway
+	clockMS = 0;
+	reads = allocs = 0;
+	for (idx = 0; idx < walks; idx++, clockMS += interval) walk(&topo, 0);
+	beforeReads  = reads;
+	beforeAllocs = allocs;
+
+	clockMS = 0;
+	reads = allocs = 0;
+	walk(&topo, 1);
+	firstReads  = reads;
+	firstAllocs = allocs;
+	for (idx = 1; idx < walks; idx++)
+	{
+		clockMS += interval;
+		if (idx == (walks / 2)) invalidateProperties(&topo.nodes[topo.count - 1]);
+		walk(&topo, 1);
+	}
+
+	printf("%-22s %12.1f %12.1f %12.1f\n", "walk before", (double) beforeReads / walks,
+			(double) beforeAllocs / walks, (double) beforeReads * latency / walks / 1000.0);
+	printf("%-22s %12llu %12llu %12.1f\n", "first walk after", (unsigned long long) firstReads,
+			(unsigned long long) firstAllocs, firstReads * latency / 1000.0);
+	if (walks > 1)
+	{
+		printf("%-22s %12.1f %12.1f %12.1f\n", "later walks after", (double) (reads - firstReads) / (walks - 1),
+				(double) (allocs - firstAllocs) / (walks - 1), (double) (reads - firstReads) * latency / (walks - 1) / 1000.0);
+	}
+	printf("%u walks %u ms apart, per walk\n", walks, interval);
+	printf("%u failures\n", failures);
+
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,155 @@
+/*
+cc -c tools/vtdstats.c -o /tmp/vtdstats.o -Wall
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../vtdstats.h"
+
+const vtd_stats_header_t *
+vtd_stats_validate(const void * blob, size_t length)
+{
+	const vtd_stats_header_t * header = (const vtd_stats_header_t *) blob;
+	const vtd_stats_record_t * record;
+	size_t                     offset;
+
+	if (length < sizeof(*header))                           return (NULL);
+	if (kVTDStatsMagic != header->magic)                    return (NULL);
+	if (header->header_length < sizeof(*header))            return (NULL);
+	if ((header->length > length) || (header->length < header->header_length)) return (NULL);
+
+	// newer versions only append fields & records
+	for (offset = header->header_length; offset < header->length; offset += record->length)
+	{
+		record = (const vtd_stats_record_t *) (((const uint8_t *) blob) + offset);
+		if ((offset + sizeof(*record)) > header->length)    return (NULL);
+		if ((record->length < sizeof(*record))
+		 || (record->length & 7)
+		 || ((offset + record->length) > header->length))   return (NULL);
+		if (((uint64_t) record->elem_length * record->count) > (record->length - sizeof(*record))) return (NULL);
+	}
+
+	return (header);
+}
+
+const vtd_stats_record_t *
+vtd_stats_next(const vtd_stats_header_t * header, const vtd_stats_record_t * prior)
+{
+	const uint8_t * next;
+
+	if (prior) next = ((const uint8_t *) prior) + prior->length;
+	else       next = ((const uint8_t *) header) + header->header_length;
+
+	if (next >= (((const uint8_t *) header) + header->length)) return (NULL);
+
+	return ((const vtd_stats_record_t *) next);
+}
+
+const vtd_stats_record_t *
+vtd_stats_find(const vtd_stats_header_t * header, const char * name)
+{
+	const vtd_stats_record_t * record;
+
+	for (record = NULL; (record = vtd_stats_next(header, record)); )
+	{
+		if (!strncmp(name, record->name, sizeof(record->name))) break;
+	}
+
+	return (record);
+}
+
+uint64_t
+vtd_stats_ns(const vtd_stats_header_t * header, uint64_t value)
+{
+	if (!header->timebase_denom) return (value);
+	return (value * header->timebase_numer / header->timebase_denom);
+}
+
+static void
+vtd_stats_print_histogram(FILE * file, const vtd_stats_header_t * header,
+						  const vtd_stats_record_t * record)
+{
+	const uint64_t * hist = (const uint64_t *) vtd_stats_elems(record);
+	uint64_t         total, limit;
+	uint32_t         idx, last;
+	bool             time;
+
+	// values recorded in absolute time are named *_time
+	time = (NULL != strstr(record->name, "_time"));
+
+	for (total = 0, last = 0, idx = 0; idx < record->count; idx++)
+	{
+		total += hist[idx];
+		if (hist[idx]) last = idx;
+	}
+	fprintf(file, "%-.*s (%llu)\n", (int) sizeof(record->name), record->name, (unsigned long long) total);
+	if (!total) return;
+
+	for (idx = 0; idx <= last; idx++)
+	{
+		limit = (1ULL << idx);
+		if (time) limit = vtd_stats_ns(header, limit);
+		fprintf(file, "  < %-12llu%s %12llu %6.2f%%\n", (unsigned long long) limit, time ? "ns" : "  ",
+				(unsigned long long) hist[idx], hist[idx] * 100.0 / total);
+	}
+}
+
+void
+vtd_stats_print(FILE * file, const vtd_stats_header_t * header)
+{
+	const vtd_stats_record_t * record;
+	const vtd_stats_sample_t * sample;
+	const vtd_stats_domain_t * domain;
+	const uint64_t           * counter;
+	uint32_t                   idx;
+
+	fprintf(file, "version %d, %d records\n", header->version, header->records);
+
+	for (record = NULL; (record = vtd_stats_next(header, record)); )
+	{
+		switch (record->type)
+		{
+			case kVTDStatsRecordCounter:
+				counter = (const uint64_t *) vtd_stats_elems(record);
+				for (idx = 0; idx < record->count; idx++)
+				{
+					fprintf(file, "%-.*s[%d] %llu\n", (int) sizeof(record->name), record->name, idx,
+							(unsigned long long) counter[idx]);
+				}
+				break;
+
+			case kVTDStatsRecordHistogram:
+				vtd_stats_print_histogram(file, header, record);
+				break;
+
+			case kVTDStatsRecordSamples:
+				fprintf(file, "%-.*s (%d)\n", (int) sizeof(record->name), record->name, record->count);
+				for (idx = 0; idx < record->count; idx++)
+				{
+					sample = (const vtd_stats_sample_t *) (((const uint8_t *) vtd_stats_elems(record)) + idx * record->elem_length);
+					fprintf(file, "  -%10.3fms small %4d large %4d\n",
+							(header->time - sample->time) ? vtd_stats_ns(header, header->time - sample->time) / 1e6 : 0.0,
+							sample->depth[0], sample->depth[1]);
+				}
+				break;
+
+			case kVTDStatsRecordDomains:
+				fprintf(file, "%-.*s (%d)\n", (int) sizeof(record->name), record->name, record->count);
+				fprintf(file, "  domain      vsize      rsize      bused      rused     tables  waits pending\n");
+				for (idx = 0; idx < record->count; idx++)
+				{
+					domain = (const vtd_stats_domain_t *) (((const uint8_t *) vtd_stats_elems(record)) + idx * record->elem_length);
+					fprintf(file, "  %6d 0x%08x 0x%08x 0x%08x 0x%08x 0x%08x %6d %7d\n",
+							domain->domain, domain->vsize, domain->rsize, domain->bused,
+							domain->rused, domain->tables, domain->waits, domain->pending_free);
+				}
+				break;
+
+			default:
+				fprintf(file, "%-.*s: unknown type %d\n", (int) sizeof(record->name), record->name, record->type);
+				break;
+		}
+	}
+}
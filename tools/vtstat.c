@@ -1,11 +1,18 @@
 /*
-cc tools/vtstat.c -o /tmp/vtstat -framework IOKit -framework CoreFoundation -g -Wall
+cc tools/vtstat.c tools/vtdstats.c -o /tmp/vtstat -framework IOKit -framework CoreFoundation -g -Wall
+cc tools/vtstat.c tools/vtdstats.c -o /tmp/vtstat -g -Wall		(decode dumps only, -f)
 */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
+#if __APPLE__
 #include <IOKit/IOKitLib.h>
+#endif
+#include "../vtdstats.h"
 
 
 typedef uint32_t ppnum_t;
@@ -25,25 +32,19 @@ struct vtd_space_stats
     ppnum_t merges;
     ppnum_t allocs[64];
 	ppnum_t bcounts[20];
+	ppnum_t superpages[2];
+	ppnum_t map_hits;
+	ppnum_t map_misses;
+	ppnum_t waits;
 };
 typedef struct vtd_space_stats vtd_space_stats_t;
 
-int main(int argc, char * argv[])
+#if __APPLE__
+static void printLegacy(const vtd_space_stats_t * stats)
 {
-    io_service_t		vtd;
-    CFDataRef			statsData;
-    vtd_space_stats_t *	stats;
     uint32_t			idx;
     uint64_t            totalAllocs;
 
-    vtd = IOServiceGetMatchingService(kIOMainPortDefault, IOServiceMatching("AppleVTD"));
-    assert(vtd);
-	statsData = IORegistryEntryCreateCFProperty(vtd, CFSTR("stats"),
-								kCFAllocatorDefault, kNilOptions);
-    assert(statsData);
-
-	stats = (vtd_space_stats_t *) CFDataGetBytePtr(statsData);
-
 	printf("vsize          0x%x\n", stats->vsize);
 	printf("tables         0x%x\n", stats->tables);
 	printf("bused          0x%x\n", stats->bused);
@@ -59,11 +60,128 @@ int main(int argc, char * argv[])
 		printf("allocs[%2d]    0x%x\n", idx, stats->allocs[idx]);
 		totalAllocs += stats->allocs[idx];
 	}
+	if (!totalAllocs) totalAllocs = 1;
 
 	printf("breakups       0x%x(%.3f)\n", stats->breakups, stats->breakups * 100.0 / totalAllocs);
-	printf("merges         0x%x(%.3f)\n", stats->breakups, stats->breakups * 100.0 / totalAllocs);
+	printf("merges         0x%x(%.3f)\n", stats->merges, stats->merges * 100.0 / totalAllocs);
 
 	for (idx = 0; idx < arrayCount(stats->bcounts); idx++)	printf("bcounts[%2d]    0x%x\n", idx, stats->bcounts[idx]);
 
-	exit(0);
+	printf("superpages 2M  0x%x\n", stats->superpages[0]);
+	printf("superpages 1G  0x%x\n", stats->superpages[1]);
+	printf("map_hits       0x%x\n", stats->map_hits);
+	printf("map_misses     0x%x\n", stats->map_misses);
+	printf("waits          0x%x\n", stats->waits);
+}
+#endif
+
+static int printStatistics(const void * bytes, size_t length)
+{
+	const vtd_stats_header_t * header;
+
+	header = vtd_stats_validate(bytes, length);
+	if (!header)
+	{
+		fprintf(stderr, "not a statistics dump\n");
+		return (1);
+	}
+	vtd_stats_print(stdout, header);
+	return (0);
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-l] [-w dumpfile] [-f dumpfile]\n"
+					"  -l  print the legacy stats property\n"
+					"  -w  capture the statistics property to a file\n"
+					"  -f  decode a captured file\n", name);
+	exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+	const char * readFile  = NULL;
+	const char * writeFile = NULL;
+	bool         legacy    = false;
+	int          ch;
+
+	while (-1 != (ch = getopt(argc, argv, "lw:f:")))
+	{
+		switch (ch)
+		{
+			case 'l': legacy    = true;   break;
+			case 'w': writeFile = optarg; break;
+			case 'f': readFile  = optarg; break;
+			default:  usage(argv[0]);
+		}
+	}
+
+	if (readFile)
+	{
+		FILE * file;
+		void * bytes;
+		long   length;
+		int    result;
+
+		file = fopen(readFile, "r");
+		if (!file)
+		{
+			perror(readFile);
+			exit(1);
+		}
+		fseek(file, 0, SEEK_END);
+		length = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		bytes = malloc(length);
+		assert(bytes);
+		if (length != (long) fread(bytes, 1, length, file))
+		{
+			perror(readFile);
+			exit(1);
+		}
+		fclose(file);
+		result = printStatistics(bytes, length);
+		free(bytes);
+		exit(result);
+	}
+
+#if __APPLE__
+    io_service_t		vtd;
+    CFDataRef			statsData;
+
+    vtd = IOServiceGetMatchingService(kIOMainPortDefault, IOServiceMatching("AppleVTD"));
+    assert(vtd);
+	statsData = IORegistryEntryCreateCFProperty(vtd, legacy ? CFSTR("stats") : CFSTR("statistics"),
+								kCFAllocatorDefault, kNilOptions);
+    assert(statsData);
+
+	if (legacy)
+	{
+		vtd_space_stats_t stats;
+
+		bzero(&stats, sizeof(stats));
+		memcpy(&stats, CFDataGetBytePtr(statsData),
+				(CFDataGetLength(statsData) < (CFIndex) sizeof(stats)) ? CFDataGetLength(statsData) : sizeof(stats));
+		printLegacy(&stats);
+		exit(0);
+	}
+
+	if (writeFile)
+	{
+		FILE * file = fopen(writeFile, "w");
+		if (!file || (1 != fwrite(CFDataGetBytePtr(statsData), CFDataGetLength(statsData), 1, file)))
+		{
+			perror(writeFile);
+			exit(1);
+		}
+		fclose(file);
+		exit(0);
+	}
+
+	exit(printStatistics(CFDataGetBytePtr(statsData), CFDataGetLength(statsData)));
+#else
+	(void) legacy;
+	(void) writeFile;
+	usage(argv[0]);
+#endif
 }
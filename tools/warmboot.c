@@ -0,0 +1,602 @@
+/*
+cc tools/warmboot.c -o /tmp/warmboot -O2 -Wall -Wextra
+ */
+
+/*
+ * Cold and warm boot enumeration of a simulated topology: root ports with
+ * chains of switches and a mix of endpoints, each with BARs implemented as
+ * registers that size the way hardware does. Cold, every function has its
+ * BARs sized by IOPCIConfigurator::probeBaseAddressRegister(), which writes
+ * every BAR with decode disabled and so runs in an mp_rendezvous on x86.
+ * Warm, a function whose IDs, class, revision and subsystem match its
+ * pci-topology-snapshot record, below a bridge that matched too, reads each
+ * recorded BAR once to check its type bits, as warmProbeBaseAddressRegister()
+ * does, falling back to a cold probe if a recorded size is not one the BAR
+ * could decode at its current address. The bus scan and the rest of the child
+ * probe are the same both ways and counted once per function. Checks that the
+ * warm ranges are identical to a cold probe, including after a device is
+ * swapped, after a BAR changes type behind unchanged IDs and with corrupt
+ * recorded sizes, that the snapshot encoding fits kIOPCITopologyMaxNVRAMSize,
+ * and prints config accesses and modeled time.
+ *
+ * warmboot [-r root ports] [-d switch depth] [-p ports per switch]
+ *          [-l config access ns] [-z rendezvous us]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define kMaxFunctions   (1024)
+#define kBars           (7)					// BAR0-5 and the expansion ROM
+#define kROM            (6)
+#define kProbeAccesses  (14)				// header, class, capabilities, CLS
+#define kScanSlots      (32)
+
+// IOPCITopologyHeader, IOPCITopologyRecord, IOPCITopologyBar
+#define kHeaderSize     (16)
+#define kRecordSize     (20)
+#define kBarSize        (12)
+#define kMaxNVRAMSize   (4096)
+
+enum { kTypeMemory = 0, kTypePrefetch = 1, kTypeIO = 2 };
+
+struct bar
+{
+	uint64_t size;							// zero if unimplemented
+	uint8_t  type;
+	uint8_t  is64;
+	uint64_t reg;							// the register, both halves
+};
+
+struct range
+{
+	uint64_t start;
+	uint64_t size;
+	uint8_t  type;
+	uint8_t  clean64;
+};
+
+struct record
+{
+	uint32_t vendorProduct, classCode, subsystem;
+	uint8_t  barMask, bar64Mask, clean64Mask;
+	uint8_t  type[kBars];
+	uint8_t  sizeShift[kBars];
+	uint64_t start[kBars];
+};
+
+struct function
+{
+	struct function * parent;				// the bridge above, NULL on the root bus
+	uint32_t          busNum;
+	uint32_t          vendorProduct, classCode, subsystem;
+	uint16_t          command;
+	struct bar        bars[kBars];
+
+	// IOPCIConfigEntry
+	struct range      ranges[kBars];
+	uint8_t           bar64Mask;
+	struct record *   warm;
+};
+
+struct topology
+{
+	struct function functions[kMaxFunctions];
+	struct record   records[kMaxFunctions];
+	uint32_t        count;
+	uint32_t        buses, scanBuses;
+};
+
+static uint64_t reads, writes, rendezvous;
+
+// NVMe, GPU with ROM, NIC, xHCI, switch port
+static const struct bar profiles[][kBars] =
+{
+	{ { 0x4000, kTypeMemory, 1, 0 } },
+	{ { 0x1000000, kTypeMemory, 0, 0 }, { 0x10000000, kTypePrefetch, 1, 0 }, { 0, 0, 0, 0 },
+	  { 0x2000000, kTypePrefetch, 1, 0 }, { 0, 0, 0, 0 }, { 0x80, kTypeIO, 0, 0 }, { 0x20000, kTypeMemory, 0, 0 } },
+	{ { 0x20000, kTypeMemory, 1, 0 }, { 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 0x4000, kTypeMemory, 1, 0 } },
+	{ { 0x10000, kTypeMemory, 1, 0 } },
+	{ { 0x40000, kTypeMemory, 0, 0 } },
+};
+static const uint32_t profileClass[] = { 0x010802, 0x030000, 0x020000, 0x0c0330, 0x060400 };
+
+static uint32_t
+barLow(const struct bar * bar, uint32_t barNum)
+{
+	if (kROM == barNum)              return (0);
+	if (kTypeIO == bar->type)        return (1);
+	return ((bar->is64 ? 4 : 0) | ((kTypePrefetch == bar->type) ? 8 : 0));
+}
+
+static uint32_t
+configRead32(struct function * fn, uint32_t offset)
+{
+	uint32_t barNum;
+
+	reads++;
+	if (0x04 == offset) return (fn->command);
+	if (0x30 == offset) barNum = kROM;
+	else
+	{
+		barNum = (offset - 0x10) / 4;
+		if (barNum && fn->bars[barNum - 1].is64 && fn->bars[barNum - 1].size)
+			return ((uint32_t) (fn->bars[barNum - 1].reg >> 32));
+	}
+	if (!fn->bars[barNum].size) return (0);
+	return (((uint32_t) fn->bars[barNum].reg) | barLow(&fn->bars[barNum], barNum));
+}
+
+static void
+configWrite32(struct function * fn, uint32_t offset, uint32_t value)
+{
+	struct bar * bar;
+	uint32_t     barNum;
+
+	writes++;
+	if (0x04 == offset)
+	{
+		fn->command = (uint16_t) value;
+		return;
+	}
+	if (0x30 == offset) barNum = kROM;
+	else
+	{
+		barNum = (offset - 0x10) / 4;
+		if (barNum && fn->bars[barNum - 1].is64 && fn->bars[barNum - 1].size)
+		{
+			bar = &fn->bars[barNum - 1];
+			bar->reg = ((((uint64_t) value) << 32) | (uint32_t) bar->reg) & ~(bar->size - 1);
+			return;
+		}
+	}
+	bar = &fn->bars[barNum];
+	if (!bar->size) return;
+	bar->reg = ((bar->reg & ~0xFFFFFFFFULL) | (value & ~((kROM == barNum) ? 0x7FF : 0xF))) & ~(bar->size - 1);
+	if (!bar->is64) bar->reg &= 0xFFFFFFFF;
+}
+
+// IOPCIConfigurator::probeBaseAddressRegister
+static void
+coldProbe(struct function * fn, uint32_t resetMask)
+{
+	uint32_t barNum, nextBarNum, value, type, offset;
+	uint64_t saved, upper, value64, barMask, size;
+	uint16_t command;
+	int      clean64;
+
+	memset(fn->ranges, 0, sizeof(fn->ranges));
+	fn->bar64Mask = 0;
+	rendezvous++;
+	command = (uint16_t) configRead32(fn, 0x04);
+	configWrite32(fn, 0x04, command & ~3);
+
+	if (3 == (fn->classCode >> 16))
+	{
+		saved = configRead32(fn, 0x30);
+		configWrite32(fn, 0x30, 0xFFFFFFFF & ~0x7FF);
+		value = configRead32(fn, 0x30);
+		configWrite32(fn, 0x30, (uint32_t) saved);
+		if (value)
+		{
+			fn->ranges[kROM].type  = kTypeMemory;
+			fn->ranges[kROM].start = (resetMask & (1 << kTypeMemory)) ? 0 : (saved & ~0x7FFULL);
+			fn->ranges[kROM].size  = (uint32_t) -(value & ~0x7FF);
+		}
+	}
+
+	for (barNum = 0; barNum < kROM; barNum = nextBarNum)
+	{
+		offset     = 0x10 + barNum * 4;
+		nextBarNum = barNum + 1;
+		value64    = (-1ULL << 32);
+		saved      = configRead32(fn, offset);
+		configWrite32(fn, offset, 0xFFFFFFFF);
+		value      = configRead32(fn, offset);
+		configWrite32(fn, offset, (uint32_t) saved);
+		if (!value) continue;
+
+		clean64 = 0;
+		if (value & 1)
+		{
+			barMask = 0x3;
+			type    = kTypeIO;
+			if (!(value & 0xFFFF0000)) value |= 0xFFFF0000;
+		}
+		else
+		{
+			barMask = 0xf;
+			type    = (value & 8) ? kTypePrefetch : kTypeMemory;
+			if (4 != (value & 6)) type = kTypeMemory;
+			else
+			{
+				fn->bar64Mask |= (1 << barNum);
+				clean64 = ((kTypePrefetch == type) || !fn->busNum);
+				if (!clean64) configWrite32(fn, offset + 4, 0);
+				else
+				{
+					upper = configRead32(fn, offset + 4);
+					saved |= (upper << 32);
+					configWrite32(fn, offset + 4, 0xFFFFFFFF);
+					value64 = ((uint64_t) configRead32(fn, offset + 4)) << 32;
+					configWrite32(fn, offset + 4, (uint32_t) upper);
+				}
+				nextBarNum = barNum + 2;
+			}
+		}
+		value   &= ~barMask;
+		value64 |= value;
+		size     = -value64;
+		if (size > (1ULL << 40))
+		{
+			size &= 0xFFFFFFFF;
+			clean64 = 0;
+		}
+		fn->ranges[barNum].type    = type;
+		fn->ranges[barNum].start   = (resetMask & (1 << type)) ? 0 : (saved & ~barMask);
+		fn->ranges[barNum].size    = size;
+		fn->ranges[barNum].clean64 = clean64;
+	}
+	configWrite32(fn, 0x04, command);
+}
+
+// IOPCIConfigurator::warmProbeBaseAddressRegister
+static int
+warmProbe(struct function * fn, uint32_t resetMask)
+{
+	struct record * warm = fn->warm;
+	uint64_t        saved[kBars], barMask;
+	uint32_t        barNum, value, type, minShift, maxShift, upperMask = 0;
+	uint16_t        command;
+
+	for (barNum = 0; barNum < kBars; barNum++)
+	{
+		saved[barNum] = 0;
+		if (!((1 << barNum) & warm->barMask)) continue;
+		if (kROM == barNum)
+		{
+			value    = configRead32(fn, 0x30);
+			type     = kTypeMemory;
+			barMask  = 0x7FF;
+			minShift = 11;
+		}
+		else
+		{
+			value = configRead32(fn, 0x10 + barNum * 4);
+			if (value & 1)                              type = kTypeIO;
+			else if ((4 == (value & 6)) && (value & 8)) type = kTypePrefetch;
+			else                                        type = kTypeMemory;
+			barMask  = (kTypeIO == type) ? 0x3 : 0xf;
+			minShift = (kTypeIO == type) ? 2 : 4;
+		}
+		maxShift = ((1 << barNum) & warm->clean64Mask) ? 40 : 32;
+		if ((0xFFFFFFFF == value)
+		 || (type != warm->type[barNum])
+		 || ((kROM != barNum) && ((4 == (value & 7)) != (0 != ((1 << barNum) & warm->bar64Mask))))
+		 || (warm->sizeShift[barNum] < minShift)
+		 || (warm->sizeShift[barNum] > maxShift))
+		{
+			fn->warm = NULL;
+			return (0);
+		}
+		saved[barNum] = value;
+		if ((1 << barNum) & warm->clean64Mask)
+			saved[barNum] |= ((uint64_t) configRead32(fn, 0x10 + barNum * 4 + 4)) << 32;
+		else if ((1 << barNum) & warm->bar64Mask)
+			upperMask |= (1 << barNum);
+		if ((saved[barNum] & ~barMask) & ((1ULL << warm->sizeShift[barNum]) - 1))
+		{
+			fn->warm = NULL;
+			return (0);
+		}
+	}
+	if (upperMask)
+	{
+		command = (uint16_t) configRead32(fn, 0x04);
+		configWrite32(fn, 0x04, command & ~3);
+		for (barNum = 0; barNum < kROM; barNum++)
+			if ((1 << barNum) & upperMask) configWrite32(fn, 0x10 + barNum * 4 + 4, 0);
+		configWrite32(fn, 0x04, command);
+	}
+
+	memset(fn->ranges, 0, sizeof(fn->ranges));
+	for (barNum = 0; barNum < kBars; barNum++)
+	{
+		if (!((1 << barNum) & warm->barMask)) continue;
+		type = warm->type[barNum];
+		if (kROM == barNum)          barMask = 0x7FF;
+		else if (kTypeIO == type)    barMask = 0x3;
+		else                         barMask = 0xf;
+		fn->ranges[barNum].type    = type;
+		fn->ranges[barNum].size    = 1ULL << warm->sizeShift[barNum];
+		fn->ranges[barNum].start   = (resetMask & (1 << type)) ? warm->start[barNum] : (saved[barNum] & ~barMask);
+		fn->ranges[barNum].clean64 = (0 != ((1 << barNum) & warm->clean64Mask));
+	}
+	fn->bar64Mask = warm->bar64Mask;
+	return (1);
+}
+
+static struct function *
+addFunction(struct topology * topo, struct function * parent, uint32_t profile)
+{
+	struct function * fn;
+	uint64_t          addr;
+	uint32_t          barNum;
+
+	if (topo->count >= kMaxFunctions) return (NULL);
+	fn = &topo->functions[topo->count++];
+	memset(fn, 0, sizeof(*fn));
+	fn->parent        = parent;
+	fn->busNum        = parent ? parent->busNum + 1 : 0;
+	fn->vendorProduct = 0x10000000 * (profile + 1) | 0x106b;
+	fn->classCode     = profileClass[profile];
+	fn->subsystem     = 0x1234106b + profile;
+	fn->command       = 6;
+	memcpy(fn->bars, profiles[profile], sizeof(fn->bars));
+	// as firmware left them, one range per function
+	for (barNum = 0; barNum < kBars; barNum++)
+	{
+		addr = 0x80000000ULL + ((uint64_t) topo->count << 28);
+		fn->bars[barNum].reg = fn->bars[barNum].size ? (addr & ~(fn->bars[barNum].size - 1)) : 0;
+		if (kTypeIO == fn->bars[barNum].type) fn->bars[barNum].reg &= 0xFFFC;
+		if (!fn->bars[barNum].is64 && fn->bars[barNum].size) fn->bars[barNum].reg &= 0xFFFFFFFF;
+	}
+	return (fn);
+}
+
+static void
+addSwitch(struct topology * topo, struct function * port, uint32_t level, uint32_t depth, uint32_t ports)
+{
+	struct function * up;
+	struct function * down;
+	uint32_t          idx;
+
+	if (!(up = addFunction(topo, port, 4))) return;
+	topo->buses++;
+	topo->scanBuses++;
+	for (idx = 0; idx < ports; idx++)
+	{
+		if (!(down = addFunction(topo, up, 4))) return;
+		topo->buses++;
+		if (!idx && ((level + 1) < depth)) addSwitch(topo, down, level + 1, depth, ports);
+		else                               addFunction(topo, down, (idx + level) % 4);
+	}
+}
+
+static void
+build(struct topology * topo, uint32_t roots, uint32_t depth, uint32_t ports)
+{
+	struct function * root;
+	uint32_t          idx;
+
+	topo->count = topo->buses = 0;
+	topo->scanBuses = 1;
+	for (idx = 0; idx < 4; idx++) addFunction(topo, NULL, idx);		// integrated
+	for (idx = 0; idx < roots; idx++)
+	{
+		if (!(root = addFunction(topo, NULL, 4))) return;
+		topo->buses++;
+		if (depth) addSwitch(topo, root, 0, depth, ports);
+		else       addFunction(topo, root, idx % 4);
+	}
+}
+
+// the bus scan, reading Vendor ID in every slot of buses that can have more
+// than device 0, and the rest of bridgeProbeChild()
+static void
+scan(struct topology * topo)
+{
+	reads += (uint64_t) topo->scanBuses * kScanSlots + (topo->buses - topo->scanBuses);
+	reads += (uint64_t) topo->count * kProbeAccesses;
+}
+
+// IOPCIConfigurator::warmBootRecord, returning the encoded snapshot size
+static uint32_t
+save(struct topology * topo)
+{
+	struct function * fn;
+	struct record *   record;
+	uint32_t          idx, barNum, size = kHeaderSize;
+
+	for (idx = 0; idx < topo->count; idx++)
+	{
+		fn     = &topo->functions[idx];
+		record = &topo->records[idx];
+		memset(record, 0, sizeof(*record));
+		record->vendorProduct = fn->vendorProduct;
+		record->classCode     = fn->classCode;
+		record->subsystem     = fn->subsystem;
+		record->bar64Mask     = fn->bar64Mask;
+		size += kRecordSize;
+		for (barNum = 0; barNum < kBars; barNum++)
+		{
+			if (!fn->ranges[barNum].size) continue;
+			record->barMask          |= (1 << barNum);
+			record->type[barNum]      = fn->ranges[barNum].type;
+			record->sizeShift[barNum] = (uint8_t) __builtin_ctzll(fn->ranges[barNum].size);
+			record->start[barNum]     = fn->ranges[barNum].start;
+			if (fn->ranges[barNum].clean64) record->clean64Mask |= (1 << barNum);
+			size += kBarSize;
+		}
+	}
+	return (size);
+}
+
+// parents come before their children in the table
+static uint32_t
+configure(struct topology * topo, int warm, uint32_t resetMask)
+{
+	struct function * fn;
+	struct record *   record;
+	uint32_t          idx, reused = 0;
+
+	scan(topo);
+	for (idx = 0; idx < topo->count; idx++)
+	{
+		fn = &topo->functions[idx];
+		record = &topo->records[idx];
+		fn->warm = NULL;
+		if (warm)
+		{
+			reads++;										// subsystem
+			if ((!fn->parent || fn->parent->warm)
+			 && (record->vendorProduct == fn->vendorProduct)
+			 && (record->classCode == fn->classCode)
+			 && (record->subsystem == fn->subsystem))
+			{
+				fn->warm = record;
+			}
+		}
+		if (fn->warm && warmProbe(fn, resetMask)) reused++;
+		else                                      coldProbe(fn, resetMask);
+	}
+	return (reused);
+}
+
+static uint32_t
+compare(struct topology * topo, struct range (*cold)[kBars], const char * what)
+{
+	uint32_t idx, failures = 0;
+
+	for (idx = 0; idx < topo->count; idx++)
+	{
+		if (memcmp(cold[idx], topo->functions[idx].ranges, sizeof(cold[idx])))
+		{
+			printf("%s: function %u ranges differ\n", what, idx);
+			failures++;
+		}
+	}
+	return (failures);
+}
+
+// an endpoint swapped for another model, and a BAR that became 32 bit
+static void
+change(struct topology * topo)
+{
+	topo->functions[topo->count - 1].vendorProduct ^= 0x00010000;
+	topo->functions[0].bars[0].is64 = 0;
+	topo->functions[0].bars[0].reg &= 0xFFFFFFFF;
+}
+
+static uint32_t
+check(uint32_t roots, uint32_t depth, uint32_t ports)
+{
+	static struct topology topo;
+	static struct range    cold[kMaxFunctions][kBars];
+	uint32_t               idx, barNum, failures = 0, reused, size;
+
+	// the same machine, with the live BARs and with the recorded placement
+	build(&topo, roots, depth, ports);
+	configure(&topo, 0, 0);
+	for (idx = 0; idx < topo.count; idx++) memcpy(cold[idx], topo.functions[idx].ranges, sizeof(cold[idx]));
+	// warmBootSaveSnapshot() leaves larger topologies to a cold boot
+	if ((size = save(&topo)) > kMaxNVRAMSize) return (failures);
+	reused = configure(&topo, 1, 0);
+	failures += compare(&topo, cold, "warm");
+	if (reused != topo.count)
+	{
+		printf("warm: reused %u of %u\n", reused, topo.count);
+		failures++;
+	}
+	configure(&topo, 1, 7);
+	for (idx = 0; idx < topo.count; idx++)
+	for (barNum = 0; barNum < kBars; barNum++)
+	{
+		if (topo.functions[idx].ranges[barNum].start != topo.records[idx].start[barNum])
+		{
+			printf("reset: function %u bar %u start differs\n", idx, barNum);
+			failures++;
+		}
+	}
+
+	// a recorded size the BAR's address can't have, and one below the minimum
+	topo.records[0].sizeShift[0] = 32;
+	topo.records[1].sizeShift[5] = 1;
+	reused = configure(&topo, 1, 0);
+	failures += compare(&topo, cold, "corrupt");
+	if (reused != (topo.count - 2))
+	{
+		printf("corrupt: reused %u of %u\n", reused, topo.count);
+		failures++;
+	}
+
+	// a cold probe of the changed machine, then a warm one with the old records
+	build(&topo, roots, depth, ports);
+	change(&topo);
+	configure(&topo, 0, 0);
+	for (idx = 0; idx < topo.count; idx++) memcpy(cold[idx], topo.functions[idx].ranges, sizeof(cold[idx]));
+	build(&topo, roots, depth, ports);
+	configure(&topo, 0, 0);
+	save(&topo);
+	build(&topo, roots, depth, ports);
+	change(&topo);
+	reused = configure(&topo, 1, 0);
+	failures += compare(&topo, cold, "changed");
+	if (reused != (topo.count - 2))
+	{
+		printf("changed: reused %u of %u\n", reused, topo.count);
+		failures++;
+	}
+	return (failures);
+}
+
+int main(int argc, char * argv[])
+{
+	static struct topology topo;
+	uint32_t roots   = 4;
+	uint32_t depth   = 3;
+	uint32_t ports   = 4;
+	uint64_t access  = 800;
+	uint64_t rendezvousUS = 20;
+	uint64_t coldReads, coldWrites, coldRendezvous;
+	uint32_t failures, reused, size;
+	int      ch;
+
+	while (-1 != (ch = getopt(argc, argv, "r:d:p:l:z:")))
+	{
+		switch (ch)
+		{
+			case 'r': roots        = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'd': depth        = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'p': ports        = (uint32_t) strtoul(optarg, NULL, 0); break;
+			case 'l': access       = strtoull(optarg, NULL, 0); break;
+			case 'z': rendezvousUS = strtoull(optarg, NULL, 0); break;
+			default:
+				fprintf(stderr, "usage: %s [-r root ports] [-d switch depth] [-p ports per switch]\n"
+						"          [-l config access ns] [-z rendezvous us]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (!ports) ports = 1;
+
+	failures = check(roots, depth, ports);
+
+	build(&topo, roots, depth, ports);
+	reads = writes = rendezvous = 0;
+	configure(&topo, 0, 0);
+	coldReads      = reads;
+	coldWrites     = writes;
+	coldRendezvous = rendezvous;
+	size = save(&topo);
+	reads = writes = rendezvous = 0;
+	reused = configure(&topo, (size <= kMaxNVRAMSize), 0);
+
+	printf("%u functions, %u root ports, switch depth %u x %u ports\n", topo.count, roots, depth, ports);
+	printf("%llu ns per config access, %llu us per rendezvous\n",
+			(unsigned long long) access, (unsigned long long) rendezvousUS);
+	printf("%-6s %10s %10s %12s %12s\n", "boot", "reads", "writes", "rendezvous", "modeled ms");
+	printf("%-6s %10llu %10llu %12llu %12.2f\n", "cold",
+			(unsigned long long) coldReads, (unsigned long long) coldWrites, (unsigned long long) coldRendezvous,
+			((coldReads + coldWrites) * access + coldRendezvous * rendezvousUS * 1000) / 1e6);
+	printf("%-6s %10llu %10llu %12llu %12.2f\n", "warm",
+			(unsigned long long) reads, (unsigned long long) writes, (unsigned long long) rendezvous,
+			((reads + writes) * access + rendezvous * rendezvousUS * 1000) / 1e6);
+	printf("%u of %u functions reused their record, snapshot of %u bytes%s\n",
+			reused, topo.count, size, (size <= kMaxNVRAMSize) ? "" : " not saved");
+	printf("%u failures\n", failures);
+
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2012-2021 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * The contents of this file constitute Original Code as defined in and
+ * are subject to the Apple Public Source License Version 1.1 (the
+ * "License").  You may not use this file except in compliance with the
+ * License.  Please obtain a copy of the License at
+ * http://www.apple.com/publicsource and read it before using this file.
+ *
+ * This Original Code and all software distributed under the License are
+ * distributed on an "AS IS" basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE OR NON-INFRINGEMENT.  Please see the
+ * License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+#pragma once
+
+#ifndef KERNEL
+#include <stdint.h>
+#endif
+
+/*
+ * Layout of the AppleVTD "statistics" property, shared with tools/vtdstats.c.
+ * A header followed by self describing records, each 8 byte aligned.
+ * Decoders skip record types they do not know; fields are only ever appended.
+ */
+
+#define kVTDStatsMagic          (0x56544453)        /* 'VTDS' */
+#define kVTDStatsVersion        (1)
+#define kVTDStatsHistBuckets    (32)
+#define kVTDStatsSamples        (64)
+#define kVTDStatsNameLength     (32)
+
+enum
+{
+	kVTDStatsRecordCounter   = 1,	// uint64_t[count]
+	kVTDStatsRecordHistogram = 2,	// uint64_t[kVTDStatsHistBuckets], bucket n counts values < (1 << n)
+	kVTDStatsRecordSamples   = 3,	// vtd_stats_sample_t[count], oldest first
+	kVTDStatsRecordDomains   = 4,	// vtd_stats_domain_t[count]
+};
+
+struct vtd_stats_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_length;
+	uint32_t length;				// whole blob
+	uint32_t records;
+	uint32_t timebase_numer;		// mach absolute time to ns
+	uint32_t timebase_denom;
+	uint64_t time;					// absolute time of the snapshot
+};
+typedef struct vtd_stats_header vtd_stats_header_t;
+
+struct vtd_stats_record
+{
+	uint32_t type;
+	uint32_t length;				// including this header
+	uint32_t elem_length;
+	uint32_t count;
+	char     name[kVTDStatsNameLength];
+};
+typedef struct vtd_stats_record vtd_stats_record_t;
+
+struct vtd_stats_sample
+{
+	uint64_t time;
+	uint32_t depth[2];				// small, large free queue
+};
+typedef struct vtd_stats_sample vtd_stats_sample_t;
+
+struct vtd_stats_domain
+{
+	uint32_t domain;
+	uint32_t vsize;
+	uint32_t rsize;
+	uint32_t bused;
+	uint32_t rused;
+	uint32_t tables;
+	uint32_t waits;
+	uint32_t pending_free;
+};
+typedef struct vtd_stats_domain vtd_stats_domain_t;
+
+#ifndef KERNEL
+
+/* decoder, tools/vtdstats.c */
+
+#include <stddef.h>
+#include <stdio.h>
+
+// returns the header if the blob is a well formed statistics dump, else NULL
+const vtd_stats_header_t * vtd_stats_validate(const void * blob, size_t length);
+// iterate records, pass NULL for the first
+const vtd_stats_record_t * vtd_stats_next(const vtd_stats_header_t * header, const vtd_stats_record_t * prior);
+const vtd_stats_record_t * vtd_stats_find(const vtd_stats_header_t * header, const char * name);
+static inline const void * vtd_stats_elems(const vtd_stats_record_t * record) { return (record + 1); }
+// convert an absolute time value to ns
+uint64_t vtd_stats_ns(const vtd_stats_header_t * header, uint64_t value);
+void vtd_stats_print(FILE * file, const vtd_stats_header_t * header);
+
+#endif /* !KERNEL */